@@ -1,7 +1,10 @@
 /*
  * RMT module.
  * 
- * The remote module is able to generate complex signals.
+ * The remote module is able to generate complex signals.  It can also capture
+ * signals with rxConfig() and rxStart(), decoding IR protocols such as NEC and
+ * RC5 natively and delivering the frames in batches.  On Linux only the
+ * receive side is available (RMT.SIMULATED is true) and it replays capture files.
  */
 var moduleRMT = ESP32.getNativeFunction("ModuleRMT");
 if (moduleRMT === null) {
@@ -15,4 +18,42 @@ var rmt = {
 
 moduleRMT(rmt);
 
+/*
+ * Stream data items to a TX channel.  The producer is called as producer(maxItems)
+ * and returns the next chunk (an array or buffer holding an even number of data
+ * items, at most maxItems of them) or null when there are no more.  The callback
+ * is invoked as callback(underruns) once everything has been transmitted.  Streaming
+ * needs ESP-IDF v3.3 or later, an Error is thrown if the firmware was built without it.
+ */
+rmt.stream = function(channel, producer, callback) {
+	if (rmt.streamStart === undefined) {
+		throw new Error("RMT streaming needs a firmware built with ESP-IDF v3.3 or later");
+	}
+	var maxItems = Math.floor(rmt.getState(channel).bufferItems / 4) * 2;
+	var ended = false;
+	function refill() {
+		if (ended) {
+			return;
+		}
+		var chunk = producer(maxItems);
+		if (chunk === null) {
+			ended = true;
+			rmt.streamEnd(channel);
+			return;
+		}
+		rmt.streamWrite(channel, chunk);
+	} // refill
+	if (!rmt.streamStart(channel, refill, function(underruns) {
+		if (callback) {
+			callback(underruns);
+		}
+	})) {
+		return false;
+	}
+	// Both halves of the item buffer are free at the start.
+	refill();
+	refill();
+	return true;
+}; // stream
+
 module.exports = rmt;
\ No newline at end of file
@@ -1,5 +1,10 @@
 /*
  * ADC module.
+ *
+ * getValue() takes a single sample.  start() begins a continuous acquisition at
+ * a given sample rate and the callback is passed blocks of samples as
+ * Uint16Arrays.  On Linux (SIMULATED is true) only the continuous acquisition is
+ * available and the samples come from a synthetic waveform.
  */
 
 /* globals ESP32, log, module */
@@ -28,7 +33,41 @@ var _ret = {
 		setAttenuation: function(channel, attenuation) {
 			internalADC.config_channel_atten(channel, attenuation);
 		},
+
+		//
+		// start
+		//
+		// Start a continuous acquisition.  The callback is invoked as callback(block)
+		// for each block of samples.  See module_adc.c for the options.
+		//
+		start: function(options, callback) {
+			return internalADC.start(options, function(blocks) {
+				var i;
+				for (i=0; i<blocks.length; i++) {
+					callback(blocks[i]);
+				}
+			});
+		},
+
+		//
+		// stats
+		//
+		// Return the statistics of the continuous acquisition.
+		//
+		stats: function() {
+			return internalADC.stats();
+		},
+
+		//
+		// stop
+		//
+		// Stop the continuous acquisition.
+		//
+		stop: function() {
+			internalADC.stop();
+		},
 		
+		SIMULATED: internalADC.SIMULATED,
 		WIDTH_9BIT: internalADC.ADC_WIDTH_9BIT,
 		WIDTH_10BIT: internalADC.ADC_WIDTH_10BIT,
 		WIDTH_11BIT: internalADC.ADC_WIDTH_11BIT,
@@ -0,0 +1,111 @@
+/*
+ * Application log module.
+ *
+ * Append only log files for data loggers.  Records are gathered in RAM and written
+ * to the file together when the buffer fills or the oldest record has waited for
+ * flushInterval msecs.  Files are rotated when they reach maxFileSize and a file
+ * damaged by a power loss is rotated out when the log is opened.
+ *
+ * open(path, options) - options are bufferSize, flushInterval, maxFileSize, maxFiles
+ *    and sync.  Returns a log with:
+ *    * append(record) - Append a string or Buffer.  Returns false if it was refused.
+ *    * flush() - Write the buffered records now.  Returns false if they couldn't be written.
+ *    * close() - Write the buffered records and close the log.  Returns false if they
+ *      couldn't be written.
+ *    * stats() - Counts of records, bytes and writes.
+ * readRecords(path) - Return an array of Buffers, one for each record in the file.
+ *
+ * The native log is released by close() or, failing that, when the object is
+ * garbage collected.
+ */
+
+/* globals ESP32, log, module, Duktape, setInterval, cancelInterval */
+
+var moduleAppLog = ESP32.getNativeFunction("ModuleAppLog");
+if (moduleAppLog === null) {
+	log("Unable to find ModuleAppLog");
+	module.exports = null;
+	return;
+}
+
+var internalAppLog = {};
+moduleAppLog(internalAppLog);
+
+var DEFAULT_FLUSH_INTERVAL = 1000;
+
+// Write records that have waited long enough even if no more are appended.  The timer
+// is started here rather than in open() so that its function only refers to the native
+// handle.  A function created in open() would keep the log object reachable from the
+// timer and its finalizer would never run.
+function startPolling(handle, interval) {
+	return setInterval(function() {
+		internalAppLog.poll(handle);
+	}, interval);
+} // startPolling
+
+module.exports = {
+	//
+	// open
+	//
+	// Open the log at path, creating it if needed.  Throws an Error if the log can't
+	// be opened.
+	//
+	open: function(path, options) {
+		options = options || {};
+		var handle = internalAppLog.open(path, options);
+		if (handle === undefined) {
+			throw new Error("applog: Unable to open " + path);
+		}
+		var timerId = startPolling(handle, options.flushInterval || DEFAULT_FLUSH_INTERVAL);
+		var appLog = {
+			_handle: handle,
+			
+			// append
+			append: function(record) {
+				if (this._handle === null) {
+					throw new Error("applog: append after close");
+				}
+				return internalAppLog.append(this._handle, record);
+			}, // append
+			
+			// flush
+			flush: function() {
+				if (this._handle === null) {
+					return false;
+				}
+				return internalAppLog.flush(this._handle);
+			}, // flush
+			
+			// close
+			close: function() {
+				if (this._handle === null) {
+					return true;
+				}
+				cancelInterval(timerId);
+				var ok = internalAppLog.close(this._handle);
+				this._handle = null;
+				return ok;
+			}, // close
+			
+			// stats
+			stats: function() {
+				if (this._handle === null) {
+					return null;
+				}
+				return internalAppLog.stats(this._handle);
+			} // stats
+		};
+		// The timer doesn't keep the log alive (see startPolling).
+		Duktape.fin(appLog, function(o) {
+			if (o._handle) {
+				cancelInterval(timerId);
+				internalAppLog.close(o._handle);
+				o._handle = null;
+			}
+		});
+		return appLog;
+	}, // open
+	
+	HEADER_SIZE: internalAppLog.HEADER_SIZE,
+	readRecords: internalAppLog.readRecords
+};
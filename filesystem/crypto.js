@@ -0,0 +1,137 @@
+/*
+ * Crypto module.
+ *
+ * Streaming message digests, HMACs and AES ciphers in the style of the Node.js
+ * crypto module.  Data may be passed to update() in as many pieces as needed so
+ * that large payloads never need to be held in RAM at once.
+ *
+ * createHash(algorithm) - algorithm is "sha1" or "sha256".
+ * createHmac(algorithm, key)
+ * createCipheriv(algorithm, key, iv, options)
+ * createDecipheriv(algorithm, key, iv, options)
+ *    algorithm is "aes-<bits>-<mode>" where bits is 128, 192 or 256 and mode is
+ *    "cbc", "ctr" or "gcm".  options.aad is the GCM additional authenticated data.
+ *
+ * The native context is released when digest()/final() is called or, failing
+ * that, when the object is garbage collected.
+ */
+
+/* globals ESP32, log, module, Duktape */
+
+var moduleCrypto = ESP32.getNativeFunction("ModuleCrypto");
+if (moduleCrypto === null) {
+	log("Unable to find ModuleCrypto");
+	module.exports = null;
+	return;
+}
+
+var internalCrypto = {};
+moduleCrypto(internalCrypto);
+
+// Attach a native context to an object so that it is released when the object
+// is garbage collected if it hasn't been released already.
+function attach(obj, handle) {
+	obj._handle = handle;
+	Duktape.fin(obj, function(o) {
+		if (o._handle) {
+			internalCrypto.free(o._handle);
+			o._handle = null;
+		}
+	});
+} // attach
+
+function release(obj) {
+	if (obj._handle) {
+		internalCrypto.free(obj._handle);
+		obj._handle = null;
+	}
+} // release
+
+function encode(data, encoding) {
+	if (encoding === "hex" || encoding === "base64") {
+		return Duktape.enc(encoding, data);
+	}
+	return data;
+} // encode
+
+function Hash(algorithm, key) {
+	var handle = internalCrypto.hashInit(algorithm, key);
+	if (handle === undefined) {
+		throw new Error("Unable to create hash " + algorithm);
+	}
+	attach(this, handle);
+} // Hash
+
+Hash.prototype.update = function(data) {
+	internalCrypto.hashUpdate(this._handle, data);
+	return this;
+}; // update
+
+Hash.prototype.digest = function(encoding) {
+	var result = internalCrypto.hashFinal(this._handle);
+	release(this);
+	return encode(result, encoding);
+}; // digest
+
+// Split "aes-128-cbc" into the native algorithm name checking the key length.
+function cipherAlgorithm(algorithm, key) {
+	var parts = algorithm.toLowerCase().split("-");
+	if (parts.length != 3 || parts[0] != "aes" || key.length * 8 != parseInt(parts[1])) {
+		throw new Error("Unsupported algorithm " + algorithm + " for a " + key.length + " byte key");
+	}
+	return "aes-" + parts[2];
+} // cipherAlgorithm
+
+function Cipher(algorithm, encrypt, key, iv, options) {
+	var nativeAlgorithm = cipherAlgorithm(algorithm, key);
+	var handle = internalCrypto.cipherInit(nativeAlgorithm, encrypt, key, iv,
+		options ? options.aad : undefined);
+	if (handle === undefined) {
+		throw new Error("Unable to create cipher " + algorithm);
+	}
+	this._authTag = undefined;
+	this._producesTag = encrypt && nativeAlgorithm == "aes-gcm";
+	attach(this, handle);
+} // Cipher
+
+Cipher.prototype.update = function(data) {
+	return internalCrypto.cipherUpdate(this._handle, data);
+}; // update
+
+Cipher.prototype.final = function() {
+	var result = internalCrypto.cipherFinal(this._handle, this._authTag);
+	if (result === null) {
+		release(this);
+		throw new Error("Unable to authenticate data");
+	}
+	if (this._producesTag) {
+		this._authTag = internalCrypto.cipherGetTag(this._handle);
+	}
+	release(this);
+	return result;
+}; // final
+
+// The GCM authentication tag of the encrypted data, available after final().
+Cipher.prototype.getAuthTag = function() {
+	return this._authTag;
+}; // getAuthTag
+
+// The expected GCM authentication tag, which must be set before final().
+Cipher.prototype.setAuthTag = function(tag) {
+	this._authTag = tag;
+}; // setAuthTag
+
+module.exports = {
+	createCipheriv: function(algorithm, key, iv, options) {
+		return new Cipher(algorithm, true, key, iv, options);
+	},
+	createDecipheriv: function(algorithm, key, iv, options) {
+		return new Cipher(algorithm, false, key, iv, options);
+	},
+	createHash: function(algorithm) {
+		return new Hash(algorithm);
+	},
+	createHmac: function(algorithm, key) {
+		return new Hash(algorithm, key);
+	}
+};
@@ -0,0 +1,315 @@
+/*
+ * UDP datagram sockets.
+ *
+ * createSocket([options], [messageListener]) - options may contain reuseAddr.  Returns a
+ *    socket with:
+ *    * bind([port], [address], [callback]) - Receive datagrams sent to the port.  With no port
+ *      (or 0) one is chosen.  The callback is the "listening" event.
+ *    * send(msg, port, address, [callback]) - Send a string or Buffer.  The address may be a
+ *      host name.  callback(err) is called once the datagram has been handed to the network
+ *      stack or has failed.
+ *    * close([callback])
+ *    * address() - {address, port} that the socket is bound to.
+ *    * addMembership(multicastAddress, [interfaceAddress])
+ *    * dropMembership(multicastAddress, [interfaceAddress])
+ *    * setBroadcast(flag), setMulticastTTL(ttl), setMulticastLoopback(flag)
+ *    * on(event, callback) - events are "message" (msg, rinfo), "listening", "close" and "error".
+ * stats() - Counts of datagrams and of the system calls used to move them.
+ *
+ * The socket joins the loop's _sockets.  When it is readable, every datagram waiting is
+ * received in one native call and passed to the "message" listener.  Datagrams are queued
+ * by send() and sent in batches, by the loop when the socket is writable or by send() once a
+ * full batch is waiting, so a burst of sends costs few system calls.
+ */
+
+/* globals ESP32, log, module, require, _sockets */
+
+var moduleDgram = ESP32.getNativeFunction("ModuleDgram");
+if (moduleDgram === null) {
+	log("Unable to find ModuleDgram");
+	module.exports = null;
+	return;
+}
+
+var internalDgram = {};
+moduleDgram(internalDgram);
+
+var dns = require("dns.js");
+
+// The most datagrams we queue for sending.  Beyond this send() fails with ENOBUFS.
+var MAX_SEND_QUEUE = 64;
+
+// The most datagrams passed to one native send.
+var SEND_BATCH = 16;
+
+module.exports = {
+	//
+	// createSocket
+	//
+	createSocket: function(options, messageListener) {
+		if (typeof options === "function") {
+			messageListener = options;
+			options = {};
+		}
+		if (typeof options !== "object" || options === null) {
+			options = {}; // "udp4" as in Node.js.
+		}
+		var fd = internalDgram.create(options.reuseAddr === true);
+		if (fd < 0) {
+			throw new Error("dgram: Unable to create socket");
+		}
+		var sendQueue = []; // [{data, address, port, callback}]
+		var bound = false;
+		var socket = {
+			_onMessage: messageListener || null,
+			_onListening: null,
+			_onClose: null,
+			_onError: null,
+			paused: false,
+
+			//
+			// getFD
+			//
+			getFD: function() {
+				return fd;
+			}, // getFD
+
+			//
+			// on
+			//
+			on: function(eventType, callback) {
+				if (eventType === "message") {
+					this._onMessage = callback;
+				} else if (eventType === "listening") {
+					this._onListening = callback;
+				} else if (eventType === "close") {
+					this._onClose = callback;
+				} else if (eventType === "error") {
+					this._onError = callback;
+				}
+			}, // on
+
+			//
+			// bind
+			//
+			bind: function(port, address, callback) {
+				if (typeof port === "function") {
+					callback = port;
+					port = 0;
+				}
+				if (typeof address === "function") {
+					callback = address;
+					address = undefined;
+				}
+				if (internalDgram.bind(fd, port || 0, address) !== 0) {
+					throw new Error("dgram: Unable to bind to port " + port);
+				}
+				bound = true;
+				_sockets[fd] = this;
+				if (callback) {
+					this._onListening = callback;
+				}
+				if (this._onListening) {
+					this._onListening();
+				}
+			}, // bind
+
+			//
+			// address
+			//
+			address: function() {
+				return {address: "0.0.0.0", port: internalDgram.localPort(fd)};
+			}, // address
+
+			//
+			// send
+			//
+			send: function(msg, port, address, callback) {
+				if (sendQueue.length >= MAX_SEND_QUEUE) {
+					var err = new Error("dgram: send queue full");
+					err.code = "ENOBUFS";
+					if (callback) {
+						callback(err);
+					} else if (this._onError) {
+						this._onError(err);
+					}
+					return;
+				}
+				if (!bound) {
+					// Sending implicitly binds an ephemeral port so that replies can reach us.
+					this.bind(0);
+				}
+				// The datagram is sent by the loop when the socket is writable, together with
+				// any queued in the meantime, or as soon as a full batch is waiting.
+				var item = {data: msg, address: dns.lookupCached(address), port: port, callback: callback};
+				sendQueue.push(item);
+				if (typeof item.address === "string") {
+					if (sendQueue.length >= SEND_BATCH) {
+						this._flush();
+					}
+					return;
+				}
+				// Look the name up without blocking.  Datagrams queued behind this one wait.
+				item.address = null;
+				var self = this;
+				dns.lookup(address, function(err, resolved) {
+					if (err) {
+						sendQueue.splice(sendQueue.indexOf(item), 1);
+						self._sendFailed(item, err);
+					} else {
+						item.address = resolved;
+					}
+				});
+			}, // send
+
+			//
+			// _flush
+			//
+			// Send queued datagrams until the socket is full or we reach one whose address is
+			// still being looked up.
+			_flush: function() {
+				while (sendQueue.length > 0 && _sockets[fd] === this) {
+					var batch = [];
+					while (batch.length < SEND_BATCH && batch.length < sendQueue.length && sendQueue[batch.length].address !== null) {
+						batch.push(sendQueue[batch.length]);
+					}
+					if (batch.length === 0) {
+						return;
+					}
+					var result = internalDgram.send(fd, batch);
+					var i;
+					sendQueue.splice(0, result.sent);
+					for (i=0; i<result.sent; i++) {
+						if (batch[i].callback) {
+							batch[i].callback(null);
+						}
+					}
+					if (result.error !== undefined) {
+						// The datagram after those sent can't be sent.  Drop it and carry on.
+						var failed = sendQueue.shift();
+						this._sendFailed(failed, new Error("dgram: send to " + failed.address + ":" + failed.port + " failed: " + result.error));
+						continue;
+					}
+					if (result.sent < batch.length) {
+						return; // The socket is full.  The loop calls us when it is writable.
+					}
+				}
+			}, // _flush
+
+			//
+			// _sendFailed
+			//
+			_sendFailed: function(item, err) {
+				if (item.callback) {
+					item.callback(err);
+				} else if (this._onError) {
+					this._onError(err);
+				} else {
+					log(err.message);
+				}
+			}, // _sendFailed
+
+			//
+			// wantsWrite
+			//
+			// Called by the loop.  We want to know when we can write if datagrams are waiting.
+			wantsWrite: function() {
+				return sendQueue.length > 0 && sendQueue[0].address !== null;
+			}, // wantsWrite
+
+			//
+			// _onReadable
+			//
+			// Called by the loop when datagrams are waiting.
+			_onReadable: function() {
+				var messages = internalDgram.receive(fd);
+				for (var i=0; i<messages.length && _sockets[fd] === this; i++) {
+					if (this._onMessage) {
+						this._onMessage(messages[i].data, {
+							address: messages[i].address,
+							port: messages[i].port,
+							size: messages[i].data.length,
+							truncated: messages[i].truncated === true
+						});
+					}
+				}
+			}, // _onReadable
+
+			//
+			// _onWritable
+			//
+			// Called by the loop when the socket can take more datagrams.
+			_onWritable: function() {
+				this._flush();
+			}, // _onWritable
+
+			//
+			// close
+			//
+			close: function(callback) {
+				if (_sockets[fd] === this) {
+					delete _sockets[fd];
+				}
+				internalDgram.close(fd);
+				var queued = sendQueue;
+				sendQueue = [];
+				for (var i=0; i<queued.length; i++) {
+					if (queued[i].callback) {
+						queued[i].callback(new Error("dgram: socket closed"));
+					}
+				}
+				if (callback) {
+					this._onClose = callback;
+				}
+				if (this._onClose) {
+					this._onClose();
+				}
+			}, // close
+
+			//
+			// addMembership
+			//
+			addMembership: function(multicastAddress, interfaceAddress) {
+				if (internalDgram.addMembership(fd, multicastAddress, interfaceAddress) !== 0) {
+					throw new Error("dgram: Unable to join " + multicastAddress);
+				}
+			}, // addMembership
+
+			//
+			// dropMembership
+			//
+			dropMembership: function(multicastAddress, interfaceAddress) {
+				internalDgram.dropMembership(fd, multicastAddress, interfaceAddress);
+			}, // dropMembership
+
+			//
+			// setBroadcast
+			//
+			setBroadcast: function(flag) {
+				internalDgram.setBroadcast(fd, flag);
+			}, // setBroadcast
+
+			//
+			// setMulticastLoopback
+			//
+			setMulticastLoopback: function(flag) {
+				internalDgram.setMulticastLoopback(fd, flag);
+			}, // setMulticastLoopback
+
+			//
+			// setMulticastTTL
+			//
+			setMulticastTTL: function(ttl) {
+				internalDgram.setMulticastTTL(fd, ttl);
+			} // setMulticastTTL
+		}; // socket
+		return socket;
+	}, // createSocket
+
+	//
+	// stats
+	//
+	stats: function() {
+		return internalDgram.stats();
+	} // stats
+}; // module.exports
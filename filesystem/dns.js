@@ -0,0 +1,223 @@
+/*
+ * Host name resolution.
+ *
+ * Lookups are performed by a resolver task so that waiting for the name server
+ * doesn't stall timers and sockets.  Results are kept in a small cache for as long
+ * as their TTL allows, including names that don't exist, and concurrent lookups of
+ * the same name share a single request to the resolver.
+ *
+ * lookup(hostname, callback) - callback(err, address) is called with the IP address
+ *    or with an Error whose code is "ENOTFOUND" or "EAI_AGAIN".  The callback is
+ *    always called after lookup() has returned.
+ * lookupCached(hostname) - Return the cached address, null if the name is cached as not
+ *    existing or undefined if the name isn't in the cache.
+ * lookupSync(hostname) - Return the address or null, blocking if it isn't cached.
+ * clear() - Empty the cache.
+ * setStub(table) - Resolve names from table instead of the name server.  See ModuleDNS.
+ * stats() - Counts of cache hits, misses, lookups combined with one in progress and
+ *    cached entries.
+ */
+
+/* globals ESP32, log, module, setTimeout */
+
+var moduleDNS = ESP32.getNativeFunction("ModuleDNS");
+if (moduleDNS === null) {
+	log("Unable to find ModuleDNS");
+	module.exports = null;
+	return;
+}
+
+var internalDNS = {};
+moduleDNS(internalDNS);
+
+var MAX_ENTRIES = 32;
+
+var cache = {};      // hostname -> {address, expires, used}
+var cacheSize = 0;
+var pending = {};    // hostname -> [callback] for lookups in progress.
+var counters = {hits: 0, misses: 0, coalesced: 0};
+
+//
+// isAddress
+//
+// Return true if the name is already an IPv4 address.
+function isAddress(hostname) {
+	return /^\d{1,3}\.\d{1,3}\.\d{1,3}\.\d{1,3}$/.test(hostname);
+} // isAddress
+
+//
+// makeError
+//
+function makeError(code, hostname) {
+	var err = new Error("getaddrinfo " + code + " " + hostname);
+	err.code = code;
+	return err;
+} // makeError
+
+//
+// cacheGet
+//
+// Return the cache entry for the name or undefined if there is none or it has expired.
+function cacheGet(hostname) {
+	var entry = cache[hostname];
+	if (entry === undefined) {
+		return undefined;
+	}
+	var now = new Date().getTime();
+	if (now >= entry.expires) {
+		delete cache[hostname];
+		cacheSize--;
+		return undefined;
+	}
+	entry.used = now;
+	return entry;
+} // cacheGet
+
+//
+// cachePut
+//
+// Add a result to the cache.  When the cache is full, expired entries are removed and,
+// if that isn't enough, the least recently used entry.
+function cachePut(hostname, address, ttl) {
+	if (!(ttl > 0)) {
+		return;
+	}
+	var now = new Date().getTime();
+	if (cache[hostname] === undefined) {
+		if (cacheSize >= MAX_ENTRIES) {
+			var oldest = null;
+			for (var name in cache) {
+				if (cache.hasOwnProperty(name)) {
+					if (now >= cache[name].expires) {
+						delete cache[name];
+						cacheSize--;
+					} else if (oldest === null || cache[name].used < cache[oldest].used) {
+						oldest = name;
+					}
+				}
+			}
+			if (cacheSize >= MAX_ENTRIES) {
+				delete cache[oldest];
+				cacheSize--;
+			}
+		}
+		cacheSize++;
+	}
+	cache[hostname] = {address: address, expires: now + ttl * 1000, used: now};
+} // cachePut
+
+//
+// complete
+//
+// The resolver has answered.  Cache the result and call everyone who asked for it.
+function complete(hostname, code, address, ttl) {
+	cachePut(hostname, address, ttl);
+	var callbacks = pending[hostname];
+	delete pending[hostname];
+	for (var i=0; i<callbacks.length; i++) {
+		if (code !== null) {
+			callbacks[i](makeError(code, hostname), null);
+		} else {
+			callbacks[i](null, address);
+		}
+	}
+} // complete
+
+module.exports = {
+	//
+	// lookup
+	//
+	lookup: function(hostname, callback) {
+		var entry;
+		if (isAddress(hostname)) {
+			entry = {address: hostname};
+		} else {
+			entry = cacheGet(hostname);
+		}
+		if (entry !== undefined) {
+			counters.hits++;
+			setTimeout(function() {
+				if (entry.address === null) {
+					callback(makeError("ENOTFOUND", hostname), null);
+				} else {
+					callback(null, entry.address);
+				}
+			}, 0);
+			return;
+		}
+		if (pending.hasOwnProperty(hostname)) {
+			counters.coalesced++;
+			pending[hostname].push(callback);
+			return;
+		}
+		counters.misses++;
+		pending[hostname] = [callback];
+		var started = internalDNS.lookup(hostname, function(code, address, ttl) {
+			complete(hostname, code, address, ttl);
+		});
+		if (!started) {
+			// Too many lookups in progress.  Report it the same way as a name server that
+			// didn't answer so that the caller may try again.
+			setTimeout(function() {
+				complete(hostname, "EAI_AGAIN", null, 0);
+			}, 0);
+		}
+	}, // lookup
+
+	//
+	// lookupCached
+	//
+	lookupCached: function(hostname) {
+		if (isAddress(hostname)) {
+			return hostname;
+		}
+		var entry = cacheGet(hostname);
+		if (entry === undefined) {
+			return undefined;
+		}
+		counters.hits++;
+		return entry.address;
+	}, // lookupCached
+
+	//
+	// lookupSync
+	//
+	lookupSync: function(hostname) {
+		var address = this.lookupCached(hostname);
+		if (address !== undefined) {
+			return address;
+		}
+		counters.misses++;
+		var result = internalDNS.lookupSync(hostname);
+		cachePut(hostname, result.address, result.ttl);
+		return result.address;
+	}, // lookupSync
+
+	//
+	// clear
+	//
+	clear: function() {
+		cache = {};
+		cacheSize = 0;
+	}, // clear
+
+	//
+	// setStub
+	//
+	setStub: function(table) {
+		internalDNS.setStub(table);
+		this.clear();
+	}, // setStub
+
+	//
+	// stats
+	//
+	stats: function() {
+		return {
+			hits: counters.hits,
+			misses: counters.misses,
+			coalesced: counters.coalesced,
+			entries: cacheSize
+		};
+	} // stats
+}; // module.exports
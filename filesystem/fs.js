@@ -8,6 +8,11 @@ if (moduleFS === null) {
 var internalFS = {};
 moduleFS(internalFS);
 
+var Stream = require("stream.js");
+
+var DEFAULT_CHUNK_SIZE = 4096;
+var DEFAULT_HIGH_WATER_MARK = 16384;
+
 var fs = {
 	//
 	// createWithContent
@@ -24,8 +29,212 @@ var fs = {
 	}, // createWithContent
 	
 	closeSync: internalFS.closeSync,
+	
+	//
+	// createReadStream
+	//
+	// Read a file as a stream.  Returns the reader of a stream (see stream.js) to which
+	// the file's content is written a chunk at a time, one chunk each pass of the event
+	// loop, so that reading a large file doesn't hold up timers and network work.  The
+	// options are:
+	// * chunkSize - The size of each read [optional; default 4096].
+	// * highWaterMark - How much is read ahead while the reader is paused or before it
+	//   registers for data [optional; default 16384].
+	// * start - The position in the file to start reading from [optional; default 0].
+	// * end - The position in the file of the last byte to read [optional; default the
+	//   end of the file].
+	// The reader also has close() which stops the reading and closes the file.
+	//
+	createReadStream: function(path, options) {
+		options = options || {};
+		var chunkSize = options.chunkSize || DEFAULT_CHUNK_SIZE;
+		var highWaterMark = options.highWaterMark || DEFAULT_HIGH_WATER_MARK;
+		var position = options.start || 0;
+		var end = options.end === undefined ? Infinity : options.end;
+		var fd = internalFS.openSync(path, "r");
+		// A chunk is only read while less than highWaterMark is held so we never
+		// need room for more than that and one more chunk.
+		var fileStream = new Stream({highWaterMark: highWaterMark, maxBuffer: highWaterMark + chunkSize});
+		var scheduled = false;
+		var waitingForDrain = false;
+		
+		function close() {
+			if (fd !== null) {
+				internalFS.closeSync(fd);
+				fd = null;
+			}
+		} // close
+		
+		function schedule() {
+			if (!scheduled) {
+				scheduled = true;
+				setTimeout(readChunk, 0);
+			}
+		} // schedule
+		
+		// Read the next chunk and pass it on.  If the stream is now holding as much as
+		// we wish to read ahead, wait until the reader drains it.
+		function readChunk() {
+			scheduled = false;
+			if (fd === null) {
+				return;
+			}
+			var length = Math.min(chunkSize, end - position + 1);
+			var data = length > 0 ? internalFS.readChunkSync(fd, length, position) : null;
+			if (data === null || data.length === 0) {
+				close();
+				fileStream.writer.end();
+				return;
+			}
+			position += data.length;
+			if (fileStream.writer.write(data)) {
+				schedule();
+			} else {
+				waitingForDrain = true;
+			}
+		} // readChunk
+		
+		fileStream.writer.on("drain", function() {
+			if (waitingForDrain) {
+				waitingForDrain = false;
+				schedule();
+			}
+		});
+		fileStream.reader.close = close;
+		schedule();
+		return fileStream.reader;
+	}, // createReadStream
+	
+	//
+	// createWriteStream
+	//
+	// Write a file as a stream.  Data passed to write() is queued and written to the file
+	// a piece each pass of the event loop.  The options are:
+	// * flags - How the file is opened [optional; default "w"].
+	// * start - The position in the file to start writing at [optional; default the
+	//   current position].
+	// * highWaterMark - The number of bytes queued before write() returns false
+	//   [optional; default 16384].
+	// The returned writer has:
+	// * write(data) - Queue a string or Buffer.  Returns false if the caller should wait
+	//   for "drain" before writing more.
+	// * end([data]) - Queue optional final data and close the file once all is written.
+	// * on(event, callback) - Register for "drain", "finish" (all data written and the
+	//   file closed) or "error" (a write failed; the file is closed and queued data dropped).
+	// * bytesWritten - The number of bytes written to the file so far.
+	//
+	createWriteStream: function(path, options) {
+		options = options || {};
+		var highWaterMark = options.highWaterMark || DEFAULT_HIGH_WATER_MARK;
+		var position = options.start === undefined ? null : options.start;
+		var fd = internalFS.openSync(path, options.flags || "w");
+		var queue = [];
+		var queuedLength = 0;
+		var scheduled = false;
+		var needDrain = false;
+		var ended = false;
+		var callbacks = {};
+		
+		function emit(event, arg) {
+			if (callbacks[event]) {
+				callbacks[event](arg);
+			}
+		} // emit
+		
+		function close() {
+			if (fd !== null) {
+				internalFS.closeSync(fd);
+				fd = null;
+			}
+		} // close
+		
+		function schedule() {
+			if (!scheduled) {
+				scheduled = true;
+				setTimeout(writeChunk, 0);
+			}
+		} // schedule
+		
+		// Write the oldest queued piece of data.
+		function writeChunk() {
+			scheduled = false;
+			if (fd === null) {
+				return;
+			}
+			if (queue.length > 0) {
+				var data = queue.shift();
+				queuedLength -= data.length;
+				var written = internalFS.writeSync(fd, data, 0, data.length, position);
+				if (written != data.length) {
+					close();
+					queue = [];
+					queuedLength = 0;
+					emit("error", new Error("fs.createWriteStream: write to " + path + " failed after " + writer.bytesWritten + " bytes"));
+					return;
+				}
+				writer.bytesWritten += written;
+				if (position !== null) {
+					position += written;
+				}
+			}
+			if (queue.length > 0) {
+				schedule();
+				return;
+			}
+			if (ended) {
+				close();
+				emit("finish");
+				return;
+			}
+			if (needDrain) {
+				needDrain = false;
+				emit("drain");
+			}
+		} // writeChunk
+		
+		var writer = {
+			bytesWritten: 0,
+			write: function(data) {
+				if (ended) {
+					throw new Error("fs.createWriteStream: write after end");
+				}
+				if (typeof data == "string") {
+					data = new Buffer(data);
+				}
+				if (data.length > 0) {
+					queue.push(data);
+					queuedLength += data.length;
+					schedule();
+				}
+				if (queuedLength >= highWaterMark) {
+					needDrain = true;
+					return false;
+				}
+				return true;
+			}, // write
+			end: function(data) {
+				if (ended) {
+					return;
+				}
+				if (data !== undefined && data !== null) {
+					this.write(data);
+				}
+				ended = true;
+				schedule();
+			}, // end
+			on: function(event, callback) {
+				if (event != "drain" && event != "finish" && event != "error") {
+					throw new Error("Unknown event type: " + event);
+				}
+				callbacks[event] = callback;
+			} // on
+		};
+		return writer;
+	}, // createWriteStream
+	
 	dump:      internalFS.dump,
 	fstatSync: internalFS.fstatSync,
+	listSync:  internalFS.listSync,
 	
 	//
 	// loadFile
@@ -50,8 +259,73 @@ var fs = {
 		}
 	}, // loadFile
 	
+	//
+	// openAtomicSync
+	//
+	// Open a file for writing such that its new content only replaces the old
+	// content once all of it has been written.  The data is written to a temporary
+	// file which is renamed over the target by commit().  If the writing is abandoned
+	// with abort(), the original file is untouched.  Returns an object with:
+	// * write(data) - Append a string or Buffer to the new content.  If not all of it
+	//   could be written (for example the file system is full), the temporary file is
+	//   removed and an Error is thrown.  commit() then throws too.
+	// * commit() - Close the temporary file and rename it to the target.
+	// * abort() - Close and remove the temporary file.
+	// * size() - The number of bytes written.
+	//
+	openAtomicSync: function(path) {
+		var tempPath = path + ".tmp";
+		var fd = internalFS.openSync(tempPath, "w");
+		var size = 0;
+		var failed = false;
+		function abort() {
+			if (fd === null) {
+				return;
+			}
+			internalFS.closeSync(fd);
+			fd = null;
+			internalFS.unlink(tempPath);
+		} // abort
+		return {
+			write: function(data) {
+				if (fd === null) {
+					throw new Error("fs.openAtomicSync: write after commit or abort");
+				}
+				if (typeof data === "string") {
+					data = new Buffer(data);
+				}
+				var written = internalFS.writeSync(fd, data);
+				if (written > 0) {
+					size += written;
+				}
+				if (written !== data.length) {
+					failed = true;
+					abort();
+					throw new Error("fs.openAtomicSync: only " + written + " of " + data.length + " bytes written to " + tempPath);
+				}
+			}, // write
+			commit: function() {
+				if (failed) {
+					throw new Error("fs.openAtomicSync: commit after a failed write to " + tempPath);
+				}
+				if (fd === null) {
+					return;
+				}
+				internalFS.closeSync(fd);
+				fd = null;
+				internalFS.renameSync(tempPath, path);
+			}, // commit
+			abort: abort,
+			size: function() {
+				return size;
+			} // size
+		};
+	}, // openAtomicSync
+	
 	openSync:  internalFS.openSync,
+	readChunkSync: internalFS.readChunkSync,
 	readSync:  internalFS.readSync,
+	renameSync: internalFS.renameSync,
 	spiffsDir: internalFS.spiffsDir,
 	statSync:  internalFS.statSync,
 	unlink:    internalFS.unlink,
@@ -3,12 +3,13 @@
  * References:
  * RFC 7230 - Hypertext Transfer Protocol (HTTP/1.1): Message Syntax and Routing
  */
-/* globals require, log, module */
+/* globals require, log, module, Buffer, setTimeout, _sockets */
 /* exported http */
 
 var net = require("net");
 var Stream = require("stream");
 var HTTPParser = require("httpparser");
+var URL = require("url");
 
 
 /**
@@ -24,27 +25,52 @@ var http = {
 	// to be sent.
 	// {
 	//    host: <IP Address or DNS hostname of target of request>
-	//    port: <port number of target> [optional; default = 80]
+	//    port: <port number of target> [optional; default = 80 or 443 when using SSL]
 	//    path: <Path within the url> [optional; default = "/"]
-	//    data: <Payload data> [optional; default = null]
+	//    method: <GET, POST, PUT or DELETE> [optional; default = "GET"]
+	//    headers: <Object of header names and values> [optional]
+	//    data: <Payload data, a string or a Buffer> [optional; default = null]
+	//    chunked: <Send the payload with "Transfer-Encoding: chunked"> [optional; default = false]
+	//    producer: <Function returning the next piece of payload or null at the end> [optional]
 	//    useSSL: <Should we use SSL> [optional; default = false]
+	//    keepAlive: <Keep the connection for reuse after the response> [optional; default = false]
+	//    file: <Name of a file into which the response body is written> [optional]
+	//    highWaterMark: <Response bytes held before we stop reading> [optional; default = 16384]
+	//    maxRedirects: <Number of redirects to follow> [optional; default = 5]
+	//    timeout: <Msecs allowed to connect, 0 for no limit> [optional; default = 20000]
 	// }
 	//
-	// The high level algorithm is that we create a new socket and then issue a connect
-	// request upon it.  When we have detected that the connect has succeeded, we then
-	// send an HTTP protocol request through the socket connection.  We register that we are
-	// interested in receiving the response and parse the response assuming it is an
-	// HTTP message.
+	// The request line, the headers and any data payload are sent with a single write.  A
+	// payload too large to hold in memory is sent chunked, either by the caller writing it in
+	// pieces with the write(data) and end([data]) functions of the returned object (with
+	// chunked: true) or by a producer function that we call for each piece as the connection
+	// is able to take it.
+	//
+	// The callback is passed a stream reader for the response body which also has httpStatus
+	// and headers properties.  The body is passed on as it arrives.  If the reader is paused,
+	// or has no "data" callback, up to highWaterMark bytes are held after which we stop
+	// reading from the connection until the reader catches up.  With the file option, the
+	// body is written to the file instead and the reader only sees the "end".  If the
+	// connection ends before a body of known length (or a chunked body) is complete, the
+	// reader's "error" callback is called and its error property set before the "end".
+	//
+	// Redirects (301, 302, 303, 307 and 308) are followed up to maxRedirects times and only
+	// the final response is passed to the reader.
+	//
+	// When keepAlive is true and the server keeps the connection open after a response whose
+	// length it declared, an SSL connection is returned to the pool of idle SSL connections
+	// (see net.Socket.release) so that the next request to the same host and port avoids a
+	// new TCP connection and TLS handshake.  Otherwise, the connection is closed once the
+	// response is complete.
 	request: function(options, httpRequestCallback) {
-		var path        = options.path;
-		var port        = options.port;
-		var host        = options.host;
-		var useSSL      = options.useSSL === true;
 		var method      = options.method;
-		var payloadData = options.data;
+		var useSSL      = options.useSSL === true;
+		var keepAlive   = options.keepAlive === true;
+		var producer    = options.producer;
+		var maxRedirects = options.maxRedirects;
 		
 		// validate inputs and set defaults for unset properties.
-		if (host === undefined) {
+		if (options.host === undefined) {
 			log("http.request: No host set");
 			return;
 		}
@@ -53,95 +79,323 @@ var http = {
 			method = "GET";
 		}
 		
-		if (method !== "GET" && method !== "POST" && method != "PUT") {
+		if (method !== "GET" && method !== "POST" && method !== "PUT" && method !== "DELETE") {
 			log("http.request: Unknown method: " + method);
 			return;
 		}
 		
-		if (path === undefined) {
-			path = "/";
-		}
-
-		if (port === undefined) {
-			port = 80;
+		if (maxRedirects === undefined) {
+			maxRedirects = 5;
 		}
 		
-		var sock = new net.Socket();
-		var clientRequest = {
-			_sock: sock	
+		var target = {
+			host:    options.host,
+			port:    options.port !== undefined ? options.port : (useSSL ? 443 : 80),
+			path:    options.path !== undefined ? options.path : "/",
+			useSSL:  useSSL,
+			method:  method,
+			data:    options.data,
+			chunked: options.chunked === true || producer !== undefined
 		};
-
-		var httpClientResponseStream = new Stream();
 		
-		if (httpRequestCallback !== null && httpRequestCallback !== undefined) {
-			httpRequestCallback(httpClientResponseStream.reader);
+		var httpClientResponseStream = new Stream(options.highWaterMark);
+		var fileFd = null;
+		if (options.file !== undefined) {
+			fileFd = require("fs").openSync(options.file, "w");
 		}
+		var bodyQueue = [];     // Body pieces written before we were connected.
+		var bodyEnded = false;  // Has the caller ended a chunked body?
+		var connected = false;
+		
+		var clientRequest = {
+			_sock: null,
 			
-		var parserStreamWriter = new HTTPParser(HTTPParser.RESPONSE, function(parserStreamReader){
-			parserStreamReader.on("data", function(data) {
-				httpClientResponseStream.reader.httpStatus = parserStreamReader.httpStatus;
-				httpClientResponseStream.reader.headers = parserStreamReader.headers;
-				httpClientResponseStream.writer.write(data);
-			});
-			parserStreamReader.on("end", function(){
-				httpClientResponseStream.reader.httpStatus = parserStreamReader.httpStatus;
-				httpClientResponseStream.reader.headers = parserStreamReader.headers;
-				httpClientResponseStream.writer.end();
-			});
-		});
-
-
-		// Send a connect request and register the function to be invoked when the connect
-		// succeeds.  That registered function is responsible for sending the HTTP request to the partner.
-		sock.connect({
-			address: host,
-			path: path,
-			port: port,
-			useSSL: useSSL
-		}, function() {
-			// We are now connected ... send the HTTP message
-			// Build the message to send.
-
-			var requestMessage = method +" " + path + " HTTP/1.1\r\n" +
-				"Host: " + host + ":" + port + "\r\n";
-			sock.write(requestMessage); // Send the message to the HTTP server.
-			if (options.headers != undefined) {
+			//
+			// write
+			//
+			// Write a piece of a chunked request body.
+			write: function(data) {
+				if (!target.chunked) {
+					throw new Error("http.request: write() requires the chunked option");
+				}
+				if (bodyEnded) {
+					throw new Error("http.request: write() after end()");
+				}
+				if (data.length === 0) {
+					return; // An empty chunk would mark the end of the body.
+				}
+				if (connected) {
+					this._sock.write(chunkOf(data));
+				} else {
+					bodyQueue.push(data);
+				}
+			}, // write
+			
+			//
+			// end
+			//
+			// Complete a chunked request body optionally writing a final piece.
+			end: function(data) {
+				if (!target.chunked || bodyEnded) {
+					return;
+				}
+				if (data !== undefined) {
+					this.write(data);
+				}
+				bodyEnded = true;
+				if (connected) {
+					this._sock.write("0\r\n\r\n");
+				}
+			} // end
+		}; // clientRequest
+		
+		//
+		// chunkOf
+		//
+		// Frame data as a chunk of a chunked body.
+		function chunkOf(data) {
+			if (typeof data == "string") {
+				data = new Buffer(data);
+			}
+			return Buffer.concat([new Buffer(data.length.toString(16) + "\r\n"), data, new Buffer("\r\n")]);
+		} // chunkOf
+		
+		//
+		// buildRequest
+		//
+		// Build the request line, headers and any payload into a single buffer.
+		function buildRequest(target) {
+			var payload = null;
+			var head = target.method + " " + target.path + " HTTP/1.1\r\n" +
+				"Host: " + target.host + ":" + target.port + "\r\n";
+			if (keepAlive) {
+				head += "Connection: keep-alive\r\n";
+			}
+			if (options.headers !== undefined) {
 				for (var name in options.headers) {
 					// Skip headers that we must NOT add to the headers.
-					if (name === "Host") {
+					if (name === "Host" || name === "Content-Length" || name === "Transfer-Encoding") {
 						continue;
 					}
-					
-					if (name === "Content-Length") {
+					if (name === "Connection" && keepAlive) {
 						continue;
 					}
-					
 					if (options.headers.hasOwnProperty(name)) {
-						log("Adding header " + name + ": " + options.headers[name]);
-						sock.write(name + ": " + options.headers[name] + "\r\n");
+						head += name + ": " + options.headers[name] + "\r\n";
 					}
 				}
 			} // Add any headers
-			
-			if (payloadData) {
-				sock.write("Content-Length: " + payloadData.length + "\r\n");
+			if (target.chunked) {
+				head += "Transfer-Encoding: chunked\r\n";
+			} else if (target.data) {
+				payload = typeof target.data == "string" ? new Buffer(target.data) : target.data;
+				head += "Content-Length: " + payload.length + "\r\n";
+			}
+			head += "\r\n";
+			if (payload === null) {
+				return head;
+			}
+			return Buffer.concat([new Buffer(head), payload]);
+		} // buildRequest
+		
+		//
+		// redirectTarget
+		//
+		// If the response is a redirect that we should follow, return the target of the
+		// redirect otherwise return null.
+		function redirectTarget(current, response) {
+			var status = Number(response.httpStatus);
+			if (maxRedirects <= 0 || [301, 302, 303, 307, 308].indexOf(status) == -1) {
+				return null;
+			}
+			var location = HTTPParser.getHeader(response.headers, "Location");
+			if (location === undefined) {
+				return null;
+			}
+			var next = {
+				host:    current.host,
+				port:    current.port,
+				path:    location,
+				useSSL:  current.useSSL,
+				method:  current.method,
+				data:    current.data,
+				chunked: current.chunked
+			};
+			// A 303 (and by common practice a 301 or 302 of a POST) is followed with a GET.
+			if (status == 303 || ((status == 301 || status == 302) && current.method == "POST")) {
+				next.method = "GET";
+				next.data = undefined;
+				next.chunked = false;
+			} else if (current.chunked) {
+				return null; // We can't send a streamed body a second time.
+			}
+			if (/^https?:\/\//i.test(location)) {
+				var parsed = URL.parse(location);
+				next.useSSL = parsed.protocol.toLowerCase() == "https:";
+				next.host = parsed.hostname;
+				next.port = parsed.host.indexOf(":") == -1 ? (next.useSSL ? 443 : 80) : Number(parsed.port);
+				next.path = (parsed.pathname || "/") + (parsed.search || "");
+			} else if (location.charAt(0) != "/") {
+				next.path = current.path.substring(0, current.path.lastIndexOf("/") + 1) + location;
 			}
+			return next;
+		} // redirectTarget
+		
+		//
+		// pump
+		//
+		// Send the pieces of a body supplied by a producer for as long as the connection has
+		// nothing waiting to be written.  If it does, try again a little later.
+		function pump(sock) {
+			while (sock._writeQueue.length === 0) {
+				var piece = producer();
+				if (piece === null || piece === undefined) {
+					sock.write("0\r\n\r\n");
+					return;
+				}
+				if (piece.length > 0) {
+					sock.write(chunkOf(piece));
+				}
+			}
+			setTimeout(function() {
+				if (_sockets[sock.getFD()] === sock) {
+					pump(sock);
+				}
+			}, 10);
+		} // pump
+		
+		//
+		// send
+		//
+		// Connect to the target, send the request and parse the response.
+		function send(target) {
+			var sock = new net.Socket();
+			var networkEnded = false; // Has the partner closed the connection?
+			clientRequest._sock = sock;
+			connected = false;
 			
-			sock.write("\r\n");
+			var parserStreamWriter = new HTTPParser(HTTPParser.RESPONSE, function(parserStreamReader) {
+				var redirect;
+				
+				// Once we have the headers of the response, decide if it is a redirect.
+				function checkRedirect() {
+					if (redirect === undefined) {
+						redirect = redirectTarget(target, parserStreamReader);
+						if (redirect === null) {
+							httpClientResponseStream.reader.httpStatus = parserStreamReader.httpStatus;
+							httpClientResponseStream.reader.headers = parserStreamReader.headers;
+						}
+					}
+				} // checkRedirect
+				
+				parserStreamReader.on("data", function(data) {
+					checkRedirect();
+					if (redirect !== null) {
+						return; // The body of a redirect is discarded.
+					}
+					if (fileFd !== null) {
+						require("fs").writeSync(fileFd, data);
+						return;
+					}
+					if (!httpClientResponseStream.writer.write(data)) {
+						sock.pause();
+					}
+				});
+				parserStreamReader.on("error", function(err) {
+					log("http.request: " + err.message);
+					checkRedirect();
+					if (redirect === null) {
+						httpClientResponseStream.reader.error = err;
+						httpClientResponseStream.writer.error(err);
+					}
+				});
+				parserStreamReader.on("end", function() {
+					checkRedirect();
+					// The response is complete.  If it ended before the connection did then the
+					// connection can be used again or else should be closed.
+					if (!networkEnded) {
+						var connection = HTTPParser.getHeader(parserStreamReader.headers, "Connection");
+						if (keepAlive && (connection === undefined || connection.toLowerCase() !== "close")) {
+							sock.release();
+						} else {
+							sock.end();
+						}
+					}
+					if (redirect !== null) {
+						log("http.request: Redirected to " + redirect.host + ":" + redirect.port + redirect.path);
+						maxRedirects--;
+						send(redirect);
+						return;
+					}
+					if (fileFd !== null) {
+						require("fs").closeSync(fileFd);
+						fileFd = null;
+					}
+					httpClientResponseStream.writer.end();
+				});
+			});
+
+			// Send a connect request and register the function to be invoked when the connect
+			// succeeds.  That registered function is responsible for sending the HTTP request to the partner.
+			sock.connect({
+				address: target.host,
+				port: target.port,
+				useSSL: target.useSSL,
+				timeout: options.timeout
+			}, function() {
+				// We are now connected ... send the HTTP message in one write.
+				sock.write(buildRequest(target));
+				connected = true;
+				if (!target.chunked) {
+					return;
+				}
+				if (producer !== undefined) {
+					pump(sock);
+					return;
+				}
+				while (bodyQueue.length > 0) {
+					sock.write(chunkOf(bodyQueue.shift()));
+				}
+				if (bodyEnded) {
+					sock.write("0\r\n\r\n");
+				}
+			}); // sock.connect connectionListener ...
 			
-			if (payloadData) {
-				sock.write(payloadData);
-				sock.write("\r\n");
-			}
-		}); // sock.connect connectionListener ...
+			sock.on("data", function(data) {
+				parserStreamWriter.write(data);
+			});
+			
+			sock.on("end", function() {
+				networkEnded = true;
+				parserStreamWriter.end();
+			});
+			
+			// We couldn't connect, for example because the host name didn't resolve or the
+			// host didn't answer in time.  End the response without a status and with the
+			// reason in its error property.
+			sock.on("error", function(err) {
+				log("http.request: " + err.message);
+				networkEnded = true;
+				if (fileFd !== null) {
+					require("fs").closeSync(fileFd);
+					fileFd = null;
+				}
+				httpClientResponseStream.reader.error = err;
+				httpClientResponseStream.writer.end();
+			});
+		} // send
 		
-		sock.on("data", function(data) {
-			parserStreamWriter.write(data);
+		// When the reader has caught up with data we held, start reading again.
+		httpClientResponseStream.writer.on("drain", function() {
+			if (clientRequest._sock !== null) {
+				clientRequest._sock.resume();
+			}
 		});
 		
-		sock.on("end", function() {
-			parserStreamWriter.end();
-		});
+		if (httpRequestCallback !== null && httpRequestCallback !== undefined) {
+			httpRequestCallback(httpClientResponseStream.reader);
+		}
+		send(target);
 		return clientRequest;
 	}, // request
 	
@@ -165,8 +419,21 @@ var http = {
 //
 // Next we create an HTTPParser object.  This is responsible for parsing the data
 // that comes from the request.
+//
+// The optional options are those of net.createServer().  A connection over the server's
+// limits is answered with a 503 and closed unless options.onOverload says otherwise.
 	
-	createServer: function(requestHandler) {
+	createServer: function(options, requestHandler) {
+		if (typeof options === "function") {
+			requestHandler = options;
+			options = {};
+		}
+		options = options || {};
+		if (!options.onOverload) {
+			options.onOverload = function(sock) {
+				sock.write("HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n");
+			};
+		}
 		// Internal connection listener that will be called when a new client connection
 		// has been received.
 
@@ -205,6 +472,14 @@ var http = {
 							statusMessage = "Not Found";
 							break;
 						}
+						case 500: {
+							statusMessage = "Internal Server Error";
+							break;
+						}
+						case 503: {
+							statusMessage = "Service Unavailable";
+							break;
+						}
 						default: {
 							statusMessage = "Unknown";
 							break;
@@ -252,6 +527,9 @@ var http = {
 					httpRequestStream.reader.headers = parserStreamReader.headers;
 					httpRequestStream.writer.write(data);
 				});
+				parserStreamReader.on("error", function(err) {
+					httpRequestStream.writer.error(err);
+				});
 				parserStreamReader.on("end", function() {
 					httpRequestStream.reader.method = parserStreamReader.method;
 					httpRequestStream.reader.path = parserStreamReader.path;
@@ -268,7 +546,7 @@ var http = {
 				parserStreamWriter.end();
 			});
 		};
-		var socketServer = net.createServer(connectionListener);
+		var socketServer = net.createServer(options, connectionListener);
 		return socketServer; // Return the socket server which has a listen() method to start it listening.
 	} // createServer
 }; // http
@@ -80,29 +80,38 @@ var Stream = require("stream.js");
 
 
 /**
- * Given a line of text that is expected to be "\r\n" delimited, return an object that
- * contains the first line and the remainder.
- * @param data The input text to parse.
- * @returns An object that contains
- * {
- *    line: <The line of text up to the first \r\n>
- *    remainder: The remainder of the data after the first \r\n or the whole
- *       data if there is no first \r\n.
- * }
+ * Find the next "\r\n" in a buffer starting at the offset.
+ * @param data The buffer to search.
+ * @param offset The index at which to start searching.
+ * @returns The index of the "\r" or -1 if there is no "\r\n".
+ */
+function indexOfCRLF(data, offset) {
+	var i;
+	for (i=offset; i<data.length-1; i++) {
+		if (data[i] === 13 && data[i+1] === 10) {
+			return i;
+		}
+	}
+	return -1;
+} // indexOfCRLF
+
+
+/**
+ * Return the value of a header ignoring the case of its name or undefined if there is
+ * no such header.
  */
-function getLine(data) {
-	var i = data.indexOf("\r\n");
-	if (i === -1) { // If we didn't find a terminator, then no lines and remainder is all.
-		return {
-			line: null,
-			remainder: data
-		};
+function getHeader(headers, name) {
+	if (headers[name] !== undefined) {
+		return headers[name];
 	}
-	return {
-		line: data.substr(0, i),
-		remainder: data.substr(i+2)
-	};
-} // getLine
+	name = name.toLowerCase();
+	for (var headerName in headers) {
+		if (headers.hasOwnProperty(headerName) && headerName.toLowerCase() === name) {
+			return headers[headerName];
+		}
+	}
+	return undefined;
+} // getHeader
 
 
 var STATE = {
@@ -110,7 +119,11 @@ var STATE = {
 	START_RESPONSE: 2,
 	HEADERS: 3,
 	BODY: 4,
-	END: 5
+	END: 5,
+	CHUNK_SIZE: 6,     // Expecting the size line of a chunk.
+	CHUNK_DATA: 7,     // Within the data of a chunk.
+	CHUNK_DATA_END: 8, // Expecting the empty line that follows the data of a chunk.
+	TRAILERS: 9        // Expecting trailer headers after the last chunk.
 };
 	
 
@@ -126,14 +139,20 @@ var STATE = {
  * * path       - For a request
  * @returns networkWriter A stream object into which the network stream being
  * received will be written.
+ *
+ * The body is delivered as Buffers exactly as received, whether it was delimited by a
+ * Content-Length, sent with "Transfer-Encoding: chunked" (the chunk framing is removed)
+ * or, for a response, runs to the end of the connection.  If the connection ends before
+ * a Content-Length or chunked body is complete, the reader's "error" callback is called
+ * before its "end".
  */
 function httpparser(type, httpParserConsumer) {
 	var networkStream = new Stream();
 	var httpStream = new Stream();
 	
 	httpStream.reader.headers = {};
-	var unconsumedData = "";
-	var bodyLeftToRead; // If we are processing a content-length body, how much remains?
+	var unconsumedData = null; // Data received that we have not yet been able to consume.
+	var bodyLeftToRead; // If we are processing a content-length body or a chunk, how much remains?
 	var state;          // State of processing for state machine
 	var isRequest;      // Is this a request or response parse
 	var readBodyToEnd;  // If we are processing a body, process to the end of the stream?
@@ -148,132 +167,189 @@ function httpparser(type, httpParserConsumer) {
 		throw new Error("ERROR: Unknown type on httpparser: " + type);
 	}
 	
-	function consume(dataToProcess) {
-		if (state == STATE.END) {
-			throw new Error("We have been asked to parse more HTTP data but we are already past the end");
+	function finish() {
+		state = STATE.END;
+		httpStream.writer.end();
+	} // finish
+	
+	function addHeader(line) {
+		var i = line.indexOf(":");
+		var name = line.substr(0, i).trim();
+		var value = line.substr(i+1).trim();
+		httpStream.reader.headers[name] = value;
+	} // addHeader
+	
+	//
+	// headersComplete
+	//
+	// We have seen the empty line that ends the headers.  Decide how the body (if any) is
+	// delimited.
+	// For requests:
+	// We have a body based on "Content-Length" or "Transfer-Encoding"
+	// For responses:
+	// The following have NO body:
+	// status: 1xx, 204 (No Content), 304 (Not modified)
+	// All others DO have a body
+	function headersComplete() {
+		var headers = httpStream.reader.headers;
+		log("End of headers\n" + JSON.stringify(headers));
+		var transferEncoding = getHeader(headers, "Transfer-Encoding");
+		var contentLength = getHeader(headers, "Content-Length");
+		if (!isRequest) {
+			var statusCode = Number(httpStream.reader.httpStatus);
+			if (statusCode >= 100 && statusCode <= 199 || statusCode == 204 || statusCode == 304) {
+				finish();
+				return;
+			}
 		}
-		var line = {remainder: ""};
-		if (state !== STATE.BODY) {
-			line = getLine(dataToProcess);
-			while (line.line !== null) {
-				log("http parsing: " + line.line);
-				
-				if (state == STATE.START_RESPONSE) {
+		if (transferEncoding !== undefined && transferEncoding.toLowerCase().indexOf("chunked") != -1) {
+			state = STATE.CHUNK_SIZE;
+		} else if (contentLength !== undefined) {
+			bodyLeftToRead = Number(contentLength);
+			readBodyToEnd = false;
+			if (bodyLeftToRead === 0) {
+				finish();
+			} else {
+				state = STATE.BODY;
+			}
+		} else if (isRequest) {
+			finish();
+		} else {
+			readBodyToEnd = true;
+			state = STATE.BODY;
+		}
+	} // headersComplete
+	
+	//
+	// processLine
+	//
+	// Process a complete line received in one of the line oriented states.
+	function processLine(line) {
+		log("http parsing: " + line);
+		var splitData;
+		switch(state) {
+			case STATE.START_RESPONSE: {
 // In the HTTP spec, the format of this line is called a "status line"
 // status-line = HTTP-Version SP status-code SP reason-phrase
 //
-					// A header line is of the form <protocols>' '<code>' '<message>
-					//                                  0          1         2					
-					var splitData = line.line.split(" ");
-					httpStream.reader.httpStatus = splitData[1];
-					log("httpStatus = " + httpStream.reader.httpStatus);
-					// We have finished with the start line ...
-					state = STATE.HEADERS;
-				} // End of in STATE.START_RESPONSE
-				else if (state == STATE.START_REQUEST) {
+				// A header line is of the form <protocols>' '<code>' '<message>
+				//                                  0          1         2
+				splitData = line.split(" ");
+				httpStream.reader.httpStatus = splitData[1];
+				log("httpStatus = " + httpStream.reader.httpStatus);
+				// We have finished with the start line ...
+				state = STATE.HEADERS;
+				break;
+			}
+			case STATE.START_REQUEST: {
 // In the HTTP spec, the format of this line is called a "request line".
 // request-line = method SP request-target SP HTTP-version
 //
-					var splitData = line.line.split(" ");
-					httpStream.reader.method = splitData[0].toUpperCase();
-					
+				splitData = line.split(" ");
+				httpStream.reader.method = splitData[0].toUpperCase();
+				
 // Set the path removing any optional query string.
-					var queryIndex = splitData[1].indexOf("?");
-					if (queryIndex == -1) {
-						httpStream.reader.path = splitData[1];
-					} else {
-						httpStream.reader.path = splitData[1].substring(0, queryIndex);
-						httpStream.reader.query = splitData[1].substring(queryIndex+1);
-					}
-
-					log("http Method: " + httpStream.reader.method + ", path: " + httpStream.reader.path + ", query: " + httpStream.reader.query);
-					// We have finished with the start line ...
-					state = STATE.HEADERS;
+				var queryIndex = splitData[1].indexOf("?");
+				if (queryIndex == -1) {
+					httpStream.reader.path = splitData[1];
+				} else {
+					httpStream.reader.path = splitData[1].substring(0, queryIndex);
+					httpStream.reader.query = splitData[1].substring(queryIndex+1);
 				}
-				else if (state == STATE.HEADERS) {
+
+				log("http Method: " + httpStream.reader.method + ", path: " + httpStream.reader.path + ", query: " + httpStream.reader.query);
+				// We have finished with the start line ...
+				state = STATE.HEADERS;
+				break;
+			}
+			case STATE.HEADERS: {
 			// Between the headers and the body of an HTTP response is an empty line that marks the end of
-			// the HTTP headers and the start of the body.  Thus we can find a line that is empty and, if it
-			// is found, we switch to STATE.BODY.  Otherwise, we found a header line of the format:
+			// the HTTP headers and the start of the body.  Otherwise, we found a header line of the format:
 			// <name>':_'<value>
-					if (line.line.length === 0) {
-						log("End of headers\n" + JSON.stringify(httpStream.reader.headers));
-						// We are about to start the body ... BUT ... at this point we only have a body
-						// if we have a contentLength.
-// Do we have a body?  It varies on whether this was a request message or a response message.
-// For request:
-// We have a body based on "Content-Length" or "Transfer-Encoding"
-// For responses:
-// The following have NO body:
-// status: 1xxx, 204 (No Content), 304 (Not modified)
-// All others DO have a body
-						if (isRequest) {
-							if (httpStream.reader.headers["Content-Length"] !== undefined) {
-								state = STATE.BODY;
-								bodyLeftToRead = Number(httpStream.reader.headers["Content-Length"]);
-								readBodyToEnd = false;
-								dataToProcess = line.remainder;
-							} else {
-								state = STATE.END;
-								httpStream.writer.end();
-							}
-						} // isRequest
-						
-						//
-						// isResponse
-						//
-						else {	
-							var statusCode = httpStream.reader.httpStatus;
-							if (statusCode >= "100" && statusCode <="199" || statusCode == "204" || statusCode == "304") {
-								// no body
-								state = STATE.END;
-								httpStream.writer.end();
-							}
-							else {
-								state = STATE.BODY;
-								if (httpStream.reader.headers["Content-Length"] !== undefined) {
-									bodyLeftToRead = Number(httpStream.reader.headers["Content-Length"]);
-									readBodyToEnd = false;
-								} else {
-									readBodyToEnd = true;
-								}
-								dataToProcess = line.remainder;
-							}
-						} // isResponse
-					} else {
-					// we found a header
-						var i = line.line.indexOf(":");
-						var name = line.line.substr(0, i).trim();
-						var value = line.line.substr(i+2).trim();
-						httpStream.reader.headers[name] = value;
-					} // Header processing
-				} // End of in STATE.HEADERS
-				else if (state == STATE.END) {
-					throw new Error("We have been asked to parse more HTTP data but we are already past the end");
+				if (line.length === 0) {
+					headersComplete();
+				} else {
+					addHeader(line);
+				}
+				break;
+			}
+			case STATE.CHUNK_SIZE: {
+			// A chunk starts with its size in hex optionally followed by extensions that we ignore.
+			// A chunk of size 0 is the last chunk and may be followed by trailer headers.
+				bodyLeftToRead = parseInt(line.split(";")[0], 16);
+				if (isNaN(bodyLeftToRead)) {
+					throw new Error("Bad chunk size: " + line);
 				}
+				state = bodyLeftToRead === 0 ? STATE.TRAILERS : STATE.CHUNK_DATA;
+				break;
+			}
+			case STATE.CHUNK_DATA_END: {
+				state = STATE.CHUNK_SIZE;
+				break;
+			}
+			case STATE.TRAILERS: {
+				if (line.length === 0) {
+					finish();
+				} else {
+					addHeader(line);
+				}
+				break;
+			}
+		} // End of switch(state)
+	} // processLine
 	
-				line = getLine(line.remainder);
-			} // End of we have processed all the lines. (end while)
-		} /// End: Was NOT STATE == BODY
-		
-		//
-		// STATE.BODY
-		//
-		if (state == STATE.BODY) {
-			httpStream.writer.write(dataToProcess);
-			line.remainder = "";
-			
-			if (!readBodyToEnd) {
-				bodyLeftToRead = bodyLeftToRead - dataToProcess.length;
-				if (bodyLeftToRead < 0) {
-					throw new Error("We have written more data than we expected");
+	//
+	// consume
+	//
+	// Consume as much of the data we have received as we can.  Lines (start line, headers,
+	// chunk sizes) are processed once complete.  Body data is passed on as soon as it arrives.
+	function consume(data) {
+		if (state == STATE.END) {
+			throw new Error("We have been asked to parse more HTTP data but we are already past the end");
+		}
+		if (typeof data == "string") {
+			data = new Buffer(data);
+		}
+		if (unconsumedData !== null) {
+			data = Buffer.concat([unconsumedData, data]);
+			unconsumedData = null;
+		}
+		var offset = 0;
+		var size;
+		while (offset < data.length && state != STATE.END) {
+			if (state == STATE.BODY || state == STATE.CHUNK_DATA) {
+				size = data.length - offset;
+				if (!readBodyToEnd || state == STATE.CHUNK_DATA) {
+					size = Math.min(size, bodyLeftToRead);
+					bodyLeftToRead -= size;
 				}
+				httpStream.writer.write(data.slice(offset, offset + size));
+				offset += size;
 				if (bodyLeftToRead === 0) {
-					state = STATE.END;
-					httpStream.writer.end();
+					if (state == STATE.CHUNK_DATA) {
+						state = STATE.CHUNK_DATA_END;
+					} else if (!readBodyToEnd) {
+						finish();
+					}
 				}
+				continue;
+			}
+			var lineEnd = indexOfCRLF(data, offset);
+			if (lineEnd === -1) {
+				break;
+			}
+			var line = data.slice(offset, lineEnd).toString();
+			offset = lineEnd + 2;
+			processLine(line);
+		} // End of while we have data to process.
+		
+		if (offset < data.length) {
+			if (state == STATE.END) {
+				log("HTTP Parser: Ignoring " + (data.length - offset) + " bytes after the end of the message");
+			} else {
+				unconsumedData = data.slice(offset);
 			}
 		}
-		return line.remainder;
 	} // consume
 	
 	httpParserConsumer(httpStream.reader);
@@ -281,20 +357,24 @@ function httpparser(type, httpParserConsumer) {
 	networkStream.reader.on("data", function(data) {
 		// When we receive additional data over the network connection we combine that with
 		// data that we received previously that has not yet been consumed.  We then
-		// call consume to consume this data and the result will be the data that we
-		// weren't yet able to consume and presumably will when more data arrives in the future.
-		unconsumedData = consume(unconsumedData + data.toString());
+		// call consume to consume this data and any data we can't consume yet (a partial line)
+		// is kept until more data arrives in the future.
+		consume(data);
 	});
 	
 	networkStream.reader.on("end", function() {
 // The interesting question is what should we do if we have been told that the network connection
 // has finished sending us any further data?  It would seem that we want to tell the httpStream writer
 // that there won't be any new data either ... but we need to be carfeful, we must NEVER call the the
-// stream writer twice!!
+// stream writer twice!!  Only a body that runs to the end of the connection is complete here.  A
+// Content-Length or chunked body that was cut short is flagged as an error on the reader.
 		log("HTTP Parser: Received an end of network connection");
-		if (state == STATE.BODY) {
+		if (state == STATE.BODY && readBodyToEnd) {
+			finish();
+		} else if (state != STATE.END && state != STATE.START_REQUEST && state != STATE.START_RESPONSE && state != STATE.HEADERS) {
+			var reason = state == STATE.BODY ? bodyLeftToRead + " bytes of the body missing" : "a chunked body incomplete";
 			state = STATE.END;
-			httpStream.writer.end();
+			httpStream.writer.error(new Error("HTTP Parser: The connection ended with " + reason));
 		}
 		
 	}); // networkStream reader on("end")
@@ -303,4 +383,5 @@ function httpparser(type, httpParserConsumer) {
 
 httpparser.REQUEST = "request";
 httpparser.RESPONSE = "response";
+httpparser.getHeader = getHeader;
 module.exports = httpparser;
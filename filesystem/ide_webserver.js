@@ -7,6 +7,9 @@
  * GET  /files - Return a JSON encoded list of files.
  * GET  /files/<name> - Return the contents of the named file.
  * POST /files/<name> - Save the content of the POST data in the named file.
+ * GET  /metrics - Return the event loop metrics in the Prometheus text format.
+ * GET  /profile - Return the profiler samples as collapsed stacks.  ?start=<msecs> starts
+ *                 the profiler and ?stop stops it.
  * GET  /<other> - Return the contents of the path as a regular WebServer.
  * 
  */
@@ -15,56 +18,83 @@
 var http = require("http");
 var ws = require("ws");
 var FS = require("fs");
+var URL = require("url");
+var metrics = require("metrics.js");
+
+// msecs that a script run by POST /run may take.  Below the loop's budget.
+var RUN_BUDGET = 1500;
 
 
 /**
- * Read a file from the SPIFFS file system and send it to the output stream.
+ * Read a file from the SPIFFS file system and send it to the output stream.  The file
+ * is read a chunk at a time from the event loop and the response is ended once all of
+ * it has been sent.
  * @param fileName The name of the file to read.
  * @param response The target where we are writing the file.
- * @returns 0 on ok, non 0 on an error.
+ * @returns N/A
  */
 function streamFile(fileName, response) {
-	//log("FS.openSync1");
-	var fd = FS.openSync(fileName, "r");
-	//log("FS.openSync2");
-   var buffer = new Buffer(128);
-   while(1) {
-   	var sizeRead = FS.readSync(fd, buffer, 0, buffer.length, null);
-   	log("Size read: " + sizeRead);
-   	if (sizeRead <= 0) {
-   		break;
-   	}
-   	response.write(buffer.toString("utf8", 0, sizeRead));
-   }
-   FS.closeSync(fd);
-   return 0;
+	FS.createReadStream(fileName).pipe(response);
 } // streamFile
 
 
 /**
- * Save the data as a local file.
- * @param fileName The file name to create.
- * @param data The data to write.
- * @returns N/A
+ * If the request is a POST /files/<name> upload, return the name of the file being
+ * uploaded otherwise return null.
+ * @param request The HTTP request.
+ * @returns The file name or null.
  */
-function saveFile(fileName, data) {
-	var fd = FS.openSync(fileName, "w");
-	FS.writeSync(fd, data);
-	FS.closeSync(fd);
-} // saveFile
+function uploadFileName(request) {
+	var pathParts = request.path.split("/");
+	if (request.method != "POST" || pathParts.length < 3 || pathParts[1] != "files") {
+		return null;
+	}
+	return "/" + pathParts.splice(2).join("/");
+} // uploadFileName
 
 
 function requestHandler(request, response) {
    log("IDE_WebServer: We have received a new HTTP client request!");
    DUKF.logHeap("requestHandler");
-   var postData = "";
+   var postChunks = []; // The body of a request that isn't an upload.
+   var upload = null;   // The file being written for an upload.
+   var uploadChecked = false;
+   var uploadError = null; // Why writing the upload failed.
    
+   // An upload to /files/<name> is written to the file as it arrives, any other body
+   // is gathered and joined once at the end.
    request.on("data", function(data) {
-      log("HTTP Request on(data) passed: " + data);
-      postData += data;
+      if (!uploadChecked) {
+         uploadChecked = true;
+         var uploadName = uploadFileName(request);
+         if (uploadName !== null) {
+            log("Writing to file " + uploadName);
+            upload = FS.openAtomicSync(DUKF.FILE_SYSTEM_ROOT + uploadName);
+         }
+      }
+      if (upload !== null) {
+         if (uploadError === null) {
+            try {
+               upload.write(data);
+            } catch(e) {
+               // The temporary file has been removed, the old file is kept.
+               uploadError = e;
+            }
+         }
+      } else {
+         postChunks.push(data);
+      }
    }); // on("data")
    
+   // The connection ended before the whole body arrived.
+   request.on("error", function(err) {
+      if (uploadError === null) {
+         uploadError = err;
+      }
+   }); // on("error")
+   
    request.on("end", function() {
+   	// Send the file, returning true if the response will be ended once it has been sent.
    	function sendFile(fileToSend) {
 	      try {
 	      	fileName = DUKF.FILE_SYSTEM_ROOT + fileToSend;
@@ -73,9 +103,11 @@ function requestHandler(request, response) {
 	      	log("Loading file: " + fileName);
 	         response.writeHead(200);
 	         streamFile(fileName, response);
+	         return true;
 	      } catch(e) {
 	      	log("(A1) We got an exception: " + e);
 	         response.writeHead(404);
+	         return false;
 	      }
    	} // sendFile
       
@@ -85,7 +117,11 @@ function requestHandler(request, response) {
       log(" - path: " + request.path);
       log(" - headers: " + JSON.stringify(request.headers));
       DUKF.logHeap("ide_webserver: request.on(end)");
+      var postData = postChunks.length > 0 ? Buffer.concat(postChunks).toString() : "";
+      postChunks = null;
 
+      // The parser has already split any query string from the path.
+      var query = request.query === undefined ? null : URL.queryParse(request.query);
       var pathParts = request.path.split("/");
 
       if (pathParts.length < 2) {
@@ -99,7 +135,11 @@ function requestHandler(request, response) {
       	// request to run a script ...
       	log("We are about to run: " + postData);
       	try {
-      		eval(postData);
+      		// Run the script with a budget below that of the loop so that a script that
+      		// never ends is stopped here and we can carry on.
+      		DUKF.runWithBudget(RUN_BUDGET, function() {
+      			eval(postData);
+      		});
       	} catch(e) {
       		//log(e.name + ": " + e.message);
       		//log("" + e.fileName + " [" + e.lineNumber + "]");
@@ -114,27 +154,69 @@ function requestHandler(request, response) {
       	}
       	response.writeHead(200);
       } 
+      else if (pathParts[0] == "metrics" && request.method == "GET") {
+      	// Prometheus text format 0.0.4.
+      	response.writeHead(200, {"Content-Type": "text/plain; version=0.0.4"});
+      	response.write(metrics.prometheus());
+      }
+      else if (pathParts[0] == "profile" && request.method == "GET") {
+      	// The collapsed stacks are the input of flamegraph.pl or speedscope.
+      	response.writeHead(200, {"Content-Type": "text/plain"});
+      	if (query !== null && query.hasOwnProperty("start")) {
+      		DUKF.profileStart(Number(query.start) || 10);
+      	} else {
+      		if (query !== null && query.hasOwnProperty("stop")) {
+      			DUKF.profileStop();
+      		}
+      		response.write(DUKF.profileCollapsed());
+      	}
+      }
       else if (pathParts[0] == "files") {
-         response.writeHead(200);
+         // A failed upload keeps the old file, report it.
+         response.writeHead(uploadError === null ? 200 : 500);
       	// Process files here ...
       	// if GET /files  -- then pathParts.length == 1
+      	// GET /files?prefix=<prefix>&offset=<n>&limit=<n> returns one page of the listing
       	if (pathParts.length == 1 && request.method == "GET") {
-      		var filesArray = FS.spiffsDir();
-         	response.write(JSON.stringify(filesArray));
+      		if (query !== null) {
+      			response.write(JSON.stringify(FS.listSync({
+      				prefix: query.prefix,
+      				offset: query.offset === undefined ? undefined : Number(query.offset),
+      				limit:  query.limit  === undefined ? undefined : Number(query.limit)
+      			})));
+      		} else {
+      			var filesArray = FS.spiffsDir();
+      			response.write(JSON.stringify(filesArray));
+      		}
       	} else { // More parts than just /files
       		fileName = "/" + pathParts.splice(1).join("/");
       		if (request.method == "GET") {
             	log("Load the file called " + fileName);
             	streamFile(DUKF.FILE_SYSTEM_ROOT + fileName, response);
+            	return; // The response is ended when the file has been sent.
       		}
       		else if (request.method == "POST") {
-      			log("Writing to file " + fileName);
-      			log("Data: " + postData);
-      			saveFile(DUKF.FILE_SYSTEM_ROOT + fileName, postData);
+      			// The data was written as it arrived, now make it the content of the file.
+      			if (upload === null) {
+      				upload = FS.openAtomicSync(DUKF.FILE_SYSTEM_ROOT + fileName); // An empty file.
+      			}
+      			var contentLength = request.getHeader("Content-Length");
+      			if (uploadError !== null) {
+      				log("Upload of " + fileName + " failed: " + uploadError.message);
+      				upload.abort();
+      			} else if (contentLength !== null && Number(contentLength) != upload.size()) {
+      				// The connection ended before the whole file arrived, keep the old file.
+      				log("Upload of " + fileName + " incomplete: " + upload.size() + " of " + contentLength + " bytes");
+      				upload.abort();
+      			} else {
+      				log("Saving " + upload.size() + " bytes to file " + fileName);
+      				upload.commit();
+      			}
+      			upload = null;
       		}
       	}
-      } else {
-      	sendFile(request.path);
+      } else if (sendFile(request.path)) {
+      	return; // The response is ended when the file has been sent.
       }
       postData = null;
       response.end();
@@ -183,4 +265,6 @@ function startIde() {
    }
 } // startIde
 
-module.exports = startIde;
\ No newline at end of file
+module.exports = startIde;
+// Exposed so that the handling of requests can be tested on another port.
+module.exports.requestHandler = requestHandler;
\ No newline at end of file
@@ -5,9 +5,12 @@
  * 
  * * Checking to see if timers have expired.
  * * Polling network I/O to see if network actions are needed.
+ *
+ * The time each phase takes is recorded by the metrics module.
  */
 /* globals _sockets, OS, log, Buffer, require, ESP32, _timers, module, DUKF */
 var net = require("net.js");
+var metrics = require("metrics.js");
 var internalSSL = {};
 var moduleSSL = ESP32.getNativeFunction("ModuleSSL");
 if (moduleSSL === null) {
@@ -17,6 +20,67 @@ if (moduleSSL === null) {
 }
 
 
+/**
+ * The partner has closed the socket (or an SSL error means we must treat it as closed).
+ * Tell the socket's user, close it and forget it.
+ */
+function socketEnded(currentSock) {
+	if (currentSock._onEnd) {
+		currentSock._onEnd();
+	}
+	if (currentSock._onClose) {
+		currentSock._onClose();
+	}
+	OS.close({sockfd: currentSock.getFD()});
+	if (currentSock.hasOwnProperty("dukf_ssl_context")) {
+		internalSSL.free_dukf_ssl_context(currentSock.dukf_ssl_context);
+		delete currentSock.dukf_ssl_context;
+	}
+	// Now that we have closed the socket ... we can remove it from
+	// our cache list.
+	currentSock._forget();
+} // socketEnded
+
+
+/**
+ * Read from an SSL socket that select() reported as readable.  While the handshake is in
+ * progress, readiness is used to advance it.  Otherwise we read records until mbedtls has no
+ * more decrypted data buffered.  mbedtls may have taken more data from the socket than it
+ * has given us so far and select() would not tell us about that data.
+ */
+function sslReadable(currentSock) {
+	if (currentSock._sslHandshaking) {
+		currentSock._sslHandshake();
+		return;
+	}
+	var recvSize;
+	do {
+		var myData = new Buffer(1024);
+		recvSize = internalSSL.read(currentSock.dukf_ssl_context, myData);
+		if (recvSize === 0 || isNaN(recvSize)) {
+			socketEnded(currentSock);
+			return;
+		}
+		if (recvSize === internalSSL.WANT_WRITE) {
+			currentSock._sslWant = "write";
+			return;
+		}
+		if (recvSize > 0 && currentSock._onData) {
+			currentSock._onData(myData.slice(0, recvSize));
+		}
+		// The data handler may have ended or released the socket.
+		if (!currentSock.hasOwnProperty("dukf_ssl_context")) {
+			return;
+		}
+	} while (recvSize > 0 && !currentSock.paused && internalSSL.pending(currentSock.dukf_ssl_context) > 0);
+	
+	// A write may have been waiting for the data we just read.
+	if (currentSock._sslWant === "read" && currentSock._writeQueue.length > 0) {
+		currentSock._sslFlush();
+	}
+} // sslReadable
+
+
 /**
  * Primary loop that processes events.
  * @returns
@@ -34,8 +98,11 @@ function loop() {
 	// }
 	//
 	
-	if (_timers.timerEntries.length > 0 && new Date().getTime() >= _timers.timerEntries[0].fire ) {
+	metrics.enter(metrics.PHASE_TIMERS);
+	var now = new Date().getTime();
+	if (_timers.timerEntries.length > 0 && now >= _timers.timerEntries[0].fire ) {
 		//log("Processing timer fired for id: " + _timers.timerEntries[0].id);
+		metrics.lag(now - _timers.timerEntries[0].fire);
 		var timerCallback = _timers.timerEntries[0].callback;
 		if (_timers.timerEntries[0].interval > 0) {
 			_timers.timerEntries[0].fire = new Date().getTime() + _timers.timerEntries[0].interval;
@@ -43,22 +110,39 @@ function loop() {
 		} else {
 			_timers.timerEntries.splice(0, 1);
 		}
+		if (DUKF.profiling) {
+			DUKF.profileDispatch(timerCallback);
+		}
 		timerCallback();
+		if (DUKF.profiling) {
+			DUKF.profileDispatch(null);
+		}
 	} // End of check timers.
 	
 	// Network I/O Polling
 	//
+	metrics.enter(metrics.PHASE_SELECT);
 	// Process the file descriptors for sockets.  We build an array that contains
 	// the set of file descriptors corresponding to the sockets that we wish to read from.
 	var readfds   = [];
 	var writefds  = [];
 	var exceptfds = [];
+	var sslBuffered = []; // SSL sockets with decrypted data that select() can't see.
 	
 	// Loop through each of the sockets and determine if we are going to work with them.
 	for (var sock in _sockets) {
-		if (_sockets.hasOwnProperty(sock)) {
-			readfds.push(_sockets[sock].getFD());
-			if (_sockets[sock].connecting) {
+		// A socket waiting for its host name to be looked up isn't connected yet and
+		// select() would report it as ready.  An offloaded socket is served by the
+		// network I/O task.
+		if (_sockets.hasOwnProperty(sock) && !_sockets[sock]._resolving && !_sockets[sock]._offloaded) {
+			if (!_sockets[sock].paused && !_sockets[sock]._connectPending) {
+				readfds.push(_sockets[sock].getFD());
+				if (_sockets[sock].hasOwnProperty("dukf_ssl_context") && !_sockets[sock]._sslHandshaking &&
+						internalSSL.pending(_sockets[sock].dukf_ssl_context) > 0) {
+					sslBuffered.push(_sockets[sock].getFD());
+				}
+			}
+			if (_sockets[sock].wantsWrite()) {
 				writefds.push(_sockets[sock].getFD());
 			}
 			exceptfds.push(_sockets[sock].getFD());
@@ -67,24 +151,51 @@ function loop() {
 	
 	// Invoke select() to see if there is any work to do.
 	var selectResult = OS.select({readfds: readfds, writefds: writefds, exceptfds: exceptfds});
+	// A socket that was paused while mbedtls held decrypted data for it must be read even
+	// though select() does not report it as readable.
+	for (var j=0; j<sslBuffered.length; j++) {
+		if (selectResult.readfds.indexOf(sslBuffered[j]) == -1) {
+			selectResult.readfds.push(sslBuffered[j]);
+		}
+	}
 	if (selectResult.readfds.length > 0 || selectResult.writefds.length > 0 || selectResult.exceptfds.length > 0) {
 		log("selectResult: " + JSON.stringify(selectResult));
 	}
 	
+	metrics.enter(metrics.PHASE_IO);
 	var currentSocketFd;
 	var currentSock;
 	
+	// lwIP reports a connect that failed as an exception rather than as writable.
+	for (var k=0; k<selectResult.exceptfds.length; k++) {
+		currentSock = _sockets[selectResult.exceptfds[k]];
+		if (currentSock !== undefined && currentSock._connectPending) {
+			currentSock._connectDone();
+		}
+	}
+	
 	// Process the write sockets
 	for (var i=0; i<selectResult.writefds.length; i++) {
 		currentSocketFd = selectResult.writefds[i];
 		currentSock = _sockets[selectResult.writefds[i]];
-		if (currentSock.connecting) {
+		if (currentSock === undefined) {
+			continue; // The socket was closed by an earlier callback.
+		}
+		if (currentSock._connectPending) {
+			// The TCP handshake has finished, successfully or not.
+			currentSock._connectDone();
+		} else if (currentSock._sslHandshaking) {
+			currentSock._sslHandshake();
+		} else if (currentSock.connecting) {
 			// Aha!!  We had a connecting socket and now we can write ... that means we are connected!
-			currentSock.connecting = false;
-			if (currentSock._onConnect) {
-				currentSock._onConnect();
-			}
+			currentSock._connected();
 		} // For each socket that is able to write and was in connecting state.
+		else if (currentSock.hasOwnProperty("dukf_ssl_context")) {
+			currentSock._sslFlush();
+		}
+		else if (currentSock._onWritable) {
+			currentSock._onWritable();
+		}
 	} // For each socket that is able to write
 	
 	// Process each ready to read file descriptor in turn
@@ -92,51 +203,43 @@ function loop() {
 		currentSocketFd = selectResult.readfds[i];
 		log("loop: working on ready to read of fd=" + currentSocketFd);
 		currentSock = _sockets[selectResult.readfds[i]];
+		if (currentSock === undefined) {
+			continue; // The socket was closed by an earlier callback.
+		}
 		
 		// We now have the object that represents the socket.  If it is a listening
 		// socket ... that means it is a server and we should accept a new client connection.
 		if (currentSock.listening) {
-			var acceptData = OS.accept({sockfd: currentSock.getFD()});
-			log("We accepted a new client connection: " + JSON.stringify(acceptData));
-			var newSocket = new net.Socket({sockfd: acceptData.sockfd});
-
-			newSocket._createdFromFd = currentSock.getFD();	// For debugging purposes only
-			
-			newSocket.on("connect", currentSock._onConnect);
-			if (newSocket._onConnect) {
-				newSocket._onConnect(newSocket);
-			}
+			// Accept every connection waiting (up to a limit per pass).
+			currentSock._accept();
 		} // Socket was a server socket
+		else if (currentSock._onReadable) {
+			// The socket reads for itself, for example a UDP socket.
+			currentSock._onReadable();
+		}
+		else if (currentSock.hasOwnProperty("dukf_ssl_context")) {
+			sslReadable(currentSock);
+		} // Socket is using SSL
 		else {
 			// We need to read data from the socket!
 			// We have a socket in currentSocket that had data ready to be read from it.  Now we
 			// read the data from that socket.
 			var myData = new Buffer(512);
-			var recvSize;
-			if (currentSock.hasOwnProperty("dukf_ssl_context")) {
-				recvSize = internalSSL.read(currentSock.dukf_ssl_context, myData);
-			} else {
-				recvSize = OS.recv({sockfd: currentSock.getFD(), data: myData});
-			}
+			var recvSize = OS.recv({sockfd: currentSock.getFD(), data: myData});
 			log("Length of data from recv: " + recvSize);
 			if (recvSize === 0) {
-				if (currentSock._onEnd) {
-					currentSock._onEnd();
-				}
-				if (currentSock._onClose) {
-					currentSock._onClose();
-				}
-				OS.close({sockfd: currentSock.getFD()});
-				if (currentSock.hasOwnProperty("dukf_ssl_context")) {
-					internalSSL.free_dukf_ssl_context(currentSock.dukf_ssl_context);
-				}
-				// Now that we have closed the socket ... we can remove it from
-				// our cache list.
-			   delete _sockets[currentSock.getFD()];
+				socketEnded(currentSock);
 			}  // We received no data.
 			else if (recvSize > 0 ) { // Data size was > 0 .
 				if (currentSock._onData) {
+					// Tell the profiler which callback runs so that its samples are named.
+					if (DUKF.profiling) {
+						DUKF.profileDispatch(currentSock._onData);
+					}
 					currentSock._onData(myData.slice(0, recvSize));
+					if (DUKF.profiling) {
+						DUKF.profileDispatch(null);
+					}
 				}
 			} // Data size was > 0
 			myData = null;
@@ -144,7 +247,9 @@ function loop() {
 	} // For each socket that is able to read ... 
 	
 	// Garbage collection.
+	metrics.enter(metrics.PHASE_GC);
 	DUKF.gc();
+	metrics.enter(metrics.PHASE_NONE);
 } // loop
 
 log("Major function \"loop()\" registered");
@@ -0,0 +1,122 @@
+/*
+ * Event loop metrics.
+ *
+ * The main task and loop.js record how long the phases of each turn take into
+ * histograms with fixed buckets (see module_metrics.c).  This module reads them and
+ * formats them, with the event lane and budget statistics, as Prometheus text for the
+ * /metrics page of the web servers.
+ *
+ * enter(phase) - End the current phase of loop.js and start another.  The phases are
+ *    PHASE_TIMERS, PHASE_SELECT, PHASE_IO and PHASE_GC.  PHASE_NONE ends the phase.
+ * lag(msecs) - Record how late a timer fired.
+ * snapshot() - Return {bounds, histograms}.  bounds are the upper bounds of the buckets
+ *    in usecs and each histogram is {buckets, count, sum, max} in usecs.
+ * reset() - Clear the histograms.
+ * prometheus() - Return the metrics in the Prometheus text format.
+ */
+
+/* globals ESP32, log, module, DUKF */
+
+var moduleMetrics = ESP32.getNativeFunction("ModuleMetrics");
+if (moduleMetrics === null) {
+	log("Unable to find ModuleMetrics");
+	module.exports = null;
+	return;
+}
+
+var internalMetrics = {};
+moduleMetrics(internalMetrics);
+
+// Histograms of the time a part of a turn takes, reported as dukf_phase_seconds.
+var PHASES = ["timers", "select", "io", "gc", "loop", "callback", "events", "turn"];
+
+//
+// histogram
+//
+// Add the lines of a histogram to the array of lines.  Prometheus wants cumulative
+// buckets in seconds.
+function histogram(lines, name, labels, bounds, h) {
+	var cumulative = 0;
+	var prefix = labels.length > 0 ? labels + "," : "";
+	for (var i=0; i<h.buckets.length; i++) {
+		cumulative += h.buckets[i];
+		var le = i < bounds.length ? String(bounds[i] / 1000000) : "+Inf";
+		lines.push(name + "_bucket{" + prefix + "le=\"" + le + "\"} " + cumulative);
+	}
+	var suffix = labels.length > 0 ? "{" + labels + "}" : "";
+	lines.push(name + "_sum" + suffix + " " + h.sum / 1000000);
+	lines.push(name + "_count" + suffix + " " + h.count);
+} // histogram
+
+
+//
+// header
+//
+function header(lines, name, type, help) {
+	lines.push("# HELP " + name + " " + help);
+	lines.push("# TYPE " + name + " " + type);
+} // header
+
+
+module.exports = {
+	PHASE_NONE:   internalMetrics.PHASE_NONE,
+	PHASE_TIMERS: internalMetrics.PHASE_TIMERS,
+	PHASE_SELECT: internalMetrics.PHASE_SELECT,
+	PHASE_IO:     internalMetrics.PHASE_IO,
+	PHASE_GC:     internalMetrics.PHASE_GC,
+
+	enter:    internalMetrics.enter,
+	lag:      internalMetrics.lag,
+	reset:    internalMetrics.reset,
+	snapshot: internalMetrics.snapshot,
+
+	//
+	// prometheus
+	//
+	prometheus: function() {
+		var snapshot = internalMetrics.snapshot();
+		var lines = [];
+		var i;
+
+		header(lines, "dukf_phase_seconds", "histogram", "Time taken by each phase of the event loop.");
+		for (i=0; i<PHASES.length; i++) {
+			histogram(lines, "dukf_phase_seconds", "phase=\"" + PHASES[i] + "\"", snapshot.bounds, snapshot.histograms[PHASES[i]]);
+		}
+		header(lines, "dukf_phase_max_seconds", "gauge", "Longest time taken by each phase of the event loop.");
+		for (i=0; i<PHASES.length; i++) {
+			lines.push("dukf_phase_max_seconds{phase=\"" + PHASES[i] + "\"} " + snapshot.histograms[PHASES[i]].max / 1000000);
+		}
+
+		header(lines, "dukf_loop_lag_seconds", "histogram", "How late timers fired.");
+		histogram(lines, "dukf_loop_lag_seconds", "", snapshot.bounds, snapshot.histograms.lag);
+
+		var lanes = DUKF.eventStats();
+		header(lines, "dukf_event_queue_depth", "gauge", "Events waiting in each lane.");
+		for (var lane in lanes) {
+			lines.push("dukf_event_queue_depth{lane=\"" + lane + "\"} " + lanes[lane].waiting);
+		}
+		header(lines, "dukf_events_processed_total", "counter", "Events processed from each lane.");
+		for (lane in lanes) {
+			lines.push("dukf_events_processed_total{lane=\"" + lane + "\"} " + lanes[lane].processed);
+		}
+		header(lines, "dukf_events_dropped_total", "counter", "Events dropped because their lane was full.");
+		for (lane in lanes) {
+			lines.push("dukf_events_dropped_total{lane=\"" + lane + "\"} " + lanes[lane].dropped);
+		}
+		header(lines, "dukf_event_wait_max_seconds", "gauge", "Longest wait of an event in each lane.");
+		for (lane in lanes) {
+			lines.push("dukf_event_wait_max_seconds{lane=\"" + lane + "\"} " + lanes[lane].maxWait / 1000);
+		}
+
+		var budgets = DUKF.budgetStats();
+		header(lines, "dukf_budget_overruns_total", "counter", "Calls into JavaScript stopped for using up their budget.");
+		for (var source in budgets) {
+			lines.push("dukf_budget_overruns_total{source=\"" + source + "\"} " + budgets[source].overruns);
+		}
+
+		header(lines, "dukf_heap_free_bytes", "gauge", "Free heap.");
+		lines.push("dukf_heap_free_bytes " + ESP32.getState().heapSize);
+
+		return lines.join("\n") + "\n";
+	} // prometheus
+};
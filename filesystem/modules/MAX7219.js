@@ -40,11 +40,25 @@ var SPI = require("spi");
 function MAX7219(spiDevice) {
   this._activeController = 0;
   this._totalControllers = 1;
-  this._buffer = new Buffer(this._totalControllers * 2);
+  this._pending = []; // Register writes waiting to be sent in the next batch.
+  this._busy = false; // A batch is with the SPI device.
+  this._retries = 0; // Attempts to queue the current batch that found the device busy.
 
   this._spi = spiDevice;
 }
 
+/**
+ * The most register writes sent in one batch.  Enough for a refresh of all eight
+ * digits.  The SPI device's queue_size must be at least this (the default is 10).
+ */
+MAX7219._MaxBatch = 8;
+
+/**
+ * The most times a batch is retried while the SPI device's queue is full.  The wait
+ * doubles each time, from 2ms to about a second, after which the batch fails.
+ */
+MAX7219._MaxRetries = 10;
+
 /**
  * Controller registers, as specified in the datasheet.
  * Don't modify this.
@@ -368,31 +382,95 @@ MAX7219.prototype = {
   /**
    * Shifts two bytes to the SPI device.
    *
+   * The write is queued rather than transmitted inline.  If a batch is already
+   * with the SPI device, the write waits and is sent with the others that arrive
+   * meanwhile, so a burst of register writes (e.g. setNumber) goes out as one
+   * or two batches, each a transaction per register clocked out back-to-back.
+   *
    * @param number firstByte
    *        The first byte, as a number.
    * @param number secondByte
    *        The second byte, as a number.
    * @param function callback [optional]
-   *        Invoked once the write to the SPI device finishes.
+   *        Invoked once the write to the SPI device finishes, with an Error if it
+   *        failed.
    */
   _shiftOut: function(firstByte, secondByte, callback) {
     if (!this._spi) {
       throw "SPI device not initialized";
     }
-
-    for (var i = 0; i < this._buffer.length; i += 2) {
-      this._buffer[i] = MAX7219._Registers.NoOp;
-      this._buffer[i + 1] = 0x00;
+    this._pending.push({
+      register: firstByte,
+      value: secondByte,
+      controller: this._activeController,
+      callback: callback
+    });
+    if (!this._busy) {
+      this._flush();
     }
+  },
 
-    var offset = this._activeController * 2;
-    this._buffer[offset] = firstByte;
-    this._buffer[offset + 1] = secondByte;
-
-    this._spi.transmit(this._buffer);
-    if (callback) {
-   	 callback();
+  /**
+   * Send the pending writes to the SPI device as one batch.  Each write takes a
+   * segment of two bytes per controller, the other controllers being given a
+   * NoOp.  Called again as each batch completes.
+   */
+  _flush: function() {
+    var self = this;
+    if (this._pending.length === 0) {
+      return;
+    }
+    var segmentSize = this._totalControllers * 2;
+    var batch = this._pending.slice(0, MAX7219._MaxBatch);
+    var buffer = new Buffer(batch.length * segmentSize);
+    var i;
+    for (i = 0; i < buffer.length; i += 2) {
+      buffer[i] = MAX7219._Registers.NoOp;
+      buffer[i + 1] = 0x00;
+    }
+    batch.forEach(function(entry, index) {
+      var offset = index * segmentSize + entry.controller * 2;
+      buffer[offset] = entry.register;
+      buffer[offset + 1] = entry.value;
+    });
+    var queued = this._spi.queueBatch(buffer, segmentSize, function(err) {
+      self._busy = false;
+      batch.forEach(function(entry) {
+        if (entry.callback) {
+          entry.callback(err);
+        }
+      });
+      self._flush();
+    });
+    this._busy = true;
+    if (!queued) {
+      // The device is busy with other transactions.  Keep the writes pending and
+      // try again, waiting longer each time.  If it stays busy, fail the batch.
+      this._retries++;
+      if (this._retries <= MAX7219._MaxRetries) {
+        setTimeout(function() { self._flush(); }, 1 << this._retries);
+        return;
+      }
+      var err = new Error("MAX7219: SPI device queue still full after " + MAX7219._MaxRetries + " retries");
+      log(err.message);
+      this._retries = 0;
+      this._busy = false;
+      this._pending.splice(0, batch.length);
+      batch.forEach(function(entry) {
+        if (entry.callback) {
+          entry.callback(err);
+        }
+      });
+      // Give the following writes their own chance.
+      setTimeout(function() {
+        if (!self._busy) {
+          self._flush();
+        }
+      }, 1);
+      return;
     }
+    this._retries = 0;
+    this._pending.splice(0, batch.length);
   }
 };
 
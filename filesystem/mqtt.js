@@ -0,0 +1,172 @@
+/*
+ * MQTT 3.1.1 client.
+ *
+ * connect(options, [connectListener]) - Start a client.  The connection is made, kept
+ *    alive and remade when lost by a native task.  The options are:
+ *    * host, port - The broker.  The port defaults to 1883, or 8883 with useSSL.
+ *    * clientId, username, password
+ *    * keepAlive - Seconds between PINGREQs when idle.  Default 60.
+ *    * cleanSession - Default true.
+ *    * useSSL - Connect with TLS using the settings given to ssl.configure().
+ *    * inflight - The most QoS 1 messages sent but not yet acknowledged.  Default 8.
+ *    * queueSize - The most messages waiting in RAM to be sent.  Default 64.
+ *    * spillFile - A file for messages published while offline once the queue is full.
+ *    * maxPacketSize - The largest packet accepted from the broker.  Default 8192.
+ *    * connectTimeout - Msecs allowed to connect.  Default 10000.
+ *
+ * The client returned has:
+ *    * publish(topic, message, [options]) - options may contain qos (0 or 1) and retain.
+ *      Returns false if the message could not be queued.
+ *    * subscribe(topic, [options]) - options may contain qos (0 or 1).
+ *    * unsubscribe(topic)
+ *    * end([callback]) - Send what is queued, disconnect and stop.  The callback is the
+ *      "end" event.
+ *    * stats()
+ *    * on(event, callback) - events are "connect", "message" (topic, payload, packet),
+ *      "messages" (array of packets), "close" (reason), "error" (err) and "end".
+ *
+ * Received messages arrive in batches.  A "messages" listener is given each batch, a
+ * "message" listener is called once for each message.
+ */
+
+/* globals ESP32, log, module */
+
+var moduleMQTT = ESP32.getNativeFunction("ModuleMQTT");
+if (moduleMQTT === null) {
+	log("Unable to find ModuleMQTT");
+	module.exports = null;
+	return;
+}
+
+var internalMQTT = {};
+moduleMQTT(internalMQTT);
+
+module.exports = {
+	//
+	// connect
+	//
+	connect: function(options, connectListener) {
+		if (typeof options !== "object" || options === null || typeof options.host !== "string") {
+			throw new Error("mqtt: options.host is required");
+		}
+		var handle = null;
+		var lastStats = null;
+		var listeners = {
+			connect: connectListener || null,
+			message: null,
+			messages: null,
+			close: null,
+			error: null,
+			end: null
+		};
+
+		var client = {
+			connected: false,
+
+			//
+			// on
+			//
+			on: function(eventType, callback) {
+				if (listeners.hasOwnProperty(eventType)) {
+					listeners[eventType] = callback;
+				}
+			}, // on
+
+			//
+			// publish
+			//
+			publish: function(topic, message, options) {
+				if (handle === null) {
+					return false;
+				}
+				options = options || {};
+				return internalMQTT.publish(handle, topic, message, options.qos || 0, options.retain === true);
+			}, // publish
+
+			//
+			// subscribe
+			//
+			subscribe: function(topic, options) {
+				if (handle !== null) {
+					internalMQTT.subscribe(handle, topic, (options && options.qos) || 0);
+				}
+			}, // subscribe
+
+			//
+			// unsubscribe
+			//
+			unsubscribe: function(topic) {
+				if (handle !== null) {
+					internalMQTT.unsubscribe(handle, topic);
+				}
+			}, // unsubscribe
+
+			//
+			// end
+			//
+			end: function(callback) {
+				if (callback) {
+					listeners.end = callback;
+				}
+				if (handle !== null) {
+					internalMQTT.end(handle);
+				}
+			}, // end
+
+			//
+			// stats
+			//
+			stats: function() {
+				return handle === null ? lastStats : internalMQTT.stats(handle);
+			} // stats
+		}; // client
+
+		//
+		// dispatch
+		//
+		// Called by the native task's events.
+		function dispatch(event, data) {
+			var i;
+			if (event === "message") {
+				if (listeners.messages) {
+					listeners.messages(data);
+				}
+				if (listeners.message) {
+					for (i=0; i<data.length && handle !== null; i++) {
+						listeners.message(data[i].topic, data[i].payload, data[i]);
+					}
+				}
+			} else if (event === "connect") {
+				client.connected = true;
+				if (listeners.connect) {
+					listeners.connect({sessionPresent: data});
+				}
+			} else if (event === "close") {
+				client.connected = false;
+				if (listeners.close) {
+					listeners.close(data);
+				}
+			} else if (event === "error") {
+				if (listeners.error) {
+					listeners.error(new Error("mqtt: " + data));
+				} else {
+					log("mqtt: " + options.host + ": " + data);
+				}
+			} else if (event === "end") {
+				// The native client has gone.
+				handle = null;
+				lastStats = data;
+				client.connected = false;
+				if (listeners.end) {
+					listeners.end();
+				}
+			}
+		} // dispatch
+
+		handle = internalMQTT.create(options, dispatch);
+		if (!handle) {
+			throw new Error("mqtt: Unable to create client");
+		}
+		return client;
+	} // connect
+}; // module.exports
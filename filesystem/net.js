@@ -1,13 +1,28 @@
 // https://www.hacksparrow.com/tcp-socket-programming-in-node-js.html
-/* globals _sockets, OS, module */
+/* globals _sockets, OS, module, setTimeout, cancelTimeout, DUKF */
 /**
  * Expected environment:
  * * A global array called _sockets should exist which contains the sockets.
  * 
  * Prereq modules:
- * * none
+ * * dns
+ * * netio (optional)
  * 
  */
+var dns = require("dns.js");
+var netio = require("netio.js"); // null when the network I/O task isn't built in.
+
+// Msecs allowed for a connection, including the host name lookup and any SSL handshake,
+// unless the connect options give a timeout.
+var DEFAULT_CONNECT_TIMEOUT = 20000;
+
+// The most connections a server keeps open at once unless its options say otherwise.  lwIP
+// on the ESP32 has few sockets and some must be left for outgoing connections.
+var DEFAULT_MAX_CONNECTIONS = DUKF.OS == "ESP32" ? 6 : 64;
+
+// The most connections a server accepts in one pass of the loop.  Any more waiting are
+// accepted in the next pass so that other sockets and timers aren't starved.
+var MAX_ACCEPTS_PER_PASS = 8;
 var moduleSSL = ESP32.getNativeFunction("ModuleSSL");
 if (moduleSSL === null) {
 	log("Unable to find ModuleSSL");
@@ -23,6 +38,8 @@ var net = {
 	// net.Socket(options)
 	// The options parameter is an optional object which can contain:
 	// * sockfd - A numeric socket fd of an open socket.
+	// * offload - false to keep the socket's I/O on the loop rather than handing it to
+	//   the network I/O task once connected.  Sockets using SSL always stay on the loop.
 	//
 	// connect - Connect to a target.
 	// getFD - Return the underlyng file descriptor.
@@ -30,6 +47,10 @@ var net = {
 	// - close
 	// - data
 	// - end
+	// - error
+	// pause - Stop reading from the socket.
+	// release - Return an SSL connection to the pool of idle connections.
+	// resume - Resume reading from the socket.
 	// write - Write data to a target.
 
 	Socket: function(options) {
@@ -45,21 +66,57 @@ var net = {
 			_onClose: null,
 			_onConnect: null,
 			_onEnd: null,
+			_onError: null,
 			_note: null,
+			_resolving: false,      // Is the host name being looked up?
+			_connectPending: false, // Is the TCP handshake in progress?
+			_connectTimer: null,    // Fails the connect if it takes too long.
+			_useSSL: false,
+			_sslHandshaking: false, // Is an SSL handshake in progress?
+			_sslWant: null,         // "read" or "write" if SSL is waiting for the socket.
+			_writeQueue: [],        // Data waiting until we are connected or, for SSL and offloaded sockets, until it can be written.
+			_offload: !(options && options.offload === false), // May the network I/O task take the socket?
+			_offloaded: false,      // Is the socket's I/O done by the network I/O task?  The loop ignores it.
+			_channel: -1,           // The network I/O task's channel.
+			_netioEnded: false,     // The task has seen the end of the partner's data.
+			_netioError: null,      // The task's reason for the socket failing.
+			_ending: false,         // The socket has been ended.  It is closed once its queued data is sent.
+			_endOnConnect: false,   // end() was called while connecting.  End once connected.
+			_onForget: null,        // Called once when the socket is closed and forgotten.
 			_createTime: new Date().getTime(), // When the socket was created
 			listening: false,
 			connecting: false,
+			paused: false, // When paused, the loop does not read from the socket.
 			remoteAddress: null,
 			remotePort: null,
 			localPort: null,
 			
 			//
 			// write - Write data down the socket.  If we are using SSL, then write using the
-			// SSL routines otherwise write using the OS send API.
+			// SSL routines otherwise write using the OS send API.  SSL sockets are non-blocking,
+			// data that can't be written yet is queued and written by the loop when the
+			// socket is ready.
 			//
 			write: function(data) {
+				if (this._resolving || this._connectPending) {
+					// We aren't connected yet.
+					this._writeQueue.push(data);
+					return data.length;
+				}
+				if (this._offloaded) {
+					if (typeof data === "string") {
+						data = new Buffer(data);
+					}
+					this._writeQueue.push(data);
+					this._netioFlush();
+					return data.length;
+				}
 				if (this.hasOwnProperty("dukf_ssl_context")) {
-					return internalSSL.write(this.dukf_ssl_context, data);
+					this._writeQueue.push(data);
+					if (!this._sslHandshaking) {
+						this._sslFlush();
+					}
+					return data.length;
 				} else {
 					var sendRc = OS.send({sockfd: sockfd, data: data});
 					if (sendRc < 0) {
@@ -68,6 +125,219 @@ var net = {
 					return sendRc;
 				}
 			}, // write
+			
+			//
+			// _sslHandshake
+			//
+			// Advance the SSL handshake.  Called when connecting and then by the loop each time
+			// the socket becomes ready in the way the handshake asked for.  When the handshake
+			// completes, the socket is connected and any queued data is written.
+			_sslHandshake: function() {
+				var rc = internalSSL.handshake(this.dukf_ssl_context);
+				if (rc === internalSSL.WANT_READ) {
+					this._sslWant = "read";
+				} else if (rc === internalSSL.WANT_WRITE) {
+					this._sslWant = "write";
+				} else if (rc === 0) {
+					this._sslHandshaking = false;
+					this._sslWant = null;
+					this._connected();
+					this._sslFlush();
+				} else {
+					log("net: SSL handshake with " + this.remoteAddress + " failed");
+					this._sslFailed();
+				}
+			}, // _sslHandshake
+			
+			//
+			// _sslFlush
+			//
+			// Write as much queued data as the socket will accept.  mbedtls requires that a write
+			// that could not complete is retried with the same data, which is why the data stays at
+			// the head of the queue until it has been written.
+			_sslFlush: function() {
+				this._sslWant = null;
+				while (this._writeQueue.length > 0 && this.hasOwnProperty("dukf_ssl_context")) {
+					var data = this._writeQueue[0];
+					var rc = internalSSL.write(this.dukf_ssl_context, data);
+					if (rc === internalSSL.WANT_READ) {
+						this._sslWant = "read";
+						return;
+					}
+					if (rc === internalSSL.WANT_WRITE) {
+						this._sslWant = "write";
+						return;
+					}
+					if (isNaN(rc)) {
+						this._sslFailed();
+						return;
+					}
+					if (rc < data.length) {
+						if (typeof data === "string") {
+							data = new Buffer(data);
+						}
+						this._writeQueue[0] = data.slice(rc);
+					} else {
+						this._writeQueue.shift();
+					}
+				}
+				if (this._ending && !this._offloaded && this._writeQueue.length === 0 &&
+						this.hasOwnProperty("dukf_ssl_context")) {
+					this._close();
+				}
+			}, // _sslFlush
+			
+			//
+			// _sslFailed
+			//
+			// The SSL connection has failed.  Close it and tell the user it has gone.
+			_sslFailed: function() {
+				this._writeQueue = [];
+				if (this._onEnd) {
+					this._onEnd();
+				}
+				if (this._onClose) {
+					this._onClose();
+				}
+				this.end();
+			}, // _sslFailed
+			
+			//
+			// _startOffload
+			//
+			// Hand the connected socket to the network I/O task.  If the task has no free
+			// channel the socket stays with the loop.
+			_startOffload: function() {
+				if (!this._offload || netio === null || this.hasOwnProperty("dukf_ssl_context")) {
+					return;
+				}
+				var channel = netio.attach(sockfd, this);
+				if (channel >= 0) {
+					this._channel = channel;
+					this._offloaded = true;
+				}
+			}, // _startOffload
+			
+			//
+			// _netioEvent
+			//
+			// Called with a report from the network I/O task.
+			_netioEvent: function(report) {
+				if (report.writable) {
+					this._netioFlush();
+				}
+				if (report.error !== null) {
+					this._netioError = report.error;
+				}
+				if (report.ended || report.error !== null) {
+					this._netioEnded = true;
+				}
+				if (this._ending) {
+					// We are only waiting to hand over queued data.  If the partner has gone
+					// there is no one to send it to.
+					if (this._netioEnded && this._offloaded) {
+						this._writeQueue = [];
+						this._netioClose();
+					}
+					return;
+				}
+				if (!this.paused) {
+					this._netioDrain();
+				}
+			}, // _netioEvent
+			
+			//
+			// _netioFlush
+			//
+			// Move queued data into the task's transmit ring.  What doesn't fit waits for a
+			// writable report.
+			_netioFlush: function() {
+				while (this._writeQueue.length > 0 && this._offloaded) {
+					var data = this._writeQueue[0];
+					var queued = netio.write(this._channel, data);
+					if (queued < 0) {
+						return;
+					}
+					if (queued < data.length) {
+						this._writeQueue[0] = data.slice(queued);
+						return;
+					}
+					this._writeQueue.shift();
+				}
+				if (this._ending && this._offloaded) {
+					this._netioClose();
+				}
+			}, // _netioFlush
+			
+			//
+			// _netioDrain
+			//
+			// Pass what the task has received to the data listener and, once the partner
+			// has finished, end the socket.
+			_netioDrain: function() {
+				if (this._ending || !this._offloaded) {
+					return; // We have ended the socket and don't want its data.
+				}
+				var data = netio.read(this._channel);
+				if (data !== undefined && this._onData) {
+					this._onData(data);
+				}
+				// The data listener may have paused or ended the socket.
+				if (!this._netioEnded || this.paused || !this._offloaded || this._ending) {
+					return;
+				}
+				if (this._netioError !== null && this._onError) {
+					this._onError(new Error("net: " + this.remoteAddress + ": " + this._netioError));
+				}
+				if (this._onEnd) {
+					this._onEnd();
+				}
+				if (this._onClose) {
+					this._onClose();
+				}
+				this._writeQueue = [];
+				this._netioClose();
+			}, // _netioDrain
+			
+			//
+			// _netioClose
+			//
+			// Give the channel back.  The task sends what is left in the ring and closes the socket.
+			_netioClose: function() {
+				netio.close(this._channel);
+				this._ending = true;
+				this._offloaded = false;
+				this._channel = -1;
+				this._forget();
+			}, // _netioClose
+			
+			//
+			// _forget
+			//
+			// Remove the closed socket from the loop's sockets and tell its server, if it has
+			// one, that the connection has gone.
+			_forget: function() {
+				if (_sockets[sockfd] === this) {
+					delete _sockets[sockfd];
+				}
+				if (this._onForget !== null) {
+					var onForget = this._onForget;
+					this._onForget = null;
+					onForget();
+				}
+			}, // _forget
+			
+			//
+			// wantsWrite
+			//
+			// Return true if the loop should tell us when the socket becomes writable.
+			wantsWrite: function() {
+				if (this._sslHandshaking || this._sslWant !== null) {
+					return this._sslWant !== "read";
+				}
+				return this.connecting || this._writeQueue.length > 0;
+			}, // wantsWrite
+			
 			//
 			// on - Register events.
 			//
@@ -88,6 +358,10 @@ var net = {
 					this._onEnd = callback;
 					return;
 				}
+				if (eventType === "error") {
+					this._onError = callback;
+					return;
+				}
 			}, // on
 /**
  * connect: Connect to a partner socket
@@ -95,6 +369,8 @@ var net = {
  * * port
  * * host
  * * useSSL
+ * * timeout - msecs, 0 for none
+ * * offload - false to keep the socket on the loop
  */
 			//
 			// connect
@@ -102,37 +378,257 @@ var net = {
 			connect: function(options, connectListener) {
 				this.connecting = true;
 				this.on("connect", connectListener);
+				this.remotePort = options.port;
+				this.remoteAddress = options.address;
+				this._useSSL = options.useSSL === true;
+				if (options.offload === false) {
+					this._offload = false;
+				}
+				
+				// Give up if we aren't connected in time.  The connect is non-blocking so
+				// a host that doesn't answer only costs us this socket.
+				var self = this;
+				var timeout = options.timeout !== undefined ? options.timeout : DEFAULT_CONNECT_TIMEOUT;
+				if (timeout > 0) {
+					this._connectTimer = setTimeout(function() {
+						self._connectTimer = null;
+						if (self.connecting && _sockets[sockfd] === self) {
+							var err = new Error("connect ETIMEDOUT " + options.address + ":" + options.port);
+							err.code = "ETIMEDOUT";
+							self._connectFailed(err);
+						}
+					}, timeout);
+				}
+
+				// If we are using SSL, see if there is an idle connection to the same
+				// host:port that we can reuse.  If there is, we adopt its socket in place
+				// of our own.  The connect listener is called from the loop as soon as
+				// the socket is seen to be writable.
+				if (options.useSSL === true) {
+					var pooled = internalSSL.acquire(options.address, options.port);
+					if (pooled !== undefined) {
+						OS.close({sockfd: sockfd});
+						delete _sockets[sockfd];
+						sockfd = pooled.fd;
+						_sockets[sockfd] = this;
+						this.dukf_ssl_context = pooled.context;
+						this.reused = true;
+						return;
+					}
+				}
+				// Connect straight away if we know the address.  Otherwise the name is looked
+				// up without blocking and we connect when the answer arrives.  The loop ignores
+				// the socket until then.
+				var address = dns.lookupCached(options.address);
+				if (typeof address === "string") {
+					this._connectTo(address, options);
+					return;
+				}
+				this._resolving = true;
+				dns.lookup(options.address, function(err, address) {
+					self._resolving = false;
+					if (_sockets[sockfd] !== self) {
+						return; // The socket was ended while we were waiting.
+					}
+					if (err) {
+						self._connectFailed(err);
+						return;
+					}
+					try {
+						self._connectTo(address, options);
+					} catch(e) {
+						self._connectFailed(e);
+					}
+				});
+			}, // connect
+			
+			//
+			// _connectTo
+			//
+			// Start connecting to the resolved address.  The loop calls _connectDone() when
+			// the socket becomes writable.
+			_connectTo: function(address, options) {
 				var connectRc = OS.connect({
 					sockfd: sockfd,
 					port: options.port,
-					address: net.getByName(options.address)
+					address: address
 				});
 				if (connectRc < 0) {
 					throw new Error("Underlying connect() failed");
 				}
-				this.remotePort = options.port;
-				this.remoteAddress = options.address;
-				
-				// If we are using SSL then create the SSL structures ...
-				if (options.useSSL === true) {
-					this.dukf_ssl_context = internalSSL.create_dukf_ssl_context(options.address, sockfd);
+				this._connectPending = true;
+			}, // _connectTo
+			
+			//
+			// _connectDone
+			//
+			// The TCP handshake has finished.  If it succeeded, start the SSL handshake or, for
+			// a plain socket, write what was queued and tell the user we are connected.
+			_connectDone: function() {
+				this._connectPending = false;
+				var result = OS.connectResult({sockfd: sockfd});
+				if (result !== null) {
+					var err = new Error("connect " + this.remoteAddress + ":" + this.remotePort + ": " + result.message);
+					err.errno = result.errno;
+					this._connectFailed(err);
+					return;
 				}
-			}, // connect
+				if (this._useSSL) {
+					var context = internalSSL.create_dukf_ssl_context(this.remoteAddress, sockfd, this.remotePort);
+					if (context === undefined) {
+						this._connectFailed(new Error("Unable to create SSL context"));
+						return;
+					}
+					this.dukf_ssl_context = context;
+					this._sslHandshaking = true;
+					this._sslHandshake();
+					return;
+				}
+				this._startOffload();
+				var queued = this._writeQueue;
+				this._writeQueue = [];
+				for (var i=0; i<queued.length; i++) {
+					this.write(queued[i]);
+				}
+				this._connected();
+			}, // _connectDone
+			
+			//
+			// _connected
+			//
+			// The connection is ready for use.
+			_connected: function() {
+				this.connecting = false;
+				if (this._connectTimer !== null) {
+					cancelTimeout(this._connectTimer);
+					this._connectTimer = null;
+				}
+				if (this._onConnect) {
+					this._onConnect();
+				}
+				if (this._endOnConnect) {
+					this.end();
+				}
+			}, // _connected
+			
+			//
+			// _connectFailed
+			//
+			// We couldn't connect.  There is no caller left to throw to so tell the user through
+			// the error event and close the socket.
+			_connectFailed: function(err) {
+				log("net: " + err.message);
+				this.connecting = false;
+				this._connectPending = false;
+				this._writeQueue = []; // It can't be sent now.
+				if (this._onError) {
+					this._onError(err);
+				}
+				if (this._onClose) {
+					this._onClose();
+				}
+				this.end();
+			}, // _connectFailed
 			
 			//
-			// close
+			// end
 			//
-			// Here we flag the socket as ended.  This means we close the socket and delete it from
-			// the list of known sockets.  This should be fine as we shouldn't ever try and read
-			// from it or write from it again.
+			// Here we flag the socket as ended.  Data already written is sent first, then we
+			// close the socket and delete it from the list of known sockets.  This should be
+			// fine as we shouldn't ever try and read from it or write from it again.
 			end: function(data) {
 				if (data !== undefined) {
 					this.write(data);
 				}
+				if (this._offloaded || (this._ending && !this.hasOwnProperty("dukf_ssl_context"))) {
+					// The task sends what it has been given before closing.  Data still
+					// waiting for room in its ring is given to it first.  The socket is
+					// the task's to close, even once we have given the channel back.
+					if (this._offloaded) {
+						this._ending = true;
+						this._netioFlush();
+					}
+					return;
+				}
+				if (this._writeQueue.length > 0) {
+					if (this._resolving || this._connectPending || this._sslHandshaking) {
+						// What has been written is sent once we are connected.
+						this._endOnConnect = true;
+						return;
+					}
+					if (this.hasOwnProperty("dukf_ssl_context")) {
+						// The loop writes the rest as the socket allows and _sslFlush()
+						// then closes the socket.
+						this._ending = true;
+						this._sslFlush();
+						return;
+					}
+				}
+				this._close();
+			}, // end
+			
+			//
+			// _close
+			//
+			// Close the socket now, discarding anything not yet written.
+			_close: function() {
+				this._writeQueue = [];
+				if (this._connectTimer !== null) {
+					cancelTimeout(this._connectTimer);
+					this._connectTimer = null;
+				}
 				OS.shutdown({sockfd: sockfd});
 				OS.close({sockfd: sockfd});
-				delete _sockets[sockfd];
-			},
+				if (this.hasOwnProperty("dukf_ssl_context")) {
+					internalSSL.free_dukf_ssl_context(this.dukf_ssl_context);
+					delete this.dukf_ssl_context;
+				}
+				this._forget();
+			}, // _close
+			
+			//
+			// release
+			//
+			// We are finished with an SSL socket but the connection to the partner is still
+			// good.  Rather than closing it, hand it to the pool of idle SSL connections so
+			// that a later connect to the same host and port can reuse it.  A socket that is
+			// not using SSL is simply ended.
+			release: function() {
+				if (!this.hasOwnProperty("dukf_ssl_context")) {
+					this.end();
+					return;
+				}
+				if (this._writeQueue.length > 0) {
+					// We can't hand over a connection with data still to be written.
+					this.end();
+					return;
+				}
+				internalSSL.release(this.dukf_ssl_context);
+				delete this.dukf_ssl_context;
+				this._forget();
+			}, // release
+			
+			//
+			// pause
+			//
+			// Stop reading data from the socket.  Data sent by the partner is left with the
+			// network stack which will in turn stop the partner sending more.
+			pause: function() {
+				this.paused = true;
+			}, // pause
+			
+			//
+			// resume
+			//
+			// Start reading data from the socket again after a pause().
+			resume: function() {
+				this.paused = false;
+				if (this._offloaded) {
+					// Deliver what the task received while we were paused.
+					this._netioDrain();
+				}
+			}, // resume
+			
 			setNote: function(text) {
 				this._note = text;
 			},
@@ -148,25 +644,96 @@ var net = {
 	}, // function Socket
 	
 	//
-	// net.createServer(...)
+	// net.createServer([options], connectionListener)
+	//
+	// The optional options object can contain:
+	// * backlog - The most connections waiting to be accepted.  Default 5.
+	// * maxConnections - The most connections open at once.  Default 6 on the ESP32, 64 on Linux.
+	// * maxConnectionsPerIP - The most connections open at once from one address.  Default no limit.
+	// * onOverload - function(sock) called with a connection that is over a limit, for example
+	//   to write an error to it.  The connection is then closed.
 	//
-	createServer: function(connectionListener) {
+	createServer: function(options, connectionListener) {
+		if (typeof options === "function") {
+			connectionListener = options;
+			options = {};
+		}
+		options = options || {};
 		var sock = new this.Socket(); // Create a new socket
 		sock.listening = true;
 		sock.on("connect", connectionListener);
-		return {
-			listen: function(port) {
+		var perIP = {}; // Open connections by partner address.
+		var server = {
+			maxConnections: options.maxConnections || DEFAULT_MAX_CONNECTIONS,
+			maxConnectionsPerIP: options.maxConnectionsPerIP || 0,
+			connections: 0, // Open now.
+			accepted: 0,
+			rejected: 0,
+			
+			listen: function(port, backlog) {
 				sock.localPort = port;
 				if (OS.bind({sockfd: sock.getFD(), port: port}) != 0) {
 					throw new Error("Underlying bind() failed");
 				}
-				if (OS.listen({sockfd: sock.getFD()}) !=0) {
+				if (OS.listen({sockfd: sock.getFD(), backlog: backlog || options.backlog}) !=0) {
 					throw new Error("Underlying listen() failed");
 				}
 				// Listen on the port
-			} // listen
-		}; // return
+			}, // listen
+			
+			//
+			// stats
+			//
+			stats: function() {
+				return {connections: this.connections, accepted: this.accepted, rejected: this.rejected};
+			} // stats
+		}; // server
 		
+		//
+		// _accept
+		//
+		// Called by the loop when the listening socket is readable.  Accept the connections
+		// waiting, turning away those over the limits.
+		sock._accept = function() {
+			for (var n=0; n<MAX_ACCEPTS_PER_PASS; n++) {
+				var acceptData = OS.accept({sockfd: sock.getFD()});
+				if (!acceptData) {
+					return; // No more waiting.
+				}
+				var newSocket = new net.Socket({sockfd: acceptData.sockfd});
+				newSocket._createdFromFd = sock.getFD();	// For debugging purposes only
+				newSocket.remoteAddress = acceptData.address;
+				newSocket.remotePort = acceptData.port;
+				var address = acceptData.address;
+				if (server.connections >= server.maxConnections ||
+						(server.maxConnectionsPerIP > 0 && (perIP[address] || 0) >= server.maxConnectionsPerIP)) {
+					server.rejected++;
+					log("net: Rejected connection from " + address + ", " + server.connections + " open");
+					if (options.onOverload) {
+						options.onOverload(newSocket);
+					}
+					newSocket.end();
+					continue;
+				}
+				server.accepted++;
+				server.connections++;
+				perIP[address] = (perIP[address] || 0) + 1;
+				newSocket._onForget = function(address) {
+					return function() {
+						server.connections--;
+						if (--perIP[address] === 0) {
+							delete perIP[address];
+						}
+					};
+				}(address);
+				newSocket._startOffload();
+				newSocket.on("connect", sock._onConnect);
+				if (newSocket._onConnect) {
+					newSocket._onConnect(newSocket);
+				}
+			}
+		}; // _accept
+		return server;
 	}, // createServer
 	
 	//
@@ -194,10 +761,10 @@ var net = {
 	// getByName()
 	//
 	// Return a string representation of the IP address of the address or null
-	// on an error.  Will also parse regular IP addresses.
+	// on an error.  Will also parse regular IP addresses.  This blocks when the
+	// name isn't in the DNS cache; use dns.lookup() to avoid that.
 	getByName: function(address) {
-		//return OS.gethostbyname(address);
-		return OS.getaddrinfo(address);
+		return dns.lookupSync(address);
 	} // getByName
 
 }; // End of module net
@@ -0,0 +1,96 @@
+/*
+ * Network I/O task.
+ *
+ * A connected socket can be handed to a native task that does its recv() and send()
+ * calls, on the other core of the ESP32, so that the loop doesn't wait on them.  The
+ * socket's data passes through a pair of rings.  net.js does this for plain TCP
+ * sockets unless they are created with the option offload: false.
+ *
+ * attach(fd, socket) - Hand over a connected socket.  Returns the channel number, or -1
+ *    if no channel is free, in which case the socket stays with the loop.  The socket's
+ *    _netioEvent(report) is called with {channel, readable, ended, error, writable}
+ *    when the task has something to say about it.
+ * read(channel) - Return a Buffer of the data received or undefined.
+ * write(channel, data) - Queue data to be sent.  Returns the number of bytes queued.  If
+ *    not all the data was queued, a report with writable set follows when there is room.
+ * close(channel) - Send what is queued then close the socket.
+ * stats() - Counts of the task's system calls, bytes moved and events.
+ */
+
+/* globals ESP32, log, module */
+
+var moduleNetIO = ESP32.getNativeFunction("ModuleNetIO");
+if (moduleNetIO === null) {
+	log("Unable to find ModuleNetIO");
+	module.exports = null;
+	return;
+}
+
+var internalNetIO = {};
+moduleNetIO(internalNetIO);
+
+var started = false;
+var channels = {}; // Channel number to socket.
+
+//
+// dispatch
+//
+// Called by the task's events with the reports of the channels that need attention.
+function dispatch(reports) {
+	for (var i=0; i<reports.length; i++) {
+		var socket = channels[reports[i].channel];
+		if (socket !== undefined) {
+			socket._netioEvent(reports[i]);
+		}
+	}
+} // dispatch
+
+module.exports = {
+	RING_SIZE: internalNetIO.RING_SIZE,
+
+	//
+	// attach
+	//
+	attach: function(fd, socket) {
+		if (!started) {
+			started = internalNetIO.init(dispatch);
+			if (!started) {
+				return -1;
+			}
+		}
+		var channel = internalNetIO.attach(fd);
+		if (channel >= 0) {
+			channels[channel] = socket;
+		}
+		return channel;
+	}, // attach
+
+	//
+	// read
+	//
+	read: function(channel) {
+		return internalNetIO.read(channel);
+	}, // read
+
+	//
+	// write
+	//
+	write: function(channel, data) {
+		return internalNetIO.write(channel, data);
+	}, // write
+
+	//
+	// close
+	//
+	close: function(channel) {
+		delete channels[channel];
+		internalNetIO.close(channel);
+	}, // close
+
+	//
+	// stats
+	//
+	stats: function() {
+		return internalNetIO.stats();
+	} // stats
+}; // module.exports
@@ -35,6 +35,7 @@ var ret = {
    //    mode: <optional mode.  Default: 0>
    //    clock_speed: <optional clock speed in Hz.  Default: 10000 (10KHz)>
    //    cs: <pin to use for CS.  Default: -1 (not used)>
+   //    queue_size: <optional maximum queued transactions.  Default: 10>
 	// }
 	addDevice: function(options) {
 		var handle = internalSPI.add_device(options);
@@ -53,8 +54,62 @@ var ret = {
 			transmit: function(data) {
 				internalSPI.transmit(handle, data);
 			}, // transmit
-		}
+			
+			//
+			// queue
+			//
+			// Queue data for transmission using DMA without waiting for it to be
+			// sent.  The callback is invoked as callback(err, rxData) when the
+			// transaction completes.  If rxData is not supplied, the received data
+			// replaces the transmitted data in the data buffer.  Neither buffer may
+			// be changed until the callback has been invoked.
+			//
+			// Returns true if the transaction was queued and false if the device
+			// already has queue_size transactions in flight.
+			//
+			queue: function(data, rxData, callback) {
+				if (typeof rxData == "function") {
+					callback = rxData;
+					rxData = null;
+				}
+				if (!callback) {
+					callback = function() {};
+				}
+				return internalSPI.queue(handle, data, rxData ? rxData : null, callback);
+			}, // queue
+			
+			//
+			// queueBatch
+			//
+			// Queue data as a batch of transactions of segmentSize bytes each.  CS is
+			// released between them, as a device such as a MAX7219 needs to latch
+			// each register write, but the callback is only invoked once, as
+			// callback(err, data), when the last has completed.  The segmentSize must
+			// be at most 4 or a multiple of 4.  The received data replaces the
+			// transmitted data.
+			//
+			// Returns true if the batch was queued and false if the device doesn't
+			// have room for all of its transactions.
+			//
+			queueBatch: function(data, segmentSize, callback) {
+				if (!callback) {
+					callback = function() {};
+				}
+				return internalSPI.queue(handle, data, null, callback, segmentSize);
+			}, // queueBatch
+			
+			//
+			// pending
+			//
+			// Return the number of queued transactions that have not yet completed.
+			//
+			pending: function() {
+				return internalSPI.pending(handle);
+			} // pending
+		};
 	} // addDevice
 }; // ret
 
+ret.SIMULATED = internalSPI.SIMULATED;
+
 module.exports = ret;
\ No newline at end of file
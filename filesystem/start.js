@@ -30,16 +30,10 @@ function runStart() {
 	var startProgram = esp32duktapeNS.get("start", "string");
 	esp32duktapeNS.close();
 	if (startProgram !== null) {
-		log("Running start program: %s" + startProgram);
-		var script = ESP32.loadFile("/spiffs" + startProgram);
-		if (script !== null) {
-			try {
-				eval(script);
-			}
-			catch (e) {
-				log("Caught exception: " + e.stack);
-			}
-		} // We loaded the script
+		log("Running start program: " + startProgram);
+		// The script is compiled natively, or loaded if it is a .jsbc file, so that we never
+		// hold both its bytes and a copy as a JavaScript string.  Errors are logged.
+		DUKF.runFile("/spiffs" + startProgram);
 	} else { // We have a program 
 		log("No start program");
 	}
@@ -2,7 +2,7 @@
  * https://nodejs.org/api/stream.html
  * @returns
  */
-/* globals Buffer, module */
+/* globals Buffer, module, ESP32, Duktape */
 /*
 #Streams
 A writer can have data written to it.
@@ -55,9 +55,18 @@ function stream() {
 }
 ```
 */
+var moduleStream = ESP32.getNativeFunction("ModuleStream");
+var internalStream = {};
+moduleStream(internalStream);
+
 /**
  * A stream object is created with
- * var myStream = new stream();
+ * var myStream = new stream([options]);
+ * where options is either the highWaterMark or an object containing:
+ * {
+ *    highWaterMark: <Bytes held before write() returns false> [optional; default 16384]
+ *    maxBuffer: <Bytes that may be held at most> [optional; default 65536]
+ * }
  * The result is an object that contains:
  * {
  *    reader: <A representation of a reader of data>
@@ -65,24 +74,125 @@ function stream() {
  * }
  * 
  * The writer object contains:
- * write: Write some data.  The input can be either a Buffer or a String.
+ * write: Write some data.  The input can be either a Buffer or a String.  Returns false if
+ *        the data had to be held and the amount held has reached the highWaterMark.  The
+ *        writer should then stop writing until "drain".  Writing more than maxBuffer bytes
+ *        that can't be passed on throws an Error rather than losing data.
  * end: Flag the stream writing as complete optionally passing in some final data.
+ * error: Flag that the data is incomplete.  The reader's "error" callback is passed the
+ *        Error and the stream is then ended.
+ * on: Register an event handler
+ * - drain: A callback that is invoked when data that was held has been passed to the reader.
  * 
  * The reader object contains:
- * read: <read some data>
+ * read: Read the data that has been held.  With no parameter a new Buffer is returned.  If
+ *       a Buffer is passed, as much data as fits is read into it and the number of bytes
+ *       read is returned.
+ * pause: Stop passing data to the "data" callback.  Data written while paused is held.
+ * resume: Pass held data to the "data" callback and continue passing new data.
+ * pipe: Pass all data and the end to a writer (such as the writer of another stream).  If
+ *       the writer returns false from write(), the reader is paused until the writer's
+ *       "drain".  The Buffers are passed along as they are, without being copied.
  * on: Register an event handler
  * - data: A callback that takes a Buffer parameter.  When called, new data is available
  *         and can be found in the passed in buffer.
  * - end: A callback (with no parameters) that indicates that the reader should
  *        not expect any more data.  It has reached the end.  We ensure that this callback is
  *        never called more than once even if a writer should signal an end more than once.
+ * - error: A callback that takes an Error.  The writer could not supply all of the data.
+ *          The "end" follows so a reader only waiting for the end isn't left waiting.
+ *
+ * Held data is kept natively in a ring buffer that starts at 1KB and doubles as needed up to
+ * maxBuffer.
  */
-function stream() {
-	var dataBuffer = null;
-	var dataBufferUsed = 0;
+function stream(options) {
+	var highWaterMark = 16384;
+	var maxBuffer = 65536;
+	var ring = {handle: null}; // The native ring buffer holding data, created when first needed.
 	var endFlag = false; // Set to true when writer has flagged an end
+	var endSignalled = false; // Set to true when the reader has been told of the end
+	var paused = false;
 	var readerCallback = null;
 	var endCallback = null;
+	var errorCallback = null;
+	var errorValue = null; // The Error flagged by the writer.
+	var drainCallback = null;
+	
+	if (typeof options == "number") {
+		highWaterMark = options;
+	} else if (options !== undefined && options !== null) {
+		if (options.highWaterMark !== undefined) {
+			highWaterMark = options.highWaterMark;
+		}
+		if (options.maxBuffer !== undefined) {
+			maxBuffer = options.maxBuffer;
+		}
+	}
+	if (maxBuffer < highWaterMark) {
+		maxBuffer = highWaterMark;
+	}
+	
+	// Release the native ring buffer when the stream is garbage collected.
+	Duktape.fin(ring, function(o) {
+		if (o.handle) {
+			internalStream.free(o.handle);
+			o.handle = null;
+		}
+	});
+	
+	function heldLength() {
+		return ring.handle === null ? 0 : internalStream.length(ring.handle);
+	} // heldLength
+	
+	//
+	// hold
+	//
+	// Append data to the data we are holding for the reader.
+	function hold(data) {
+		if (ring.handle === null) {
+			ring.handle = internalStream.create(1024, maxBuffer);
+			if (ring.handle === undefined) {
+				ring.handle = null;
+				throw new Error("Unable to allocate stream buffer");
+			}
+		}
+		if (internalStream.write(ring.handle, data) < data.length) {
+			throw new Error("Stream buffer full: more than " + maxBuffer + " bytes held");
+		}
+	} // hold
+	
+	//
+	// takeHeld
+	//
+	// Return the data being held as a new buffer and forget it.
+	function takeHeld() {
+		return internalStream.read(ring.handle);
+	} // takeHeld
+	
+	//
+	// delivered
+	//
+	// The data we held has been passed on.  Release the storage and tell the writer.
+	function delivered() {
+		if (ring.handle !== null && heldLength() === 0) {
+			internalStream.free(ring.handle);
+			ring.handle = null;
+		}
+		if (drainCallback && heldLength() < highWaterMark) {
+			drainCallback();
+		}
+	} // delivered
+	
+	//
+	// signalEnd
+	//
+	// Tell the reader about the end once all the data has been delivered.
+	function signalEnd() {
+		if (endFlag && !endSignalled && endCallback && heldLength() === 0) {
+			endSignalled = true;
+			endCallback();
+		}
+	} // signalEnd
 
 	var writer = {
 		//
@@ -99,20 +209,44 @@ function stream() {
 			if (typeof data == "string") {
 				data = new Buffer(data);
 			}
-			if (readerCallback !== null) {
+			if (readerCallback !== null && !paused) {
 				readerCallback(data);
+				return true;
 			}
-			// We don't have a consumer for the stream (yet) so we store the data until
-			// we have a consumer.
-			else {
-				if (dataBuffer === null) {
-					dataBuffer = new Buffer(1000); // FIX .. we need to be able to increase.
-				}
-				data.copy(dataBuffer, dataBufferUsed);
-				dataBufferUsed += data.length;
-			}
+			// We don't have a consumer for the stream (yet) or it has paused so we store the
+			// data until we have a consumer.
+			hold(data);
+			return heldLength() < highWaterMark;
 		}, // write()
 		
+		//
+		// on
+		//
+		// Register handlers for events sent to the writer.
+		on: function(event, callback) {
+			if (event == "drain") {
+				drainCallback = callback;
+			} else {
+				throw new Error("Unknown event type: "+ event);
+			}
+		}, // on
+		
+		//
+		// error
+		//
+		// The data written so far is all there will be but it is incomplete.  Tell the
+		// reader and end the stream.
+		error: function(err) {
+			if (endFlag) {
+				return;
+			}
+			errorValue = err;
+			if (errorCallback) {
+				errorCallback(err);
+			}
+			this.end();
+		}, // error
+		
 		//
 		// end
 		//
@@ -129,8 +263,13 @@ function stream() {
 
 			endFlag = true;
 			
-			if (endCallback) {
-				endCallback();
+			// If a data consumer is paused, the end is signalled when the held data
+			// has been delivered.  A reader using read() is told straight away.
+			if (readerCallback === null || !paused) {
+				if (endCallback && !endSignalled) {
+					endSignalled = true;
+					endCallback();
+				}
 			}
 		} // end()
 	};
@@ -143,16 +282,67 @@ function stream() {
 		// read
 		//
 		// Read data that has been accumulated and we have no "data" handler.
-		read: function() {
-			if (dataBufferUsed === 0) {
+		read: function(buffer) {
+			if (buffer !== undefined) {
+				if (ring.handle === null) {
+					return 0;
+				}
+				var size = internalStream.readInto(ring.handle, buffer, 0);
+				delivered();
+				return size;
+			}
+			if (heldLength() === 0) {
 				return new Buffer(0);
 			}
-			var tempBuffer = new Buffer(dataBufferUsed);
-			dataBuffer.copy(tempBuffer, 0, 0, dataBufferUsed);
-			dataBufferUsed = 0;
+			var tempBuffer = takeHeld();
+			delivered();
 			return tempBuffer;
 		}, // read
 		
+		//
+		// pause
+		//
+		// Stop delivering data to the "data" callback.  It is held until resume().
+		pause: function() {
+			paused = true;
+		}, // pause
+		
+		//
+		// resume
+		//
+		// Deliver any held data, any pending end and continue delivering data as it
+		// is written.
+		resume: function() {
+			paused = false;
+			if (readerCallback !== null && heldLength() > 0) {
+				readerCallback(takeHeld());
+				delivered();
+			}
+			signalEnd();
+		}, // resume
+		
+		//
+		// pipe
+		//
+		// Pass everything that is written to this stream on to the destination writer.
+		pipe: function(destination) {
+			var source = this;
+			if (typeof destination.on == "function") {
+				destination.on("drain", function() {
+					source.resume();
+				});
+			}
+			this.on("data", function(data) {
+				if (destination.write(data) === false) {
+					source.pause();
+				}
+			});
+			this.on("end", function() {
+				destination.end();
+			});
+			return destination;
+		}, // pipe
+		
 		//
 		// on
 		//
@@ -168,12 +358,9 @@ function stream() {
 			// stored up till now.
 			if (event == "data") {
 				readerCallback = callback; // Save the readerCallback which will be invoked on writes.
-				if (dataBufferUsed > 0) {
-					var tempBuffer = new Buffer(dataBufferUsed);
-					dataBuffer.copy(tempBuffer, 0, 0, dataBufferUsed);
-					readerCallback(tempBuffer);
-					dataBuffer = null; // Release any storage we may have saved for a dataBuffer.
-					dataBufferUsed = 0;
+				if (heldLength() > 0 && !paused) {
+					readerCallback(takeHeld());
+					delivered();
 				}
 			} // data
 			
@@ -182,10 +369,20 @@ function stream() {
 			// so we may need to invoke the callback immediately.
 			else if (event == "end") {
 				endCallback = callback;
-				if (endFlag) {
+				if (endFlag && !endSignalled && (readerCallback === null || !paused)) {
+					endSignalled = true;
 					endCallback();
 				}
 			} // end
+			
+			// The caller wishes to know if the writer failed to supply all the data.  If it
+			// already has, tell the caller now.
+			else if (event == "error") {
+				errorCallback = callback;
+				if (errorValue !== null) {
+					errorCallback(errorValue);
+				}
+			} // error
 			else {
 				throw new Error("Unknown event type: "+ event);
 			}
@@ -199,4 +396,4 @@ function stream() {
 	};
 } // stream
 
-module.exports = stream;
\ No newline at end of file
+module.exports = stream;
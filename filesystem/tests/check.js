@@ -0,0 +1,30 @@
+/*
+ * The checks shared by the tests.  Each test creates its own checker:
+ *
+ * var check = require("tests/check").create();
+ * check(condition, text);              // Log text as a failure if condition is false.
+ * check.equal(name, actual, expected); // Log a failure if actual != expected.
+ * check.done();                        // Log PASS or the number of failures.
+ */
+module.exports = {
+	create: function() {
+		var failures = 0;
+		var check = function(condition, text) {
+			if (!condition) {
+				log("FAIL: " + text);
+				failures++;
+			}
+			return condition;
+		}; // check
+		check.equal = function(name, actual, expected) {
+			return check(actual == expected, name + ": expected " + expected + " got " + actual);
+		}; // equal
+		check.failures = function() {
+			return failures;
+		}; // failures
+		check.done = function() {
+			log(failures === 0 ? "PASS" : "FAIL: " + failures + " failures");
+		}; // done
+		return check;
+	} // create
+};
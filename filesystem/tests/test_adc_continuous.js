@@ -0,0 +1,94 @@
+/*
+ * Test continuous ADC acquisition.
+ * On the ESP32, feed a signal crossing the trigger level into ADC1 channel 0
+ * (GPIO 36).  On Linux a synthetic sine wave is sampled and the blocks must follow
+ * it: each starts on a rising crossing of the trigger level and the extremes are
+ * those of the sine.  Set realtime to false to measure how fast the pipeline can go
+ * (the rate check is then skipped).
+ */
+var check = require("tests/check").create();
+var ADC = require("adc");
+var BLOCKS = 40;
+var SAMPLE_RATE = 20000;
+var BLOCK_SIZE = 500;
+var DECIMATE = 4;
+var LEVEL = 2048;
+var WAVEFORM = { type: "sine", frequency: 50, amplitude: 1500, realtime: true };
+
+var blocks = 0;
+var min = 4095;
+var max = 0;
+var start = new Date().getTime();
+var finished = false;
+
+function finish() {
+	if (finished) {
+		return;
+	}
+	finished = true;
+	var elapsed = new Date().getTime() - start;
+	var stats = ADC.stats();
+	ADC.stop();
+	log("ADC continuous test complete: " + blocks + " blocks in " + elapsed + "ms" +
+		", min: " + min + ", max: " + max +
+		", raw samples/s: " + Math.round(stats.samplesIn * 1000 / elapsed) +
+		", triggers: " + stats.triggers + ", dropped: " + stats.droppedSamples);
+	check.equal("blocks", blocks, BLOCKS);
+	check(stats.triggers >= BLOCKS, "expected a trigger per block but got " + stats.triggers);
+	check(stats.samplesOut >= BLOCKS * BLOCK_SIZE, "expected " + BLOCKS * BLOCK_SIZE + " output samples but got " + stats.samplesOut);
+	check(stats.samplesIn >= stats.samplesOut * DECIMATE, "each output sample should take " + DECIMATE + " raw samples");
+	check.equal("dropped samples", stats.droppedSamples, 0);
+	if (!ADC.SIMULATED || WAVEFORM.realtime) {
+		var rate = stats.samplesIn * 1000 / elapsed;
+		check(rate > SAMPLE_RATE * 0.8 && rate < SAMPLE_RATE * 1.2, "raw sample rate " + Math.round(rate) + " should be near " + SAMPLE_RATE);
+	}
+	if (ADC.SIMULATED) {
+		check(min < LEVEL - WAVEFORM.amplitude + 50, "minimum " + min + " should reach the bottom of the sine");
+		check(max > LEVEL + WAVEFORM.amplitude - 50, "maximum " + max + " should reach the top of the sine");
+	}
+	// Blocks already taken with this one are still passed on but no more arrive
+	// once stopped.
+	setTimeout(function() {
+		var delivered = blocks;
+		setTimeout(function() {
+			check.equal("blocks after stop", blocks - delivered, 0);
+			check.done();
+		}, 200);
+	}, 0);
+} // finish
+
+ADC.start({
+	channel: 0,
+	sampleRate: SAMPLE_RATE,
+	blockSize: BLOCK_SIZE,
+	decimate: DECIMATE,
+	average: true,
+	trigger: { level: LEVEL, edge: "rising" },
+	waveform: WAVEFORM
+}, function(block) {
+	if (finished) {
+		blocks++;
+		return;
+	}
+	var i;
+	check.equal("block length", block.length, BLOCK_SIZE);
+	// The block starts with the first sample at or above the level after one below it.
+	check(block[0] >= LEVEL, "block " + blocks + " starts below the trigger level: " + block[0]);
+	if (ADC.SIMULATED) {
+		// The sine rises by at most 2 * PI * 50 * 1500 / 5000 = 94 per output sample.
+		check(block[0] < LEVEL + 100, "block " + blocks + " starts too far past the trigger level: " + block[0]);
+	}
+	for (i=0; i<block.length; i++) {
+		if (block[i] < min) { min = block[i]; }
+		if (block[i] > max) { max = block[i]; }
+	}
+	check(max <= 4095, "sample out of range: " + max);
+	blocks++;
+	if (blocks == BLOCKS) {
+		finish();
+	}
+});
+
+// 40 blocks take 4 seconds in real time.  Without a signal crossing the trigger level
+// no blocks arrive, report that rather than waiting for ever.
+setTimeout(finish, 15000);
@@ -0,0 +1,59 @@
+/*
+ * Append records to an application log, check that they read back, that the file
+ * rotates at its size cap and that a file ending with a partial record (as left by a
+ * power loss) is rotated out when the log is opened.
+ */
+var check = require("tests/check").create();
+var applog = require("applog");
+var FS = require("fs");
+var PATH = DUKF.FILE_SYSTEM_ROOT + "/test_applog.log";
+
+function removeAll() {
+	[PATH, PATH + ".1", PATH + ".2"].forEach(function(path) {
+		try {
+			FS.unlink(path);
+		} catch(e) {
+		}
+	});
+} // removeAll
+
+removeAll();
+
+// Records read back in order.
+var myLog = applog.open(PATH, {bufferSize: 512, maxFileSize: 2048, maxFiles: 3});
+for (var i=0; i<20; i++) {
+	myLog.append("record " + i);
+}
+check(myLog.close(), "close should write the records");
+var records = applog.readRecords(PATH);
+check.equal("records read back", records.length, 20);
+check(records.length > 0 && records[19].toString() == "record 19", "last record differs");
+
+// Rotation at the size cap.
+myLog = applog.open(PATH, {bufferSize: 512, maxFileSize: 2048, maxFiles: 3});
+for (i=0; i<200; i++) {
+	myLog.append("a somewhat longer record number " + i);
+}
+var stats = myLog.stats();
+myLog.close();
+log("Stats: " + JSON.stringify(stats));
+check(stats.rotations > 0, "expected the file to rotate");
+check(stats.writes < stats.records / 4, "expected records to be written in groups");
+check(FS.statSync(PATH).size <= 2048, "file larger than its cap");
+
+// Recovery from a partial record.
+var fd = FS.openSync(PATH, "a");
+FS.writeSync(fd, new Buffer([0x4C, 0x47, 0x10, 0x00, 0x61, 0x62, 0x63])); // A header and part of the data.
+FS.closeSync(fd);
+var goodRecords = applog.readRecords(PATH).length;
+myLog = applog.open(PATH);
+myLog.append("after recovery");
+stats = myLog.stats();
+myLog.close();
+check(stats.recoveries == 1, "expected the damaged file to be found");
+check(applog.readRecords(PATH + ".1").length == goodRecords, "good records lost from the damaged file");
+check.equal("records in the new file", applog.readRecords(PATH).length, 1);
+check.equal("write errors", stats.writeErrors, 0);
+
+removeAll();
+check.done();
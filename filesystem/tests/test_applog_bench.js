@@ -0,0 +1,64 @@
+/*
+ * Compare logging records with an open/write/close per record against an application
+ * log.  Reports records per second and an estimate of the flash write amplification:
+ * the bytes SPIFFS programs for each byte of record data.  The estimate assumes that
+ * each write() programs the 256 byte pages it touches (251 bytes of data each) plus
+ * an index page update.  Run it on Linux for throughput or on the ESP32 for both.
+ */
+var applog = require("applog");
+var FS = require("fs");
+var PATH = DUKF.FILE_SYSTEM_ROOT + "/bench_applog.log";
+var RECORDS = 2000;
+var PAGE_SIZE = 256;
+var PAGE_DATA = 251;
+
+function record(i) {
+	return JSON.stringify({t: 1500000000 + i, temp: 20 + (i % 50) / 10, humidity: 40 + i % 20});
+} // record
+
+function amplification(writes, fileBytes, recordBytes) {
+	// Full data pages, plus a partially filled page and an index page for each write.
+	var pages = Math.ceil(fileBytes / PAGE_DATA) + 2 * writes;
+	return (pages * PAGE_SIZE / recordBytes).toFixed(1);
+} // amplification
+
+function report(name, start, writes, fileBytes, recordBytes) {
+	var msecs = Math.max(new Date().getTime() - start, 1);
+	log(name + ": " + Math.round(RECORDS * 1000 / msecs) + " records/s, " + writes + " writes, " +
+		"write amplification ~" + amplification(writes, fileBytes, recordBytes) + "x");
+} // report
+
+function removeAll() {
+	[PATH, PATH + ".1", PATH + ".2", PATH + ".3"].forEach(function(path) {
+		try {
+			FS.unlink(path);
+		} catch(e) {
+		}
+	});
+} // removeAll
+
+// One open/write/close per record.
+removeAll();
+var start = new Date().getTime();
+var bytes = 0;
+for (var i=0; i<RECORDS; i++) {
+	var data = record(i) + "\n";
+	var fd = FS.openSync(PATH, "a");
+	FS.writeSync(fd, data);
+	FS.closeSync(fd);
+	bytes += data.length;
+}
+report("open/write/close", start, RECORDS, bytes, bytes);
+
+// Application log.
+removeAll();
+start = new Date().getTime();
+var myLog = applog.open(PATH, {maxFileSize: 256 * 1024});
+for (i=0; i<RECORDS; i++) {
+	myLog.append(record(i));
+}
+myLog.flush();
+var stats = myLog.stats();
+report("applog", start, stats.writes, stats.fileBytes, stats.recordBytes);
+myLog.close();
+removeAll();
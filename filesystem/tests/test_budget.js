@@ -0,0 +1,52 @@
+/*
+ * Test the execution budgets.  A function that never ends is run with a small budget
+ * of its own and must be stopped with a RangeError that we can catch.  A function that
+ * returns in time gives us its result and errors it throws come through unchanged.
+ * From a timer we are inside the loop's budget so remaining() must be finite.
+ */
+var check = require("tests/check").create();
+
+var before = DUKF.budgetStats();
+check(before.loop !== undefined && before.callback !== undefined && before.command !== undefined &&
+	before.job !== undefined, "expected loop, callback, command and job budgets: " + JSON.stringify(before));
+
+// A function that returns in time.
+var result = DUKF.runWithBudget(1000, function() {
+	check(DUKF.remaining() <= 1000, "remaining should be within the budget: " + DUKF.remaining());
+	return 42;
+});
+check(result === 42, "expected the result of the function: " + result);
+
+// A function that throws.
+try {
+	DUKF.runWithBudget(1000, function() {
+		throw new Error("thrown");
+	});
+	check(false, "expected the error to be thrown on");
+} catch(e) {
+	check(e.message === "thrown", "expected the function's error: " + e);
+}
+
+// A function that never ends.
+var start = new Date().getTime();
+try {
+	DUKF.runWithBudget(100, function() {
+		while(true) {}
+	});
+	check(false, "the loop should have been stopped");
+} catch(e) {
+	var elapsed = new Date().getTime() - start;
+	check(e instanceof RangeError, "expected a RangeError: " + e);
+	check(elapsed >= 100 && elapsed < 1000, "stopped after " + elapsed + " msecs");
+}
+
+var after = DUKF.budgetStats();
+check(after.job.runs === before.job.runs + 3, "expected 3 more job runs: " + JSON.stringify(after.job));
+check(after.job.overruns === before.job.overruns + 1, "expected 1 more job overrun: " + JSON.stringify(after.job));
+
+setTimeout(function() {
+	var remaining = DUKF.remaining();
+	check(remaining > 0 && remaining <= DUKF.budgetStats().loop.budget,
+		"a timer should run within the loop's budget: " + remaining);
+	check.done();
+}, 10);
@@ -0,0 +1,85 @@
+/*
+ * Test the streaming crypto module against known answers and by round tripping
+ * data fed in uneven pieces.
+ */
+var crypto = require("crypto");
+var check = require("tests/check").create();
+
+function concat(list) {
+	var length = 0;
+	list.forEach(function(b) { length += b.length; });
+	var result = new Buffer(length);
+	var offset = 0;
+	list.forEach(function(b) {
+		var i;
+		for (i=0; i<b.length; i++) {
+			result[offset++] = b[i];
+		}
+	});
+	return result;
+} // concat
+
+// Known answers.
+check.equal("sha1", crypto.createHash("sha1").update("abc").digest("hex"),
+	"a9993e364706816aba3e25717850c26c9cd0d89d");
+check.equal("sha256", crypto.createHash("sha256").update("ab").update("c").digest("hex"),
+	"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+check.equal("hmac-sha256", crypto.createHmac("sha256", "key")
+	.update("The quick brown fox jumps over the lazy dog").digest("hex"),
+	"f7bc83f430538424b13298e6aa6fb143ef4d59a14946175997479dbc2d1a3cd8");
+
+// Round trip 1000 bytes in pieces of varying size through each mode.
+var plain = new Buffer(1000);
+var i;
+for (i=0; i<plain.length; i++) {
+	plain[i] = (i * 7) & 0xff;
+}
+var key = new Buffer(32);
+var iv = new Buffer(16);
+for (i=0; i<32; i++) {
+	key[i] = i;
+}
+for (i=0; i<16; i++) {
+	iv[i] = 0xa0 + i;
+}
+
+["aes-256-cbc", "aes-256-ctr", "aes-256-gcm"].forEach(function(algorithm) {
+	var options = { aad: "header" };
+	var cipher = crypto.createCipheriv(algorithm, key, iv, options);
+	var pieces = [];
+	var offset = 0;
+	var size = 1;
+	while (offset < plain.length) {
+		var piece = plain.slice(offset, Math.min(offset + size, plain.length));
+		pieces.push(cipher.update(piece));
+		offset += piece.length;
+		size = size * 3 % 97 + 1;
+	}
+	pieces.push(cipher.final());
+	var encrypted = concat(pieces);
+
+	var decipher = crypto.createDecipheriv(algorithm, key, iv, options);
+	if (algorithm == "aes-256-gcm") {
+		decipher.setAuthTag(cipher.getAuthTag());
+	}
+	var decrypted = concat([decipher.update(encrypted), decipher.final()]);
+	check.equal(algorithm + " length", decrypted.length, plain.length);
+	check.equal(algorithm + " data", Duktape.enc("hex", decrypted), Duktape.enc("hex", plain));
+});
+
+// A tampered GCM message must not authenticate.
+var gcm = crypto.createCipheriv("aes-256-gcm", key, iv);
+var sealed = concat([gcm.update("secret"), gcm.final()]);
+sealed[0] ^= 1;
+var opener = crypto.createDecipheriv("aes-256-gcm", key, iv);
+opener.setAuthTag(gcm.getAuthTag());
+opener.update(sealed);
+var rejected = false;
+try {
+	opener.final();
+} catch(e) {
+	rejected = true;
+}
+check.equal("gcm tamper detected", rejected, true);
+
+check.done();
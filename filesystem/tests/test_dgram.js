@@ -0,0 +1,69 @@
+/*
+ * Send a burst of UDP datagrams to ourselves and check that they all arrive and that
+ * they were moved in batches.  Then join a multicast group and send to it with
+ * loopback enabled.
+ *
+ * On Linux all the datagrams should be received with far fewer system calls than
+ * datagrams.  On the ESP32 each datagram takes one call.
+ */
+var dgram = require("dgram.js");
+
+var COUNT = 200;
+var GROUP = "239.255.0.1";
+var check = require("tests/check").create();
+
+var received = 0;
+var receiver = dgram.createSocket({reuseAddr: true}, function(msg, rinfo) {
+	check(msg.toString() === "reading " + received, "datagram " + received + " was \"" + msg + "\" from " + rinfo.address);
+	received++;
+	if (received == COUNT) {
+		var stats = dgram.stats();
+		log("dgram stats: " + JSON.stringify(stats));
+		check(stats.recvCalls <= stats.received, "each receive call should take at least one datagram");
+		multicast();
+	}
+});
+receiver.bind(0, "127.0.0.1", function() {
+	var port = receiver.address().port;
+	var sender = dgram.createSocket();
+	var sent = 0;
+	for (var i=0; i<COUNT; i++) {
+		sender.send("reading " + i, port, "127.0.0.1", function(err) {
+			check(err === null, "send failed: " + (err && err.message));
+			sent++;
+			if (sent == COUNT) {
+				sender.close();
+			}
+		});
+	}
+});
+
+function multicast() {
+	var group = dgram.createSocket({reuseAddr: true});
+	group.bind(41234);
+	group.setMulticastLoopback(true);
+	try {
+		group.addMembership(GROUP);
+	} catch(e) {
+		log("Skipping multicast: " + e.message);
+		done(group);
+		return;
+	}
+	var timer = setTimeout(function() {
+		check(false, "multicast datagram not received");
+		done(group);
+	}, 2000);
+	group.on("message", function(msg) {
+		check(msg.toString() === "hello group", "multicast datagram was \"" + msg + "\"");
+		cancelTimeout(timer);
+		group.dropMembership(GROUP);
+		done(group);
+	});
+	group.send("hello group", 41234, GROUP);
+} // multicast
+
+function done(group) {
+	group.close();
+	receiver.close();
+	check.done();
+} // done
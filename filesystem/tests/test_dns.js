@@ -0,0 +1,59 @@
+/*
+ * Test the DNS cache and the combining of lookups using the stub resolver so that no
+ * network is needed.  The stub answers after a delay as a name server would.
+ */
+var dns = require("dns.js");
+var net = require("net.js");
+
+var check = require("tests/check").create();
+
+dns.setStub({
+	"device.test": {address: "10.0.0.1", ttl: 1, delay: 100},
+	"missing.test": {address: null, delay: 50}
+});
+
+var answers = 0;
+function concurrent(err, address) {
+	check(err === null && address === "10.0.0.1", "device.test resolved to " + address);
+	answers++;
+	if (answers == 3) {
+		var stats = dns.stats();
+		check(stats.misses == 1 && stats.coalesced == 2, "3 lookups should make 1 request: " + JSON.stringify(stats));
+		cached();
+	}
+} // concurrent
+
+// Three lookups of the same name while the first is in progress.
+dns.lookup("device.test", concurrent);
+dns.lookup("device.test", concurrent);
+dns.lookup("device.test", concurrent);
+
+// The answer is now cached.
+function cached() {
+	check(dns.lookupCached("device.test") === "10.0.0.1", "device.test should be cached");
+	check(net.getByName("device.test") === "10.0.0.1", "getByName should use the cache");
+	check(dns.lookupCached("192.168.1.1") === "192.168.1.1", "an address needs no lookup");
+	dns.lookup("missing.test", function(err, address) {
+		check(err !== null && err.code === "ENOTFOUND" && address === null, "missing.test should not exist");
+		var misses = dns.stats().misses;
+		dns.lookup("missing.test", function(err) {
+			check(err !== null && dns.stats().misses == misses, "missing.test should be cached as not existing");
+			setTimeout(expired, 1100);
+		});
+	});
+} // cached
+
+// The TTL of device.test has passed.
+function expired() {
+	check(dns.lookupCached("device.test") === undefined, "device.test should have expired");
+	var start = new Date().getTime();
+	var sock = net.connect({address: "missing.test", port: 80}, function() {
+		check(false, "connect to missing.test should fail");
+	});
+	sock.on("error", function(err) {
+		check(err.code === "ENOTFOUND", "connect error was " + err.message);
+		check(new Date().getTime() - start < 50, "a cached failure should be reported at once");
+		dns.setStub(null);
+		check.done();
+	});
+} // expired
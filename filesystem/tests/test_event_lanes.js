@@ -0,0 +1,19 @@
+/*
+ * Test the event lane statistics.  A DNS lookup is answered by an event in the I/O lane
+ * so the lane should count it and the time it waited should be sane.
+ */
+var dns = require("dns.js");
+
+var check = require("tests/check").create();
+
+var before = DUKF.eventStats();
+check(before.realtime !== undefined && before.io !== undefined && before.background !== undefined,
+	"expected realtime, io and background lanes: " + JSON.stringify(before));
+dns.lookup("localhost", function(err) {
+	var after = DUKF.eventStats();
+	log("event lanes: " + JSON.stringify(after));
+	check(after.io.processed > before.io.processed, "the answer should have come through the I/O lane");
+	check(after.io.maxWait >= 0 && after.io.maxWait < 5000, "I/O lane maxWait " + after.io.maxWait);
+	check(after.realtime.dropped === 0, "no realtime events should be dropped");
+	check.done();
+});
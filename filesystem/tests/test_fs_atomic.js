@@ -0,0 +1,27 @@
+/*
+ * Write files through openAtomicSync and check that an aborted write leaves the
+ * previous content in place while a committed write replaces it.  Then leave only
+ * the backup that renameSync keeps while replacing a file, as if we had been stopped
+ * half way, and check that opening the file restores it.
+ */
+var FS = require("fs");
+var FILE = DUKF.FILE_SYSTEM_ROOT + "/test_atomic.txt";
+
+var file = FS.openAtomicSync(FILE);
+file.write("Hello ");
+file.write(new Buffer("World"));
+file.commit();
+log("After commit: \"" + FS.loadFile(FILE).toString() + "\"");
+
+file = FS.openAtomicSync(FILE);
+file.write("Partial");
+file.abort();
+var content = FS.loadFile(FILE).toString();
+log("After abort: \"" + content + "\"");
+
+FS.renameSync(FILE, FILE + ".bak");
+var recovered = FS.loadFile(FILE);
+recovered = recovered === null ? null : recovered.toString();
+log("After recovery: \"" + recovered + "\"");
+log(content == "Hello World" && recovered == "Hello World" ? "PASS" : "FAIL");
+FS.unlink(FILE);
@@ -0,0 +1,37 @@
+/*
+ * Create a number of files and list them a page at a time with a prefix, checking
+ * that the listing sees files being created and removed.
+ */
+var FS = require("fs");
+var PREFIX = "test_list_";
+var COUNT = 25;
+var PAGE = 10;
+var i;
+
+for (i=0; i<COUNT; i++) {
+	FS.createWithContent(DUKF.FILE_SYSTEM_ROOT + "/" + PREFIX + (i < 10 ? "0" : "") + i, "file " + i);
+}
+
+var start = new Date().getTime();
+var names = [];
+var offset = 0;
+var page;
+do {
+	page = FS.listSync({prefix: PREFIX, offset: offset, limit: PAGE});
+	for (i=0; i<page.entries.length; i++) {
+		names.push(page.entries[i].name + " (" + page.entries[i].size + " bytes)");
+	}
+	offset += page.entries.length;
+} while (offset < page.total && page.entries.length > 0);
+log("Listed " + names.length + " of " + page.total + " files in " + (new Date().getTime() - start) + " msecs");
+log(names.join(", "));
+var ok = names.length == COUNT && names[0] == PREFIX + "00 (6 bytes)";
+
+FS.unlink(DUKF.FILE_SYSTEM_ROOT + "/" + PREFIX + "00");
+ok = ok && FS.listSync({prefix: PREFIX}).total == COUNT - 1;
+
+for (i=1; i<COUNT; i++) {
+	FS.unlink(DUKF.FILE_SYSTEM_ROOT + "/" + PREFIX + (i < 10 ? "0" : "") + i);
+}
+ok = ok && FS.listSync({prefix: PREFIX}).total === 0;
+log(ok ? "PASS" : "FAIL");
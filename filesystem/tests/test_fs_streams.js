@@ -0,0 +1,46 @@
+/*
+ * Copy a file larger than the chunk size with createReadStream and createWriteStream
+ * while a timer keeps running, then compare the copy with the original and read a
+ * range from the middle of the file.
+ */
+var FS = require("fs");
+var SOURCE = DUKF.FILE_SYSTEM_ROOT + "/test_stream_src.bin";
+var TARGET = DUKF.FILE_SYSTEM_ROOT + "/test_stream_dst.bin";
+var SIZE = 20000;
+
+var data = new Buffer(SIZE);
+for (var i=0; i<SIZE; i++) {
+	data[i] = (i * 7) % 251;
+}
+FS.createWithContent(SOURCE, data);
+
+var ticks = 0;
+var interval = setInterval(function() {
+	ticks++;
+}, 0);
+
+var start = new Date().getTime();
+var writer = FS.createWriteStream(TARGET);
+writer.on("finish", function() {
+	cancelInterval(interval);
+	log("Copied " + writer.bytesWritten + " bytes in " + (new Date().getTime() - start) + " msecs, timer ran " + ticks + " times");
+	var copy = FS.loadFile(TARGET);
+	var same = copy.length == SIZE;
+	for (var j=0; same && j<SIZE; j++) {
+		same = copy[j] == data[j];
+	}
+	log(same ? "PASS: copy" : "FAIL: copy differs");
+	
+	var chunks = [];
+	var reader = FS.createReadStream(SOURCE, {start: 5000, end: 5009});
+	reader.on("data", function(chunk) {
+		chunks.push(chunk);
+	});
+	reader.on("end", function() {
+		var range = Buffer.concat(chunks);
+		log(range.length == 10 && range[0] == data[5000] && range[9] == data[5009] ? "PASS: range" : "FAIL: range");
+		FS.unlink(SOURCE);
+		FS.unlink(TARGET);
+	});
+});
+FS.createReadStream(SOURCE, {chunkSize: 1024}).pipe(writer);
@@ -0,0 +1,80 @@
+/*
+ * Exercise the HTTP client against httpbin.org:
+ * * A chunked response.
+ * * A redirect chain.
+ * * A large download written to a file.
+ * * A chunked upload supplied by a producer.
+ */
+var http = require("http.js");
+var fs = require("fs");
+var HOST = "httpbin.org";
+var tests = [];
+
+tests.push(function(next) {
+	var lines = 0;
+	http.request({host: HOST, path: "/stream/20"}, function(response) {
+		response.on("data", function(data) {
+			lines += data.toString().split("\n").length - 1;
+		});
+		response.on("end", function() {
+			log("chunked: status " + response.httpStatus + ", " + lines + " lines" + (lines == 20 ? " PASS" : " FAIL"));
+			next();
+		});
+	});
+});
+
+tests.push(function(next) {
+	http.request({host: HOST, path: "/redirect/3"}, function(response) {
+		response.on("data", function() {});
+		response.on("end", function() {
+			log("redirect: status " + response.httpStatus + (response.httpStatus == "200" ? " PASS" : " FAIL"));
+			next();
+		});
+	});
+});
+
+tests.push(function(next) {
+	var FILE = "/spiffs/download.bin";
+	http.request({host: HOST, path: "/bytes/60000", file: FILE}, function(response) {
+		response.on("end", function() {
+			var size = fs.statSync(FILE).size;
+			log("download: " + size + " bytes" + (size == 60000 ? " PASS" : " FAIL"));
+			fs.unlink(FILE);
+			next();
+		});
+	});
+});
+
+tests.push(function(next) {
+	var pieces = 10;
+	var body = "";
+	http.request({
+		host: HOST,
+		method: "POST",
+		path: "/post",
+		producer: function() {
+			if (pieces === 0) {
+				return null;
+			}
+			pieces--;
+			return "0123456789";
+		}
+	}, function(response) {
+		response.on("data", function(data) {
+			body += data.toString();
+		});
+		response.on("end", function() {
+			var json = JSON.parse(body);
+			log("upload: " + json.data.length + " bytes" + (json.data.length == 100 ? " PASS" : " FAIL"));
+			next();
+		});
+	});
+});
+
+function runNext() {
+	if (tests.length > 0) {
+		tests.shift()(runNext);
+	}
+} // runNext
+
+runNext();
@@ -0,0 +1,35 @@
+/*
+ * Feed the HTTP parser bodies that are cut short by the end of the connection and
+ * check that the reader is told of the error before the end, while a complete body
+ * and a response body that runs to the end of the connection just end.
+ */
+var check = require("tests/check").create();
+var HTTPParser = require("httpparser");
+
+function parse(type, message) {
+	var events = [];
+	var networkWriter = new HTTPParser(type, function(reader) {
+		reader.on("data", function(data) {
+			events.push("data " + data.length);
+		});
+		reader.on("error", function() {
+			events.push("error");
+		});
+		reader.on("end", function() {
+			events.push("end");
+		});
+	});
+	networkWriter.write(message);
+	networkWriter.end();
+	return events.join(", ");
+} // parse
+
+check.equal("short Content-Length body",
+	parse("request", "POST /x HTTP/1.1\r\nContent-Length: 10\r\n\r\nabc"), "data 3, error, end");
+check.equal("complete Content-Length body",
+	parse("request", "POST /x HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"), "data 3, end");
+check.equal("short chunked body",
+	parse("request", "POST /x HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n"), "data 3, error, end");
+check.equal("response read to the end",
+	parse("response", "HTTP/1.1 200 OK\r\n\r\nabc"), "data 3, end");
+check.done();
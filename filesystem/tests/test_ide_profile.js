@@ -0,0 +1,48 @@
+/*
+ * Drive the IDE's /profile handler over HTTP and check that the query string reaches
+ * the profiler: ?start=<msecs> starts it and ?stop stops it and returns the collapsed
+ * stacks.  The handler is served on its own port so a running IDE is not disturbed.
+ */
+var check = require("tests/check").create();
+var http = require("http.js");
+var requestHandler = require("ide_webserver.js").requestHandler;
+var PORT = 8003;
+
+function get(path, callback) {
+	http.request({host: "127.0.0.1", port: PORT, path: path}, function(response) {
+		var body = "";
+		response.on("data", function(data) {
+			body += data.toString();
+		});
+		response.on("end", function() {
+			callback(response.httpStatus, body);
+		});
+	});
+} // get
+
+function busyWork(msecs) {
+	var end = new Date().getTime() + msecs;
+	var x = 0;
+	while (new Date().getTime() < end) {
+		x += Math.sqrt(x + 1);
+	}
+	return x;
+} // busyWork
+
+http.createServer(requestHandler).listen(PORT);
+
+get("/profile?start=5", function(status) {
+	check.equal("start status", status, 200);
+	check(DUKF.profileStats().running, "?start should start the profiler");
+	setTimeout(function busy() {
+		busyWork(300);
+		get("/profile?stop", function(status, body) {
+			check.equal("stop status", status, 200);
+			var stats = DUKF.profileStats();
+			check(!stats.running, "?stop should stop the profiler");
+			check(stats.samples > 0, "expected samples");
+			check(body.indexOf("busy (") != -1, "the collapsed stacks should include busy: " + body);
+			check.done();
+		});
+	}, 50);
+});
@@ -0,0 +1,52 @@
+/*
+ * Test the event loop metrics.  A timer that keeps the loop busy should show up in the
+ * timers phase and make the following timers late, which the loop lag records.  The
+ * Prometheus text should hold a complete histogram for each phase.
+ */
+var metrics = require("metrics.js");
+
+var check = require("tests/check").create();
+
+metrics.reset();
+
+// Keep the loop busy for 50 msecs in one timer so that the next one fires late.
+setTimeout(function() {
+	var end = new Date().getTime() + 50;
+	while (new Date().getTime() < end) {
+	}
+}, 10);
+setTimeout(function() {
+}, 20);
+
+setTimeout(function() {
+	var snapshot = metrics.snapshot();
+	var h = snapshot.histograms;
+	check(snapshot.bounds.length + 1 === h.timers.buckets.length, "one more bucket than bounds");
+	["timers", "select", "io", "gc", "loop", "turn"].forEach(function(name) {
+		check(h[name].count > 0, name + " should have been recorded");
+	});
+	check(h.timers.max >= 45000, "the busy timer should take about 50 msecs: " + h.timers.max);
+	check(h.loop.max >= h.timers.max, "the loop includes its timers");
+	check(h.lag.count >= 2 && h.lag.max >= 30000, "the second timer should be late: " + JSON.stringify(h.lag));
+
+	var text = metrics.prometheus();
+	var lines = text.split("\n");
+	check(lines.indexOf("# TYPE dukf_phase_seconds histogram") != -1, "expected the phase histogram");
+	check(text.indexOf("dukf_phase_seconds_count{phase=\"loop\"}") != -1, "expected the loop count");
+	check(text.indexOf("dukf_phase_seconds_bucket{phase=\"timers\",le=\"+Inf\"}") != -1, "expected a +Inf bucket");
+	check(text.indexOf("dukf_loop_lag_seconds_bucket{le=\"0.0001\"}") != -1, "expected the lag histogram");
+	check(text.indexOf("dukf_event_queue_depth{lane=\"io\"}") != -1, "expected the queue depths");
+	check(text.indexOf("dukf_events_dropped_total{lane=\"realtime\"}") != -1, "expected the dropped events");
+
+	// Buckets are cumulative.
+	var last = -1;
+	lines.forEach(function(line) {
+		if (line.indexOf("dukf_phase_seconds_bucket{phase=\"timers\"") === 0) {
+			var count = Number(line.slice(line.lastIndexOf(" ") + 1));
+			check(count >= last, "buckets should be cumulative: " + line);
+			last = count;
+		}
+	});
+	check(last === h.timers.count, "the +Inf bucket should hold every timers sample");
+	check.done();
+}, 500);
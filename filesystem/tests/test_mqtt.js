@@ -0,0 +1,163 @@
+/*
+ * Test the MQTT client against a broker stand-in served by this runtime.  The stand-in
+ * only knows CONNECT, PUBLISH, SUBSCRIBE, PINGREQ and DISCONNECT and sends every
+ * message published to the clients subscribed to a matching topic.  It is enough to
+ * run the test on Linux without a real broker.
+ *
+ * First a burst of QoS 1 messages is published and received back over one connection,
+ * which should take far fewer writes than messages.  Then a client publishes while its
+ * broker is down, so that messages spill to a file, and delivers them once the broker
+ * is started.
+ */
+var mqtt = require("mqtt.js");
+var net = require("net.js");
+
+var PORT = 18830;
+var COUNT = 200;
+var SPILL = DUKF.FILE_SYSTEM_ROOT + "/test_mqtt.spill";
+var check = require("tests/check").create();
+
+//
+// startBroker
+//
+// Listen on the port and call onPublish(topic, payload) for each message published.
+function startBroker(port, onPublish) {
+	var subscribers = [];
+	function matches(filter, topic) {
+		var f = filter.split("/");
+		var t = topic.split("/");
+		for (var i=0; i<f.length; i++) {
+			if (f[i] === "#") {
+				return true;
+			}
+			if (i >= t.length || (f[i] !== "+" && f[i] !== t[i])) {
+				return false;
+			}
+		}
+		return f.length === t.length;
+	}
+	function packet(type, body) {
+		var header = [type];
+		var length = body.length;
+		do {
+			var b = length % 128;
+			length = Math.floor(length / 128);
+			header.push(length > 0 ? b | 0x80 : b);
+		} while (length > 0);
+		return Buffer.concat([new Buffer(header), body]);
+	}
+	var server = net.createServer(function(sock) {
+		var pending = new Buffer(0);
+		var filters = [];
+		subscribers.push({sock: sock, filters: filters});
+		sock.on("data", function(data) {
+			pending = Buffer.concat([pending, data]);
+			while (pending.length >= 2) {
+				var length = 0, multiplier = 1, i = 1;
+				while (i < pending.length) {
+					length += (pending[i] & 0x7f) * multiplier;
+					multiplier *= 128;
+					if ((pending[i++] & 0x80) === 0) {
+						break;
+					}
+				}
+				if (pending.length < i + length) {
+					return;
+				}
+				var type = pending[0];
+				var body = pending.slice(i, i + length);
+				pending = pending.slice(i + length);
+				if ((type & 0xf0) === 0x10) {
+					sock.write(new Buffer([0x20, 2, 0, 0]));
+				} else if ((type & 0xf0) === 0x30) {
+					var topicLength = (body[0] << 8) | body[1];
+					var topic = body.slice(2, 2 + topicLength).toString();
+					var qos = (type >> 1) & 3;
+					var payload = body.slice(2 + topicLength + (qos > 0 ? 2 : 0));
+					if (qos > 0) {
+						sock.write(new Buffer([0x40, 2, body[2 + topicLength], body[3 + topicLength]]));
+					}
+					onPublish(topic, payload);
+					var forward = packet(0x30, Buffer.concat([body.slice(0, 2 + topicLength), payload]));
+					subscribers.forEach(function(subscriber) {
+						if (subscriber.filters.some(function(filter) { return matches(filter, topic); })) {
+							subscriber.sock.write(forward);
+						}
+					});
+				} else if ((type & 0xf0) === 0x80) {
+					filters.push(body.slice(4, 4 + ((body[2] << 8) | body[3])).toString());
+					sock.write(new Buffer([0x90, 3, body[0], body[1], 1]));
+				} else if ((type & 0xf0) === 0xc0) {
+					sock.write(new Buffer([0xd0, 0]));
+				}
+			}
+		});
+	});
+	server.listen(port);
+} // startBroker
+
+var timeout = setTimeout(function() {
+	check(false, "test did not finish");
+	done();
+}, 30000);
+
+function done() {
+	cancelTimeout(timeout);
+	check.done();
+} // done
+
+// Round trip a burst of messages over one connection.
+startBroker(PORT, function() {});
+var received = [];
+var client = mqtt.connect({host: "127.0.0.1", port: PORT, clientId: "test_mqtt", inflight: 16, queueSize: 256});
+client.on("connect", function() {
+	client.subscribe("test/#", {qos: 1});
+	for (var i=0; i<COUNT; i++) {
+		check(client.publish("test/reading", "r" + i, {qos: 1}), "publish " + i + " was refused");
+	}
+});
+client.on("messages", function(batch) {
+	batch.forEach(function(packet) {
+		check(packet.payload.toString() === "r" + received.length, "message " + received.length + " was " + packet.payload);
+		received.push(packet);
+	});
+	if (received.length === COUNT) {
+		client.end(function() {
+			var stats = client.stats();
+			log("mqtt stats: " + JSON.stringify(stats));
+			check(stats.connects === 1 && stats.acked === COUNT, "expected 1 connect and " + COUNT + " acks");
+			check(stats.writes < COUNT, "messages should share writes");
+			check(stats.batches < COUNT, "messages should arrive in batches");
+			check(stats.inflightPeak <= 16, "in-flight window exceeded");
+			spill();
+		});
+	}
+});
+
+// Publish while the broker is down, then start it.
+function spill() {
+	var FS = require("fs");
+	try {
+		FS.unlink(SPILL);
+	} catch(e) {
+	}
+	var delivered = 0;
+	var offline = mqtt.connect({host: "127.0.0.1", port: PORT + 1, queueSize: 10, spillFile: SPILL});
+	offline.on("error", function() {}); // Expected until the broker starts.
+	for (var i=0; i<50; i++) {
+		offline.publish("spill/reading", "s" + i, {qos: 1});
+	}
+	var stats = offline.stats();
+	check(stats.queued === 10 && stats.spilled === 40, "expected 40 messages spilled: " + JSON.stringify(stats));
+	startBroker(PORT + 1, function(topic, payload) {
+		check(payload.toString() === "s" + delivered, "spilled message " + delivered + " was " + payload);
+		delivered++;
+		if (delivered === 50) {
+			offline.end(function() {
+				var stats = offline.stats();
+				check(stats.unspilled === 40 && stats.spillBytes === 0, "spill file should be emptied: " + JSON.stringify(stats));
+				done();
+			});
+		}
+	});
+} // spill
@@ -0,0 +1,82 @@
+/*
+ * Animate a long strip of Neopixels and check the achieved frame rate.  A frame of 300
+ * pixels takes 9ms on the wire so we expect well over MIN_FPS.  Also check that the
+ * pixels read back as set, that every show() callback is invoked exactly once (even
+ * when shows are coalesced) and that the heap doesn't shrink as frames are sent.
+ * Attach the data-in of the Neopixels to the GPIO pin.
+ */
+ESP32.setLogLevel("*", "error");
+var check = require("tests/check").create();
+var PIN = 21;
+var PIXEL_COUNT = 300;
+var FRAMES = 360;
+var MIN_FPS = 30;
+
+var neopixel = require("neopixels");
+var n = new neopixel(PIN, PIXEL_COUNT);
+var frame = new Buffer(PIXEL_COUNT * 3);
+var frames = 0;
+var start;
+var startHeap;
+
+// Draw a moving rainbow into the frame buffer.
+function drawFrame() {
+	var i;
+	for (i=0; i<PIXEL_COUNT; i++) {
+		var hue = (i * 3 + frames * 4) % 768;
+		var offset = i * 3;
+		frame[offset]     = hue < 256 ? 255 - hue : (hue < 512 ? 0 : hue - 512);
+		frame[offset + 1] = hue < 256 ? hue : (hue < 512 ? 511 - hue : 0);
+		frame[offset + 2] = hue < 256 ? 0 : (hue < 512 ? hue - 256 : 767 - hue);
+	}
+	n.setPixels(frame);
+} // drawFrame
+
+function pixelOf(i) {
+	return (frame[i*3] << 16) | (frame[i*3 + 1] << 8) | frame[i*3 + 2];
+} // pixelOf
+
+function finish() {
+	var msecs = new Date().getTime() - start;
+	var fps = Math.round((FRAMES - 60) * 1000 / msecs);
+	var heapLost = startHeap - ESP32.getState().heapSize;
+	log("fps: " + fps + ", heap lost: " + heapLost);
+	check(fps >= MIN_FPS, "expected at least " + MIN_FPS + " fps but got " + fps);
+	check(heapLost < 1024, "heap shrank by " + heapLost + " bytes");
+	n.free();
+	check.done();
+} // finish
+
+// Show the next frame as soon as the previous one has been accepted for transmission.
+// The timing starts once the pipeline has settled.
+function animate() {
+	drawFrame();
+	n.show(function() {
+		frames++;
+		if (frames == 60) {
+			start = new Date().getTime();
+			startHeap = ESP32.getState().heapSize;
+		}
+		if (frames == FRAMES) {
+			finish();
+			return;
+		}
+		animate();
+	});
+} // animate
+
+drawFrame();
+check.equal("first pixel", n.getPixel(0), pixelOf(0));
+check.equal("last pixel", n.getPixel(PIXEL_COUNT - 1), pixelOf(PIXEL_COUNT - 1));
+
+// Three shows in a row: the second and third are coalesced but all callbacks run once.
+var called = [0, 0, 0];
+[0, 1, 2].forEach(function(index) {
+	n.show(function() {
+		called[index]++;
+		if (called[0] + called[1] + called[2] == 3) {
+			check(called[0] == 1 && called[1] == 1 && called[2] == 1, "each callback once: " + called);
+			animate();
+		}
+	});
+});
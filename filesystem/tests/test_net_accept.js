@@ -0,0 +1,77 @@
+/*
+ * Test that a server accepts a burst of connections in one go and turns away those over
+ * its limits.  Five clients connect at once to a server that allows three; two should
+ * be answered by onOverload and closed.  Once a connection closes there is room for a
+ * new one.  A second server allows one connection per address.
+ */
+var net = require("net.js");
+
+var PORT = 18850;
+var check = require("tests/check").create();
+
+var timeout = setTimeout(function() {
+	check(false, "test did not finish");
+	done();
+}, 10000);
+
+function done() {
+	cancelTimeout(timeout);
+	check.done();
+} // done
+
+var accepted = [];
+var server = net.createServer({maxConnections: 3, onOverload: function(sock) {
+	sock.write("busy");
+}}, function(sock) {
+	accepted.push(sock);
+	sock.write("hello");
+});
+server.listen(PORT);
+
+//
+// connectClients
+//
+// Connect count clients and call callback with what each received before it closed
+// or, for those left open, after a while.
+function connectClients(port, count, callback) {
+	var replies = [];
+	var clients = [];
+	for (var i=0; i<count; i++) {
+		replies.push("");
+		clients.push(net.connect({address: "127.0.0.1", port: port, offload: false}));
+		clients[i].on("data", function(i) {
+			return function(data) {
+				replies[i] += data;
+			};
+		}(i));
+	}
+	setTimeout(function() {
+		callback(replies, clients);
+	}, 500);
+} // connectClients
+
+connectClients(PORT, 5, function(replies, clients) {
+	var hello = replies.filter(function(r) { return r === "hello"; }).length;
+	var busy = replies.filter(function(r) { return r === "busy"; }).length;
+	check(hello === 3 && busy === 2, "expected 3 accepted and 2 turned away: " + JSON.stringify(replies));
+	var stats = server.stats();
+	check(stats.connections === 3 && stats.rejected === 2, "server stats: " + JSON.stringify(stats));
+	clients.forEach(function(client) {
+		client.end();
+	});
+	accepted[0].end();
+	check(server.stats().connections === 2, "closing a connection should make room");
+	// Only one connection at a time from 127.0.0.1.
+	var perIP = net.createServer({maxConnectionsPerIP: 1}, function(sock) {
+		sock.write("hello");
+	});
+	perIP.listen(PORT + 1);
+	connectClients(PORT + 1, 2, function(replies, clients) {
+		check(replies.sort().join() === ",hello", "expected one connection per address: " + JSON.stringify(replies));
+		check(perIP.stats().rejected === 1, "per address limit should reject one");
+		clients.forEach(function(client) {
+			client.end();
+		});
+		done();
+	});
+});
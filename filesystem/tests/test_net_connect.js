@@ -0,0 +1,44 @@
+/*
+ * Test that connecting doesn't block the runtime.  A connect to an address that
+ * doesn't answer must fail with ETIMEDOUT after its timeout while timers keep
+ * running, and a connect to a port nobody is listening on must fail with an error
+ * event.
+ *
+ * 10.255.255.1 is assumed to be unreachable and nothing is assumed to be listening
+ * on port 1 of 127.0.0.1 (on the ESP32, change LOCAL to a machine on the network).
+ */
+var net = require("net.js");
+
+var DEAD = "10.255.255.1";
+var LOCAL = "127.0.0.1";
+var TIMEOUT = 2000;
+var check = require("tests/check").create();
+var ticks = 0;
+
+var ticker = setInterval(function() {
+	ticks++;
+}, 100);
+
+function refused() {
+	var sock = net.connect({address: LOCAL, port: 1}, function() {
+		check(false, "connect to port 1 should fail");
+	});
+	sock.on("error", function(err) {
+		check(err.code !== "ETIMEDOUT", "port 1 should refuse the connection: " + err.message);
+		cancelInterval(ticker);
+		check.done();
+	});
+} // refused
+
+var start = new Date().getTime();
+var sock = net.connect({address: DEAD, port: 80, timeout: TIMEOUT}, function() {
+	check(false, "connect to " + DEAD + " should time out");
+});
+sock.on("error", function(err) {
+	var elapsed = new Date().getTime() - start;
+	check(err.code === "ETIMEDOUT", "expected ETIMEDOUT but got " + err.message);
+	check(elapsed >= TIMEOUT && elapsed < TIMEOUT + 1000, "timed out after " + elapsed + " msecs");
+	// The interval should have fired about 20 times while we waited.
+	check(ticks >= TIMEOUT / 100 / 2, "timers only fired " + ticks + " times while connecting");
+	refused();
+});
@@ -0,0 +1,89 @@
+/*
+ * Test sockets served by the network I/O task.  An echo server and a client, both
+ * offloaded, pass more data than fits in a ring so that writes have to wait for room
+ * and reads for the data listener.  The client pauses half way to check that nothing
+ * is lost while it isn't reading.  A second client that stays on the loop checks that
+ * the two kinds of socket talk to each other.
+ */
+var net = require("net.js");
+var netio = require("netio.js");
+
+var PORT = 18840;
+var TOTAL = netio.RING_SIZE * 4;
+var check = require("tests/check").create();
+
+var timeout = setTimeout(function() {
+	check(false, "test did not finish");
+	done();
+}, 30000);
+
+function done() {
+	cancelTimeout(timeout);
+	check.done();
+} // done
+
+var serverSockets = [];
+var server = net.createServer(function(sock) {
+	serverSockets.push(sock);
+	check(sock._offloaded, "accepted socket should be offloaded");
+	sock.on("data", function(data) {
+		sock.write(data);
+	});
+	sock.on("end", function() {
+		sock.end();
+	});
+});
+server.listen(PORT);
+
+//
+// echo
+//
+// Send TOTAL bytes and check that they come back in order.
+function echo(options, callback) {
+	var sent = new Buffer(TOTAL);
+	for (var i=0; i<TOTAL; i++) {
+		sent[i] = (i * 7) & 0xff;
+	}
+	var received = 0;
+	var paused = false;
+	var client = net.connect({address: "127.0.0.1", port: PORT, offload: options.offload}, function() {
+		check(client._offloaded === options.offload, "client offloaded should be " + options.offload);
+		for (var j=0; j<TOTAL; j+=1000) {
+			client.write(sent.slice(j, Math.min(j + 1000, TOTAL)));
+		}
+	});
+	client.on("data", function(data) {
+		for (var k=0; k<data.length; k++) {
+			if (data[k] !== sent[received + k]) {
+				check(false, "byte " + (received + k) + " was " + data[k]);
+				break;
+			}
+		}
+		received += data.length;
+		if (!paused && received >= TOTAL / 2 && received < TOTAL) {
+			paused = true;
+			client.pause();
+			setTimeout(function() {
+				client.resume();
+			}, 200);
+		}
+		if (received === TOTAL) {
+			client.end();
+			callback();
+		}
+	});
+} // echo
+
+echo({offload: true}, function() {
+	echo({offload: false}, function() {
+		// Give the task time to close the channels.
+		setTimeout(function() {
+			var stats = netio.stats();
+			log("netio stats: " + JSON.stringify(stats));
+			check(stats.attached === 3, "expected 3 sockets attached");
+			check(stats.bytesIn >= TOTAL * 3 && stats.bytesOut >= TOTAL * 3, "bytes moved by the task");
+			check(stats.channels === 0, "all channels should be closed");
+			done();
+		}, 500);
+	});
+});
@@ -0,0 +1,52 @@
+/*
+ * Test the sampling profiler.  We keep the interpreter busy, a piece at a time from a
+ * timer, and check that the timer callback shows up in the collapsed stacks.
+ */
+var check = require("tests/check").create();
+
+function busyWork(msecs) {
+	var end = new Date().getTime() + msecs;
+	var x = 0;
+	while (new Date().getTime() < end) {
+		x += Math.sqrt(x + 1);
+	}
+	return x;
+} // busyWork
+
+check(DUKF.profileStart(5), "the profiler should start");
+check(DUKF.profileStats().running, "the profiler should be running");
+
+var pieces = 0;
+var interval = setInterval(function tick() {
+	busyWork(300);
+	pieces++;
+	if (pieces < 5) {
+		return;
+	}
+	cancelInterval(interval);
+	DUKF.profileStop();
+
+	var stats = DUKF.profileStats();
+	log("profiler stats: " + JSON.stringify(stats));
+	check(!stats.running, "the profiler should have stopped");
+	check(stats.samples > 0, "expected samples");
+	check(stats.samples <= stats.ticks, "can't have more samples than ticks");
+
+	var collapsed = DUKF.profileCollapsed();
+	var lines = collapsed.split("\n").filter(function(line) {
+		return line.length > 0;
+	});
+	var total = 0;
+	var busy = 0;
+	lines.forEach(function(line) {
+		var count = Number(line.slice(line.lastIndexOf(" ") + 1));
+		check(count > 0, "each line should end with a count: " + line);
+		total += count;
+		if (line.indexOf("tick (") != -1) {
+			busy += count;
+		}
+	});
+	check(total === stats.samples - stats.overwritten, "the counts should add up to the samples kept");
+	check(busy > total / 2, "most samples should be in tick: " + busy + " of " + total);
+	check.done();
+}, 50);
@@ -0,0 +1,94 @@
+/*
+ * Test asynchronous RMT writes and streaming.  Check that a busy channel refuses
+ * writes, that each completion callback is invoked once and no sooner than the items
+ * take to send, and that a stream delivers all of its chunks without underruns.
+ * Attach a logic analyzer or scope to the GPIO pin to see the output.
+ */
+var check = require("tests/check").create();
+var RMT = require("RMT");
+var PIN = 21;
+var CHANNEL = 0;
+
+RMT.txConfig(CHANNEL, {
+	gpio: PIN,
+	memBlocks: 1,
+	clockDiv: 80, // 1 tick = 1 microsecond
+	bufferItems: 128
+});
+log("Item buffer holds " + RMT.getState(CHANNEL).bufferItems + " data items");
+
+// Build a buffer of count data items alternating high and low, each of the given
+// duration.  Each data item is 16 bits of level<<15 | duration.
+function squareWave(count, duration) {
+	var buffer = new Buffer(count * 2);
+	var i;
+	for (i=0; i<count; i++) {
+		var item = (i % 2 === 0 ? 0x8000 : 0) | duration;
+		buffer[i*2]     = item & 0xff;
+		buffer[i*2 + 1] = item >> 8;
+	}
+	return buffer;
+} // squareWave
+
+// An asynchronous write that is larger than the item buffer.  The buffer grows
+// once and is reused from then on.  200 data items of 50us take 10ms.
+var start = new Date().getTime();
+var writeCallbacks = 0;
+var accepted = RMT.write(CHANNEL, squareWave(200, 50), function() {
+	var msecs = new Date().getTime() - start;
+	writeCallbacks++;
+	log("Async write complete after " + msecs + "ms, buffer now " +
+		RMT.getState(CHANNEL).bufferItems + " data items");
+	check.equal("write callbacks", writeCallbacks, 1);
+	check(msecs >= 9, "write completed after " + msecs + "ms, too soon for 10ms of items");
+	check(RMT.getState(CHANNEL).bufferItems >= 200, "the item buffer should have grown to 200 data items");
+	var secondDone = false;
+	check.equal("second async write", RMT.write(CHANNEL, squareWave(2, 10), function() {
+		secondDone = true;
+	}), true);
+	setTimeout(function() {
+		check(secondDone, "second async write should have completed");
+		streamTest();
+	}, 100);
+});
+check.equal("async write accepted", accepted, true);
+check(RMT.getState(CHANNEL).busy, "the channel should be busy");
+check.equal("write while busy", RMT.write(CHANNEL, squareWave(2, 10)), false);
+
+// Stream 20 chunks of 64 data items through the two halves of the item buffer.  Chunk
+// n holds items of 20 + n us so the whole stream takes 64 * (20 * 20 + 210)us = 39ms.
+function streamTest() {
+	if (RMT.streamStart === undefined) {
+		// The firmware was built without streaming.
+		var threw = false;
+		try {
+			RMT.stream(CHANNEL, function() { return null; });
+		} catch(e) {
+			threw = true;
+		}
+		check(threw, "RMT.stream() should throw without streaming support");
+		check.done();
+		return;
+	}
+	var chunks = 0;
+	var streamCallbacks = 0;
+	start = new Date().getTime();
+	var started = RMT.stream(CHANNEL, function(maxItems) {
+		if (chunks == 20) {
+			return null;
+		}
+		chunks++;
+		return squareWave(Math.min(64, maxItems), 20 + chunks);
+	}, function(underruns) {
+		var msecs = new Date().getTime() - start;
+		streamCallbacks++;
+		log("Streamed " + chunks + " chunks in " + msecs + "ms with " + underruns + " underruns");
+		check.equal("stream callbacks", streamCallbacks, 1);
+		check.equal("chunks streamed", chunks, 20);
+		check.equal("underruns", underruns, 0);
+		check(msecs >= 38, "stream completed after " + msecs + "ms, too soon for 39ms of items");
+		check(!RMT.getState(CHANNEL).busy, "the channel should be free after the stream");
+		check.done();
+	});
+	check.equal("stream started", started, true);
+} // streamTest
@@ -0,0 +1,120 @@
+/*
+ * Test the RMT receive pipeline with the NEC decoder.
+ * On the ESP32, attach the output of an IR demodulator (e.g. a TSOP38238) to the
+ * GPIO pin and press buttons on an NEC remote until HARDWARE_FRAMES frames have been
+ * decoded.  On Linux a capture of a few NEC frames is generated and replayed and the
+ * decoded frames must match the codes in it.
+ */
+var check = require("tests/check").create();
+var RMT = require("RMT");
+var FS = require("fs");
+var PIN = 19;
+var CHANNEL = 4;
+var CAPTURE_FILE = "/tmp/test_rmt_rx.rmt";
+var HARDWARE_FRAMES = 5;
+
+RMT.rxConfig(CHANNEL, {
+	gpio: PIN,
+	clockDiv: 80, // 1 tick = 1 microsecond
+	idleThreshold: 12000
+});
+
+// Build a capture of NEC frames in the same 16 bit data item format as the RMT.
+// A mark (carrier present) is a low level from the demodulator.
+function necCapture(codes) {
+	var items = [];
+	function mark(us) { items.push(us); }
+	function space(us) { items.push(0x8000 | us); }
+	codes.forEach(function(code) {
+		if (code.repeat) {
+			mark(9000); space(2250); mark(560);
+		} else {
+			var value = [code.address, ~code.address & 0xff, code.command, ~code.command & 0xff];
+			mark(9000); space(4500);
+			var i;
+			for (i=0; i<32; i++) {
+				mark(560);
+				space((value[i >> 3] >> (i & 7)) & 1 ? 1690 : 560);
+			}
+			mark(560);
+		}
+		items.push(0); // End of frame.
+	});
+	var buffer = new Buffer(items.length * 2);
+	items.forEach(function(item, i) {
+		buffer[i*2]     = item & 0xff;
+		buffer[i*2 + 1] = item >> 8;
+	});
+	return buffer;
+} // necCapture
+
+var options = { decoder: "NEC", maxBatch: 16 };
+var expected = HARDWARE_FRAMES;
+var expectedCodes = null; // The codes we know were sent, each repeat with the code it repeats.
+if (RMT.SIMULATED) {
+	var codes = [
+		{ address: 0x04, command: 0x08 },
+		{ repeat: true },
+		{ repeat: true },
+		{ address: 0x04, command: 0x11 },
+		{ address: 0x20, command: 0x45 }
+	];
+	FS.createWithContent(CAPTURE_FILE, necCapture(codes));
+	options.replay = CAPTURE_FILE;
+	options.replayInterval = 20;
+	expected = codes.length;
+	var last = null;
+	expectedCodes = codes.map(function(code) {
+		if (!code.repeat) {
+			last = code;
+		}
+		return { address: last.address, command: last.command, repeat: !!code.repeat };
+	});
+}
+
+var received = 0;
+var totalDropped = 0;
+var batches = 0;
+var finished = false;
+
+function finish() {
+	if (finished) {
+		return;
+	}
+	finished = true;
+	RMT.rxStop(CHANNEL);
+	log("RMT RX test complete: " + received + " frames decoded in " + batches + " batches");
+	if (expectedCodes !== null) {
+		check.equal("frames decoded", received, expectedCodes.length);
+	}
+	check.equal("frames dropped", totalDropped, 0);
+	check.done();
+} // finish
+
+// The replay takes well under a second.  If frames are lost, report it rather than
+// waiting for ever.
+if (RMT.SIMULATED) {
+	setTimeout(finish, 5000);
+}
+
+RMT.rxStart(CHANNEL, options, function(frames, dropped) {
+	batches++;
+	check(frames.length <= options.maxBatch, "batch of " + frames.length + " exceeds maxBatch");
+	frames.forEach(function(frame) {
+		log(frame.protocol + " address: 0x" + frame.address.toString(16) +
+			" command: 0x" + frame.command.toString(16) + (frame.repeat ? " (repeat)" : ""));
+		check.equal("protocol", frame.protocol, "NEC");
+		check(frame.command >= 0 && frame.command <= 0xff, "command out of range: " + frame.command);
+		if (expectedCodes !== null && received < expectedCodes.length) {
+			var code = expectedCodes[received];
+			check.equal("frame " + received + " address", frame.address, code.address);
+			check.equal("frame " + received + " command", frame.command, code.command);
+			check.equal("frame " + received + " repeat", frame.repeat, code.repeat);
+		}
+		received++;
+	});
+	totalDropped += dropped;
+	if (received >= expected) {
+		finish();
+	}
+});
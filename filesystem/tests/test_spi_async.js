@@ -0,0 +1,61 @@
+/*
+ * Test queued (DMA) SPI transactions.
+ * On the ESP32, wire MOSI (21) to MISO (19) so that the received data
+ * matches the transmitted data.  On Linux the simulated SPI device loops the
+ * data back for us.
+ */
+var SPI = require("spi");
+SPI.initialize({
+   mosi: 21,
+   miso: 19,
+   clk: 22
+});
+var device = SPI.addDevice({
+	clock_speed: 1000000,
+	queue_size: 4
+});
+
+var check = require("tests/check").create();
+
+var TRANSACTIONS = 10;
+var completed = 0;
+var sent = 0;
+
+function onComplete(tx) {
+	return function(err, rx) {
+		completed++;
+		if (check(!err, "transaction failed: " + err)) {
+			var i;
+			for (i=0; i<tx.length; i++) {
+				if (!check(rx[i] == tx[i], "mismatch at " + i + ": sent " + tx[i] + " received " + rx[i])) {
+					break;
+				}
+			}
+		}
+		queueMore();
+		if (completed == TRANSACTIONS) {
+			log("SPI async test complete: " + completed + " transactions");
+			check.done();
+			device.remove();
+			SPI.free();
+		}
+	};
+} // onComplete
+
+function queueMore() {
+	while (sent < TRANSACTIONS) {
+		var tx = new Buffer(64);
+		var rx = new Buffer(64);
+		var i;
+		for (i=0; i<tx.length; i++) {
+			tx[i] = (sent + i) & 0xff;
+		}
+		if (!device.queue(tx, rx, onComplete(tx))) {
+			break; // Queue full, try again when a transaction completes.
+		}
+		sent++;
+	}
+	log("Queued " + sent + " transactions, " + device.pending() + " in flight");
+} // queueMore
+
+queueMore();
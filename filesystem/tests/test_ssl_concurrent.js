@@ -0,0 +1,54 @@
+/*
+ * Run several HTTPS requests at the same time and check that each one completes
+ * with all of its data.  The handshakes and reads of the connections are driven by the
+ * event loop so the requests interleave instead of running one after another.
+ *
+ * On Linux run a local TLS server first, for example:
+ *
+ * openssl req -x509 -newkey rsa:2048 -nodes -keyout key.pem -out cert.pem -subj /CN=localhost
+ * openssl s_server -accept 4433 -cert cert.pem -key key.pem -WWW
+ *
+ * and create a file called big.txt of some tens of KB in the directory it was started from.
+ */
+var http = require("http.js");
+
+var HOST = "localhost";
+var PORT = 4433;
+var PATH = "/big.txt";
+var CONNECTIONS = 3;
+var sizes = [];
+var completed = 0;
+var start = new Date().getTime();
+
+function request(id) {
+	sizes[id] = 0;
+	http.request({
+		host: HOST,
+		port: PORT,
+		path: PATH,
+		useSSL: true
+	}, function(response) {
+		response.on("data", function(data) {
+			sizes[id] += data.length;
+		});
+		response.on("end", function() {
+			log("Request " + id + ": status " + response.httpStatus + ", " + sizes[id] + " bytes");
+			completed++;
+			if (completed == CONNECTIONS) {
+				var i;
+				var ok = true;
+				for (i=1; i<CONNECTIONS; i++) {
+					if (sizes[i] != sizes[0] || sizes[i] === 0) {
+						ok = false;
+					}
+				}
+				log((ok ? "PASS" : "FAIL: sizes differ") + " in " + (new Date().getTime() - start) + " msecs");
+			}
+		});
+	});
+} // request
+
+var i;
+for (i=0; i<CONNECTIONS; i++) {
+	request(i);
+}
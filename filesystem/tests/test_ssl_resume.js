@@ -0,0 +1,53 @@
+/*
+ * Make a series of HTTPS requests to the same server and check that the later ones
+ * reuse the TLS session or an idle pooled connection instead of performing a full
+ * handshake each time.
+ *
+ * On Linux run a local TLS server first, for example:
+ *
+ * openssl req -x509 -newkey rsa:2048 -nodes -keyout key.pem -out cert.pem -subj /CN=localhost
+ * openssl s_server -accept 4433 -cert cert.pem -key key.pem -www
+ *
+ * s_server closes the connection after each response so this exercises session
+ * resumption.  To exercise the connection pool, use a server that keeps HTTP/1.1
+ * connections alive and sends a Content-Length.
+ */
+var http = require("http.js");
+var internalSSL = {};
+ESP32.getNativeFunction("ModuleSSL")(internalSSL);
+
+var HOST = "localhost";
+var PORT = 4433;
+var REQUESTS = 4;
+var count = 0;
+
+function next() {
+	if (count == REQUESTS) {
+		var stats = internalSSL.stats();
+		log("SSL stats: " + JSON.stringify(stats));
+		if (stats.fullHandshakes + stats.resumedHandshakes + stats.poolHits < REQUESTS) {
+			log("FAIL: not every request completed");
+		} else if (stats.fullHandshakes > 1) {
+			log("FAIL: expected at most one full handshake");
+		} else {
+			log("PASS");
+		}
+		return;
+	}
+	count++;
+	var start = new Date().getTime();
+	http.request({
+		host: HOST,
+		port: PORT,
+		path: "/",
+		useSSL: true,
+		keepAlive: true
+	}, function(response) {
+		response.on("end", function() {
+			log("Request " + count + ": status " + response.httpStatus + " in " + (new Date().getTime() - start) + " msecs");
+			setTimeout(next, 100);
+		});
+	});
+} // next
+
+next();
@@ -71,6 +71,79 @@ function stream_test1() {
 	s2.writer.end(dataItem1);
 	testsRun++;
 	
+	// #6 Test that more data than used to fit in the stream is held and returned.
+	var s3 = new stream();
+	var i;
+	for (i=0; i<300; i++) {
+		s3.writer.write(dataItem1);
+	}
+	if (s3.reader.read().length === 3000) {
+		pass++;
+	} else {
+		console.log("Error: test6 failed");
+		fail++;
+	}
+	testsRun++;
+	
+	// #7 Test the highWaterMark, pause/resume and drain.
+	var s4 = new stream(16);
+	var drained = false;
+	var received = "";
+	s4.writer.on("drain", function() {
+		drained = true;
+	});
+	s4.reader.on("data", function(data) {
+		received += data.toString();
+	});
+	s4.reader.pause();
+	var belowMark = s4.writer.write(dataItem1);
+	var aboveMark = s4.writer.write(dataItem2);
+	s4.reader.resume();
+	if (belowMark === true && aboveMark === false && drained && received === dataItem1 + dataItem2) {
+		pass++;
+	} else {
+		console.log("Error: test7 failed");
+		fail++;
+	}
+	testsRun++;
+	
+	// #8 Test pipe() passes data and the end along, respecting a paused destination.
+	var s5 = new stream(16);
+	var s6 = new stream(16);
+	var piped = "";
+	var pipeEnded = false;
+	s5.reader.pipe(s6.writer);
+	s6.reader.on("data", function(data) {
+		piped += data.toString();
+	});
+	s6.reader.on("end", function() {
+		pipeEnded = true;
+	});
+	s6.reader.pause();
+	s5.writer.write(dataItem1);
+	s5.writer.write(dataItem2);
+	s5.writer.end(dataItem1);
+	s6.reader.resume();
+	if (piped === dataItem1 + dataItem2 + dataItem1 && pipeEnded) {
+		pass++;
+	} else {
+		console.log("Error: test8 failed");
+		fail++;
+	}
+	testsRun++;
+	
+	// #9 Test that writing past maxBuffer throws rather than losing data.
+	var s7 = new stream({highWaterMark: 8, maxBuffer: 16});
+	try {
+		s7.writer.write(dataItem1);
+		s7.writer.write(dataItem2);
+		console.log("Error: test9 failed");
+		fail++;
+	} catch(e) {
+		pass++;
+	}
+	testsRun++;
+	
 	setTimeout(function() {
 		console.log("Tests complete: Pass: " + pass + ", Fail: " + fail + " off " + testsRun);
 	}, 500);
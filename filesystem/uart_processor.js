@@ -6,6 +6,8 @@
  * * RUN  - Run the body as a script.
  * * SAVE - Save the body as a file.
  * * LIST - List the files on the file systems.
+ * * PROFILE - Write the profiler samples as collapsed stacks.  The body may be "start",
+ *             "start <msecs>" or "stop".
  * * DISABLESTART - Disable the auto start of the module.
  * 
  * The serial port access is provided by the serial class.
@@ -13,6 +15,8 @@
 
 /* globals require, log, module, DUKF */
 (function() {
+	// msecs that a script run by the RUN command may take.  Below the budget of a callback.
+	var RUN_BUDGET = 1500;
 	var parserStreamWriter;
 	var serialPort;
 	function createHTTPParser() {
@@ -34,7 +38,11 @@
 					log("Command is: " + command);
 					if (command == "RUN") {
 						try {
-							eval(accumulatedData);
+							// Run the script with a budget of its own so that a script that never ends
+							// is stopped here and we can carry on.
+							DUKF.runWithBudget(RUN_BUDGET, function() {
+								eval(accumulatedData);
+							});
 						} catch(e) {
 							log("Exception caught: " + e.stack);
 						}
@@ -61,6 +69,19 @@
 						serialPort.write("\r\n");
 					} // End of List
 					
+					if (command == "PROFILE") {
+						var args = accumulatedData.trim().split(/\s+/);
+						if (args[0] == "start") {
+							DUKF.profileStart(Number(args[1]) || 10);
+						} else {
+							if (args[0] == "stop") {
+								DUKF.profileStop();
+							}
+							serialPort.write(DUKF.profileCollapsed());
+							serialPort.write("\r\n");
+						}
+					} // End of Profile
+					
 					if (command == "DISABLESTART") {
 						var NVS = require("nvs");
 						var esp32duktapeNS = NVS.open("esp32duktape", "readwrite");
@@ -164,16 +164,9 @@ $(document).ready(function() {
 	});
 	
 	$("#load").button().click(function() {
-		$.ajax({
-			url: "http://" + settings.esp32_host + "/files",
-			method: "GET",
-			dataType: "json",
-			success: function(data) {
-				populateSelectWithFiles($("#loadSelect"), function() {
-					$("#loadDialog").dialog("open");
-				});
-			} // Success
-		}); // .ajax
+		populateSelectWithFiles($("#loadSelect"), function() {
+			$("#loadDialog").dialog("open");
+		});
 	});
 	
 	$("#saveSelect").change(function(event) {
@@ -185,17 +178,10 @@ $(document).ready(function() {
 	 * This will open the save dialog.
 	 */
 	$("#save").button().click(function() {
-		$.ajax({
-			url: "http://" + settings.esp32_host + "/files",
-			method: "GET",
-			dataType: "json",
-			success: function(data) {
-				populateSelectWithFiles($("#saveSelect"), function() {
-					$("#saveFileNameText").val("");
-					$("#saveDialog").dialog("open");
-				});
-			} // Success
-		}); // .ajax
+		populateSelectWithFiles($("#saveSelect"), function() {
+			$("#saveFileNameText").val("");
+			$("#saveDialog").dialog("open");
+		});
 	});
 	
 	// Handle the settings button.
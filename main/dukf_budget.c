@@ -0,0 +1,223 @@
+/**
+ * Execution budgets.
+ *
+ * There is one interpreter so JavaScript that runs for a long time (a runaway loop or
+ * simply a big eval) holds up timers, sockets and interrupt events.  Each time the main
+ * task calls into JavaScript it starts a budget for the source of the call: the loop
+ * function, an event callback or a command line.  Duktape calls
+ * dukf_exec_timeout_check() as it runs (DUK_USE_EXEC_TIMEOUT_CHECK in
+ * data/duktape/ESP32-Duktape.yaml) and once the budget is used up it throws a RangeError
+ * that unwinds the call.  The check keeps failing until the call has returned so a
+ * catch block can't carry on.  A budget of 0 means no limit.
+ *
+ * JavaScript can ask how much of the budget is left and split long work into pieces run
+ * from timers, or run a function with a smaller budget of its own.
+ */
+#if defined(ESP_PLATFORM)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else /* ESP_PLATFORM */
+#include <sys/time.h>
+#endif /* ESP_PLATFORM */
+
+#include <duktape.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "c_timeutils.h"
+#include "dukf_budget.h"
+#include "dukf_profiler.h"
+#include "logging.h"
+
+LOG_TAG("dukf_budget");
+
+// The budget in msecs of each source.  Below the ESP32's task watchdog period.
+static uint32_t g_budgets[DUKF_BUDGET_SOURCE_COUNT] = {
+	2000, // DUKF_BUDGET_LOOP
+	2000, // DUKF_BUDGET_CALLBACK
+	4000, // DUKF_BUDGET_COMMAND
+	0     // DUKF_BUDGET_JOB - given with each call.
+};
+
+static const char *g_sourceNames[DUKF_BUDGET_SOURCE_COUNT] = {
+	"loop",
+	"callback",
+	"command",
+	"job"
+};
+
+static dukf_budget_stats_t g_stats[DUKF_BUDGET_SOURCE_COUNT];
+
+static int      g_source = -1;     // The source of the call running now or -1.
+static uint32_t g_start;           // When it started.
+static bool     g_armed = false;   // Is there a deadline?
+static uint32_t g_deadline;        // When the budget is used up.
+static bool     g_expired = false; // Has the deadline passed?
+
+
+/**
+ * Return the time in msecs.
+ */
+static uint32_t budget_now() {
+#if defined(ESP_PLATFORM)
+	return xTaskGetTickCount() * portTICK_PERIOD_MS;
+#else /* ESP_PLATFORM */
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return timeval_toMsecs(&tv);
+#endif /* ESP_PLATFORM */
+} // budget_now
+
+
+/**
+ * Called by Duktape while it executes.  Returning true makes it throw a RangeError.
+ * This is called often so it must be cheap.  It is also where the profiler notes that a
+ * sample is due; the sample itself is taken later outside of the executor.
+ */
+duk_bool_t dukf_exec_timeout_check(void *udata) {
+	dukf_profiler_check();
+	if (!g_armed) {
+		return 0;
+	}
+	if (!g_expired && (int32_t)(budget_now() - g_deadline) >= 0) {
+		g_expired = true;
+	}
+	return g_expired;
+} // dukf_exec_timeout_check
+
+
+/**
+ * Start the budget for a call into JavaScript from the given source.
+ */
+void dukf_budget_start(int source) {
+	g_source   = source;
+	g_start    = budget_now();
+	g_armed    = g_budgets[source] > 0;
+	g_deadline = g_start + g_budgets[source];
+	g_expired  = false;
+} // dukf_budget_start
+
+
+/**
+ * The call started by dukf_budget_start() has returned with the given rc.  Record how
+ * long it took and whether it was stopped.
+ */
+void dukf_budget_stop(int rc) {
+	if (g_source < 0) {
+		return;
+	}
+	uint32_t elapsed = budget_now() - g_start;
+	dukf_budget_stats_t *pStats = &g_stats[g_source];
+	pStats->runs++;
+	if (elapsed > pStats->maxElapsed) {
+		pStats->maxElapsed = elapsed;
+	}
+	if (g_expired && rc != 0) {
+		pStats->overruns++;
+		LOGE("A %s call was stopped after %d msecs, its budget is %d msecs",
+			g_sourceNames[g_source], elapsed, g_budgets[g_source]);
+	}
+	g_armed   = false;
+	g_expired = false;
+	g_source  = -1;
+} // dukf_budget_stop
+
+
+/**
+ * Call the function on the top of the stack with no arguments and a budget of its own
+ * of msecs.  The budget can only be tighter than that of the call we are in.  The
+ * result or error replaces the function as with duk_pcall().  *pOverran is set if the
+ * function was stopped by its own budget.
+ */
+duk_int_t dukf_budget_pcall(duk_context *ctx, uint32_t msecs, bool *pOverran) {
+	bool     outerArmed    = g_armed;
+	uint32_t outerDeadline = g_deadline;
+	uint32_t start         = budget_now();
+	uint32_t deadline      = start + msecs;
+	bool     tighter       = msecs > 0 && (!outerArmed || (int32_t)(deadline - outerDeadline) < 0);
+
+	if (tighter) {
+		g_armed    = true;
+		g_deadline = deadline;
+	}
+	duk_int_t rc = duk_pcall(ctx, 0);
+	*pOverran = tighter && g_expired && rc != 0;
+	if (tighter) {
+		// Back to the budget of the call we are in.  If that has also been used up, the
+		// next check says so.
+		g_armed    = outerArmed;
+		g_deadline = outerDeadline;
+		g_expired  = false;
+	}
+
+	uint32_t elapsed = budget_now() - start;
+	dukf_budget_stats_t *pStats = &g_stats[DUKF_BUDGET_JOB];
+	pStats->runs++;
+	if (elapsed > pStats->maxElapsed) {
+		pStats->maxElapsed = elapsed;
+	}
+	if (*pOverran) {
+		pStats->overruns++;
+	}
+	return rc;
+} // dukf_budget_pcall
+
+
+/**
+ * Return the msecs left of the budget of the call running now.  If there is no
+ * limit, the result is infinity.
+ */
+double dukf_budget_remaining() {
+	if (!g_armed) {
+		return INFINITY;
+	}
+	int32_t remaining = (int32_t)(g_deadline - budget_now());
+	return remaining < 0 ? 0 : remaining;
+} // dukf_budget_remaining
+
+
+/**
+ * Return the budget of a source.
+ */
+uint32_t dukf_budget_get(int source) {
+	return g_budgets[source];
+} // dukf_budget_get
+
+
+/**
+ * Set the budget of a source.  It applies from the next call.
+ */
+void dukf_budget_set(int source, uint32_t msecs) {
+	g_budgets[source] = msecs;
+} // dukf_budget_set
+
+
+/**
+ * Return the statistics of a source.
+ */
+void dukf_budget_getStats(int source, dukf_budget_stats_t *pStats) {
+	*pStats = g_stats[source];
+} // dukf_budget_getStats
+
+
+/**
+ * Return the source with the given name or -1.
+ */
+int dukf_budget_sourceFromName(const char *name) {
+	int source;
+	for (source=0; name != NULL && source<DUKF_BUDGET_SOURCE_COUNT; source++) {
+		if (strcmp(name, g_sourceNames[source]) == 0) {
+			return source;
+		}
+	}
+	return -1;
+} // dukf_budget_sourceFromName
+
+
+/**
+ * Return the name of a source.
+ */
+const char *dukf_budget_sourceName(int source) {
+	return g_sourceNames[source];
+} // dukf_budget_sourceName
@@ -0,0 +1,369 @@
+/**
+ * Sampling profiler.
+ *
+ * A timer asks for a sample every interval.  On the ESP32 this is an esp_timer, on Linux a
+ * thread that sleeps for the interval (SIGPROF would interrupt the select() calls of our
+ * other threads).  The timer only sets a flag.
+ *
+ * Duktape calls dukf_exec_timeout_check() from inside its executor, where the Duktape API
+ * must not be used, so there we only note that JavaScript was running when the timer
+ * fired.  The sample is recorded at the next safe point: when the call into JavaScript
+ * returns to the main task or when loop.js moves on to another callback.  A sample names
+ * what was running as up to three frames:
+ * * the source of the call - loop, callback or command.
+ * * the function the main task called - the loop function or an event callback.
+ * * the timer or socket callback that loop.js was running, if any.
+ * Function names are looked up when the call is made, outside the executor.
+ *
+ * Frames are kept once in a fixed table and samples are a fixed ring of frame indexes, so
+ * nothing is allocated while profiling.  The samples can be exported as collapsed stacks
+ * ("outer;inner count" lines) which flamegraph.pl and speedscope read.
+ *
+ * Duktape only runs its check every so many bytecode instructions so the real interval
+ * between samples is the longer of the timer interval and the time those instructions
+ * take.  Time spent outside JavaScript, in native code or waiting for events, is not
+ * sampled.  The difference between ticks and samples shows how much of that there was.
+ */
+#if defined(ESP_PLATFORM)
+#include <esp_timer.h>
+#else /* ESP_PLATFORM */
+#include <pthread.h>
+#include <time.h>
+#endif /* ESP_PLATFORM */
+
+#include <duktape.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dukf_budget.h"
+#include "dukf_profiler.h"
+#include "logging.h"
+
+LOG_TAG("dukf_profiler");
+
+#if defined(ESP_PLATFORM)
+#define PROFILER_SAMPLES   (512) // Samples kept.
+#define PROFILER_FRAMES    (96)  // Distinct frames kept.
+#define PROFILER_FRAME_LEN (40)  // Longest frame text including the NUL.
+#else /* ESP_PLATFORM */
+#define PROFILER_SAMPLES   (4096)
+#define PROFILER_FRAMES    (1024)
+#define PROFILER_FRAME_LEN (96)
+#endif /* ESP_PLATFORM */
+#define PROFILER_DEPTH     (3)
+#define PROFILER_NO_FRAME  (0xffff)
+
+typedef struct {
+	uint8_t  depth;
+	uint16_t frames[PROFILER_DEPTH]; // Outermost first.
+} profiler_sample_t;
+
+static profiler_sample_t     g_samples[PROFILER_SAMPLES];
+static uint32_t              g_next = 0;  // Where the next sample goes.
+static uint32_t              g_used = 0;  // Samples in the ring.
+static char                  g_frames[PROFILER_FRAMES][PROFILER_FRAME_LEN]; // [0] is "[other]".
+static uint32_t              g_frameCount = 0;
+static dukf_profiler_stats_t g_stats;
+static uint32_t              g_due = 0;      // Set by the timer.
+static bool                  g_pending = false; // JavaScript was running when the timer fired.
+
+// What is running now.
+static uint16_t g_sourceFrame = PROFILER_NO_FRAME;
+static uint16_t g_baseFrame   = PROFILER_NO_FRAME;
+static uint16_t g_entryFrame  = PROFILER_NO_FRAME;
+
+#if defined(ESP_PLATFORM)
+static esp_timer_handle_t g_timer = NULL;
+#else /* ESP_PLATFORM */
+static uint32_t g_generation = 0; // A timer thread runs while this is the value it started with.
+#endif /* ESP_PLATFORM */
+
+
+/**
+ * The timer has fired.  Ask for a sample.
+ */
+static void profiler_timer(void *arg) {
+	__atomic_add_fetch(&g_stats.ticks, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&g_due, 1, __ATOMIC_RELAXED);
+} // profiler_timer
+
+
+#if !defined(ESP_PLATFORM)
+/**
+ * The timer on Linux.  The thread ends once the profiler is stopped or restarted.
+ */
+static void *profiler_thread(void *param) {
+	uint32_t generation = (uint32_t)(uintptr_t)param;
+	struct timespec interval;
+	interval.tv_sec  = g_stats.interval / 1000;
+	interval.tv_nsec = (g_stats.interval % 1000) * 1000000;
+	while (__atomic_load_n(&g_generation, __ATOMIC_ACQUIRE) == generation) {
+		nanosleep(&interval, NULL);
+		profiler_timer(NULL);
+	}
+	return NULL;
+} // profiler_thread
+#endif /* !ESP_PLATFORM */
+
+
+/**
+ * Return the index of the frame with the given text, adding it to the table if it is new.
+ */
+static uint16_t profiler_frame(const char *text) {
+	uint32_t i;
+	for (i=1; i<g_frameCount; i++) {
+		if (strcmp(g_frames[i], text) == 0) {
+			return i;
+		}
+	}
+	if (g_frameCount == PROFILER_FRAMES) {
+		g_stats.framesLost++;
+		return 0;
+	}
+	snprintf(g_frames[g_frameCount], PROFILER_FRAME_LEN, "%s", text);
+	g_stats.frames++;
+	return g_frameCount++;
+} // profiler_frame
+
+
+/**
+ * Return the frame of the function at the given index of the value stack.  Only called
+ * from outside the executor.
+ */
+static uint16_t profiler_functionFrame(duk_context *ctx, duk_idx_t funcIdx) {
+	char text[PROFILER_FRAME_LEN];
+	char *p;
+	funcIdx = duk_normalize_index(ctx, funcIdx);
+	if (funcIdx == DUK_INVALID_INDEX || !duk_is_function(ctx, funcIdx)) {
+		return PROFILER_NO_FRAME;
+	}
+	duk_get_prop_string(ctx, funcIdx, "name");
+	duk_get_prop_string(ctx, funcIdx, "fileName");
+	const char *name = duk_get_string(ctx, -2);
+	const char *fileName = duk_get_string(ctx, -1);
+	if (name == NULL || *name == '\0') {
+		name = "(anonymous)";
+	}
+	if (fileName == NULL) {
+		snprintf(text, sizeof(text), "%s", name); // A native function.
+	} else {
+		snprintf(text, sizeof(text), "%s (%s)", name, fileName);
+	}
+	duk_pop_2(ctx);
+	// A semicolon separates frames in a collapsed stack.
+	for (p = text; (p = strchr(p, ';')) != NULL; ) {
+		*p = ':';
+	}
+	return profiler_frame(text);
+} // profiler_functionFrame
+
+
+/**
+ * If JavaScript was running when the timer fired, record a sample of what was running.
+ */
+static void profiler_flush() {
+	if (!g_pending) {
+		return;
+	}
+	g_pending = false;
+	if (!g_stats.running || g_sourceFrame == PROFILER_NO_FRAME) {
+		return;
+	}
+	profiler_sample_t *pSample = &g_samples[g_next];
+	pSample->depth = 0;
+	pSample->frames[pSample->depth++] = g_sourceFrame;
+	if (g_baseFrame != PROFILER_NO_FRAME) {
+		pSample->frames[pSample->depth++] = g_baseFrame;
+	}
+	if (g_entryFrame != PROFILER_NO_FRAME) {
+		pSample->frames[pSample->depth++] = g_entryFrame;
+	}
+	g_next = (g_next + 1) % PROFILER_SAMPLES;
+	if (g_used < PROFILER_SAMPLES) {
+		g_used++;
+	} else {
+		g_stats.overwritten++;
+	}
+	g_stats.samples++;
+} // profiler_flush
+
+
+/**
+ * Called from dukf_exec_timeout_check() inside the executor.  No Duktape API may be used
+ * here, we only note that a sample is due while JavaScript runs.
+ */
+void dukf_profiler_check() {
+	if (__atomic_load_n(&g_due, __ATOMIC_RELAXED) != 0) {
+		__atomic_store_n(&g_due, 0, __ATOMIC_RELAXED);
+		g_pending = true;
+	}
+} // dukf_profiler_check
+
+
+/**
+ * The main task is about to call into JavaScript from the given source (a DUKF_BUDGET_
+ * value).  funcIdx is the function it calls or DUK_INVALID_INDEX.
+ */
+void dukf_profiler_enter(duk_context *ctx, int source, duk_idx_t funcIdx) {
+	if (!g_stats.running) {
+		return;
+	}
+	// A tick while no JavaScript ran is not a sample.
+	__atomic_store_n(&g_due, 0, __ATOMIC_RELAXED);
+	g_pending = false;
+	g_sourceFrame = profiler_frame(dukf_budget_sourceName(source));
+	g_baseFrame = profiler_functionFrame(ctx, funcIdx);
+	g_entryFrame = PROFILER_NO_FRAME;
+} // dukf_profiler_enter
+
+
+/**
+ * The call into JavaScript has returned.
+ */
+void dukf_profiler_leave() {
+	profiler_flush();
+	g_sourceFrame = PROFILER_NO_FRAME;
+	g_baseFrame   = PROFILER_NO_FRAME;
+	g_entryFrame  = PROFILER_NO_FRAME;
+} // dukf_profiler_leave
+
+
+/**
+ * loop.js is about to call the function at funcIdx or, if it isn't a function, has
+ * returned from it.  Called from a native function so the API may be used.
+ */
+void dukf_profiler_dispatch(duk_context *ctx, duk_idx_t funcIdx) {
+	if (!g_stats.running) {
+		return;
+	}
+	profiler_flush();
+	g_entryFrame = profiler_functionFrame(ctx, funcIdx);
+} // dukf_profiler_dispatch
+
+
+/**
+ * Start profiling with a sample every intervalMsecs.  Earlier samples are discarded.
+ */
+bool dukf_profiler_start(uint32_t intervalMsecs) {
+	dukf_profiler_stop();
+
+	memset(&g_stats, 0, sizeof(g_stats));
+	g_next = 0;
+	g_used = 0;
+	strcpy(g_frames[0], "[other]");
+	g_frameCount = 1;
+	g_sourceFrame = PROFILER_NO_FRAME;
+	g_baseFrame   = PROFILER_NO_FRAME;
+	g_entryFrame  = PROFILER_NO_FRAME;
+	g_pending = false;
+	g_stats.interval = intervalMsecs > 0 ? intervalMsecs : 1;
+	__atomic_store_n(&g_due, 0, __ATOMIC_RELAXED);
+
+#if defined(ESP_PLATFORM)
+	if (g_timer == NULL) {
+		esp_timer_create_args_t args;
+		memset(&args, 0, sizeof(args));
+		args.callback = profiler_timer;
+		args.name = "profiler";
+		if (esp_timer_create(&args, &g_timer) != ESP_OK) {
+			LOGE("Unable to create the profiler timer");
+			g_timer = NULL;
+			return false;
+		}
+	}
+	if (esp_timer_start_periodic(g_timer, (uint64_t)g_stats.interval * 1000) != ESP_OK) {
+		LOGE("Unable to start the profiler timer");
+		return false;
+	}
+#else /* ESP_PLATFORM */
+	pthread_t thread;
+	uint32_t generation = __atomic_add_fetch(&g_generation, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&thread, NULL, profiler_thread, (void *)(uintptr_t)generation) != 0) {
+		LOGE("Unable to create the profiler thread");
+		return false;
+	}
+	pthread_detach(thread);
+#endif /* ESP_PLATFORM */
+
+	g_stats.running = true;
+	LOGD("Profiling with a sample every %d msecs", g_stats.interval);
+	return true;
+} // dukf_profiler_start
+
+
+/**
+ * Stop profiling.  The samples are kept until the next start.
+ */
+void dukf_profiler_stop() {
+	if (!g_stats.running) {
+		return;
+	}
+#if defined(ESP_PLATFORM)
+	esp_timer_stop(g_timer);
+#else /* ESP_PLATFORM */
+	__atomic_add_fetch(&g_generation, 1, __ATOMIC_RELEASE);
+#endif /* ESP_PLATFORM */
+	g_stats.running = false;
+} // dukf_profiler_stop
+
+
+/**
+ * Is the profiler running?
+ */
+bool dukf_profiler_isRunning() {
+	return g_stats.running;
+} // dukf_profiler_isRunning
+
+
+/**
+ * Return the statistics of the profiler.
+ */
+void dukf_profiler_getStats(dukf_profiler_stats_t *pStats) {
+	*pStats = g_stats;
+	pStats->ticks = __atomic_load_n(&g_stats.ticks, __ATOMIC_RELAXED);
+} // dukf_profiler_getStats
+
+
+/**
+ * Push a string holding the samples as collapsed stacks.  Each distinct stack is a line of
+ * its frames, outermost first and separated by semicolons, followed by a space and the
+ * number of samples of that stack.
+ */
+void dukf_profiler_pushCollapsed(duk_context *ctx) {
+	static uint8_t counted[(PROFILER_SAMPLES + 7) / 8];
+	uint32_t i, j, count;
+	int frame, lines = 0;
+
+	memset(counted, 0, sizeof(counted));
+	for (i=0; i<g_used; i++) {
+		if (counted[i / 8] & (1 << (i % 8))) {
+			continue;
+		}
+		count = 1;
+		for (j=i+1; j<g_used; j++) {
+			if (!(counted[j / 8] & (1 << (j % 8))) && g_samples[j].depth == g_samples[i].depth &&
+					memcmp(g_samples[j].frames, g_samples[i].frames, g_samples[i].depth * sizeof(uint16_t)) == 0) {
+				counted[j / 8] |= 1 << (j % 8);
+				count++;
+			}
+		}
+		if (!duk_check_stack(ctx, PROFILER_DEPTH * 2 + 1)) {
+			LOGE("No room to export all the stacks");
+			break;
+		}
+		for (frame=0; frame<g_samples[i].depth; frame++) {
+			if (frame > 0) {
+				duk_push_string(ctx, ";");
+			}
+			duk_push_string(ctx, g_frames[g_samples[i].frames[frame]]);
+		}
+		duk_push_sprintf(ctx, " %lu\n", (unsigned long)count);
+		duk_concat(ctx, g_samples[i].depth * 2);
+		lines++;
+	}
+	if (lines == 0) {
+		duk_push_string(ctx, "");
+	} else {
+		duk_concat(ctx, lines);
+	}
+} // dukf_profiler_pushCollapsed
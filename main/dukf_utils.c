@@ -18,7 +18,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <nvs.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -30,6 +32,13 @@
 
 #define MAX_RUN_AT_START (5)
 
+// The extension of files holding bytecode written by dukf_compileFile().
+#define DUKF_BYTECODE_EXTENSION ".jsbc"
+
+// The first byte of a function dumped by duk_dump_function().  A bytecode file that
+// doesn't start with it is refused rather than given to duk_load_function().
+#define DUKF_BYTECODE_MARKER (0xBF)
+
 LOG_TAG("dukf_utils");
 
 // Number of scripts registered to run at the start.
@@ -63,32 +72,122 @@ void dukf_runAtStart(duk_context *ctx) {
 
 
 /**
- * Load the named file and run it in a JS environment.  We try and load the file first
- * from the ESPFS file system and if that fails, we try and load it from the SPIFFS
- * file system.
+ * Read the named Posix file into a new fixed buffer pushed onto the value stack.  The
+ * data is read straight into the buffer so there is only one copy of it in RAM.
+ * Returns a pointer to the data or NULL, with nothing pushed, if the file can't be read.
  */
-void dukf_runFile(duk_context *ctx, const char *fileName) {
-	LOGD(">> dukf_runFile: %s", fileName);
+static uint8_t *pushFileBuffer(duk_context *ctx, const char *path, size_t *fileSize) {
+	struct stat statBuf;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		LOGE("Failed to open file %s - %s", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &statBuf) == -1) {
+		LOGE("Failed to stat file %s - %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	uint8_t *data = duk_push_fixed_buffer(ctx, statBuf.st_size);
+	size_t sizeRead = 0;
+	while (sizeRead < (size_t)statBuf.st_size) {
+		ssize_t rc = read(fd, data + sizeRead, statBuf.st_size - sizeRead);
+		if (rc <= 0) {
+			LOGE("Failed to read file %s - %s", path, strerror(errno));
+			duk_pop(ctx);
+			close(fd);
+			return NULL;
+		}
+		sizeRead += rc;
+	}
+	close(fd);
+	*fileSize = sizeRead;
+	return data;
+} // pushFileBuffer
+
+
+/**
+ * Does the file name say that the file holds bytecode?
+ */
+static bool isBytecodeFile(const char *fileName) {
+	size_t length = strlen(fileName);
+	size_t extensionLength = strlen(DUKF_BYTECODE_EXTENSION);
+	return length > extensionLength &&
+		strcmp(fileName + length - extensionLength, DUKF_BYTECODE_EXTENSION) == 0;
+} // isBytecodeFile
+
+
+/**
+ * Safe call target to load a bytecode function.
+ * [0] - buffer holding the dumped function
+ */
+static duk_ret_t loadFunction(duk_context *ctx, void *udata) {
+	duk_load_function(ctx);
+	return 1;
+} // loadFunction
+
+
+/**
+ * Load the named file and leave a function that runs it on the top of the value stack.
+ * We try and load the file first from the ESPFS file system and if that fails, we try
+ * and load it from the SPIFFS file system.  A file whose name ends with ".jsbc" holds
+ * bytecode written by dukf_compileFile(), any other file holds source.
+ *
+ * ESPFS data is mapped from flash and is compiled or loaded in place.  SPIFFS data is
+ * read into a buffer which is released once the function has been created, before the
+ * script runs.
+ *
+ * Returns 0 on success otherwise an error code with the error on the value stack.
+ */
+static int compileFile(duk_context *ctx, const char *fileName) {
 	size_t fileSize;
-	bool loadedFromPOSIX = false;
-	char *fileData = (char *)dukf_loadFileFromESPFS(fileName, &fileSize);
+	bool onStack = false;
+	const uint8_t *fileData = (const uint8_t *)dukf_loadFileFromESPFS(fileName, &fileSize);
 	if (fileData == NULL) {
-		fileData = dukf_loadFileFromPosix(fileName, &fileSize);
+		fileData = pushFileBuffer(ctx, fileName, &fileSize);
 		if (fileData == NULL) {
-			LOGE("<< dukf_runFile: Failed to load file");
-			return;
+			duk_push_error_object(ctx, DUK_ERR_ERROR, "Failed to load file %s", fileName);
+			return DUK_EXEC_ERROR;
+		}
+		onStack = true;
+	}
+	int rc;
+	if (isBytecodeFile(fileName)) {
+		LOGD("compileFile: %s is bytecode", fileName);
+		if (fileSize == 0 || fileData[0] != DUKF_BYTECODE_MARKER) {
+			if (onStack) {
+				duk_pop(ctx);
+			}
+			duk_push_error_object(ctx, DUK_ERR_ERROR, "%s does not hold bytecode", fileName);
+			return DUK_EXEC_ERROR;
+		}
+		if (!onStack) {
+			duk_push_external_buffer(ctx);
+			duk_config_buffer(ctx, -1, (void *)fileData, fileSize);
+		}
+		rc = duk_safe_call(ctx, loadFunction, NULL, 1, 1);
+	} else {
+		duk_push_string(ctx, fileName);
+		rc = duk_pcompile_lstring_filename(ctx, 0, (const char *)fileData, fileSize);
+		if (onStack) {
+			duk_remove(ctx, -2); // Release the source now that it has been compiled.
 		}
-		loadedFromPOSIX = true;
 	}
-	// At this point we have the file in memory and we know its size.  Now we push it onto
-	// the stack and run the script.
-	duk_push_string(ctx, fileName);
-	duk_compile_lstring_filename(ctx, 0, fileData, fileSize);
-	if (loadedFromPOSIX) {
-		free(fileData);
-		fileData = NULL;
+	return rc;
+} // compileFile
+
+
+/**
+ * Load the named file and run it in a JS environment.
+ */
+void dukf_runFile(duk_context *ctx, const char *fileName) {
+	LOGD(">> dukf_runFile: %s", fileName);
+	if (compileFile(ctx, fileName) != 0) {
+		esp32_duktape_log_error(ctx);
+		duk_pop(ctx);
+		LOGE("<< dukf_runFile: Failed to load file");
+		return;
 	}
-	//int rc = duk_peval_lstring(ctx, fileData, fileSize);
 	int rc = duk_pcall(
 		ctx,
 		0 // Number of arguments
@@ -101,6 +200,44 @@ void dukf_runFile(duk_context *ctx, const char *fileName) {
 } // dukf_runFile
 
 
+/**
+ * Compile the named source file and write the bytecode to a new file which can be run
+ * in its place by dukf_runFile().  The name of the bytecode file must end with ".jsbc".
+ * Bytecode is only valid for the same build of Duktape that produced it.
+ *
+ * Returns true on success.
+ */
+bool dukf_compileFile(duk_context *ctx, const char *sourceFileName, const char *bytecodeFileName) {
+	LOGD(">> dukf_compileFile: %s -> %s", sourceFileName, bytecodeFileName);
+	if (!isBytecodeFile(bytecodeFileName)) {
+		LOGE("The name of bytecode file %s must end with %s", bytecodeFileName, DUKF_BYTECODE_EXTENSION);
+		return false;
+	}
+	if (compileFile(ctx, sourceFileName) != 0) {
+		esp32_duktape_log_error(ctx);
+		duk_pop(ctx);
+		return false;
+	}
+	duk_dump_function(ctx);
+	duk_size_t size;
+	void *data = duk_get_buffer(ctx, -1, &size);
+	bool ok = false;
+	int fd = open(bytecodeFileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if (fd == -1) {
+		LOGE("Failed to open file %s - %s", bytecodeFileName, strerror(errno));
+	} else {
+		ok = write(fd, data, size) == (ssize_t)size;
+		if (!ok) {
+			LOGE("Failed to write file %s - %s", bytecodeFileName, strerror(errno));
+		}
+		close(fd);
+	}
+	duk_pop(ctx);
+	LOGD("<< dukf_compileFile: %d bytes", (int)size);
+	return ok;
+} // dukf_compileFile
+
+
 /**
  * Record the name of a file we wish to run at the start.
  */
@@ -1,8 +1,12 @@
 #if defined(ESP_PLATFORM)
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/task.h>
 #include <esp_log.h>
 #include "sdkconfig.h"
+#else // ESP_PLATFORM
+#include <pthread.h>
+#include <sys/time.h>
 #endif // ESP_PLATFORM
 
 #include <assert.h>
@@ -17,14 +21,50 @@
 LOG_TAG("duktape_event");
 
 // The maximum number of concurrent events we can have on the
-// queue for processing.
+// queue of each lane for processing.
 #define MAX_EVENT_QUEUE_SIZE (20)
 
+// The most events taken from each lane in one turn of the main loop.  Once a lane has
+// used its budget, lower lanes get their turn and the loop runs its timers and sockets.
+static const int g_laneBudget[ESP32_DUKTAPE_LANE_COUNT] = {
+	16, // ESP32_DUKTAPE_LANE_REALTIME
+	8,  // ESP32_DUKTAPE_LANE_IO
+	1   // ESP32_DUKTAPE_LANE_BACKGROUND
+};
+static int g_laneUsed[ESP32_DUKTAPE_LANE_COUNT];
+static esp32_duktape_lane_stats_t g_laneStats[ESP32_DUKTAPE_LANE_COUNT];
+
 #if defined(ESP_PLATFORM)
-static QueueHandle_t esp32_duktape_event_queue; // The event queue (provided by FreeRTOS).
+static QueueHandle_t esp32_duktape_event_queue[ESP32_DUKTAPE_LANE_COUNT]; // The event queues (provided by FreeRTOS).
+#else /* ESP_PLATFORM */
+// On Linux there is no FreeRTOS so we model each lane's queue as a fixed size
+// circular array, all guarded by one mutex.  Simulated devices post from their own
+// threads and block on the condition variable if their lane is full.
+typedef struct {
+	esp32_duktape_event_t events[MAX_EVENT_QUEUE_SIZE];
+	int head;  // Index of the next event to be received.
+	int count; // Number of events currently queued.
+} event_lane_t;
+static event_lane_t g_lanes[ESP32_DUKTAPE_LANE_COUNT];
+static pthread_mutex_t g_eventQueueMutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_eventQueueNotFull = PTHREAD_COND_INITIALIZER;
 #endif /* ESP_PLATFORM */
 
-static void postEvent(esp32_duktape_event_t *pEvent, bool isISR);
+static void postEvent(esp32_duktape_event_t *pEvent, int lane, bool isISR);
+
+
+/**
+ * Return the time in msecs used to measure how long events wait.
+ */
+static uint32_t event_now(bool isISR) {
+#if defined(ESP_PLATFORM)
+	return (isISR ? xTaskGetTickCountFromISR() : xTaskGetTickCount()) * portTICK_PERIOD_MS;
+#else /* ESP_PLATFORM */
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return timeval_toMsecs(&tv);
+#endif /* ESP_PLATFORM */
+} // event_now
 
 
 /**
@@ -53,27 +93,87 @@ void esp32_duktape_freeEvent(duk_context *ctx, esp32_duktape_event_t *pEvent) {
  * Initialize the event handling.
  */
 void esp32_duktape_initEvents() {
-	// Initialize the FreeRTOS queue.
+	// Initialize the FreeRTOS queues.
 #ifdef ESP_PLATFORM
-	esp32_duktape_event_queue = xQueueCreate(MAX_EVENT_QUEUE_SIZE, sizeof(esp32_duktape_event_t));
+	int lane;
+	for (lane=0; lane<ESP32_DUKTAPE_LANE_COUNT; lane++) {
+		esp32_duktape_event_queue[lane] = xQueueCreate(MAX_EVENT_QUEUE_SIZE, sizeof(esp32_duktape_event_t));
+	}
 #endif
 } // esp32_duktape_initEvents
 
 
 /**
- * Check to see if there is an event to process.
+ * Start a new turn of the main loop.  Every lane gets its budget back.
+ */
+void esp32_duktape_newEventTurn() {
+	memset(g_laneUsed, 0, sizeof(g_laneUsed));
+} // esp32_duktape_newEventTurn
+
+
+/**
+ * Take the next event from a lane.  Returns 0 if the lane is empty.
+ */
+static int receiveEvent(int lane, esp32_duktape_event_t* pEvent) {
+#if defined(ESP_PLATFORM)
+	return xQueueReceive(esp32_duktape_event_queue[lane], pEvent, 0) == pdTRUE;
+#else /* ESP_PLATFORM */
+	int rc = 0;
+	pthread_mutex_lock(&g_eventQueueMutex);
+	if (g_lanes[lane].count > 0) {
+		*pEvent = g_lanes[lane].events[g_lanes[lane].head];
+		g_lanes[lane].head = (g_lanes[lane].head + 1) % MAX_EVENT_QUEUE_SIZE;
+		g_lanes[lane].count--;
+		pthread_cond_broadcast(&g_eventQueueNotFull);
+		rc = 1;
+	}
+	pthread_mutex_unlock(&g_eventQueueMutex);
+	return rc;
+#endif /* ESP_PLATFORM */
+} // receiveEvent
+
+
+/**
+ * Check to see if there is an event to process.  The event is taken from the highest
+ * priority lane that has one and hasn't used its budget for this turn.
  *
  * We return 0 to indicate that no event was caught.
  */
 int esp32_duktape_waitForEvent(esp32_duktape_event_t* pEvent) {
-	// Ask FreeRTOS to see if we have a new event.
+	int lane;
+	for (lane=0; lane<ESP32_DUKTAPE_LANE_COUNT; lane++) {
+		if (g_laneUsed[lane] >= g_laneBudget[lane] || !receiveEvent(lane, pEvent)) {
+			continue;
+		}
+		g_laneUsed[lane]++;
+		uint32_t wait = event_now(false) - pEvent->header.postedAt;
+		g_laneStats[lane].processed++;
+		g_laneStats[lane].totalWait += wait;
+		if (wait > g_laneStats[lane].maxWait) {
+			g_laneStats[lane].maxWait = wait;
+		}
+		return 1;
+	}
+	return 0;
+} // esp32_duktape_waitForEvent
+
+
+/**
+ * Return the statistics of each lane.
+ */
+void esp32_duktape_getLaneStats(esp32_duktape_lane_stats_t stats[ESP32_DUKTAPE_LANE_COUNT]) {
+	int lane;
+	for (lane=0; lane<ESP32_DUKTAPE_LANE_COUNT; lane++) {
+		stats[lane] = g_laneStats[lane];
 #if defined(ESP_PLATFORM)
-	BaseType_t rc = xQueueReceive(esp32_duktape_event_queue, pEvent, 0);
+		stats[lane].waiting = uxQueueMessagesWaiting(esp32_duktape_event_queue[lane]);
 #else /* ESP_PLATFORM */
-	int rc = 0;
+		pthread_mutex_lock(&g_eventQueueMutex);
+		stats[lane].waiting = g_lanes[lane].count;
+		pthread_mutex_unlock(&g_eventQueueMutex);
 #endif /* ESP_PLATFORM */
-	return (int)rc;
-} // esp32_duktape_waitForEvent
+	}
+} // esp32_duktape_getLaneStats
 
 
 /**
@@ -99,23 +199,50 @@ char *event_eventTypeToString(int eventType) {
  * * callbackType - The type of callback.  Choices are:
  *   - ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION - General function callback.  This is a one time callback
  *      and the data associated with it will be deleted after being called.
+ *   - ESP32_DUKTAPE_CALLBACK_TYPE_ISR_FUNCTION - Posted from an interrupt handler.  The stash is kept
+ *      so that the callback can be requested again.
+ *   - ESP32_DUKTAPE_CALLBACK_TYPE_PERSISTENT_FUNCTION - Posted from a task.  The stash is kept so that
+ *      the callback can be requested again.  The owner deletes the stash when it is no longer needed.
  * * stashKey - A key to an array stash which holds the JS function to be called plus any
  *              parameters to that function.
  * * dataProvider - a function that will be called to add parameters to the eventual JS callback.
  *                  This can be NULL if no such function is desired.
  * * contextData - ??
+ *
+ * Callbacks posted from an ISR go in the realtime lane, others in the I/O lane.
  */
 void event_newCallbackRequestedEvent(
 	uint32_t callbackType,
 	uint32_t stashKey,
 	esp32_duktape_callback_dataprovider dataProvider,
 	void *contextData) {
+	event_newLaneCallbackRequestedEvent(
+		callbackType == ESP32_DUKTAPE_CALLBACK_TYPE_ISR_FUNCTION ? ESP32_DUKTAPE_LANE_REALTIME : ESP32_DUKTAPE_LANE_IO,
+		callbackType,
+		stashKey,
+		dataProvider,
+		contextData);
+} // event_newCallbackRequestedEvent
+
+
+/**
+ * Build and post a new CallbackRequestedEvent in the given lane.  The parameters are
+ * those of event_newCallbackRequestedEvent().  Use this for control events that should
+ * be handled ahead of I/O or for bulk data that can wait.
+ */
+void event_newLaneCallbackRequestedEvent(
+	int lane,
+	uint32_t callbackType,
+	uint32_t stashKey,
+	esp32_duktape_callback_dataprovider dataProvider,
+	void *contextData) {
 
 	LOGD(">> event_newCallbackRequestedEvent stashKey=%d", stashKey);
 	esp32_duktape_event_t event;
 	event.type = ESP32_DUKTAPE_EVENT_CALLBACK_REQUESTED;
 	if (callbackType != ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION &&
-			callbackType != ESP32_DUKTAPE_CALLBACK_TYPE_ISR_FUNCTION) {
+			callbackType != ESP32_DUKTAPE_CALLBACK_TYPE_ISR_FUNCTION &&
+			callbackType != ESP32_DUKTAPE_CALLBACK_TYPE_PERSISTENT_FUNCTION) {
 		LOGE("event_newCallbackRequestedEvent: Unknown callbackType: %d", callbackType);
 		return;
 	}
@@ -124,12 +251,12 @@ void event_newCallbackRequestedEvent(
 	event.callbackRequested.dataProvider = dataProvider;
 	event.callbackRequested.context      = contextData;
 	if (callbackType == ESP32_DUKTAPE_CALLBACK_TYPE_ISR_FUNCTION) {
-		postEvent(&event, true);
+		postEvent(&event, lane, true);
 	} else {
-		postEvent(&event, false);
+		postEvent(&event, lane, false);
 	}
 	LOGD("<< event_newCallbackRequestedEvent");
-} // event_newCallbackRequestedEvent
+} // event_newLaneCallbackRequestedEvent
 
 
 /**
@@ -159,21 +286,36 @@ void event_newCommandLineEvent(
 	event.commandLine.commandLineLength = commandLength;
 	event.commandLine.fromKeyboard = fromKeyboard;
 
-	postEvent(&event, false); // Post the event.
+	// A command line may take a long time to evaluate so it waits for interrupts and I/O.
+	postEvent(&event, ESP32_DUKTAPE_LANE_BACKGROUND, false); // Post the event.
 } //newCommandLineEvent
 
 
 /**
- * Post the event onto the queue for handling when idle.
+ * Post the event onto the lane's queue for handling when idle.
  */
-static void postEvent(esp32_duktape_event_t *pEvent, bool isISR) {
+static void postEvent(esp32_duktape_event_t *pEvent, int lane, bool isISR) {
+	if (lane < 0 || lane >= ESP32_DUKTAPE_LANE_COUNT) {
+		lane = ESP32_DUKTAPE_LANE_IO;
+	}
+	pEvent->header.postedAt = event_now(isISR);
 #if defined(ESP_PLATFORM)
 	if (isISR) {
-		xQueueSendToBackFromISR(esp32_duktape_event_queue, pEvent, NULL);
+		if (xQueueSendToBackFromISR(esp32_duktape_event_queue[lane], pEvent, NULL) != pdTRUE) {
+			g_laneStats[lane].dropped++;
+		}
 	} else {
-		xQueueSendToBack(esp32_duktape_event_queue, pEvent, portMAX_DELAY);
+		xQueueSendToBack(esp32_duktape_event_queue[lane], pEvent, portMAX_DELAY);
 	}
 #else /* ESP_PLATFORM */
-	assert(0);
+	// There are no interrupts on Linux, every poster is a thread that may wait.
+	event_lane_t *pLane = &g_lanes[lane];
+	pthread_mutex_lock(&g_eventQueueMutex);
+	while (pLane->count == MAX_EVENT_QUEUE_SIZE) {
+		pthread_cond_wait(&g_eventQueueNotFull, &g_eventQueueMutex);
+	}
+	pLane->events[(pLane->head + pLane->count) % MAX_EVENT_QUEUE_SIZE] = *pEvent;
+	pLane->count++;
+	pthread_mutex_unlock(&g_eventQueueMutex);
 #endif  /* ESP_PLATFORM */
 } // postEvent
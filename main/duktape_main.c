@@ -17,6 +17,14 @@
 
 LOG_TAG("duktape_main");
 
+// JavaScript runs on the APP_CPU so that the PRO_CPU is left to lwIP, WiFi and the
+// network I/O task (module_netio.c).
+#if defined(CONFIG_FREERTOS_UNICORE)
+#define DUKTAPE_TASK_CORE tskNO_AFFINITY
+#else
+#define DUKTAPE_TASK_CORE (1)
+#endif
+
 /**
  * Receive data from the telnet or uart and process it.
  */
@@ -87,7 +95,7 @@ static void init() {
 	//xTaskCreatePinnedToCore(&telnetTask, "telnetTask", 8048, NULL, 5, NULL, 0);
 	//startMongooseServer();
 	//xTaskCreatePinnedToCore(&socket_server, "socket_server", 8048, NULL, 5, NULL, 0);
-	xTaskCreatePinnedToCore(&duktape_task, "duktape_task", 16*1024, NULL, 5, NULL, tskNO_AFFINITY);
+	xTaskCreatePinnedToCore(&duktape_task, "duktape_task", 16*1024, NULL, 5, NULL, DUKTAPE_TASK_CORE);
 } // init
 
 
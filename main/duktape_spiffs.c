@@ -25,46 +25,6 @@ static const char *typeToString(char type) {
     }
 } // typeToString
 
-/**
- * Create a JS array on the value stack which contains objects.  Each
- * object represents one file entry.  Each object contains:
- * {
- *    name: <file name>
- *    size: <file size>
- * }
- */
-void esp32_duktape_dump_spiffs_array(duk_context *ctx) {
-    DIR* dir = opendir(DUKTAPE_SPIFFS_MOUNTPOINT);
-    struct dirent *dirEnt;
-    const char rootPath[] = "/";
-
-    LOGD(">> esp32_duktape_dump_spiffs_array: rootPath=\"%s\"", rootPath);
-
-    duk_push_array(ctx);
-
-    if (dir == NULL) {
-        LOGD("Unable to open %s dir", rootPath);
-    } else {
-        int arrayIndex = 0;
-        while((dirEnt = readdir(dir))) {
-            int len = strlen((char *)dirEnt->d_name);
-            // Skip files that end with "/."
-            if (len>=2 && strcmp((char *)(dirEnt->d_name + len -2), "/.") == 0) {
-                continue;
-            }
-            duk_push_object(ctx);
-            duk_push_string(ctx, (char *)dirEnt->d_name);
-            duk_put_prop_string(ctx, -2, "name");
-            duk_put_prop_index(ctx, -2, arrayIndex);
-            arrayIndex++;
-        }
-        closedir(dir);
-    }
-    LOGD("<< esp32_duktape_dump_spiffs_array");
-    return;
-} // esp32_duktape_dump_spiffs_json
-
-
 void esp32_duktape_dump_spiffs() {
     DIR* dir = opendir(DUKTAPE_SPIFFS_MOUNTPOINT);
     struct dirent *dirEnt;
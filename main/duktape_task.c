@@ -22,11 +22,14 @@
 #include <stdlib.h>
 
 #include "duk_module_duktape.h"
+#include "dukf_budget.h"
+#include "dukf_profiler.h"
 #include "dukf_utils.h"
 #include "duktape_task.h"
 #include "duktape_utils.h"
 #include "duktape_event.h"
 #include "logging.h"
+#include "module_metrics.h"
 #include "modules.h"
 //#include "telnet.h"
 
@@ -141,7 +144,11 @@ void processEvent(esp32_duktape_event_t *pEvent) {
 		// Handle a new command line submitted to us.
 		case ESP32_DUKTAPE_EVENT_COMMAND_LINE: {
 			LOGD("We are about to eval: %.*s", pEvent->commandLine.commandLineLength, pEvent->commandLine.commandLine);
+			dukf_profiler_enter(esp32_duk_context, DUKF_BUDGET_COMMAND, DUK_INVALID_INDEX);
+			dukf_budget_start(DUKF_BUDGET_COMMAND);
 			callRc = duk_peval_lstring(esp32_duk_context,	pEvent->commandLine.commandLine, pEvent->commandLine.commandLineLength);
+			dukf_budget_stop(callRc);
+			dukf_profiler_leave();
 			// [0] - result
 
 // If an error was detected, perform error logging.
@@ -174,7 +181,8 @@ void processEvent(esp32_duktape_event_t *pEvent) {
 				pEvent->callbackRequested.stashKey
 			);
 			if (pEvent->callbackRequested.callbackType == ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION ||
-					pEvent->callbackRequested.callbackType == ESP32_DUKTAPE_CALLBACK_TYPE_ISR_FUNCTION) {
+					pEvent->callbackRequested.callbackType == ESP32_DUKTAPE_CALLBACK_TYPE_ISR_FUNCTION ||
+					pEvent->callbackRequested.callbackType == ESP32_DUKTAPE_CALLBACK_TYPE_PERSISTENT_FUNCTION) {
 
 				int topStart = duk_get_top(esp32_duk_context);
 
@@ -200,9 +208,19 @@ void processEvent(esp32_duktape_event_t *pEvent) {
 					numberParams += numberAdditionalStackItems;
 				}
 
-				duk_pcall(esp32_duk_context, numberParams);
+				uint32_t callbackStart = metrics_now();
+				dukf_profiler_enter(esp32_duk_context, DUKF_BUDGET_CALLBACK, topStart);
+				dukf_budget_start(DUKF_BUDGET_CALLBACK);
+				callRc = duk_pcall(esp32_duk_context, numberParams);
+				dukf_budget_stop(callRc);
+				dukf_profiler_leave();
+				metrics_record(METRICS_CALLBACK, metrics_now() - callbackStart);
 				// [0] - Ret val
 
+				if (callRc != 0) {
+					esp32_duktape_log_error(esp32_duk_context);
+				}
+
 				duk_pop(esp32_duk_context);
 				// <empty stack>
 			}
@@ -229,6 +247,9 @@ void processEvent(esp32_duktape_event_t *pEvent) {
 void duktape_task(void* ignore) {
 	esp32_duktape_event_t esp32_duktape_event;
 	int rc;
+	uint32_t turnStart;
+	uint32_t phaseStart;
+	int events;
 
 	LOGD(">> duktape_task");
 	dukf_log_heap("duktape_task");
@@ -265,13 +286,27 @@ void duktape_task(void* ignore) {
 	showLogo();
 
 	LOGD("Starting main loop!");
+	turnStart = metrics_now();
 	while(1) {
+		// Record how long the last turn took.
+		phaseStart = metrics_now();
+		metrics_record(METRICS_TURN, phaseStart - turnStart);
+		turnStart = phaseStart;
+
 		// call the loop routine.
 		duk_push_global_object(esp32_duk_context);
 		duk_get_prop_string(esp32_duk_context, -1, "_loop");
 		assert(duk_is_function(esp32_duk_context, -1));
 
+		// The loop function has a budget of time.  If it runs over, for example a timer
+		// callback that never returns, it is stopped so that events can still be processed.
+		dukf_profiler_enter(esp32_duk_context, DUKF_BUDGET_LOOP, duk_get_top_index(esp32_duk_context));
+		dukf_budget_start(DUKF_BUDGET_LOOP);
 		rc = duk_pcall(esp32_duk_context, 0);
+		dukf_budget_stop(rc);
+		dukf_profiler_leave();
+		// End the phase loop.js was in.  If it threw or was stopped, it couldn't.
+		metrics_enter(METRICS_NONE);
 		if (rc != 0) {
 #if defined(ESP_PLATFORM)
 			LOGD("Error running loop!  free heap=%d", esp_get_free_heap_size());
@@ -280,13 +315,25 @@ void duktape_task(void* ignore) {
 		}
 		duk_pop_2(esp32_duk_context);
 		// We have ended the loop routine.
+		metrics_record(METRICS_LOOP, metrics_now() - phaseStart);
 
 
-		// Process any events.  A return code other than 0 indicates we have an event.
-		rc = esp32_duktape_waitForEvent(&esp32_duktape_event);
-		if (rc != 0) {
+		// Process the events that are waiting, highest priority lane first, until each
+		// lane has used its budget for this turn.  A return code other than 0 indicates
+		// we have an event.
+		esp32_duktape_newEventTurn();
+		phaseStart = metrics_now();
+		events = 0;
+		while ((rc = esp32_duktape_waitForEvent(&esp32_duktape_event)) != 0) {
 			processEvent(&esp32_duktape_event);
 			esp32_duktape_freeEvent(esp32_duk_context, &esp32_duktape_event);
+			events++;
+			if (esp32_duktape_is_reset()) {
+				break;
+			}
+		}
+		if (events > 0) {
+			metrics_record(METRICS_EVENTS, metrics_now() - phaseStart);
 		}
 
 		// If we have been requested to reset the environment
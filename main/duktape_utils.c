@@ -207,7 +207,7 @@ uint32_t esp32_duktape_stash_array(duk_context *ctx, int count) {
 		return 0;
 	}
 
-	duk_idx_t arrayIdx = duk_get_top_index(ctx);
+	duk_idx_t arrayIdx = duk_get_top(ctx) - count;
 
 	duk_push_array(ctx);
 	// [0] - Item 1
@@ -215,15 +215,16 @@ uint32_t esp32_duktape_stash_array(duk_context *ctx, int count) {
 	// [count-1] - Item Count
 	// [count] - array
 
-	// Move the top of the stack to arrayIdx.
+	// Move the top of the stack to arrayIdx so that it sits below the first item.
 	duk_insert(ctx, arrayIdx);
 	// [0] - array
 	// [1] - Item 1
 	// [.] - ...
 	// [count] - Item Count
 
+	// Pop the items from the top down so that array[0] is Item 1.
 	int i;
-	for (i=0; i<count; i++) {
+	for (i=count-1; i>=0; i--) {
 		duk_put_prop_index(ctx, arrayIdx, i);
 	}
 	// [0] - array
@@ -373,7 +374,7 @@ size_t esp32_duktape_unstash_array(duk_context *ctx, uint32_t key) {
 	duk_size_t arraySize = duk_get_length(ctx, -1);
 
 	int i;
-	for (i=arraySize-1; i>=0; i--) {
+	for (i=0; i<arraySize; i++) {
 		duk_get_prop_index(ctx, objIdx, i);
 	}
 	// [0] - Global object
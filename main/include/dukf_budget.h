@@ -0,0 +1,38 @@
+/*
+ * dukf_budget.h
+ */
+
+#if !defined(MAIN_INCLUDE_DUKF_BUDGET_H_)
+#define MAIN_INCLUDE_DUKF_BUDGET_H_
+#include <duktape.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The sources of JavaScript execution that each have their own budget.
+ */
+enum {
+	DUKF_BUDGET_LOOP     = 0, // One call of the main loop function, with its timers and socket callbacks.
+	DUKF_BUDGET_CALLBACK = 1, // One callback requested by an event.
+	DUKF_BUDGET_COMMAND  = 2, // One command line.
+	DUKF_BUDGET_JOB      = 3, // One function run by DUKF.runWithBudget().
+	DUKF_BUDGET_SOURCE_COUNT
+};
+
+typedef struct {
+	uint32_t runs;
+	uint32_t overruns;   // Runs stopped because they used up their budget.
+	uint32_t maxElapsed; // msecs
+} dukf_budget_stats_t;
+
+uint32_t    dukf_budget_get(int source);
+void        dukf_budget_getStats(int source, dukf_budget_stats_t *pStats);
+duk_int_t   dukf_budget_pcall(duk_context *ctx, uint32_t msecs, bool *pOverran);
+double      dukf_budget_remaining();
+void        dukf_budget_set(int source, uint32_t msecs);
+int         dukf_budget_sourceFromName(const char *name);
+const char *dukf_budget_sourceName(int source);
+void        dukf_budget_start(int source);
+void        dukf_budget_stop(int rc);
+
+#endif /* MAIN_INCLUDE_DUKF_BUDGET_H_ */
@@ -0,0 +1,31 @@
+/*
+ * dukf_profiler.h
+ */
+
+#if !defined(MAIN_INCLUDE_DUKF_PROFILER_H_)
+#define MAIN_INCLUDE_DUKF_PROFILER_H_
+#include <duktape.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+	bool     running;
+	uint32_t interval;    // msecs between samples.
+	uint32_t ticks;       // Times the timer asked for a sample.
+	uint32_t samples;     // Samples taken.
+	uint32_t overwritten; // Samples lost because the ring was full.
+	uint32_t frames;      // Distinct frames seen.
+	uint32_t framesLost;  // Frames recorded as [other] because the frame table was full.
+} dukf_profiler_stats_t;
+
+void dukf_profiler_check();
+void dukf_profiler_dispatch(duk_context *ctx, duk_idx_t funcIdx);
+void dukf_profiler_enter(duk_context *ctx, int source, duk_idx_t funcIdx);
+void dukf_profiler_getStats(dukf_profiler_stats_t *pStats);
+bool dukf_profiler_isRunning();
+void dukf_profiler_leave();
+void dukf_profiler_pushCollapsed(duk_context *ctx);
+bool dukf_profiler_start(uint32_t intervalMsecs);
+void dukf_profiler_stop();
+
+#endif /* MAIN_INCLUDE_DUKF_PROFILER_H_ */
@@ -8,10 +8,12 @@
 #if !defined(MAIN_DUKF_UTILS_H_)
 #define MAIN_DUKF_UTILS_H_
 #include <duktape.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
 void        dukf_addRunAtStart(const char *fileName);
+bool        dukf_compileFile(duk_context *ctx, const char *sourceFileName, const char *bytecodeFileName);
 uint32_t    dukf_get_free_heap_size();
 void        dukf_init_nvs_values();
 const char *dukf_loadFileFromESPFS(const char *path, size_t *fileSize);
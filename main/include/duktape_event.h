@@ -20,10 +20,34 @@ enum {
 };
 
 enum {
-	ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION     = 1,
-	ESP32_DUKTAPE_CALLBACK_TYPE_ISR_FUNCTION = 2
+	ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION            = 1, // One time callback, the stash is deleted after the call.
+	ESP32_DUKTAPE_CALLBACK_TYPE_ISR_FUNCTION        = 2, // Posted from an ISR, the stash is kept.
+	ESP32_DUKTAPE_CALLBACK_TYPE_PERSISTENT_FUNCTION = 3  // Posted from a task, the stash is kept.
 };
 
+/*
+ * Events are queued in lanes.  Each time round the main loop, events are taken from the
+ * highest priority lane that has events and hasn't used up its budget for the turn, so
+ * an interrupt doesn't wait behind a long command line or a burst of network events.
+ */
+enum {
+	ESP32_DUKTAPE_LANE_REALTIME   = 0, // Interrupts and control events.
+	ESP32_DUKTAPE_LANE_IO         = 1, // Completions from tasks, for example network I/O.
+	ESP32_DUKTAPE_LANE_BACKGROUND = 2, // Bulk work such as command lines and sample batches.
+	ESP32_DUKTAPE_LANE_COUNT      = 3
+};
+
+/*
+ * Statistics kept for each lane.  Times are msecs from posting to processing.
+ */
+typedef struct {
+	uint32_t processed;
+	uint32_t dropped;   // Posted from an ISR while the lane was full.
+	uint32_t waiting;   // Queued now.
+	uint32_t totalWait;
+	uint32_t maxWait;
+} esp32_duktape_lane_stats_t;
+
 /*
  * The signature of a data provide function.  When called it will place 0 or more
  * values on the callstack and return how many were added.
@@ -31,12 +55,18 @@ enum {
 typedef int (*esp32_duktape_callback_dataprovider)(duk_context* ctx, void* context);
 
 // !!! IMPORTANT !!!
-// All event types MUST start with an int type
+// All event types MUST start with an int type followed by a uint32_t postedAt, the
+// time in msecs when the event was posted.  It is filled in by the posting functions.
 typedef union {
 	int type;
+	struct {
+		int      type;
+		uint32_t postedAt;
+	} header;
 	// ESP32_DUKTAPE_EVENT_COMMAND_LINE
 	struct {
-		int   type;
+		int      type;
+		uint32_t postedAt;
 		// Command line parts
 		char* commandLine;
 		int   commandLineLength;
@@ -45,7 +75,8 @@ typedef union {
 
 	// ESP32_DUKTAPE_EVENT_HTTPSERVER_REQUEST
 	struct {
-		int   type;
+		int      type;
+		uint32_t postedAt;
 		// HTTP parts
 		char* uri;
 		char* method;
@@ -53,7 +84,8 @@ typedef union {
 
 	// ESP32_DUKTAPE_EVENT_TIMER_FIRED
 	struct {
-		int type;
+		int      type;
+		uint32_t postedAt;
 		// Timer fired parts
 		unsigned long id;
 	} timerFired;
@@ -61,6 +93,7 @@ typedef union {
 	// ESP32_DUKTAPE_EVENT_CALLBACK_REQUESTED
 	struct {
 		int                                 type;
+		uint32_t                            postedAt;
 		uint32_t                            callbackType;
 		uint32_t                            stashKey;
 		esp32_duktape_callback_dataprovider dataProvider; // A C function to be called that will push values onto the call stack
@@ -71,13 +104,21 @@ typedef union {
 void  event_newISREvent(int isrType, void* data);
 void  esp32_duktape_freeEvent(duk_context* ctx, esp32_duktape_event_t* pEvent);
 void  esp32_duktape_initEvents();
-int   esp32_duktape_waitForEvent();
+void  esp32_duktape_getLaneStats(esp32_duktape_lane_stats_t stats[ESP32_DUKTAPE_LANE_COUNT]);
+void  esp32_duktape_newEventTurn();
+int   esp32_duktape_waitForEvent(esp32_duktape_event_t* pEvent);
 char* event_eventTypeToString(int eventType);
 void  event_newCallbackRequestedEvent(
 	uint32_t callbackType,
 	uint32_t stashKey,
 	esp32_duktape_callback_dataprovider dataProvider,
 	void* contextData);
+void  event_newLaneCallbackRequestedEvent(
+	int lane,
+	uint32_t callbackType,
+	uint32_t stashKey,
+	esp32_duktape_callback_dataprovider dataProvider,
+	void* contextData);
 void  event_newCommandLineEvent(char* commandData, size_t commandLength, int fromKeyboard);
 //void  event_newHTTPServerRequestEvent(char *uri, char *method);
 //void  event_newTimerAddedEvent(unsigned long);
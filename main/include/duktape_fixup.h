@@ -19,4 +19,11 @@
  */
 duk_double_t esp32_duktape_get_now();
 
+/**
+ * Called by Duktape while it executes JavaScript.  Returns true when the current
+ * execution budget has been used up (see dukf_budget.c).  The name of the function
+ * is given as DUK_USE_EXEC_TIMEOUT_CHECK.
+ */
+duk_bool_t dukf_exec_timeout_check(void *udata);
+
 #endif /* MAIN_INCLUDE_DUKTAPE_FIXUP_H_ */
@@ -11,7 +11,6 @@
 #include <duktape.h>
 
 void esp32_duktape_dump_spiffs();
-void esp32_duktape_dump_spiffs_array(duk_context *ctx);
 void esp32_duktape_spiffs_mount();
 
 #endif /* MAIN_DUKTAPE_SPIFFS_H_ */
@@ -0,0 +1,11 @@
+/*
+ * module_applog.h
+ */
+
+#if !defined(MAIN_INCLUDE_MODULE_APPLOG_H_)
+#define MAIN_INCLUDE_MODULE_APPLOG_H_
+#include <duktape.h>
+
+duk_ret_t ModuleAppLog(duk_context *ctx);
+
+#endif /* MAIN_INCLUDE_MODULE_APPLOG_H_ */
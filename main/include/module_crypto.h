@@ -0,0 +1,11 @@
+/*
+ * module_crypto.h
+ */
+
+#if !defined(MAIN_INCLUDE_MODULE_CRYPTO_H_)
+#define MAIN_INCLUDE_MODULE_CRYPTO_H_
+#include <duktape.h>
+
+duk_ret_t ModuleCrypto(duk_context *ctx);
+
+#endif /* MAIN_INCLUDE_MODULE_CRYPTO_H_ */
@@ -0,0 +1,11 @@
+/*
+ * module_dgram.h
+ */
+
+#if !defined(MAIN_INCLUDE_MODULE_DGRAM_H_)
+#define MAIN_INCLUDE_MODULE_DGRAM_H_
+#include <duktape.h>
+
+duk_ret_t ModuleDgram(duk_context *ctx);
+
+#endif /* MAIN_INCLUDE_MODULE_DGRAM_H_ */
@@ -0,0 +1,11 @@
+/*
+ * module_dns.h
+ */
+
+#if !defined(MAIN_INCLUDE_MODULE_DNS_H_)
+#define MAIN_INCLUDE_MODULE_DNS_H_
+#include <duktape.h>
+
+duk_ret_t ModuleDNS(duk_context *ctx);
+
+#endif /* MAIN_INCLUDE_MODULE_DNS_H_ */
@@ -10,5 +10,6 @@
 #include <duktape.h>
 
 duk_ret_t ModuleFS(duk_context *ctx);
+void dukf_fs_invalidateListing();
 
 #endif /* MAIN_ESP32_DUKTAPE_MODULE_FS_H_ */
@@ -0,0 +1,33 @@
+/*
+ * module_metrics.h
+ */
+
+#if !defined(MAIN_INCLUDE_MODULE_METRICS_H_)
+#define MAIN_INCLUDE_MODULE_METRICS_H_
+#include <duktape.h>
+#include <stdint.h>
+
+/*
+ * The histograms.  The first ones are the phases of loop.js, marked with enter().
+ */
+enum {
+	METRICS_TIMERS   = 0, // Timer callbacks.
+	METRICS_SELECT   = 1, // select() on the sockets.
+	METRICS_IO       = 2, // Socket reads, writes and accepts.
+	METRICS_GC       = 3, // Garbage collection.
+	METRICS_LOOP     = 4, // The whole loop function.
+	METRICS_CALLBACK = 5, // One event callback.
+	METRICS_EVENTS   = 6, // The events processed in a turn of the main task.
+	METRICS_TURN     = 7, // From the start of one turn of the main task to the next.
+	METRICS_LAG      = 8, // How late a timer fired.
+	METRICS_COUNT
+};
+
+#define METRICS_NONE (-1) // No phase, for metrics_enter().
+
+void     metrics_enter(int histogram);
+uint32_t metrics_now();
+void     metrics_record(int histogram, uint32_t usecs);
+duk_ret_t ModuleMetrics(duk_context *ctx);
+
+#endif /* MAIN_INCLUDE_MODULE_METRICS_H_ */
@@ -0,0 +1,11 @@
+/*
+ * module_mqtt.h
+ */
+
+#if !defined(MAIN_INCLUDE_MODULE_MQTT_H_)
+#define MAIN_INCLUDE_MODULE_MQTT_H_
+#include <duktape.h>
+
+duk_ret_t ModuleMQTT(duk_context *ctx);
+
+#endif /* MAIN_INCLUDE_MODULE_MQTT_H_ */
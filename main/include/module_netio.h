@@ -0,0 +1,11 @@
+/*
+ * module_netio.h
+ */
+
+#if !defined(MAIN_INCLUDE_MODULE_NETIO_H_)
+#define MAIN_INCLUDE_MODULE_NETIO_H_
+#include <duktape.h>
+
+duk_ret_t ModuleNetIO(duk_context *ctx);
+
+#endif /* MAIN_INCLUDE_MODULE_NETIO_H_ */
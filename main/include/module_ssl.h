@@ -8,6 +8,24 @@
 #ifndef MAIN_INCLUDE_MODULE_SSL_H_
 #define MAIN_INCLUDE_MODULE_SSL_H_
 #include <duktape.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Results of the dukf_ssl_* functions other than a byte count.
+#define DUKF_SSL_ERROR      (-1)
+#define DUKF_SSL_WANT_READ  (-2) // Call again when the socket is readable.
+#define DUKF_SSL_WANT_WRITE (-3) // Call again when the socket is writable.
+
+typedef struct dukf_ssl_context dukf_ssl_context_t;
+
 duk_ret_t ModuleSSL(duk_context *ctx);
 
+int                 dukf_ssl_init();
+dukf_ssl_context_t *dukf_ssl_create(const char *hostname, int fd, int port);
+void                dukf_ssl_free(dukf_ssl_context_t *dukf_ssl_context);
+int                 dukf_ssl_handshake(dukf_ssl_context_t *dukf_ssl_context);
+size_t              dukf_ssl_pending(dukf_ssl_context_t *dukf_ssl_context);
+int                 dukf_ssl_read(dukf_ssl_context_t *dukf_ssl_context, uint8_t *buf, size_t len);
+int                 dukf_ssl_write(dukf_ssl_context_t *dukf_ssl_context, const uint8_t *buf, size_t len);
+
 #endif /* MAIN_INCLUDE_MODULE_SSL_H_ */
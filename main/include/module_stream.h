@@ -0,0 +1,11 @@
+/*
+ * module_stream.h
+ */
+
+#if !defined(MAIN_INCLUDE_MODULE_STREAM_H_)
+#define MAIN_INCLUDE_MODULE_STREAM_H_
+#include <duktape.h>
+
+duk_ret_t ModuleStream(duk_context *ctx);
+
+#endif /* MAIN_INCLUDE_MODULE_STREAM_H_ */
@@ -0,0 +1,11 @@
+/*
+ * module_ws2812.h
+ */
+
+#if !defined(MAIN_INCLUDE_MODULE_WS2812_H_)
+#define MAIN_INCLUDE_MODULE_WS2812_H_
+#include <duktape.h>
+
+duk_ret_t ModuleWS2812(duk_context *ctx);
+
+#endif /* MAIN_INCLUDE_MODULE_WS2812_H_ */
@@ -0,0 +1,44 @@
+/*
+ * rmt_decoders.h
+ */
+
+#if !defined(MAIN_INCLUDE_RMT_DECODERS_H_)
+#define MAIN_INCLUDE_RMT_DECODERS_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Captured RMT data is held as 16 bit data items of the form level<<15 | duration,
+ * the same layout as the two halves of an ESP32 rmt_item32_t.  A duration of 0
+ * marks the end of a capture.  The decoders expect the output of an IR
+ * demodulator where a mark (carrier present) is a low level.
+ */
+#define RMT_DATA_ITEM_LEVEL(item)    (((item) >> 15) & 1)
+#define RMT_DATA_ITEM_DURATION(item) ((item) & 0x7fff)
+
+typedef enum {
+	RMT_DECODER_NONE = 0,
+	RMT_DECODER_NEC,
+	RMT_DECODER_RC5
+} rmt_decoder_type_t;
+
+typedef struct {
+	rmt_decoder_type_t protocol;
+	uint16_t           address;
+	uint16_t           command;
+	bool               repeat; // NEC repeat code or RC5 toggle bit unchanged.
+	bool               toggle; // RC5 toggle bit.
+} rmt_decoded_t;
+
+// State kept between the frames of one channel.
+typedef struct {
+	bool          haveLast;
+	rmt_decoded_t last;
+} rmt_decoder_state_t;
+
+rmt_decoder_type_t rmt_decoder_fromString(const char *name);
+const char        *rmt_decoder_toString(rmt_decoder_type_t type);
+bool               rmt_decode(rmt_decoder_type_t type, rmt_decoder_state_t *state, const uint16_t *items, size_t count, uint32_t tickNs, rmt_decoded_t *result);
+
+#endif /* MAIN_INCLUDE_RMT_DECODERS_H_ */
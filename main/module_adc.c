@@ -2,21 +2,136 @@
  * Handle the Analog To Digital conversion functions.
  * The ESP32 has a number of analog to digital inputs which are exposed
  * via the ESP-IDF.  This module exposes these functions through mapped
- * JavaScript functions.  The three functions exposed are:
+ * JavaScript functions.  The functions exposed are:
  * * config_channel_atten
  * * config_width
  * * get_voltage
+ * * start
+ * * stats
+ * * stop
+ *
+ * get_voltage takes a single sample.  start() begins a continuous acquisition
+ * where the I2S peripheral clocks ADC1 samples into DMA buffers at the requested
+ * sample rate.  A task drains the DMA buffers, optionally decimates/averages the
+ * samples and applies a threshold trigger before filling blocks in a ring.  Full
+ * blocks are delivered to JavaScript as Uint16Arrays through the event queue.
+ *
+ * On Linux only the continuous acquisition is available and its samples come
+ * from a synthetic waveform generator.
  */
+#if defined(ESP_PLATFORM)
 #include <driver/adc.h>
+#include <driver/i2s.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "esp32_specific.h"
+#else /* ESP_PLATFORM */
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif /* ESP_PLATFORM */
+
 #include <duktape.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "duktape_event.h"
 #include "duktape_utils.h"
-#include "esp32_specific.h"
 #include "logging.h"
 #include "module_adc.h"
 
 LOG_TAG("module_adc");
 
+// The largest sample value of the 12 bit ADC.
+#define ADC_MAX_VALUE (4095)
+
+// The number of raw samples read from the DMA buffers (or generated) at a time.
+#define ADC_READ_SAMPLES (256)
+
+typedef enum {
+	ADC_TRIGGER_NONE,
+	ADC_TRIGGER_RISING,
+	ADC_TRIGGER_FALLING
+} adc_trigger_t;
+
+#if !defined(ESP_PLATFORM)
+typedef enum {
+	ADC_WAVEFORM_SINE,
+	ADC_WAVEFORM_SQUARE,
+	ADC_WAVEFORM_NOISE
+} adc_waveform_t;
+#endif /* !ESP_PLATFORM */
+
+/*
+ * The state of the continuous acquisition.  There is only one as the I2S
+ * peripheral can only sample a single ADC1 channel.
+ */
+typedef struct {
+	volatile bool  running;          // The acquisition task should keep running.
+	volatile bool  taskRunning;      // The acquisition task has not yet ended.
+	bool           stopping;         // stop() has been called with an event outstanding.
+	uint32_t       callbackStashKey; // The block callback (a persistent stash).
+	bool           eventPosted;      // An event for the full blocks is outstanding.
+
+	int            channel;
+	uint32_t       sampleRate;       // Raw samples per second.
+	uint32_t       decimate;         // Raw samples per output sample.
+	bool           average;          // Output the mean of the decimated samples rather than the last.
+	adc_trigger_t  trigger;
+	uint16_t       triggerLevel;
+
+	// Pipeline state, only used by the acquisition task.
+	uint32_t       accumulator;
+	uint32_t       accumulated;
+	bool           triggered;        // A block is being filled.
+	int32_t        previous;         // The previous output sample (for the trigger).
+
+	// The ring of blocks.  The slot at (head + fullCount) % ringBlocks is being
+	// filled unless all of them are full.
+	uint16_t      *ring;
+	size_t         blockSize;        // Samples per block.
+	size_t         ringBlocks;
+	size_t         head;
+	volatile size_t fullCount;
+	size_t         fill;             // Samples in the block being filled.
+
+	// Statistics.
+	uint32_t       samplesIn;
+	uint32_t       samplesOut;
+	uint32_t       blocks;
+	uint32_t       droppedSamples;
+	uint32_t       triggers;
+
+#if defined(ESP_PLATFORM)
+	TaskHandle_t   task;
+#else
+	pthread_t      thread;
+	adc_waveform_t waveform;
+	double         frequency;
+	double         amplitude;
+	double         offset;
+	bool           realtime;         // Generate samples at sampleRate rather than flat out.
+#endif
+} adc_acquisition_t;
+
+static adc_acquisition_t g_acquisition;
+
+#if defined(ESP_PLATFORM)
+static SemaphoreHandle_t g_acquisitionLock = NULL;
+#define ACQ_LOCK()   xSemaphoreTake(g_acquisitionLock, portMAX_DELAY)
+#define ACQ_UNLOCK() xSemaphoreGive(g_acquisitionLock)
+#else
+static pthread_mutex_t g_acquisitionLock = PTHREAD_MUTEX_INITIALIZER;
+#define ACQ_LOCK()   pthread_mutex_lock(&g_acquisitionLock)
+#define ACQ_UNLOCK() pthread_mutex_unlock(&g_acquisitionLock)
+#endif
+
+#if defined(ESP_PLATFORM)
 /*
  * [0] - ADC channel - int
  * [1] - Attenuation - int
@@ -69,6 +184,458 @@ static duk_ret_t js_adc_get_voltage(duk_context *ctx) {
 	LOGD("<< js_adc_get_voltage");
 	return 1;
 } // js_adc_get_voltage
+#endif /* ESP_PLATFORM */
+
+
+/**
+ * Called on the JavaScript task to deliver the full blocks.  The callback is
+ * invoked as callback(blocks) where blocks is an array of Uint16Arrays.
+ */
+static int adc_blocks_dataProvider(duk_context *ctx, void *context) {
+	adc_acquisition_t *acq = (adc_acquisition_t *)context;
+	duk_uarridx_t i = 0;
+
+	duk_push_array(ctx);
+	ACQ_LOCK();
+	while(acq->ring != NULL && acq->fullCount > 0) {
+		size_t bytes = acq->blockSize * sizeof(uint16_t);
+		void *data = duk_push_fixed_buffer(ctx, bytes);
+		memcpy(data, acq->ring + acq->head * acq->blockSize, bytes);
+		duk_push_buffer_object(ctx, -1, 0, bytes, DUK_BUFOBJ_UINT16ARRAY);
+		duk_remove(ctx, -2);
+		duk_put_prop_index(ctx, -2, i++);
+		acq->head = (acq->head + 1) % acq->ringBlocks;
+		acq->fullCount--;
+	}
+	acq->eventPosted = false;
+	ACQ_UNLOCK();
+
+	// If the acquisition was stopped while this event was outstanding, the callback
+	// has now been retrieved for the last time.
+	if (acq->stopping) {
+		esp32_duktape_stash_delete(ctx, acq->callbackStashKey);
+		acq->callbackStashKey = 0;
+		acq->stopping = false;
+	}
+	return 1;
+} // adc_blocks_dataProvider
+
+
+/**
+ * Add an output sample to the block being filled, waiting for the trigger if one
+ * is set.  Called on the acquisition task.
+ */
+static void adc_pushSample(adc_acquisition_t *acq, uint16_t value) {
+	bool post = false;
+
+	if (!acq->triggered) {
+		bool fire = false;
+		if (acq->trigger == ADC_TRIGGER_NONE) {
+			fire = true;
+		} else if (acq->previous >= 0) {
+			if (acq->trigger == ADC_TRIGGER_RISING) {
+				fire = acq->previous < acq->triggerLevel && value >= acq->triggerLevel;
+			} else {
+				fire = acq->previous > acq->triggerLevel && value <= acq->triggerLevel;
+			}
+		}
+		acq->previous = value;
+		if (!fire) {
+			return;
+		}
+		acq->triggered = true;
+		acq->triggers++;
+	}
+
+	if (acq->fullCount == acq->ringBlocks) {
+		// JavaScript hasn't kept up and every block is waiting to be delivered.
+		acq->droppedSamples++;
+		return;
+	}
+	size_t slot = (acq->head + acq->fullCount) % acq->ringBlocks;
+	acq->ring[slot * acq->blockSize + acq->fill] = value;
+	acq->samplesOut++;
+	if (++acq->fill < acq->blockSize) {
+		return;
+	}
+
+	// The block is full.
+	acq->fill = 0;
+	acq->blocks++;
+	acq->triggered = false;
+	acq->previous = value;
+	ACQ_LOCK();
+	acq->fullCount++;
+	if (!acq->eventPosted) {
+		acq->eventPosted = true;
+		post = true;
+	}
+	ACQ_UNLOCK();
+	if (post) {
+		// Blocks are bulk data and can wait behind interrupts and network I/O.  The
+		// ring holds the blocks until they are taken.
+		event_newLaneCallbackRequestedEvent(
+			ESP32_DUKTAPE_LANE_BACKGROUND,
+			ESP32_DUKTAPE_CALLBACK_TYPE_PERSISTENT_FUNCTION,
+			acq->callbackStashKey,
+			adc_blocks_dataProvider,
+			acq);
+	}
+} // adc_pushSample
+
+
+/**
+ * Run count raw samples through the decimation stage.  Called on the acquisition
+ * task.
+ */
+static void adc_processSamples(adc_acquisition_t *acq, const uint16_t *samples, size_t count) {
+	size_t i;
+	acq->samplesIn += count;
+	for (i=0; i<count; i++) {
+		acq->accumulator += samples[i];
+		acq->accumulated++;
+		if (acq->accumulated < acq->decimate) {
+			continue;
+		}
+		uint16_t value = acq->average ? acq->accumulator / acq->accumulated : samples[i];
+		acq->accumulator = 0;
+		acq->accumulated = 0;
+		adc_pushSample(acq, value);
+	}
+} // adc_processSamples
+
+
+#if defined(ESP_PLATFORM)
+/**
+ * The acquisition task.  The I2S peripheral clocks ADC1 samples into its DMA
+ * buffers; we drain them and feed the pipeline.
+ */
+static void adc_acquisition_task(void *param) {
+	adc_acquisition_t *acq = (adc_acquisition_t *)param;
+	uint16_t samples[ADC_READ_SAMPLES];
+	esp_err_t errRc;
+
+	i2s_config_t config;
+	memset(&config, 0, sizeof(config));
+	config.mode                 = I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN;
+	config.sample_rate          = acq->sampleRate;
+	config.bits_per_sample      = I2S_BITS_PER_SAMPLE_16BIT;
+	config.channel_format       = I2S_CHANNEL_FMT_ONLY_RIGHT;
+	config.communication_format = I2S_COMM_FORMAT_I2S_MSB;
+	config.dma_buf_count        = 4;
+	config.dma_buf_len          = ADC_READ_SAMPLES;
+
+	errRc = i2s_driver_install(I2S_NUM_0, &config, 0, NULL);
+	if (errRc != ESP_OK) {
+		LOGE("adc_acquisition_task: i2s_driver_install: %s", esp32_errToString(errRc));
+		acq->taskRunning = false;
+		vTaskDelete(NULL);
+		return;
+	}
+	i2s_set_adc_mode(ADC_UNIT_1, acq->channel);
+	i2s_adc_enable(I2S_NUM_0);
+
+	while(acq->running) {
+		int bytesRead = i2s_read_bytes(I2S_NUM_0, (char *)samples, sizeof(samples), pdMS_TO_TICKS(100));
+		if (bytesRead <= 0) {
+			continue;
+		}
+		size_t count = bytesRead / sizeof(uint16_t);
+		size_t i;
+		// The top 4 bits of each sample hold the channel number and the two
+		// samples of each 32 bit DMA word arrive swapped.
+		for (i=0; i+1<count; i+=2) {
+			uint16_t first = samples[i+1] & 0x0fff;
+			samples[i+1]   = samples[i] & 0x0fff;
+			samples[i]     = first;
+		}
+		adc_processSamples(acq, samples, count & ~1);
+	}
+
+	i2s_adc_disable(I2S_NUM_0);
+	i2s_driver_uninstall(I2S_NUM_0);
+	acq->taskRunning = false;
+	vTaskDelete(NULL);
+} // adc_acquisition_task
+
+#else /* ESP_PLATFORM */
+
+/**
+ * The synthetic acquisition thread.  Samples of the configured waveform are
+ * generated ADC_READ_SAMPLES at a time, paced to the sample rate unless
+ * realtime is false in which case the pipeline runs flat out.
+ */
+static void *adc_synthetic_thread(void *param) {
+	adc_acquisition_t *acq = (adc_acquisition_t *)param;
+	uint16_t samples[ADC_READ_SAMPLES];
+	uint64_t sampleNumber = 0;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(acq->running) {
+		size_t i;
+		for (i=0; i<ADC_READ_SAMPLES; i++, sampleNumber++) {
+			double t = (double)sampleNumber / acq->sampleRate;
+			double phase = fmod(t * acq->frequency, 1.0);
+			double value;
+			switch(acq->waveform) {
+				case ADC_WAVEFORM_SQUARE:
+					value = acq->offset + (phase < 0.5 ? acq->amplitude : -acq->amplitude);
+					break;
+				case ADC_WAVEFORM_NOISE:
+					value = acq->offset + acq->amplitude * (2.0 * rand() / RAND_MAX - 1.0);
+					break;
+				default:
+					value = acq->offset + acq->amplitude * sin(2 * M_PI * phase);
+					break;
+			}
+			if (value < 0) {
+				value = 0;
+			} else if (value > ADC_MAX_VALUE) {
+				value = ADC_MAX_VALUE;
+			}
+			samples[i] = (uint16_t)value;
+		}
+		adc_processSamples(acq, samples, ADC_READ_SAMPLES);
+
+		if (acq->realtime) {
+			uint64_t nsecs = (uint64_t)ADC_READ_SAMPLES * 1000000000ULL / acq->sampleRate;
+			next.tv_nsec += nsecs % 1000000000ULL;
+			next.tv_sec  += nsecs / 1000000000ULL + next.tv_nsec / 1000000000L;
+			next.tv_nsec %= 1000000000L;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+	}
+	acq->taskRunning = false;
+	return NULL;
+} // adc_synthetic_thread
+#endif /* ESP_PLATFORM */
+
+
+/**
+ * Get an optional numeric property of the options object at idx.
+ */
+static double getNumberOption(duk_context *ctx, duk_idx_t idx, const char *name, double defaultValue) {
+	double value = defaultValue;
+	if (duk_get_prop_string(ctx, idx, name)) {
+		value = duk_get_number(ctx, -1);
+	}
+	duk_pop(ctx);
+	return value;
+} // getNumberOption
+
+
+/*
+ * Start a continuous acquisition.
+ *
+ * [0] - options
+ * {
+ *    channel: <number> - The ADC1 channel.  Default is 0.
+ *    sampleRate: <number> - Raw samples per second.  Default is 10000.
+ *    blockSize: <number> - Samples per delivered block.  Default is 256.
+ *    ringBlocks: <number> - Blocks in the ring.  Default is 4.
+ *    decimate: <number> - Raw samples per output sample.  Default is 1.
+ *    average: <boolean> - Output the mean of each group of decimated samples
+ *      rather than the last of them.  Default is false.
+ *    trigger: {
+ *       level: <number> - Only start a block when the signal crosses this level.
+ *       edge: "rising" (default) or "falling"
+ *    }
+ *    waveform: { - Linux only.
+ *       type: "sine" (default), "square" or "noise"
+ *       frequency: <number> - Hz.  Default 50.
+ *       amplitude: <number> - Default 1000.
+ *       offset: <number> - Default 2048.
+ *       realtime: <boolean> - Pace samples to sampleRate.  Default true.
+ *    }
+ * }
+ * [1] - callback - Invoked as callback(blocks).
+ *
+ * Return:
+ * true if the acquisition was started.
+ */
+static duk_ret_t js_adc_start(duk_context *ctx) {
+	LOGD(">> js_adc_start");
+	adc_acquisition_t *acq = &g_acquisition;
+
+	if (acq->callbackStashKey != 0) {
+		LOGE("<< js_adc_start: an acquisition is already running");
+		duk_push_false(ctx);
+		return 1;
+	}
+	if (!duk_is_object(ctx, 0) || !duk_is_function(ctx, 1)) {
+		LOGE("<< js_adc_start: usage start(options, callback)");
+		duk_push_false(ctx);
+		return 1;
+	}
+
+	acq->channel      = (int)getNumberOption(ctx, 0, "channel", 0);
+	acq->sampleRate   = (uint32_t)getNumberOption(ctx, 0, "sampleRate", 10000);
+	acq->blockSize    = (size_t)getNumberOption(ctx, 0, "blockSize", 256);
+	acq->ringBlocks   = (size_t)getNumberOption(ctx, 0, "ringBlocks", 4);
+	acq->decimate     = (uint32_t)getNumberOption(ctx, 0, "decimate", 1);
+	acq->average      = false;
+	acq->trigger      = ADC_TRIGGER_NONE;
+	acq->triggerLevel = 0;
+	if (duk_get_prop_string(ctx, 0, "average")) {
+		acq->average = duk_to_boolean(ctx, -1);
+	}
+	duk_pop(ctx);
+	if (duk_get_prop_string(ctx, 0, "trigger") && duk_is_object(ctx, -1)) {
+		acq->trigger      = ADC_TRIGGER_RISING;
+		acq->triggerLevel = (uint16_t)getNumberOption(ctx, -1, "level", ADC_MAX_VALUE / 2);
+		if (duk_get_prop_string(ctx, -1, "edge") && strcmp(duk_to_string(ctx, -1), "falling") == 0) {
+			acq->trigger = ADC_TRIGGER_FALLING;
+		}
+		duk_pop(ctx);
+	}
+	duk_pop(ctx);
+#if !defined(ESP_PLATFORM)
+	acq->waveform  = ADC_WAVEFORM_SINE;
+	acq->frequency = 50;
+	acq->amplitude = 1000;
+	acq->offset    = 2048;
+	acq->realtime  = true;
+	if (duk_get_prop_string(ctx, 0, "waveform") && duk_is_object(ctx, -1)) {
+		acq->frequency = getNumberOption(ctx, -1, "frequency", acq->frequency);
+		acq->amplitude = getNumberOption(ctx, -1, "amplitude", acq->amplitude);
+		acq->offset    = getNumberOption(ctx, -1, "offset", acq->offset);
+		if (duk_get_prop_string(ctx, -1, "type")) {
+			const char *type = duk_to_string(ctx, -1);
+			if (strcmp(type, "square") == 0) {
+				acq->waveform = ADC_WAVEFORM_SQUARE;
+			} else if (strcmp(type, "noise") == 0) {
+				acq->waveform = ADC_WAVEFORM_NOISE;
+			}
+		}
+		duk_pop(ctx);
+		if (duk_get_prop_string(ctx, -1, "realtime")) {
+			acq->realtime = duk_to_boolean(ctx, -1);
+		}
+		duk_pop(ctx);
+	}
+	duk_pop(ctx);
+#endif
+
+	if (acq->sampleRate == 0 || acq->blockSize == 0 || acq->ringBlocks < 2 || acq->decimate == 0) {
+		LOGE("<< js_adc_start: sampleRate, blockSize and decimate must be >= 1 and ringBlocks >= 2");
+		duk_push_false(ctx);
+		return 1;
+	}
+
+	acq->ring = malloc(acq->blockSize * acq->ringBlocks * sizeof(uint16_t));
+	if (acq->ring == NULL) {
+		LOGE("<< js_adc_start: unable to allocate %d blocks of %d samples", acq->ringBlocks, acq->blockSize);
+		duk_push_false(ctx);
+		return 1;
+	}
+	acq->head           = 0;
+	acq->fullCount      = 0;
+	acq->fill           = 0;
+	acq->accumulator    = 0;
+	acq->accumulated    = 0;
+	acq->triggered      = false;
+	acq->previous       = -1;
+	acq->eventPosted    = false;
+	acq->samplesIn      = 0;
+	acq->samplesOut     = 0;
+	acq->blocks         = 0;
+	acq->droppedSamples = 0;
+	acq->triggers       = 0;
+
+	duk_dup(ctx, 1);
+	acq->callbackStashKey = esp32_duktape_stash_array(ctx, 1);
+	acq->running     = true;
+	acq->taskRunning = true;
+
+#if defined(ESP_PLATFORM)
+	if (g_acquisitionLock == NULL) {
+		g_acquisitionLock = xSemaphoreCreateMutex();
+	}
+	if (xTaskCreatePinnedToCore(&adc_acquisition_task, "adc", 3072, acq, 7, &acq->task, tskNO_AFFINITY) != pdPASS) {
+		acq->taskRunning = false;
+	}
+#else
+	if (pthread_create(&acq->thread, NULL, adc_synthetic_thread, acq) != 0) {
+		acq->taskRunning = false;
+	}
+#endif
+	if (!acq->taskRunning) {
+		LOGE("<< js_adc_start: unable to start the acquisition task");
+		acq->running = false;
+		esp32_duktape_stash_delete(ctx, acq->callbackStashKey);
+		acq->callbackStashKey = 0;
+		free(acq->ring);
+		acq->ring = NULL;
+		duk_push_false(ctx);
+		return 1;
+	}
+
+	LOGD("<< js_adc_start");
+	duk_push_true(ctx);
+	return 1;
+} // js_adc_start
+
+
+/*
+ * Return the statistics of the current (or last) acquisition.
+ *
+ * Return:
+ * {
+ *    samplesIn: <number> - Raw samples taken.
+ *    samplesOut: <number> - Samples placed in blocks.
+ *    blocks: <number> - Blocks filled.
+ *    droppedSamples: <number> - Samples lost because every block was waiting.
+ *    triggers: <number> - Times the trigger fired.
+ *    pending: <number> - Blocks waiting to be delivered.
+ * }
+ */
+static duk_ret_t js_adc_stats(duk_context *ctx) {
+	adc_acquisition_t *acq = &g_acquisition;
+	duk_push_object(ctx);
+	ADD_INT("samplesIn",      acq->samplesIn);
+	ADD_INT("samplesOut",     acq->samplesOut);
+	ADD_INT("blocks",         acq->blocks);
+	ADD_INT("droppedSamples", acq->droppedSamples);
+	ADD_INT("triggers",       acq->triggers);
+	ADD_INT("pending",        acq->fullCount);
+	return 1;
+} // js_adc_stats
+
+
+/*
+ * Stop the continuous acquisition.  Blocks not yet delivered are discarded.
+ */
+static duk_ret_t js_adc_stop(duk_context *ctx) {
+	LOGD(">> js_adc_stop");
+	adc_acquisition_t *acq = &g_acquisition;
+	if (acq->callbackStashKey == 0 || acq->stopping) {
+		LOGD("<< js_adc_stop: no acquisition running");
+		return 0;
+	}
+	acq->running = false;
+#if defined(ESP_PLATFORM)
+	while(acq->taskRunning) {
+		vTaskDelay(10 / portTICK_PERIOD_MS);
+	}
+#else
+	pthread_join(acq->thread, NULL);
+	acq->taskRunning = false;
+#endif
+
+	// The acquisition task has ended so only this task touches the state from here on.
+	free(acq->ring);
+	acq->ring      = NULL;
+	acq->fullCount = 0;
+	if (acq->eventPosted) {
+		acq->stopping = true; // The data provider releases the callback.
+	} else {
+		esp32_duktape_stash_delete(ctx, acq->callbackStashKey);
+		acq->callbackStashKey = 0;
+	}
+	LOGD("<< js_adc_stop");
+	return 0;
+} // js_adc_stop
 
 
 /**
@@ -77,6 +644,11 @@ static duk_ret_t js_adc_get_voltage(duk_context *ctx) {
  */
 duk_ret_t ModuleADC(duk_context *ctx) {
 
+	ADD_FUNCTION("start",                js_adc_start,                2);
+	ADD_FUNCTION("stats",                js_adc_stats,                0);
+	ADD_FUNCTION("stop",                 js_adc_stop,                 0);
+
+#if defined(ESP_PLATFORM)
 	ADD_FUNCTION("config_channel_atten", js_adc_config_channel_atten, 2);
 	ADD_FUNCTION("config_width",         js_adc_config_width,         1);
 	ADD_FUNCTION("get_voltage",          js_adc_get_voltage,          1);
@@ -98,5 +670,10 @@ duk_ret_t ModuleADC(duk_context *ctx) {
 	ADD_INT("ADC_CHANNEL_6",   ADC1_CHANNEL_6);
 	ADD_INT("ADC_CHANNEL_7",   ADC1_CHANNEL_7);
 
+	ADD_BOOLEAN("SIMULATED", 0);
+#else
+	ADD_BOOLEAN("SIMULATED", 1);
+#endif /* ESP_PLATFORM */
+
 	return 0;
 } // ModuleADC
@@ -0,0 +1,625 @@
+/*
+ * Append only log files.
+ *
+ * Data loggers that open, write and close a file for every record pay for a flash
+ * page program and a metadata update on each small write.  An application log instead
+ * gathers records in RAM and writes them to the file together (a group commit) when
+ * the buffer fills or the oldest buffered record reaches an age limit.  When the file
+ * reaches its size cap it is rotated: "log" becomes "log.1", "log.1" becomes "log.2"
+ * and so on up to the number of files to keep.
+ *
+ * Each record is written with an 8 byte header:
+ * * 'L' 'G'           - marker
+ * * length  (2 bytes) - little endian length of the record data
+ * * crc     (4 bytes) - little endian CRC-32 of the record data
+ * followed by the record data.  When a log is opened, the existing file is checked.  If
+ * power was lost during a write, the file ends with a partial or corrupt record.  Such a
+ * file is rotated out so that new records are not appended after the damage.  Readers
+ * of a file stop at the first bad record.  A write that fails part way (for example
+ * because the file system is full) is treated the same way and the records that
+ * weren't written are kept in the buffer to be written again.
+ *
+ * The functions exposed are:
+ * * append
+ * * close
+ * * flush
+ * * open
+ * * poll
+ * * readRecords
+ * * stats
+ *
+ * A log is a pointer which must be released with close() once it is no longer needed.
+ */
+#include <duktape.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "c_timeutils.h"
+#include "duktape_utils.h"
+#include "logging.h"
+#include "module_applog.h"
+#include "module_fs.h"
+
+LOG_TAG("module_applog");
+
+// Value identifying a log behind a pointer passed in from JavaScript.
+#define APPLOG_MAGIC (0x4150504C) // "APPL"
+
+#define APPLOG_HEADER_SIZE        (8)
+#define APPLOG_MAX_RECORD         (0xFFFF)
+#define APPLOG_MAX_PATH           (128)
+
+#define APPLOG_DEFAULT_BUFFER_SIZE    (4096)
+#define APPLOG_DEFAULT_FLUSH_INTERVAL (1000)      // msecs
+#define APPLOG_DEFAULT_MAX_FILE_SIZE  (64 * 1024)
+#define APPLOG_DEFAULT_MAX_FILES      (4)
+
+typedef struct {
+	uint32_t magic;
+	char     path[APPLOG_MAX_PATH];
+	int      fd;
+	uint8_t *buffer;
+	size_t   bufferSize;
+	size_t   buffered;          // Bytes in buffer waiting to be written.
+	uint32_t firstBufferedTime; // Time (msecs) the oldest buffered record was appended.
+	uint32_t flushInterval;     // Maximum age (msecs) of a buffered record.
+	size_t   maxFileSize;
+	int      maxFiles;          // Number of files kept including the current one.
+	bool     sync;              // fsync() after each group commit.
+	size_t   fileSize;
+	// Statistics
+	uint32_t records;
+	uint32_t writes;
+	uint32_t flushes;
+	uint32_t rotations;
+	uint32_t recoveries;
+	uint32_t writeErrors;       // Failed writes.
+	uint32_t dropped;           // Records refused because a failed write left no room.
+	double   recordBytes;       // Bytes of record data appended.
+	double   fileBytes;         // Bytes written to files including headers.
+} dukf_applog_t;
+
+
+/**
+ * Get the current time in msecs.
+ */
+static uint32_t nowMsecs() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return timeval_toMsecs(&tv);
+} // nowMsecs
+
+
+/**
+ * Update a CRC-32 (IEEE 802.3) with more data.  Start with crc = 0.
+ */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length) {
+	crc = ~crc;
+	while (length--) {
+		crc ^= *data++;
+		int i;
+		for (i=0; i<8; i++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+} // crc32_update
+
+
+/**
+ * Read exactly length bytes.  Returns false at the end of the file or on an error.
+ */
+static bool readFully(int fd, uint8_t *data, size_t length) {
+	while (length > 0) {
+		ssize_t rc = read(fd, data, length);
+		if (rc <= 0) {
+			return false;
+		}
+		data += rc;
+		length -= rc;
+	}
+	return true;
+} // readFully
+
+
+/**
+ * Write all of the data.  Returns false on an error.
+ */
+static bool writeFully(int fd, const uint8_t *data, size_t length) {
+	while (length > 0) {
+		ssize_t rc = write(fd, data, length);
+		if (rc <= 0) {
+			LOGE("writeFully: write() error: %d %s", errno, strerror(errno));
+			return false;
+		}
+		data += rc;
+		length -= rc;
+	}
+	return true;
+} // writeFully
+
+
+/**
+ * Walk the records of an open file.  If ctx is not NULL, each record is pushed as a
+ * Buffer into the array at the top of its value stack.  Returns the number of bytes
+ * of the file that hold whole, valid records.
+ */
+static off_t scanRecords(int fd, duk_context *ctx) {
+	uint8_t header[APPLOG_HEADER_SIZE];
+	uint8_t scratch[256];
+	off_t validLength = 0;
+	duk_uarridx_t index = 0;
+	while (readFully(fd, header, APPLOG_HEADER_SIZE)) {
+		if (header[0] != 'L' || header[1] != 'G') {
+			break;
+		}
+		size_t length = header[2] | (header[3] << 8);
+		uint32_t crc = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+		uint32_t actualCrc = 0;
+		bool ok = true;
+		if (ctx != NULL) {
+			uint8_t *data = duk_push_fixed_buffer(ctx, length);
+			ok = readFully(fd, data, length);
+			if (ok) {
+				actualCrc = crc32_update(0, data, length);
+			}
+		} else {
+			size_t remaining = length;
+			while (ok && remaining > 0) {
+				size_t size = remaining < sizeof(scratch) ? remaining : sizeof(scratch);
+				ok = readFully(fd, scratch, size);
+				actualCrc = crc32_update(actualCrc, scratch, size);
+				remaining -= size;
+			}
+		}
+		if (!ok || actualCrc != crc) {
+			if (ctx != NULL) {
+				duk_pop(ctx);
+			}
+			break;
+		}
+		if (ctx != NULL) {
+			duk_push_buffer_object(ctx, -1, 0, length, DUK_BUFOBJ_NODEJS_BUFFER);
+			duk_remove(ctx, -2);
+			duk_put_prop_index(ctx, -2, index);
+			index++;
+		}
+		validLength += APPLOG_HEADER_SIZE + length;
+	}
+	return validLength;
+} // scanRecords
+
+
+/**
+ * Open (or create) the current file of the log for appending.
+ */
+static bool openCurrent(dukf_applog_t *appLog) {
+	appLog->fd = open(appLog->path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if (appLog->fd < 0) {
+		LOGE("openCurrent: Unable to open %s: %d %s", appLog->path, errno, strerror(errno));
+		return false;
+	}
+	struct stat statBuf;
+	appLog->fileSize = fstat(appLog->fd, &statBuf) == 0 ? statBuf.st_size : 0;
+	dukf_fs_invalidateListing(); // The file may have been created.
+	return true;
+} // openCurrent
+
+
+/**
+ * Move the current file aside and start a new one.  The oldest file is discarded.  SPIFFS
+ * won't rename over an existing file so each target is removed first.
+ */
+static bool rotate(dukf_applog_t *appLog) {
+	char from[APPLOG_MAX_PATH + 4];
+	char to[APPLOG_MAX_PATH + 4];
+	LOGD(">> rotate: %s", appLog->path);
+	if (appLog->fd >= 0) {
+		close(appLog->fd);
+		appLog->fd = -1;
+	}
+	int i;
+	for (i = appLog->maxFiles - 1; i >= 1; i--) {
+		snprintf(to, sizeof(to), "%s.%d", appLog->path, i);
+		if (i == 1) {
+			snprintf(from, sizeof(from), "%s", appLog->path);
+		} else {
+			snprintf(from, sizeof(from), "%s.%d", appLog->path, i - 1);
+		}
+		unlink(to);
+		rename(from, to);
+	}
+	unlink(appLog->path);
+	appLog->rotations++;
+	dukf_fs_invalidateListing();
+	LOGD("<< rotate");
+	return openCurrent(appLog);
+} // rotate
+
+
+/**
+ * A write to the current file failed.  If part of the data reached the file, the file
+ * now ends with a torn record so it is rotated out, as is a damaged file found when
+ * the log is opened, and the following records start a new file.
+ */
+static void writeFailed(dukf_applog_t *appLog) {
+	struct stat statBuf;
+	appLog->writeErrors++;
+	dukf_fs_invalidateListing();
+	if (appLog->fd >= 0 && fstat(appLog->fd, &statBuf) == 0 && (size_t)statBuf.st_size == appLog->fileSize) {
+		return; // Nothing was written.
+	}
+	LOGW("writeFailed: %s ends with a partial record, rotating it", appLog->path);
+	rotate(appLog);
+} // writeFailed
+
+
+/**
+ * Write the buffered records to the file as one group, rotating first if they would
+ * take the file past its size cap.  If the write fails, the records stay in the buffer.
+ */
+static bool flush(dukf_applog_t *appLog) {
+	if (appLog->buffered == 0) {
+		return true;
+	}
+	if (appLog->fileSize > 0 && appLog->fileSize + appLog->buffered > appLog->maxFileSize) {
+		if (!rotate(appLog)) {
+			return false;
+		}
+	}
+	if (appLog->fd < 0 && !openCurrent(appLog)) {
+		return false;
+	}
+	bool ok = writeFully(appLog->fd, appLog->buffer, appLog->buffered);
+	appLog->writes++;
+	appLog->flushes++;
+	if (!ok) {
+		writeFailed(appLog);
+		return false;
+	}
+	if (appLog->sync) {
+		fsync(appLog->fd);
+	}
+	appLog->fileSize += appLog->buffered;
+	appLog->fileBytes += appLog->buffered;
+	appLog->buffered = 0;
+	dukf_fs_invalidateListing();
+	return true;
+} // flush
+
+
+/**
+ * Get the log at idx or NULL if it isn't one.
+ */
+static dukf_applog_t *getAppLog(duk_context *ctx, duk_idx_t idx) {
+	dukf_applog_t *appLog = duk_get_pointer(ctx, idx);
+	if (appLog == NULL || appLog->magic != APPLOG_MAGIC) {
+		LOGE("Not an application log");
+		return NULL;
+	}
+	return appLog;
+} // getAppLog
+
+
+/**
+ * Get an optional positive integer property of the object at idx.
+ */
+static int getIntOption(duk_context *ctx, duk_idx_t idx, const char *name, int defaultValue) {
+	int value = defaultValue;
+	if (duk_is_object(ctx, idx)) {
+		duk_get_prop_string(ctx, idx, name);
+		if (duk_is_number(ctx, -1) && duk_get_int(ctx, -1) > 0) {
+			value = duk_get_int(ctx, -1);
+		}
+		duk_pop(ctx);
+	}
+	return value;
+} // getIntOption
+
+
+/*
+ * Append a record.  The record is buffered and written with the others in the buffer
+ * when the buffer is full or the oldest record has been buffered for flushInterval.
+ * [0] - log
+ * [1] - record - string or buffer
+ *
+ * Returns true if the record was written or buffered.  False if it was refused because
+ * it is too large or earlier records that failed to be written fill the buffer.
+ */
+static duk_ret_t js_applog_append(duk_context *ctx) {
+	dukf_applog_t *appLog = getAppLog(ctx, 0);
+	if (appLog == NULL) {
+		return 0;
+	}
+	duk_size_t length;
+	const uint8_t *data;
+	if (duk_is_string(ctx, 1)) {
+		data = (const uint8_t *)duk_get_lstring(ctx, 1, &length);
+	} else {
+		data = duk_get_buffer_data(ctx, 1, &length);
+	}
+	if (data == NULL || length > APPLOG_MAX_RECORD) {
+		LOGE("js_applog_append: No record or record larger than %d bytes", APPLOG_MAX_RECORD);
+		duk_push_false(ctx);
+		return 1;
+	}
+	uint8_t header[APPLOG_HEADER_SIZE];
+	uint32_t crc = crc32_update(0, data, length);
+	header[0] = 'L';
+	header[1] = 'G';
+	header[2] = length & 0xFF;
+	header[3] = (length >> 8) & 0xFF;
+	header[4] = crc & 0xFF;
+	header[5] = (crc >> 8) & 0xFF;
+	header[6] = (crc >> 16) & 0xFF;
+	header[7] = (crc >> 24) & 0xFF;
+
+	size_t recordSize = APPLOG_HEADER_SIZE + length;
+	bool ok = true;
+	if (appLog->buffered + recordSize > appLog->bufferSize) {
+		ok = flush(appLog);
+	}
+	if (recordSize > appLog->bufferSize) {
+		// Too big to buffer so write it on its own, but not ahead of records that are
+		// still waiting after a failed write.
+		if (appLog->fileSize > 0 && appLog->fileSize + recordSize > appLog->maxFileSize) {
+			ok = rotate(appLog) && ok;
+		}
+		if (ok) {
+			ok = writeFully(appLog->fd, header, APPLOG_HEADER_SIZE) && writeFully(appLog->fd, data, length);
+			appLog->writes += 2;
+			if (ok) {
+				appLog->fileSize += recordSize;
+				appLog->fileBytes += recordSize;
+				dukf_fs_invalidateListing();
+			} else {
+				writeFailed(appLog);
+			}
+		}
+	} else if (appLog->buffered + recordSize > appLog->bufferSize) {
+		// The flush failed and left no room.
+		ok = false;
+	} else {
+		if (appLog->buffered == 0) {
+			appLog->firstBufferedTime = nowMsecs();
+		}
+		memcpy(appLog->buffer + appLog->buffered, header, APPLOG_HEADER_SIZE);
+		memcpy(appLog->buffer + appLog->buffered + APPLOG_HEADER_SIZE, data, length);
+		appLog->buffered += recordSize;
+		if (nowMsecs() - appLog->firstBufferedTime >= appLog->flushInterval) {
+			flush(appLog); // If this fails the record stays buffered.
+		}
+	}
+	if (!ok) {
+		appLog->dropped++;
+		duk_push_false(ctx);
+		return 1;
+	}
+	appLog->records++;
+	appLog->recordBytes += length;
+	duk_push_true(ctx);
+	return 1;
+} // js_applog_append
+
+
+/*
+ * Write any buffered records, close the file and release the log.
+ * [0] - log
+ *
+ * Returns true if all the records were written.
+ */
+static duk_ret_t js_applog_close(duk_context *ctx) {
+	dukf_applog_t *appLog = getAppLog(ctx, 0);
+	if (appLog == NULL) {
+		return 0;
+	}
+	bool ok = flush(appLog);
+	if (!ok) {
+		LOGE("js_applog_close: %d bytes of records of %s could not be written", (int)appLog->buffered, appLog->path);
+	}
+	if (appLog->fd >= 0) {
+		close(appLog->fd);
+	}
+	appLog->magic = 0;
+	free(appLog->buffer);
+	free(appLog);
+	duk_push_boolean(ctx, ok);
+	return 1;
+} // js_applog_close
+
+
+/*
+ * Write any buffered records now.
+ * [0] - log
+ *
+ * Returns true if the records were written.
+ */
+static duk_ret_t js_applog_flush(duk_context *ctx) {
+	dukf_applog_t *appLog = getAppLog(ctx, 0);
+	if (appLog == NULL) {
+		return 0;
+	}
+	duk_push_boolean(ctx, flush(appLog));
+	return 1;
+} // js_applog_flush
+
+
+/*
+ * Open a log.
+ * [0] - path
+ * [1] - options [optional]
+ * {
+ *    bufferSize: <Bytes buffered before a write> [default 4096]
+ *    flushInterval: <Maximum msecs a record is buffered> [default 1000]
+ *    maxFileSize: <Size at which the file is rotated> [default 64K]
+ *    maxFiles: <Number of files kept including the current one> [default 4]
+ *    sync: <fsync() after each write> [default true]
+ * }
+ *
+ * Returns the log or undefined if it can't be opened.
+ */
+static duk_ret_t js_applog_open(duk_context *ctx) {
+	const char *path = duk_require_string(ctx, 0);
+	LOGD(">> js_applog_open: %s", path);
+	if (strlen(path) >= APPLOG_MAX_PATH) {
+		LOGE("js_applog_open: Path too long: %s", path);
+		return 0;
+	}
+	dukf_applog_t *appLog = calloc(1, sizeof(dukf_applog_t));
+	if (appLog == NULL) {
+		LOGE("js_applog_open: out of memory");
+		return 0;
+	}
+	strcpy(appLog->path, path);
+	appLog->bufferSize    = getIntOption(ctx, 1, "bufferSize", APPLOG_DEFAULT_BUFFER_SIZE);
+	appLog->flushInterval = getIntOption(ctx, 1, "flushInterval", APPLOG_DEFAULT_FLUSH_INTERVAL);
+	appLog->maxFileSize   = getIntOption(ctx, 1, "maxFileSize", APPLOG_DEFAULT_MAX_FILE_SIZE);
+	appLog->maxFiles      = getIntOption(ctx, 1, "maxFiles", APPLOG_DEFAULT_MAX_FILES);
+	appLog->sync = true;
+	if (duk_is_object(ctx, 1)) {
+		duk_get_prop_string(ctx, 1, "sync");
+		if (duk_is_boolean(ctx, -1)) {
+			appLog->sync = duk_get_boolean(ctx, -1);
+		}
+		duk_pop(ctx);
+	}
+	appLog->buffer = malloc(appLog->bufferSize);
+	if (appLog->buffer == NULL) {
+		LOGE("js_applog_open: Unable to allocate %d bytes", (int)appLog->bufferSize);
+		free(appLog);
+		return 0;
+	}
+	appLog->magic = APPLOG_MAGIC;
+	appLog->fd = -1;
+
+	// Check that the existing file ends with a whole record.  If it doesn't, we lost
+	// power (or crashed) while writing so we keep its good records by rotating it out.
+	bool torn = false;
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		struct stat statBuf;
+		off_t validLength = scanRecords(fd, NULL);
+		torn = fstat(fd, &statBuf) == 0 && validLength != statBuf.st_size;
+		close(fd);
+		if (torn) {
+			LOGW("js_applog_open: %s has a damaged record after %ld bytes, rotating it", path, (long)validLength);
+			appLog->recoveries++;
+		}
+	}
+	bool ok = torn ? rotate(appLog) : openCurrent(appLog);
+	if (!ok) {
+		free(appLog->buffer);
+		free(appLog);
+		return 0;
+	}
+	duk_push_pointer(ctx, appLog);
+	LOGD("<< js_applog_open");
+	return 1;
+} // js_applog_open
+
+
+/*
+ * Write the buffered records if the oldest has been buffered for flushInterval.  This
+ * is called periodically so that records are written even if no more are appended.
+ * [0] - log
+ */
+static duk_ret_t js_applog_poll(duk_context *ctx) {
+	dukf_applog_t *appLog = getAppLog(ctx, 0);
+	if (appLog != NULL && appLog->buffered > 0 &&
+			nowMsecs() - appLog->firstBufferedTime >= appLog->flushInterval) {
+		flush(appLog);
+	}
+	return 0;
+} // js_applog_poll
+
+
+/*
+ * Read the records of a log file.
+ * [0] - path
+ *
+ * Returns an array of Buffers, one for each record up to the first damaged record.
+ */
+static duk_ret_t js_applog_readRecords(duk_context *ctx) {
+	const char *path = duk_require_string(ctx, 0);
+	duk_push_array(ctx);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		LOGD("js_applog_readRecords: Unable to open %s: %d %s", path, errno, strerror(errno));
+		return 1;
+	}
+	scanRecords(fd, ctx);
+	close(fd);
+	return 1;
+} // js_applog_readRecords
+
+
+/*
+ * Return statistics about a log.
+ * [0] - log
+ *
+ * {
+ *    records: <Records appended>
+ *    recordBytes: <Bytes of record data appended>
+ *    fileBytes: <Bytes written to files including record headers>
+ *    writes: <Number of write() calls>
+ *    flushes: <Number of group commits>
+ *    rotations: <Number of times the file was rotated>
+ *    recoveries: <Number of damaged files found when opening>
+ *    writeErrors: <Number of failed writes>
+ *    dropped: <Records refused because failed writes left no room in the buffer>
+ *    buffered: <Bytes waiting to be written>
+ * }
+ */
+static duk_ret_t js_applog_stats(duk_context *ctx) {
+	dukf_applog_t *appLog = getAppLog(ctx, 0);
+	if (appLog == NULL) {
+		return 0;
+	}
+	duk_push_object(ctx);
+	duk_push_number(ctx, appLog->records);
+	duk_put_prop_string(ctx, -2, "records");
+	duk_push_number(ctx, appLog->recordBytes);
+	duk_put_prop_string(ctx, -2, "recordBytes");
+	duk_push_number(ctx, appLog->fileBytes);
+	duk_put_prop_string(ctx, -2, "fileBytes");
+	duk_push_number(ctx, appLog->writes);
+	duk_put_prop_string(ctx, -2, "writes");
+	duk_push_number(ctx, appLog->flushes);
+	duk_put_prop_string(ctx, -2, "flushes");
+	duk_push_number(ctx, appLog->rotations);
+	duk_put_prop_string(ctx, -2, "rotations");
+	duk_push_number(ctx, appLog->recoveries);
+	duk_put_prop_string(ctx, -2, "recoveries");
+	duk_push_number(ctx, appLog->writeErrors);
+	duk_put_prop_string(ctx, -2, "writeErrors");
+	duk_push_number(ctx, appLog->dropped);
+	duk_put_prop_string(ctx, -2, "dropped");
+	duk_push_number(ctx, appLog->buffered);
+	duk_put_prop_string(ctx, -2, "buffered");
+	return 1;
+} // js_applog_stats
+
+
+/**
+ * Add native methods to the AppLog object.
+ * [0] - AppLog Object
+ */
+duk_ret_t ModuleAppLog(duk_context *ctx) {
+	ADD_INT("HEADER_SIZE", APPLOG_HEADER_SIZE);
+	ADD_FUNCTION("append",      js_applog_append,      2);
+	ADD_FUNCTION("close",       js_applog_close,       1);
+	ADD_FUNCTION("flush",       js_applog_flush,       1);
+	ADD_FUNCTION("open",        js_applog_open,        2);
+	ADD_FUNCTION("poll",        js_applog_poll,        1);
+	ADD_FUNCTION("readRecords", js_applog_readRecords, 1);
+	ADD_FUNCTION("stats",       js_applog_stats,       1);
+	return 0;
+} // ModuleAppLog
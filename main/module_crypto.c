@@ -0,0 +1,691 @@
+/*
+ * Streaming cryptography.
+ *
+ * Message digests (SHA-1, SHA-256 and their HMACs) and AES ciphers (CBC, CTR
+ * and GCM) are exposed as contexts that are created, fed data in as many
+ * pieces as needed and then finalized.  This means that large payloads such as
+ * firmware images or uploads never need to be held in RAM at once.
+ *
+ * On the ESP32 the work is done by mbedTLS which is configured to use the
+ * hardware AES and SHA engines.  On Linux it is done by OpenSSL (libcrypto).
+ *
+ * The functions exposed are:
+ * * cipherFinal
+ * * cipherGetTag
+ * * cipherInit
+ * * cipherUpdate
+ * * free
+ * * hashFinal
+ * * hashInit
+ * * hashUpdate
+ *
+ * A context is a pointer which must be released with free() once it is no
+ * longer needed, whether or not it was finalized.
+ */
+#if defined(ESP_PLATFORM)
+#include <mbedtls/aes.h>
+#include <mbedtls/gcm.h>
+#include <mbedtls/md.h>
+
+#include "sdkconfig.h"
+#else /* ESP_PLATFORM */
+#include <openssl/evp.h>
+#endif /* ESP_PLATFORM */
+
+#include <duktape.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "duktape_utils.h"
+#include "logging.h"
+#include "module_crypto.h"
+
+LOG_TAG("module_crypto");
+
+#define CRYPTO_AES_BLOCK_SIZE (16)
+#define CRYPTO_GCM_TAG_SIZE   (16)
+#define CRYPTO_MAX_DIGEST     (32)
+
+// Values identifying the kind of context behind a pointer passed in from JavaScript.
+#define CRYPTO_HASH_MAGIC   (0x48415348) // "HASH"
+#define CRYPTO_CIPHER_MAGIC (0x43495048) // "CIPH"
+
+typedef struct {
+	uint32_t magic;
+	size_t   digestSize;
+#if defined(ESP_PLATFORM)
+	mbedtls_md_context_t md;
+	bool                 hmac;
+#else
+	EVP_MD_CTX          *md;
+	EVP_PKEY            *key; // The HMAC key (NULL for a plain digest).
+#endif
+} dukf_crypto_hash_t;
+
+typedef enum {
+	CRYPTO_AES_CBC,
+	CRYPTO_AES_CTR,
+	CRYPTO_AES_GCM
+} dukf_crypto_mode_t;
+
+typedef struct {
+	uint32_t           magic;
+	dukf_crypto_mode_t mode;
+	bool               encrypt;
+	bool               finished;
+	uint8_t            tag[CRYPTO_GCM_TAG_SIZE]; // GCM: the computed (encrypt) or expected (decrypt) tag.
+	bool               tagSet;
+#if defined(ESP_PLATFORM)
+	mbedtls_aes_context aes;
+	mbedtls_gcm_context gcm;
+	uint8_t            iv[CRYPTO_AES_BLOCK_SIZE];          // CBC chaining value or CTR counter.
+	uint8_t            streamBlock[CRYPTO_AES_BLOCK_SIZE]; // CTR key stream.
+	size_t             streamOffset;
+	uint8_t            pending[CRYPTO_AES_BLOCK_SIZE];     // A partial (or held back) block.
+	size_t             pendingLength;
+#else
+	EVP_CIPHER_CTX    *cipher;
+#endif
+} dukf_crypto_cipher_t;
+
+
+/**
+ * Get the data of a string or buffer value.
+ */
+static const uint8_t *getData(duk_context *ctx, duk_idx_t idx, size_t *length) {
+	if (duk_is_string(ctx, idx)) {
+		duk_size_t stringLength;
+		const char *data = duk_get_lstring(ctx, idx, &stringLength);
+		*length = stringLength;
+		return (const uint8_t *)data;
+	}
+	if (duk_is_buffer_data(ctx, idx)) {
+		duk_size_t bufferSize;
+		uint8_t *data = duk_get_buffer_data(ctx, idx, &bufferSize);
+		*length = bufferSize;
+		return data;
+	}
+	*length = 0;
+	return NULL;
+} // getData
+
+
+/**
+ * Push a NodeJS Buffer holding a copy of length bytes of data.
+ */
+static void pushBuffer(duk_context *ctx, const uint8_t *data, size_t length) {
+	void *buffer = duk_push_fixed_buffer(ctx, length);
+	memcpy(buffer, data, length);
+	duk_push_buffer_object(ctx, -1, 0, length, DUK_BUFOBJ_NODEJS_BUFFER);
+	duk_remove(ctx, -2);
+} // pushBuffer
+
+
+/**
+ * Get the hash context at idx or NULL if it isn't one.
+ */
+static dukf_crypto_hash_t *getHash(duk_context *ctx, duk_idx_t idx) {
+	dukf_crypto_hash_t *hash = duk_get_pointer(ctx, idx);
+	if (hash == NULL || hash->magic != CRYPTO_HASH_MAGIC) {
+		LOGE("Not a hash context");
+		return NULL;
+	}
+	return hash;
+} // getHash
+
+
+/**
+ * Get the cipher context at idx or NULL if it isn't one.
+ */
+static dukf_crypto_cipher_t *getCipher(duk_context *ctx, duk_idx_t idx) {
+	dukf_crypto_cipher_t *cipher = duk_get_pointer(ctx, idx);
+	if (cipher == NULL || cipher->magic != CRYPTO_CIPHER_MAGIC) {
+		LOGE("Not a cipher context");
+		return NULL;
+	}
+	return cipher;
+} // getCipher
+
+
+/**
+ * Release the native resources of a hash context.
+ */
+static void freeHash(dukf_crypto_hash_t *hash) {
+#if defined(ESP_PLATFORM)
+	mbedtls_md_free(&hash->md);
+#else
+	EVP_MD_CTX_free(hash->md);
+	EVP_PKEY_free(hash->key);
+#endif
+	hash->magic = 0;
+	free(hash);
+} // freeHash
+
+
+/**
+ * Release the native resources of a cipher context.
+ */
+static void freeCipher(dukf_crypto_cipher_t *cipher) {
+#if defined(ESP_PLATFORM)
+	mbedtls_aes_free(&cipher->aes);
+	mbedtls_gcm_free(&cipher->gcm);
+#else
+	EVP_CIPHER_CTX_free(cipher->cipher);
+#endif
+	memset(cipher, 0, sizeof(*cipher)); // Don't leave keys lying around in the heap.
+	free(cipher);
+} // freeCipher
+
+
+/*
+ * Create a hash context.
+ *
+ * [0] - algorithm - "sha1" or "sha256"
+ * [1] - key - Optional.  If supplied (string or buffer) the context computes an
+ *   HMAC with this key.
+ *
+ * Return:
+ * A context pointer or undefined on error.
+ */
+static duk_ret_t js_crypto_hashInit(duk_context *ctx) {
+	LOGD(">> js_crypto_hashInit");
+	const char *algorithm = duk_get_string(ctx, 0);
+	size_t keyLength = 0;
+	const uint8_t *key = NULL;
+	int rc;
+
+	if (algorithm == NULL) {
+		LOGE("<< js_crypto_hashInit: no algorithm");
+		return 0;
+	}
+	if (!duk_is_undefined(ctx, 1) && !duk_is_null(ctx, 1)) {
+		key = getData(ctx, 1, &keyLength);
+		if (key == NULL) {
+			LOGE("<< js_crypto_hashInit: key must be a string or buffer");
+			return 0;
+		}
+	}
+
+	dukf_crypto_hash_t *hash = calloc(1, sizeof(dukf_crypto_hash_t));
+	if (hash == NULL) {
+		LOGE("<< js_crypto_hashInit: out of memory");
+		return 0;
+	}
+
+#if defined(ESP_PLATFORM)
+	const mbedtls_md_info_t *info;
+	if (strcmp(algorithm, "sha1") == 0) {
+		info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA1);
+	} else if (strcmp(algorithm, "sha256") == 0) {
+		info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+	} else {
+		info = NULL;
+	}
+	mbedtls_md_init(&hash->md);
+	if (info == NULL) {
+		LOGE("<< js_crypto_hashInit: unknown algorithm %s", algorithm);
+		freeHash(hash);
+		return 0;
+	}
+	hash->hmac = (key != NULL);
+	rc = mbedtls_md_setup(&hash->md, info, hash->hmac);
+	if (rc == 0) {
+		rc = hash->hmac ? mbedtls_md_hmac_starts(&hash->md, key, keyLength) : mbedtls_md_starts(&hash->md);
+	}
+	hash->digestSize = mbedtls_md_get_size(info);
+	rc = (rc == 0);
+#else /* ESP_PLATFORM */
+	const EVP_MD *md;
+	if (strcmp(algorithm, "sha1") == 0) {
+		md = EVP_sha1();
+	} else if (strcmp(algorithm, "sha256") == 0) {
+		md = EVP_sha256();
+	} else {
+		LOGE("<< js_crypto_hashInit: unknown algorithm %s", algorithm);
+		free(hash);
+		return 0;
+	}
+	hash->md = EVP_MD_CTX_new();
+	if (key != NULL) {
+		hash->key = EVP_PKEY_new_mac_key(EVP_PKEY_HMAC, NULL, key, keyLength);
+		rc = hash->md != NULL && hash->key != NULL && EVP_DigestSignInit(hash->md, NULL, md, NULL, hash->key) == 1;
+	} else {
+		rc = hash->md != NULL && EVP_DigestInit_ex(hash->md, md, NULL) == 1;
+	}
+	hash->digestSize = EVP_MD_size(md);
+#endif /* ESP_PLATFORM */
+
+	if (!rc) {
+		LOGE("<< js_crypto_hashInit: unable to initialize %s", algorithm);
+		freeHash(hash);
+		return 0;
+	}
+	hash->magic = CRYPTO_HASH_MAGIC;
+	duk_push_pointer(ctx, hash);
+	LOGD("<< js_crypto_hashInit");
+	return 1;
+} // js_crypto_hashInit
+
+
+/*
+ * Add data to a hash.
+ *
+ * [0] - context
+ * [1] - data - string or buffer
+ */
+static duk_ret_t js_crypto_hashUpdate(duk_context *ctx) {
+	dukf_crypto_hash_t *hash = getHash(ctx, 0);
+	size_t length;
+	const uint8_t *data = getData(ctx, 1, &length);
+	if (hash == NULL || data == NULL) {
+		LOGE("js_crypto_hashUpdate: usage hashUpdate(context, data)");
+		return 0;
+	}
+#if defined(ESP_PLATFORM)
+	if (hash->hmac) {
+		mbedtls_md_hmac_update(&hash->md, data, length);
+	} else {
+		mbedtls_md_update(&hash->md, data, length);
+	}
+#else
+	if (hash->key != NULL) {
+		EVP_DigestSignUpdate(hash->md, data, length);
+	} else {
+		EVP_DigestUpdate(hash->md, data, length);
+	}
+#endif
+	return 0;
+} // js_crypto_hashUpdate
+
+
+/*
+ * Finish a hash.
+ *
+ * [0] - context
+ *
+ * Return:
+ * A buffer holding the digest.
+ */
+static duk_ret_t js_crypto_hashFinal(duk_context *ctx) {
+	dukf_crypto_hash_t *hash = getHash(ctx, 0);
+	uint8_t digest[CRYPTO_MAX_DIGEST];
+	if (hash == NULL) {
+		return 0;
+	}
+#if defined(ESP_PLATFORM)
+	if (hash->hmac) {
+		mbedtls_md_hmac_finish(&hash->md, digest);
+	} else {
+		mbedtls_md_finish(&hash->md, digest);
+	}
+#else
+	if (hash->key != NULL) {
+		size_t digestLength = sizeof(digest);
+		EVP_DigestSignFinal(hash->md, digest, &digestLength);
+	} else {
+		EVP_DigestFinal_ex(hash->md, digest, NULL);
+	}
+#endif
+	pushBuffer(ctx, digest, hash->digestSize);
+	return 1;
+} // js_crypto_hashFinal
+
+
+/*
+ * Create a cipher context.
+ *
+ * [0] - algorithm - "aes-cbc", "aes-ctr" or "aes-gcm".  The key size (128, 192 or
+ *   256 bits) is taken from the length of the key.
+ * [1] - encrypt - true to encrypt, false to decrypt.
+ * [2] - key - buffer of 16, 24 or 32 bytes.
+ * [3] - iv - buffer.  16 bytes for CBC and CTR (the initial counter block), any
+ *   length (12 recommended) for GCM.
+ * [4] - aad - Optional.  GCM additional authenticated data.
+ *
+ * CBC uses PKCS#7 padding.
+ *
+ * Return:
+ * A context pointer or undefined on error.
+ */
+static duk_ret_t js_crypto_cipherInit(duk_context *ctx) {
+	LOGD(">> js_crypto_cipherInit");
+	const char *algorithm = duk_get_string(ctx, 0);
+	bool encrypt = duk_get_boolean(ctx, 1);
+	size_t keyLength, ivLength, aadLength = 0;
+	const uint8_t *key = getData(ctx, 2, &keyLength);
+	const uint8_t *iv  = getData(ctx, 3, &ivLength);
+	const uint8_t *aad = getData(ctx, 4, &aadLength);
+	dukf_crypto_mode_t mode;
+	int rc;
+
+	if (algorithm == NULL || key == NULL || iv == NULL) {
+		LOGE("<< js_crypto_cipherInit: usage cipherInit(algorithm, encrypt, key, iv[, aad])");
+		return 0;
+	}
+	if (strcmp(algorithm, "aes-cbc") == 0) {
+		mode = CRYPTO_AES_CBC;
+	} else if (strcmp(algorithm, "aes-ctr") == 0) {
+		mode = CRYPTO_AES_CTR;
+	} else if (strcmp(algorithm, "aes-gcm") == 0) {
+		mode = CRYPTO_AES_GCM;
+	} else {
+		LOGE("<< js_crypto_cipherInit: unknown algorithm %s", algorithm);
+		return 0;
+	}
+	if (keyLength != 16 && keyLength != 24 && keyLength != 32) {
+		LOGE("<< js_crypto_cipherInit: key must be 16, 24 or 32 bytes");
+		return 0;
+	}
+	if (mode != CRYPTO_AES_GCM && ivLength != CRYPTO_AES_BLOCK_SIZE) {
+		LOGE("<< js_crypto_cipherInit: iv must be %d bytes", CRYPTO_AES_BLOCK_SIZE);
+		return 0;
+	}
+	if (mode == CRYPTO_AES_GCM && ivLength == 0) {
+		LOGE("<< js_crypto_cipherInit: iv must not be empty");
+		return 0;
+	}
+
+	dukf_crypto_cipher_t *cipher = calloc(1, sizeof(dukf_crypto_cipher_t));
+	if (cipher == NULL) {
+		LOGE("<< js_crypto_cipherInit: out of memory");
+		return 0;
+	}
+	cipher->mode    = mode;
+	cipher->encrypt = encrypt;
+
+#if defined(ESP_PLATFORM)
+	mbedtls_aes_init(&cipher->aes);
+	mbedtls_gcm_init(&cipher->gcm);
+	switch(mode) {
+		case CRYPTO_AES_CBC:
+			rc = encrypt ?
+				mbedtls_aes_setkey_enc(&cipher->aes, key, keyLength * 8) :
+				mbedtls_aes_setkey_dec(&cipher->aes, key, keyLength * 8);
+			memcpy(cipher->iv, iv, CRYPTO_AES_BLOCK_SIZE);
+			break;
+		case CRYPTO_AES_CTR:
+			// CTR always runs the block cipher forwards.
+			rc = mbedtls_aes_setkey_enc(&cipher->aes, key, keyLength * 8);
+			memcpy(cipher->iv, iv, CRYPTO_AES_BLOCK_SIZE);
+			break;
+		default:
+			rc = mbedtls_gcm_setkey(&cipher->gcm, MBEDTLS_CIPHER_ID_AES, key, keyLength * 8);
+			if (rc == 0) {
+				rc = mbedtls_gcm_starts(&cipher->gcm, encrypt ? MBEDTLS_GCM_ENCRYPT : MBEDTLS_GCM_DECRYPT,
+					iv, ivLength, aad, aadLength);
+			}
+			break;
+	}
+	rc = (rc == 0);
+#else /* ESP_PLATFORM */
+	const EVP_CIPHER *type;
+	switch(mode) {
+		case CRYPTO_AES_CBC:
+			type = keyLength == 16 ? EVP_aes_128_cbc() : (keyLength == 24 ? EVP_aes_192_cbc() : EVP_aes_256_cbc());
+			break;
+		case CRYPTO_AES_CTR:
+			type = keyLength == 16 ? EVP_aes_128_ctr() : (keyLength == 24 ? EVP_aes_192_ctr() : EVP_aes_256_ctr());
+			break;
+		default:
+			type = keyLength == 16 ? EVP_aes_128_gcm() : (keyLength == 24 ? EVP_aes_192_gcm() : EVP_aes_256_gcm());
+			break;
+	}
+	cipher->cipher = EVP_CIPHER_CTX_new();
+	rc = cipher->cipher != NULL && EVP_CipherInit_ex(cipher->cipher, type, NULL, NULL, NULL, encrypt) == 1;
+	if (rc && mode == CRYPTO_AES_GCM) {
+		rc = EVP_CIPHER_CTX_ctrl(cipher->cipher, EVP_CTRL_GCM_SET_IVLEN, ivLength, NULL) == 1;
+	}
+	if (rc) {
+		rc = EVP_CipherInit_ex(cipher->cipher, NULL, NULL, key, iv, encrypt) == 1;
+	}
+	if (rc && mode == CRYPTO_AES_GCM && aad != NULL && aadLength > 0) {
+		int outLength;
+		rc = EVP_CipherUpdate(cipher->cipher, NULL, &outLength, aad, aadLength) == 1;
+	}
+#endif /* ESP_PLATFORM */
+
+	if (!rc) {
+		LOGE("<< js_crypto_cipherInit: unable to initialize %s", algorithm);
+		freeCipher(cipher);
+		return 0;
+	}
+	cipher->magic = CRYPTO_CIPHER_MAGIC;
+	duk_push_pointer(ctx, cipher);
+	LOGD("<< js_crypto_cipherInit");
+	return 1;
+} // js_crypto_cipherInit
+
+
+#if defined(ESP_PLATFORM)
+/**
+ * Run the block modes (CBC and GCM) over whole blocks.  The bytes that don't make
+ * up a whole block are kept until more data (or the end) arrives.  When
+ * decrypting CBC the last whole block is also kept as it may hold the padding.
+ * Returns the number of bytes written to output which must have room for
+ * length + CRYPTO_AES_BLOCK_SIZE bytes.
+ */
+static size_t cipherBlocks(dukf_crypto_cipher_t *cipher, const uint8_t *input, size_t length, uint8_t *output) {
+	size_t total = cipher->pendingLength + length;
+	size_t processLength = total - total % CRYPTO_AES_BLOCK_SIZE;
+	if (cipher->mode == CRYPTO_AES_CBC && !cipher->encrypt && processLength == total && processLength > 0) {
+		processLength -= CRYPTO_AES_BLOCK_SIZE;
+	}
+	if (processLength == 0) {
+		memcpy(cipher->pending + cipher->pendingLength, input, length);
+		cipher->pendingLength += length;
+		return 0;
+	}
+
+	// Gather the blocks to process in the output and transform them in place.
+	size_t fromInput = processLength - cipher->pendingLength;
+	memcpy(output, cipher->pending, cipher->pendingLength);
+	memcpy(output + cipher->pendingLength, input, fromInput);
+	if (cipher->mode == CRYPTO_AES_CBC) {
+		mbedtls_aes_crypt_cbc(&cipher->aes, cipher->encrypt ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT,
+			processLength, cipher->iv, output, output);
+	} else {
+		mbedtls_gcm_update(&cipher->gcm, processLength, output, output);
+	}
+	cipher->pendingLength = length - fromInput;
+	memcpy(cipher->pending, input + fromInput, cipher->pendingLength);
+	return processLength;
+} // cipherBlocks
+#endif /* ESP_PLATFORM */
+
+
+/*
+ * Add data to a cipher.
+ *
+ * [0] - context
+ * [1] - data - string or buffer
+ *
+ * Return:
+ * A buffer with the output produced so far.  It may be shorter than the input
+ * as the block modes hold back partial blocks.
+ */
+static duk_ret_t js_crypto_cipherUpdate(duk_context *ctx) {
+	dukf_crypto_cipher_t *cipher = getCipher(ctx, 0);
+	size_t length;
+	size_t outLength = 0;
+	const uint8_t *data = getData(ctx, 1, &length);
+	if (cipher == NULL || data == NULL || cipher->finished) {
+		LOGE("js_crypto_cipherUpdate: usage cipherUpdate(context, data) before cipherFinal");
+		return 0;
+	}
+
+	uint8_t *output = duk_push_fixed_buffer(ctx, length + CRYPTO_AES_BLOCK_SIZE);
+#if defined(ESP_PLATFORM)
+	if (cipher->mode == CRYPTO_AES_CTR) {
+		mbedtls_aes_crypt_ctr(&cipher->aes, length, &cipher->streamOffset, cipher->iv, cipher->streamBlock, data, output);
+		outLength = length;
+	} else {
+		outLength = cipherBlocks(cipher, data, length, output);
+	}
+#else
+	int written = 0;
+	EVP_CipherUpdate(cipher->cipher, output, &written, data, length);
+	outLength = written;
+#endif
+	duk_push_buffer_object(ctx, -1, 0, outLength, DUK_BUFOBJ_NODEJS_BUFFER);
+	duk_remove(ctx, -2);
+	return 1;
+} // js_crypto_cipherUpdate
+
+
+/*
+ * Finish a cipher.
+ *
+ * [0] - context
+ * [1] - tag - GCM decryption only.  The expected authentication tag.
+ *
+ * Return:
+ * A buffer with the remaining output, or null if decryption failed (bad
+ * padding or the GCM tag didn't match).  When GCM decryption fails, the output
+ * already returned by cipherUpdate must be discarded.
+ */
+static duk_ret_t js_crypto_cipherFinal(duk_context *ctx) {
+	dukf_crypto_cipher_t *cipher = getCipher(ctx, 0);
+	uint8_t output[CRYPTO_AES_BLOCK_SIZE * 2];
+	size_t outLength = 0;
+	bool ok = true;
+
+	if (cipher == NULL || cipher->finished) {
+		LOGE("js_crypto_cipherFinal: not an unfinished cipher context");
+		return 0;
+	}
+	cipher->finished = true;
+	if (cipher->mode == CRYPTO_AES_GCM && !cipher->encrypt) {
+		size_t tagLength;
+		const uint8_t *expectedTag = getData(ctx, 1, &tagLength);
+		if (expectedTag == NULL || tagLength != CRYPTO_GCM_TAG_SIZE) {
+			LOGE("js_crypto_cipherFinal: a %d byte tag is required", CRYPTO_GCM_TAG_SIZE);
+			duk_push_null(ctx);
+			return 1;
+		}
+		memcpy(cipher->tag, expectedTag, CRYPTO_GCM_TAG_SIZE);
+	}
+
+#if defined(ESP_PLATFORM)
+	switch(cipher->mode) {
+		case CRYPTO_AES_CBC:
+			if (cipher->encrypt) {
+				uint8_t pad = CRYPTO_AES_BLOCK_SIZE - cipher->pendingLength;
+				memset(cipher->pending + cipher->pendingLength, pad, pad);
+				mbedtls_aes_crypt_cbc(&cipher->aes, MBEDTLS_AES_ENCRYPT, CRYPTO_AES_BLOCK_SIZE, cipher->iv, cipher->pending, output);
+				outLength = CRYPTO_AES_BLOCK_SIZE;
+			} else if (cipher->pendingLength != CRYPTO_AES_BLOCK_SIZE) {
+				ok = false;
+			} else {
+				mbedtls_aes_crypt_cbc(&cipher->aes, MBEDTLS_AES_DECRYPT, CRYPTO_AES_BLOCK_SIZE, cipher->iv, cipher->pending, output);
+				uint8_t pad = output[CRYPTO_AES_BLOCK_SIZE - 1];
+				int i;
+				ok = pad >= 1 && pad <= CRYPTO_AES_BLOCK_SIZE;
+				for (i=0; ok && i<pad; i++) {
+					ok = output[CRYPTO_AES_BLOCK_SIZE - 1 - i] == pad;
+				}
+				outLength = ok ? CRYPTO_AES_BLOCK_SIZE - pad : 0;
+			}
+			break;
+		case CRYPTO_AES_GCM: {
+			uint8_t computedTag[CRYPTO_GCM_TAG_SIZE];
+			mbedtls_gcm_update(&cipher->gcm, cipher->pendingLength, cipher->pending, output);
+			outLength = cipher->pendingLength;
+			mbedtls_gcm_finish(&cipher->gcm, computedTag, CRYPTO_GCM_TAG_SIZE);
+			if (cipher->encrypt) {
+				memcpy(cipher->tag, computedTag, CRYPTO_GCM_TAG_SIZE);
+				cipher->tagSet = true;
+			} else {
+				// Compare in constant time.
+				uint8_t diff = 0;
+				int i;
+				for (i=0; i<CRYPTO_GCM_TAG_SIZE; i++) {
+					diff |= computedTag[i] ^ cipher->tag[i];
+				}
+				ok = (diff == 0);
+			}
+			break;
+		}
+		default:
+			break;
+	}
+	cipher->pendingLength = 0;
+#else /* ESP_PLATFORM */
+	int written = 0;
+	if (cipher->mode == CRYPTO_AES_GCM && !cipher->encrypt) {
+		EVP_CIPHER_CTX_ctrl(cipher->cipher, EVP_CTRL_GCM_SET_TAG, CRYPTO_GCM_TAG_SIZE, cipher->tag);
+	}
+	ok = EVP_CipherFinal_ex(cipher->cipher, output, &written) == 1;
+	outLength = ok ? written : 0;
+	if (ok && cipher->mode == CRYPTO_AES_GCM && cipher->encrypt) {
+		EVP_CIPHER_CTX_ctrl(cipher->cipher, EVP_CTRL_GCM_GET_TAG, CRYPTO_GCM_TAG_SIZE, cipher->tag);
+		cipher->tagSet = true;
+	}
+#endif /* ESP_PLATFORM */
+
+	if (!ok) {
+		LOGD("js_crypto_cipherFinal: decryption failed");
+		duk_push_null(ctx);
+		return 1;
+	}
+	pushBuffer(ctx, output, outLength);
+	return 1;
+} // js_crypto_cipherFinal
+
+
+/*
+ * Get the authentication tag of a finished GCM encryption.
+ *
+ * [0] - context
+ *
+ * Return:
+ * A 16 byte buffer or undefined if there is no tag.
+ */
+static duk_ret_t js_crypto_cipherGetTag(duk_context *ctx) {
+	dukf_crypto_cipher_t *cipher = getCipher(ctx, 0);
+	if (cipher == NULL || !cipher->tagSet) {
+		LOGE("js_crypto_cipherGetTag: no tag available");
+		return 0;
+	}
+	pushBuffer(ctx, cipher->tag, CRYPTO_GCM_TAG_SIZE);
+	return 1;
+} // js_crypto_cipherGetTag
+
+
+/*
+ * Release a hash or cipher context.
+ *
+ * [0] - context
+ */
+static duk_ret_t js_crypto_free(duk_context *ctx) {
+	uint32_t *magic = duk_get_pointer(ctx, 0);
+	if (magic == NULL) {
+		return 0;
+	}
+	if (*magic == CRYPTO_HASH_MAGIC) {
+		freeHash((dukf_crypto_hash_t *)magic);
+	} else if (*magic == CRYPTO_CIPHER_MAGIC) {
+		freeCipher((dukf_crypto_cipher_t *)magic);
+	} else {
+		LOGE("js_crypto_free: not a crypto context");
+	}
+	return 0;
+} // js_crypto_free
+
+
+/**
+ * Add native methods to the Crypto object.
+ * [0] - Crypto Object
+ */
+duk_ret_t ModuleCrypto(duk_context *ctx) {
+	ADD_FUNCTION("cipherFinal",  js_crypto_cipherFinal,  2);
+	ADD_FUNCTION("cipherGetTag", js_crypto_cipherGetTag, 1);
+	ADD_FUNCTION("cipherInit",   js_crypto_cipherInit,   5);
+	ADD_FUNCTION("cipherUpdate", js_crypto_cipherUpdate, 2);
+	ADD_FUNCTION("free",         js_crypto_free,         1);
+	ADD_FUNCTION("hashFinal",    js_crypto_hashFinal,    1);
+	ADD_FUNCTION("hashInit",     js_crypto_hashInit,     2);
+	ADD_FUNCTION("hashUpdate",   js_crypto_hashUpdate,   2);
+	return 0;
+} // ModuleCrypto
@@ -0,0 +1,564 @@
+/*
+ * UDP datagram sockets.
+ *
+ * The sockets are non-blocking and are serviced by the event loop.  When the loop sees
+ * that a socket is readable, receive() takes every datagram that is waiting (up to a
+ * limit) in one call.  When we have datagrams to send, send() hands over as many as
+ * the network stack will take.
+ *
+ * On Linux the datagrams are moved in batches with recvmmsg() and sendmmsg() so that
+ * a burst costs one system call rather than one per datagram.  lwIP has no batched
+ * calls so on the ESP32 we loop on recvfrom() and sendto() until the socket would
+ * block.
+ *
+ * Datagrams are received into a pool of buffers that is allocated once and reused
+ * for every receive.  Each datagram is then copied into a Buffer of its exact size.
+ * A datagram larger than DGRAM_BUFFER_SIZE is truncated and counted.
+ *
+ * The functions exposed are:
+ * * addMembership
+ * * bind
+ * * close
+ * * create
+ * * dropMembership
+ * * localPort
+ * * receive
+ * * send
+ * * setBroadcast
+ * * setMulticastLoopback
+ * * setMulticastTTL
+ * * stats
+ */
+#if defined(ESP_PLATFORM)
+#include <lwip/sockets.h>
+#else /* ESP_PLATFORM */
+#define _GNU_SOURCE // For recvmmsg() and sendmmsg().
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif /* ESP_PLATFORM */
+
+#include <duktape.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "duktape_utils.h"
+#include "logging.h"
+#include "module_dgram.h"
+
+LOG_TAG("module_dgram");
+
+// The largest datagram we receive whole.  This is the UDP payload of a full
+// Ethernet frame.
+#define DGRAM_BUFFER_SIZE (1472)
+
+// The number of datagrams moved by one system call.
+#if defined(ESP_PLATFORM)
+#define DGRAM_BATCH (1)
+#else
+#define DGRAM_BATCH (16)
+#endif
+
+// The default limit on the datagrams taken by one receive().
+#define DGRAM_DEFAULT_MAX_RECEIVE (64)
+
+static uint8_t *g_rxPool = NULL; // DGRAM_BATCH buffers of DGRAM_BUFFER_SIZE.
+
+static struct {
+	uint32_t received;  // Datagrams received.
+	uint32_t sent;      // Datagrams sent.
+	uint32_t truncated; // Datagrams received that didn't fit in a buffer.
+	uint32_t sendErrors;
+	uint32_t recvCalls; // System calls made to receive.
+	uint32_t sendCalls; // System calls made to send.
+} g_stats;
+
+
+/*
+ * Allocate the receive pool if we haven't already.
+ */
+static bool dgram_initPool() {
+	if (g_rxPool == NULL) {
+		g_rxPool = malloc(DGRAM_BATCH * DGRAM_BUFFER_SIZE);
+		if (g_rxPool == NULL) {
+			LOGE("dgram_initPool: Unable to allocate %d bytes", DGRAM_BATCH * DGRAM_BUFFER_SIZE);
+			return false;
+		}
+	}
+	return true;
+} // dgram_initPool
+
+
+/*
+ * Fill in an IPv4 socket address.  Returns false if the address isn't a dotted
+ * decimal string.
+ */
+static bool dgram_address(struct sockaddr_in *sockAddr, const char *address, int port) {
+	memset(sockAddr, 0, sizeof(struct sockaddr_in));
+	sockAddr->sin_family = AF_INET;
+	sockAddr->sin_port = htons(port);
+	if (address == NULL) {
+		sockAddr->sin_addr.s_addr = htonl(INADDR_ANY);
+		return true;
+	}
+	return inet_pton(AF_INET, address, &sockAddr->sin_addr) == 1;
+} // dgram_address
+
+
+/*
+ * Push a received datagram as an object containing data, address, port and, if it
+ * was cut short, truncated.
+ */
+static void dgram_pushMessage(duk_context *ctx, const uint8_t *data, size_t length, bool truncated, struct sockaddr_in *from) {
+	char address[INET_ADDRSTRLEN];
+
+	duk_push_object(ctx);
+	void *buffer = duk_push_fixed_buffer(ctx, length);
+	memcpy(buffer, data, length);
+	duk_push_buffer_object(ctx, -1, 0, length, DUK_BUFOBJ_NODEJS_BUFFER);
+	duk_remove(ctx, -2);
+	duk_put_prop_string(ctx, -2, "data");
+	inet_ntop(AF_INET, &from->sin_addr, address, sizeof(address));
+	duk_push_string(ctx, address);
+	duk_put_prop_string(ctx, -2, "address");
+	duk_push_int(ctx, ntohs(from->sin_port));
+	duk_put_prop_string(ctx, -2, "port");
+	if (truncated) {
+		duk_push_true(ctx);
+		duk_put_prop_string(ctx, -2, "truncated");
+		g_stats.truncated++;
+	}
+	g_stats.received++;
+} // dgram_pushMessage
+
+
+/*
+ * Get the data of a datagram to send from the object at idx.  Returns NULL if there
+ * is no data.
+ */
+static const void *dgram_getData(duk_context *ctx, duk_idx_t idx, duk_size_t *length) {
+	const void *data = NULL;
+	if (duk_get_prop_string(ctx, idx, "data")) {
+		if (duk_is_string(ctx, -1)) {
+			data = duk_get_lstring(ctx, -1, length);
+		} else {
+			data = duk_get_buffer_data(ctx, -1, length);
+		}
+	}
+	duk_pop(ctx);
+	return data;
+} // dgram_getData
+
+
+/*
+ * Get the destination of a datagram to send from the object at idx.
+ */
+static bool dgram_getDestination(duk_context *ctx, duk_idx_t idx, struct sockaddr_in *sockAddr) {
+	duk_get_prop_string(ctx, idx, "address");
+	duk_get_prop_string(ctx, idx, "port");
+	bool rc = duk_is_string(ctx, -2) && duk_is_number(ctx, -1) &&
+		dgram_address(sockAddr, duk_get_string(ctx, -2), duk_get_int(ctx, -1));
+	duk_pop_2(ctx);
+	return rc;
+} // dgram_getDestination
+
+
+/*
+ * Set an integer socket option.
+ * [0] - fd
+ * [1] - value
+ */
+static duk_ret_t dgram_setOption(duk_context *ctx, int level, int option) {
+	int fd = duk_get_int(ctx, 0);
+	int value = duk_to_int(ctx, 1);
+#if defined(ESP_PLATFORM)
+	if (option == IP_MULTICAST_TTL || option == IP_MULTICAST_LOOP) {
+		// lwIP takes these as a single byte.
+		uint8_t byteValue = value;
+		duk_push_int(ctx, setsockopt(fd, level, option, &byteValue, sizeof(byteValue)));
+		return 1;
+	}
+#endif
+	duk_push_int(ctx, setsockopt(fd, level, option, &value, sizeof(value)));
+	return 1;
+} // dgram_setOption
+
+
+/*
+ * Join or leave a multicast group.
+ * [0] - fd
+ * [1] - multicast address
+ * [2] - interface address [optional; default any]
+ */
+static duk_ret_t dgram_membership(duk_context *ctx, int option) {
+	struct ip_mreq mreq;
+	int fd = duk_get_int(ctx, 0);
+	const char *group = duk_get_string(ctx, 1);
+	const char *interface = duk_get_string(ctx, 2);
+
+	memset(&mreq, 0, sizeof(mreq));
+	if (group == NULL || inet_pton(AF_INET, group, &mreq.imr_multiaddr) != 1) {
+		LOGE("dgram_membership: Bad multicast address");
+		return DUK_RET_TYPE_ERROR;
+	}
+	if (interface == NULL) {
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	} else if (inet_pton(AF_INET, interface, &mreq.imr_interface) != 1) {
+		LOGE("dgram_membership: Bad interface address");
+		return DUK_RET_TYPE_ERROR;
+	}
+	int rc = setsockopt(fd, IPPROTO_IP, option, &mreq, sizeof(mreq));
+	if (rc != 0) {
+		LOGE("dgram_membership: %d - %s", errno, strerror(errno));
+	}
+	duk_push_int(ctx, rc);
+	return 1;
+} // dgram_membership
+
+
+/*
+ * Join a multicast group.
+ * [0] - fd
+ * [1] - multicast address
+ * [2] - interface address [optional; default any]
+ *
+ * Returns 0 on success.
+ */
+static duk_ret_t js_dgram_addMembership(duk_context *ctx) {
+	return dgram_membership(ctx, IP_ADD_MEMBERSHIP);
+} // js_dgram_addMembership
+
+
+/*
+ * Bind the socket to a local port.
+ * [0] - fd
+ * [1] - port - 0 to have one chosen for us
+ * [2] - address [optional; default any]
+ *
+ * Returns 0 on success.
+ */
+static duk_ret_t js_dgram_bind(duk_context *ctx) {
+	struct sockaddr_in sockAddr;
+	int fd = duk_get_int(ctx, 0);
+	if (!dgram_address(&sockAddr, duk_get_string(ctx, 2), duk_get_int(ctx, 1))) {
+		LOGE("js_dgram_bind: Bad address");
+		return DUK_RET_TYPE_ERROR;
+	}
+	int rc = bind(fd, (struct sockaddr *)&sockAddr, sizeof(sockAddr));
+	if (rc != 0) {
+		LOGE("js_dgram_bind: %d - %s", errno, strerror(errno));
+	}
+	duk_push_int(ctx, rc);
+	return 1;
+} // js_dgram_bind
+
+
+/*
+ * Close the socket.
+ * [0] - fd
+ */
+static duk_ret_t js_dgram_close(duk_context *ctx) {
+	close(duk_get_int(ctx, 0));
+	return 0;
+} // js_dgram_close
+
+
+/*
+ * Create a non-blocking UDP socket.
+ * [0] - reuseAddr - Allow other sockets to bind the same port [optional; default false]
+ *
+ * Returns the fd or -1 on an error.
+ */
+static duk_ret_t js_dgram_create(duk_context *ctx) {
+	LOGD(">> js_dgram_create");
+	int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0) {
+		LOGE("<< js_dgram_create: %d - %s", errno, strerror(errno));
+		duk_push_int(ctx, -1);
+		return 1;
+	}
+	if (duk_to_boolean(ctx, 0)) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	duk_push_int(ctx, fd);
+	LOGD("<< js_dgram_create: fd=%d", fd);
+	return 1;
+} // js_dgram_create
+
+
+/*
+ * Leave a multicast group.
+ * [0] - fd
+ * [1] - multicast address
+ * [2] - interface address [optional; default any]
+ *
+ * Returns 0 on success.
+ */
+static duk_ret_t js_dgram_dropMembership(duk_context *ctx) {
+	return dgram_membership(ctx, IP_DROP_MEMBERSHIP);
+} // js_dgram_dropMembership
+
+
+/*
+ * Return the local port the socket is bound to.
+ * [0] - fd
+ */
+static duk_ret_t js_dgram_localPort(duk_context *ctx) {
+	struct sockaddr_in sockAddr;
+	socklen_t length = sizeof(sockAddr);
+	if (getsockname(duk_get_int(ctx, 0), (struct sockaddr *)&sockAddr, &length) != 0) {
+		return 0;
+	}
+	duk_push_int(ctx, ntohs(sockAddr.sin_port));
+	return 1;
+} // js_dgram_localPort
+
+
+/*
+ * Receive the datagrams that are waiting.
+ * [0] - fd
+ * [1] - maximum number of datagrams [optional; default 64]
+ *
+ * Returns an array of objects containing:
+ * * data - a Buffer
+ * * address - the sender's address
+ * * port - the sender's port
+ * * truncated - true if the datagram was larger than we could hold
+ * The array is empty if nothing was waiting.
+ */
+static duk_ret_t js_dgram_receive(duk_context *ctx) {
+	int fd = duk_get_int(ctx, 0);
+	int max = DGRAM_DEFAULT_MAX_RECEIVE;
+	if (duk_is_number(ctx, 1) && duk_get_int(ctx, 1) > 0) {
+		max = duk_get_int(ctx, 1);
+	}
+	if (!dgram_initPool()) {
+		return 0;
+	}
+	duk_push_array(ctx);
+	int count = 0;
+	while (count < max) {
+#if defined(ESP_PLATFORM)
+		struct sockaddr_in from;
+		socklen_t fromLength = sizeof(from);
+		g_stats.recvCalls++;
+		int rc = recvfrom(fd, g_rxPool, DGRAM_BUFFER_SIZE, 0, (struct sockaddr *)&from, &fromLength);
+		if (rc < 0) {
+			break;
+		}
+		// lwIP discards what didn't fit without telling us so a full buffer is the best
+		// sign of truncation that we have.
+		dgram_pushMessage(ctx, g_rxPool, rc, rc == DGRAM_BUFFER_SIZE, &from);
+		duk_put_prop_index(ctx, -2, count);
+		count++;
+#else /* ESP_PLATFORM */
+		struct mmsghdr msgs[DGRAM_BATCH];
+		struct iovec iovecs[DGRAM_BATCH];
+		struct sockaddr_in from[DGRAM_BATCH];
+		int batch = max - count;
+		if (batch > DGRAM_BATCH) {
+			batch = DGRAM_BATCH;
+		}
+		memset(msgs, 0, sizeof(msgs));
+		for (int i=0; i<batch; i++) {
+			iovecs[i].iov_base = g_rxPool + i * DGRAM_BUFFER_SIZE;
+			iovecs[i].iov_len = DGRAM_BUFFER_SIZE;
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &from[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		}
+		g_stats.recvCalls++;
+		int rc = recvmmsg(fd, msgs, batch, MSG_DONTWAIT, NULL);
+		if (rc <= 0) {
+			break;
+		}
+		for (int i=0; i<rc; i++) {
+			dgram_pushMessage(ctx, iovecs[i].iov_base, msgs[i].msg_len, (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0, &from[i]);
+			duk_put_prop_index(ctx, -2, count);
+			count++;
+		}
+		if (rc < batch) {
+			break; // Nothing more is waiting.
+		}
+#endif /* ESP_PLATFORM */
+	}
+	return 1;
+} // js_dgram_receive
+
+
+/*
+ * Send datagrams.
+ * [0] - fd
+ * [1] - An array of objects containing:
+ *       * data - a string or Buffer
+ *       * address - the destination address as a dotted decimal string
+ *       * port - the destination port
+ *
+ * Returns an object containing:
+ * * sent - the number of datagrams from the start of the array that were sent.  Stop
+ *   when this is less than the array length and there is no error; the socket is full
+ *   and the rest should be sent when it becomes writable.
+ * * error - If the datagram after those sent could not be sent, why.  That datagram
+ *   should be discarded.
+ */
+static duk_ret_t js_dgram_send(duk_context *ctx) {
+	int fd = duk_get_int(ctx, 0);
+	int length = duk_get_length(ctx, 1);
+	int sent = 0;
+	int error = 0;
+
+	while (sent < length && error == 0) {
+#if defined(ESP_PLATFORM)
+		struct sockaddr_in to;
+		duk_size_t dataLength = 0;
+		duk_get_prop_index(ctx, 1, sent);
+		const void *data = dgram_getData(ctx, -1, &dataLength);
+		bool valid = data != NULL && dgram_getDestination(ctx, -1, &to);
+		duk_pop(ctx);
+		if (!valid) {
+			error = EINVAL;
+			break;
+		}
+		g_stats.sendCalls++;
+		if (sendto(fd, data, dataLength, 0, (struct sockaddr *)&to, sizeof(to)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOMEM) {
+				error = errno;
+			}
+			break;
+		}
+		sent++;
+#else /* ESP_PLATFORM */
+		struct mmsghdr msgs[DGRAM_BATCH];
+		struct iovec iovecs[DGRAM_BATCH];
+		struct sockaddr_in to[DGRAM_BATCH];
+		int batch = 0;
+		memset(msgs, 0, sizeof(msgs));
+		// The data pointers stay valid while the objects are held by the array.
+		while (batch < DGRAM_BATCH && sent + batch < length) {
+			duk_size_t dataLength = 0;
+			duk_get_prop_index(ctx, 1, sent + batch);
+			const void *data = dgram_getData(ctx, -1, &dataLength);
+			bool valid = data != NULL && dgram_getDestination(ctx, -1, &to[batch]);
+			duk_pop(ctx);
+			if (!valid) {
+				break;
+			}
+			iovecs[batch].iov_base = (void *)data;
+			iovecs[batch].iov_len = dataLength;
+			msgs[batch].msg_hdr.msg_iov = &iovecs[batch];
+			msgs[batch].msg_hdr.msg_iovlen = 1;
+			msgs[batch].msg_hdr.msg_name = &to[batch];
+			msgs[batch].msg_hdr.msg_namelen = sizeof(to[batch]);
+			batch++;
+		}
+		if (batch == 0) {
+			error = EINVAL;
+			break;
+		}
+		g_stats.sendCalls++;
+		int rc = sendmmsg(fd, msgs, batch, MSG_DONTWAIT);
+		if (rc < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+				error = errno;
+			}
+			break;
+		}
+		sent += rc;
+		if (rc < batch) {
+			break; // The socket is full (or the next datagram fails, which we'll learn next time).
+		}
+#endif /* ESP_PLATFORM */
+	}
+	g_stats.sent += sent;
+	duk_push_object(ctx);
+	duk_push_int(ctx, sent);
+	duk_put_prop_string(ctx, -2, "sent");
+	if (error != 0) {
+		g_stats.sendErrors++;
+		LOGD("js_dgram_send: %d - %s", error, strerror(error));
+		duk_push_string(ctx, strerror(error));
+		duk_put_prop_string(ctx, -2, "error");
+	}
+	return 1;
+} // js_dgram_send
+
+
+/*
+ * Allow datagrams to be sent to the broadcast address.
+ * [0] - fd
+ * [1] - flag
+ */
+static duk_ret_t js_dgram_setBroadcast(duk_context *ctx) {
+	return dgram_setOption(ctx, SOL_SOCKET, SO_BROADCAST);
+} // js_dgram_setBroadcast
+
+
+/*
+ * Set whether multicast datagrams we send are looped back to us.
+ * [0] - fd
+ * [1] - flag
+ */
+static duk_ret_t js_dgram_setMulticastLoopback(duk_context *ctx) {
+	return dgram_setOption(ctx, IPPROTO_IP, IP_MULTICAST_LOOP);
+} // js_dgram_setMulticastLoopback
+
+
+/*
+ * Set the number of hops multicast datagrams we send may take.
+ * [0] - fd
+ * [1] - ttl
+ */
+static duk_ret_t js_dgram_setMulticastTTL(duk_context *ctx) {
+	return dgram_setOption(ctx, IPPROTO_IP, IP_MULTICAST_TTL);
+} // js_dgram_setMulticastTTL
+
+
+/*
+ * Return the counts of datagrams and system calls.
+ */
+static duk_ret_t js_dgram_stats(duk_context *ctx) {
+	duk_push_object(ctx);
+	duk_push_number(ctx, g_stats.received);
+	duk_put_prop_string(ctx, -2, "received");
+	duk_push_number(ctx, g_stats.sent);
+	duk_put_prop_string(ctx, -2, "sent");
+	duk_push_number(ctx, g_stats.truncated);
+	duk_put_prop_string(ctx, -2, "truncated");
+	duk_push_number(ctx, g_stats.sendErrors);
+	duk_put_prop_string(ctx, -2, "sendErrors");
+	duk_push_number(ctx, g_stats.recvCalls);
+	duk_put_prop_string(ctx, -2, "recvCalls");
+	duk_push_number(ctx, g_stats.sendCalls);
+	duk_put_prop_string(ctx, -2, "sendCalls");
+	return 1;
+} // js_dgram_stats
+
+
+/**
+ * Add native methods to the Dgram object.
+ * [0] - Dgram Object
+ */
+duk_ret_t ModuleDgram(duk_context *ctx) {
+	ADD_FUNCTION("addMembership",        js_dgram_addMembership,        3);
+	ADD_FUNCTION("bind",                 js_dgram_bind,                 3);
+	ADD_FUNCTION("close",                js_dgram_close,                1);
+	ADD_FUNCTION("create",               js_dgram_create,               1);
+	ADD_FUNCTION("dropMembership",       js_dgram_dropMembership,       3);
+	ADD_FUNCTION("localPort",            js_dgram_localPort,            1);
+	ADD_FUNCTION("receive",              js_dgram_receive,              2);
+	ADD_FUNCTION("send",                 js_dgram_send,                 2);
+	ADD_FUNCTION("setBroadcast",         js_dgram_setBroadcast,         2);
+	ADD_FUNCTION("setMulticastLoopback", js_dgram_setMulticastLoopback, 2);
+	ADD_FUNCTION("setMulticastTTL",      js_dgram_setMulticastTTL,      2);
+	ADD_FUNCTION("stats",                js_dgram_stats,                0);
+
+	ADD_INT("BUFFER_SIZE", DGRAM_BUFFER_SIZE);
+	return 0;
+} // ModuleDgram
@@ -0,0 +1,469 @@
+/*
+ * Asynchronous host name resolution.
+ *
+ * getaddrinfo() blocks until the name server answers which can take hundreds of
+ * msecs or, when the server can't be reached, several seconds.  Calling it from
+ * JavaScript stalls every timer and socket while it waits.  Here the lookups are
+ * handed to a resolver task which performs them one at a time and reports each
+ * result through the event queue.
+ *
+ * getaddrinfo() doesn't tell us the TTL of the records it found so each result is
+ * reported with a default TTL: DEFAULT_TTL seconds for an address and NEGATIVE_TTL
+ * seconds for a name that doesn't exist.  The cache itself is kept in dns.js.
+ *
+ * For testing without a network a stub table can be installed with setStub().  While
+ * it is installed, names are resolved from the table only (after an optional delay
+ * that stands in for the name server) and getaddrinfo() isn't called.
+ *
+ * The functions exposed are:
+ * * lookup
+ * * lookupSync
+ * * setStub
+ */
+#if defined(ESP_PLATFORM)
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <lwip/netdb.h>
+#include <lwip/sockets.h>
+
+#include "sdkconfig.h"
+#else /* ESP_PLATFORM */
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif /* ESP_PLATFORM */
+
+#include <assert.h>
+#include <duktape.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "duktape_event.h"
+#include "duktape_utils.h"
+#include "logging.h"
+#include "module_dns.h"
+
+LOG_TAG("module_dns");
+
+#define DNS_DEFAULT_TTL  (60) // Seconds an address is cached for.
+#define DNS_NEGATIVE_TTL (10) // Seconds a name that doesn't exist is cached for.
+
+// The maximum number of lookups that may be queued or in progress.  Lookups of the
+// same name are combined in dns.js so this is the number of distinct names.
+#define DNS_MAX_PENDING (8)
+
+#define DNS_OK        (0)
+#define DNS_NOT_FOUND (1) // The name doesn't exist.
+#define DNS_TRY_AGAIN (2) // The name server couldn't be reached.
+
+/*
+ * A lookup.  It is allocated when the lookup is requested and freed once its
+ * result has been handed to the JavaScript callback.
+ */
+typedef struct dukf_dns_request {
+	char                    *hostname;
+	uint32_t                 callbackStashKey; // Stash of [callback].
+	bool                     stubbed;          // Resolved from the stub table.
+	uint32_t                 delay;            // Msecs to wait before reporting a stubbed result.
+	int                      status;           // DNS_OK, DNS_NOT_FOUND or DNS_TRY_AGAIN.
+	char                     address[INET_ADDRSTRLEN];
+	uint32_t                 ttl;              // Seconds the result may be cached for.
+	struct dukf_dns_request *next;             // Linux queue link.
+} dukf_dns_request_t;
+
+/*
+ * An entry in the stub table.  An entry with an empty address is a name that
+ * doesn't exist.  The table is only used on the JavaScript task.
+ */
+typedef struct dukf_dns_stub {
+	char                 *hostname;
+	char                  address[INET_ADDRSTRLEN];
+	uint32_t              ttl;
+	uint32_t              delay;
+	struct dukf_dns_stub *next;
+} dukf_dns_stub_t;
+
+static dukf_dns_stub_t *g_stubs = NULL;
+static bool             g_stubActive = false;
+static int              g_pending = 0; // Lookups whose callbacks have not yet run.
+
+#if defined(ESP_PLATFORM)
+static QueueHandle_t g_dnsQueue = NULL;
+#else /* ESP_PLATFORM */
+static pthread_mutex_t     g_dnsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      g_dnsCond  = PTHREAD_COND_INITIALIZER;
+static dukf_dns_request_t *g_dnsHead  = NULL;
+static dukf_dns_request_t *g_dnsTail  = NULL;
+static bool                g_dnsStarted = false;
+#endif /* ESP_PLATFORM */
+
+
+/*
+ * Return the error string reported to JavaScript for a status.
+ */
+static const char *dns_errorString(int status) {
+	if (status == DNS_TRY_AGAIN) {
+		return "EAI_AGAIN";
+	}
+	return "ENOTFOUND";
+} // dns_errorString
+
+
+/*
+ * Resolve the request's host name with getaddrinfo().  This blocks and so must
+ * only be called on the resolver task (or by lookupSync).
+ */
+static void dns_resolve(dukf_dns_request_t *request) {
+	struct addrinfo hints;
+	struct addrinfo *result;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	int rc = getaddrinfo(request->hostname, NULL, &hints, &result);
+	if (rc != 0) {
+		LOGD(" - %s not found! rc = %d", request->hostname, rc);
+		request->status = DNS_NOT_FOUND;
+		request->ttl = DNS_NEGATIVE_TTL;
+#if defined(EAI_AGAIN)
+		if (rc == EAI_AGAIN) {
+			// The answer may be different next time so don't cache it.
+			request->status = DNS_TRY_AGAIN;
+			request->ttl = 0;
+		}
+#endif
+		return;
+	}
+	inet_ntop(
+		AF_INET,
+		&((struct sockaddr_in *)(result->ai_addr))->sin_addr,
+		request->address, sizeof(request->address));
+	freeaddrinfo(result);
+	request->status = DNS_OK;
+	request->ttl = DNS_DEFAULT_TTL;
+} // dns_resolve
+
+
+/*
+ * If the stub table is installed, resolve the request from it and return true.
+ * A name that isn't in the table doesn't exist.
+ */
+static bool dns_resolveStub(dukf_dns_request_t *request) {
+	if (!g_stubActive) {
+		return false;
+	}
+	request->stubbed = true;
+	request->status = DNS_NOT_FOUND;
+	request->ttl = DNS_NEGATIVE_TTL;
+	dukf_dns_stub_t *stub = g_stubs;
+	while (stub != NULL) {
+		if (strcmp(stub->hostname, request->hostname) == 0) {
+			request->delay = stub->delay;
+			if (stub->address[0] != '\0') {
+				request->status = DNS_OK;
+				strcpy(request->address, stub->address);
+			}
+			if (stub->ttl != UINT32_MAX) {
+				request->ttl = stub->ttl;
+			} else if (request->status == DNS_OK) {
+				request->ttl = DNS_DEFAULT_TTL;
+			}
+			break;
+		}
+		stub = stub->next;
+	}
+	return true;
+} // dns_resolveStub
+
+
+/*
+ * Release a request.
+ */
+static void dns_freeRequest(dukf_dns_request_t *request) {
+	free(request->hostname);
+	free(request);
+} // dns_freeRequest
+
+
+/*
+ * Push the result of a request as [err, address, ttl].
+ */
+static void dns_pushResult(duk_context *ctx, dukf_dns_request_t *request) {
+	if (request->status == DNS_OK) {
+		duk_push_null(ctx);
+		duk_push_string(ctx, request->address);
+	} else {
+		duk_push_string(ctx, dns_errorString(request->status));
+		duk_push_null(ctx);
+	}
+	duk_push_number(ctx, request->ttl);
+} // dns_pushResult
+
+
+/*
+ * Called on the JavaScript task when the completion event for a lookup is
+ * processed.  We add the error (or null), the address and the TTL as the
+ * parameters to the callback and release the request.
+ */
+static int dns_dataProvider(duk_context *ctx, void *context) {
+	dukf_dns_request_t *request = (dukf_dns_request_t *)context;
+	g_pending--;
+	dns_pushResult(ctx, request);
+	// [0] - err
+	// [1] - address
+	// [2] - ttl
+	dns_freeRequest(request);
+	return 3;
+} // dns_dataProvider
+
+
+/*
+ * Perform a lookup on the resolver task and post its completion event.
+ */
+static void dns_process(dukf_dns_request_t *request) {
+	if (request->stubbed) {
+#if defined(ESP_PLATFORM)
+		vTaskDelay(request->delay / portTICK_PERIOD_MS);
+#else
+		usleep((useconds_t)request->delay * 1000);
+#endif
+	} else {
+		dns_resolve(request);
+	}
+	event_newCallbackRequestedEvent(
+		ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION,
+		request->callbackStashKey,
+		dns_dataProvider,
+		request);
+} // dns_process
+
+
+#if defined(ESP_PLATFORM)
+/*
+ * The resolver task.  Lookups are performed one at a time in the order they
+ * were requested.
+ */
+static void dns_task(void *ignore) {
+	dukf_dns_request_t *request;
+	while(1) {
+		if (xQueueReceive(g_dnsQueue, &request, portMAX_DELAY) != pdTRUE) {
+			continue;
+		}
+		dns_process(request);
+	}
+	vTaskDelete(NULL);
+} // dns_task
+#else /* ESP_PLATFORM */
+/*
+ * The resolver thread.  Lookups are performed one at a time in the order they
+ * were requested.
+ */
+static void *dns_thread(void *ignore) {
+	dukf_dns_request_t *request;
+	while(1) {
+		pthread_mutex_lock(&g_dnsMutex);
+		while (g_dnsHead == NULL) {
+			pthread_cond_wait(&g_dnsCond, &g_dnsMutex);
+		}
+		request = g_dnsHead;
+		g_dnsHead = request->next;
+		if (g_dnsHead == NULL) {
+			g_dnsTail = NULL;
+		}
+		pthread_mutex_unlock(&g_dnsMutex);
+		dns_process(request);
+	}
+	return NULL;
+} // dns_thread
+#endif /* ESP_PLATFORM */
+
+
+/*
+ * Hand a request to the resolver, starting it if this is the first lookup.
+ */
+static void dns_queue(dukf_dns_request_t *request) {
+#if defined(ESP_PLATFORM)
+	if (g_dnsQueue == NULL) {
+		g_dnsQueue = xQueueCreate(DNS_MAX_PENDING, sizeof(dukf_dns_request_t *));
+		assert(g_dnsQueue != NULL);
+		// getaddrinfo() needs more stack than most of our tasks.
+		xTaskCreatePinnedToCore(&dns_task, "dns_resolver", 4096, NULL, 5, NULL, tskNO_AFFINITY);
+	}
+	xQueueSend(g_dnsQueue, &request, portMAX_DELAY);
+#else /* ESP_PLATFORM */
+	pthread_mutex_lock(&g_dnsMutex);
+	if (!g_dnsStarted) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, dns_thread, NULL);
+		pthread_detach(thread);
+		g_dnsStarted = true;
+	}
+	request->next = NULL;
+	if (g_dnsTail == NULL) {
+		g_dnsHead = request;
+	} else {
+		g_dnsTail->next = request;
+	}
+	g_dnsTail = request;
+	pthread_cond_signal(&g_dnsCond);
+	pthread_mutex_unlock(&g_dnsMutex);
+#endif /* ESP_PLATFORM */
+} // dns_queue
+
+
+/*
+ * Release the stub table.
+ */
+static void dns_freeStubs() {
+	while (g_stubs != NULL) {
+		dukf_dns_stub_t *next = g_stubs->next;
+		free(g_stubs->hostname);
+		free(g_stubs);
+		g_stubs = next;
+	}
+	g_stubActive = false;
+} // dns_freeStubs
+
+
+/*
+ * Start resolving a host name.
+ * [0] - hostname
+ * [1] - callback - function(err, address, ttl)
+ *
+ * Returns true if the lookup was started and false if too many lookups are already
+ * in progress.  err is null, "ENOTFOUND" or "EAI_AGAIN" and ttl is the number of
+ * seconds the result may be cached for.
+ */
+static duk_ret_t js_dns_lookup(duk_context *ctx) {
+	LOGD(">> js_dns_lookup");
+	const char *hostname = duk_get_string(ctx, 0);
+	if (hostname == NULL || !duk_is_function(ctx, 1)) {
+		LOGE("<< js_dns_lookup: Expected a hostname and a callback");
+		return DUK_RET_TYPE_ERROR;
+	}
+	if (g_pending >= DNS_MAX_PENDING) {
+		LOGD("<< js_dns_lookup: %d lookups already pending", g_pending);
+		duk_push_false(ctx);
+		return 1;
+	}
+	dukf_dns_request_t *request = calloc(1, sizeof(dukf_dns_request_t));
+	if (request == NULL || (request->hostname = strdup(hostname)) == NULL) {
+		LOGE("<< js_dns_lookup: out of memory");
+		free(request);
+		duk_push_false(ctx);
+		return 1;
+	}
+	dns_resolveStub(request);
+
+	duk_dup(ctx, 1);
+	request->callbackStashKey = esp32_duktape_stash_array(ctx, 1);
+	g_pending++;
+	dns_queue(request);
+
+	duk_push_true(ctx);
+	LOGD("<< js_dns_lookup: %s", hostname);
+	return 1;
+} // js_dns_lookup
+
+
+/*
+ * Resolve a host name, blocking until the answer is known.  The stub table is
+ * used if installed but its delay is ignored.
+ * [0] - hostname
+ *
+ * Returns an object containing:
+ * * err - null, "ENOTFOUND" or "EAI_AGAIN"
+ * * address - the IP address or null
+ * * ttl - the number of seconds the result may be cached for
+ */
+static duk_ret_t js_dns_lookupSync(duk_context *ctx) {
+	dukf_dns_request_t request;
+	memset(&request, 0, sizeof(request));
+	request.hostname = (char *)duk_get_string(ctx, 0);
+	if (request.hostname == NULL) {
+		return DUK_RET_TYPE_ERROR;
+	}
+	if (!dns_resolveStub(&request)) {
+		dns_resolve(&request);
+	}
+	duk_push_object(ctx);
+	dns_pushResult(ctx, &request);
+	duk_put_prop_string(ctx, -4, "ttl");
+	duk_put_prop_string(ctx, -3, "address");
+	duk_put_prop_string(ctx, -2, "err");
+	return 1;
+} // js_dns_lookupSync
+
+
+/*
+ * Install a stub table in place of the name server or remove it.
+ * [0] - table - An object whose property names are host names and whose values are
+ *       one of:
+ *       * an address string.
+ *       * null - the name doesn't exist.
+ *       * an object containing address (a string or null), ttl (seconds) and
+ *         delay (msecs).  All are optional.
+ *       Passing null or undefined removes the table.
+ */
+static duk_ret_t js_dns_setStub(duk_context *ctx) {
+	dns_freeStubs();
+	if (!duk_is_object(ctx, 0)) {
+		return 0;
+	}
+	g_stubActive = true;
+	duk_enum(ctx, 0, DUK_ENUM_OWN_PROPERTIES_ONLY);
+	while (duk_next(ctx, -1, 1)) {
+		// [1] - enum
+		// [2] - hostname
+		// [3] - value
+		dukf_dns_stub_t *stub = calloc(1, sizeof(dukf_dns_stub_t));
+		if (stub == NULL || (stub->hostname = strdup(duk_get_string(ctx, 2))) == NULL) {
+			LOGE("js_dns_setStub: out of memory");
+			free(stub);
+			duk_pop_2(ctx);
+			break;
+		}
+		stub->ttl = UINT32_MAX;
+		const char *address = NULL;
+		if (duk_is_string(ctx, 3)) {
+			address = duk_get_string(ctx, 3);
+		} else if (duk_is_object(ctx, 3)) {
+			if (duk_get_prop_string(ctx, 3, "address") && duk_is_string(ctx, -1)) {
+				address = duk_get_string(ctx, -1);
+			}
+			if (duk_get_prop_string(ctx, 3, "ttl") && duk_is_number(ctx, -1)) {
+				stub->ttl = duk_get_uint(ctx, -1);
+			}
+			if (duk_get_prop_string(ctx, 3, "delay") && duk_is_number(ctx, -1)) {
+				stub->delay = duk_get_uint(ctx, -1);
+			}
+		}
+		if (address != NULL) {
+			strncpy(stub->address, address, sizeof(stub->address) - 1);
+		}
+		stub->next = g_stubs;
+		g_stubs = stub;
+		duk_set_top(ctx, 2);
+	}
+	duk_pop(ctx);
+	return 0;
+} // js_dns_setStub
+
+
+/**
+ * Add native methods to the DNS object.
+ * [0] - DNS Object
+ */
+duk_ret_t ModuleDNS(duk_context *ctx) {
+	ADD_FUNCTION("lookup",     js_dns_lookup,     2);
+	ADD_FUNCTION("lookupSync", js_dns_lookupSync, 1);
+	ADD_FUNCTION("setStub",    js_dns_setStub,    1);
+
+	ADD_INT("DEFAULT_TTL",  DNS_DEFAULT_TTL);
+	ADD_INT("NEGATIVE_TTL", DNS_NEGATIVE_TTL);
+	return 0;
+} // ModuleDNS
@@ -8,6 +8,9 @@
 
 #include <duktape.h>
 
+#include "dukf_budget.h"
+#include "dukf_profiler.h"
+#include "duktape_event.h"
 #include "duktape_utils.h"
 #include "logging.h"
 #include "dukf_utils.h"
@@ -38,6 +41,22 @@ static duk_ret_t js_dukf_debug(duk_context *ctx) {
 } // js_esp32_debug
 
 
+/*
+ * Compile a source file into a bytecode file that can be run in its place with
+ * DUKF.runFile() without the source having to be held in RAM and compiled.
+ * [0] - source file name
+ * [1] - bytecode file name
+ *
+ * Returns true on success.
+ */
+static duk_ret_t js_dukf_compileFile(duk_context *ctx) {
+	const char *sourceFileName = duk_require_string(ctx, 0);
+	const char *bytecodeFileName = duk_require_string(ctx, 1);
+	duk_push_boolean(ctx, dukf_compileFile(ctx, sourceFileName, bytecodeFileName));
+	return 1;
+} // js_dukf_compileFile
+
+
 // Ask JS to perform a gabrage collection.
 static duk_ret_t js_dukf_gc(duk_context *ctx) {
 	duk_gc(ctx, 0);
@@ -110,6 +129,194 @@ static duk_ret_t js_dukf_setStartFile(duk_context *ctx) {
 } // js_dukf_setStartFile
 
 
+/*
+ * Return statistics about the event lanes.  The result is an object with a property
+ * for each lane (realtime, io and background) holding processed, dropped, waiting,
+ * maxWait and meanWait.  The waits are msecs from posting to processing.
+ */
+static duk_ret_t js_dukf_eventStats(duk_context *ctx) {
+	static const char *laneNames[ESP32_DUKTAPE_LANE_COUNT] = { "realtime", "io", "background" };
+	esp32_duktape_lane_stats_t stats[ESP32_DUKTAPE_LANE_COUNT];
+	int lane;
+	esp32_duktape_getLaneStats(stats);
+	duk_push_object(ctx);
+	for (lane=0; lane<ESP32_DUKTAPE_LANE_COUNT; lane++) {
+		duk_push_object(ctx);
+		duk_push_number(ctx, stats[lane].processed);
+		duk_put_prop_string(ctx, -2, "processed");
+		duk_push_number(ctx, stats[lane].dropped);
+		duk_put_prop_string(ctx, -2, "dropped");
+		duk_push_number(ctx, stats[lane].waiting);
+		duk_put_prop_string(ctx, -2, "waiting");
+		duk_push_number(ctx, stats[lane].maxWait);
+		duk_put_prop_string(ctx, -2, "maxWait");
+		duk_push_number(ctx, stats[lane].processed == 0 ? 0 : (double)stats[lane].totalWait / stats[lane].processed);
+		duk_put_prop_string(ctx, -2, "meanWait");
+		duk_put_prop_string(ctx, -2, laneNames[lane]);
+	}
+	return 1;
+} // js_dukf_eventStats
+
+
+/*
+ * Return statistics about the execution budgets.  The result is an object with a
+ * property for each source (loop, callback, command and job) holding budget, runs,
+ * overruns and maxElapsed.  The times are msecs.
+ */
+static duk_ret_t js_dukf_budgetStats(duk_context *ctx) {
+	dukf_budget_stats_t stats;
+	int source;
+	duk_push_object(ctx);
+	for (source=0; source<DUKF_BUDGET_SOURCE_COUNT; source++) {
+		dukf_budget_getStats(source, &stats);
+		duk_push_object(ctx);
+		duk_push_number(ctx, dukf_budget_get(source));
+		duk_put_prop_string(ctx, -2, "budget");
+		duk_push_number(ctx, stats.runs);
+		duk_put_prop_string(ctx, -2, "runs");
+		duk_push_number(ctx, stats.overruns);
+		duk_put_prop_string(ctx, -2, "overruns");
+		duk_push_number(ctx, stats.maxElapsed);
+		duk_put_prop_string(ctx, -2, "maxElapsed");
+		duk_put_prop_string(ctx, -2, dukf_budget_sourceName(source));
+	}
+	return 1;
+} // js_dukf_budgetStats
+
+
+/*
+ * Set DUKF.profiling to whether the profiler is running.  loop.js reads it to decide
+ * whether to call profileDispatch().
+ */
+static void dukf_setProfiling(duk_context *ctx) {
+	duk_push_global_object(ctx);
+	duk_get_prop_string(ctx, -1, "DUKF");
+	duk_push_boolean(ctx, dukf_profiler_isRunning());
+	duk_put_prop_string(ctx, -2, "profiling");
+	duk_pop_2(ctx);
+} // dukf_setProfiling
+
+
+/*
+ * Return the samples of the profiler as collapsed stacks, one line per distinct stack
+ * of "outer;...;inner count".  This is the input of flamegraph.pl.
+ */
+static duk_ret_t js_dukf_profileCollapsed(duk_context *ctx) {
+	dukf_profiler_pushCollapsed(ctx);
+	return 1;
+} // js_dukf_profileCollapsed
+
+
+/*
+ * Tell the profiler that loop.js is about to call a timer or socket callback, or has
+ * returned from one if the argument isn't a function.
+ * [0] - function or null
+ */
+static duk_ret_t js_dukf_profileDispatch(duk_context *ctx) {
+	dukf_profiler_dispatch(ctx, 0);
+	return 0;
+} // js_dukf_profileDispatch
+
+
+/*
+ * Start the profiler.  Earlier samples are discarded.
+ * [0] - interval - msecs between samples (optional, default 10)
+ *
+ * Returns true if the profiler was started.
+ */
+static duk_ret_t js_dukf_profileStart(duk_context *ctx) {
+	uint32_t interval = duk_is_number(ctx, 0) ? duk_get_uint(ctx, 0) : 10;
+	duk_push_boolean(ctx, dukf_profiler_start(interval));
+	dukf_setProfiling(ctx);
+	return 1;
+} // js_dukf_profileStart
+
+
+/*
+ * Return statistics about the profiler: running, interval, ticks, samples, overwritten,
+ * frames and framesLost.
+ */
+static duk_ret_t js_dukf_profileStats(duk_context *ctx) {
+	dukf_profiler_stats_t stats;
+	dukf_profiler_getStats(&stats);
+	duk_push_object(ctx);
+	duk_push_boolean(ctx, stats.running);
+	duk_put_prop_string(ctx, -2, "running");
+	duk_push_number(ctx, stats.interval);
+	duk_put_prop_string(ctx, -2, "interval");
+	duk_push_number(ctx, stats.ticks);
+	duk_put_prop_string(ctx, -2, "ticks");
+	duk_push_number(ctx, stats.samples);
+	duk_put_prop_string(ctx, -2, "samples");
+	duk_push_number(ctx, stats.overwritten);
+	duk_put_prop_string(ctx, -2, "overwritten");
+	duk_push_number(ctx, stats.frames);
+	duk_put_prop_string(ctx, -2, "frames");
+	duk_push_number(ctx, stats.framesLost);
+	duk_put_prop_string(ctx, -2, "framesLost");
+	return 1;
+} // js_dukf_profileStats
+
+
+/*
+ * Stop the profiler.  The samples are kept until it is started again.
+ */
+static duk_ret_t js_dukf_profileStop(duk_context *ctx) {
+	dukf_profiler_stop();
+	dukf_setProfiling(ctx);
+	return 0;
+} // js_dukf_profileStop
+
+
+/*
+ * Return the msecs left of the budget of the JavaScript running now, or Infinity if
+ * it has no limit.  Long work can check this and continue from a timer.
+ */
+static duk_ret_t js_dukf_remaining(duk_context *ctx) {
+	duk_push_number(ctx, dukf_budget_remaining());
+	return 1;
+} // js_dukf_remaining
+
+
+/*
+ * Call a function with a budget of its own.  If the function runs for longer than
+ * the budget, it is stopped and a RangeError is thrown.  Other errors thrown by the
+ * function are thrown on.
+ * [0] - msecs
+ * [1] - function
+ *
+ * Returns the result of the function.
+ */
+static duk_ret_t js_dukf_runWithBudget(duk_context *ctx) {
+	uint32_t msecs = duk_require_uint(ctx, 0);
+	bool overran;
+	duk_require_function(ctx, 1);
+	duk_dup(ctx, 1);
+	if (dukf_budget_pcall(ctx, msecs, &overran) != 0) {
+		if (overran) {
+			duk_error(ctx, DUK_ERR_RANGE_ERROR, "budget of %d msecs exceeded", (int)msecs);
+		}
+		duk_throw(ctx);
+	}
+	return 1;
+} // js_dukf_runWithBudget
+
+
+/*
+ * Set the budget of a source of JavaScript execution.  A budget of 0 means no limit.
+ * [0] - source - "loop", "callback" or "command"
+ * [1] - msecs
+ */
+static duk_ret_t js_dukf_setBudget(duk_context *ctx) {
+	int source = dukf_budget_sourceFromName(duk_require_string(ctx, 0));
+	if (source < 0 || source == DUKF_BUDGET_JOB) {
+		duk_error(ctx, DUK_ERR_TYPE_ERROR, "unknown budget source: %s", duk_get_string(ctx, 0));
+	}
+	dukf_budget_set(source, duk_require_uint(ctx, 1));
+	return 0;
+} // js_dukf_setBudget
+
+
 /*
  * Sleep for the specified number of milliseconds.
  * [0] - int milliseconds
@@ -129,12 +336,23 @@ void ModuleDUKF(duk_context *ctx) {
 	// [0] - Global object
 	// [1] - New object - DUKF Object
 
+	ADD_FUNCTION("budgetStats",  js_dukf_budgetStats,   0);
+	ADD_FUNCTION("compileFile",  js_dukf_compileFile,   2);
 	ADD_FUNCTION("debug",        js_dukf_debug,         1);
+	ADD_FUNCTION("eventStats",   js_dukf_eventStats,    0);
 	ADD_FUNCTION("gc",           js_dukf_gc,            1);
 	ADD_FUNCTION("global",       js_dukf_global,        0);
 	ADD_FUNCTION("loadFile",     js_dukf_loadFile,      1);
 	ADD_FUNCTION("logHeap",      js_dukf_logHeap,       1);
+	ADD_FUNCTION("profileCollapsed", js_dukf_profileCollapsed, 0);
+	ADD_FUNCTION("profileDispatch", js_dukf_profileDispatch, 1);
+	ADD_FUNCTION("profileStart", js_dukf_profileStart,  1);
+	ADD_FUNCTION("profileStats", js_dukf_profileStats,  0);
+	ADD_FUNCTION("profileStop",  js_dukf_profileStop,   0);
+	ADD_FUNCTION("remaining",    js_dukf_remaining,     0);
 	ADD_FUNCTION("runFile",      js_dukf_runFile,       1);
+	ADD_FUNCTION("runWithBudget", js_dukf_runWithBudget, 2);
+	ADD_FUNCTION("setBudget",    js_dukf_setBudget,     2);
 	ADD_FUNCTION("setStartFile", js_dukf_setStartFile,  1);
 	ADD_FUNCTION("sleep",        js_dukf_sleep,         1);
 
@@ -155,6 +373,9 @@ void ModuleDUKF(duk_context *ctx) {
 #endif // ESP_PLATFORM
 	duk_put_prop_string(ctx, -2, "OS");
 
+	duk_push_false(ctx);
+	duk_put_prop_string(ctx, -2, "profiling"); // Set by profileStart() and profileStop().
+
 
 	duk_put_prop_string(ctx, -2, "DUKF"); // Add DUKF to global
 	// [0] - Global object
@@ -7,15 +7,16 @@
 #include <esp_system.h>
 #include "duktape_spiffs.h"
 #include "sdkconfig.h"
-#else // ESP_PLATFORM
-#include <dirent.h>
 #endif // ESP_PLATFORM
 
+#include <dirent.h>
 #include <duktape.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -25,6 +26,135 @@
 
 LOG_TAG("module_fs");
 
+/*
+ * The directory listing is built with one pass over the file system and kept until
+ * a file is created, written, renamed or removed.  Listing hundreds of SPIFFS files
+ * is slow so repeated requests (such as from the IDE file browser) use the cache.
+ */
+typedef struct {
+	char    *name;
+	uint32_t size;
+	uint32_t mtime; // Seconds since the epoch.
+} dukf_fs_entry_t;
+
+static dukf_fs_entry_t *g_listing = NULL; // Entries sorted by name.
+static int              g_listingCount = 0;
+static bool             g_listingValid = false;
+
+
+/**
+ * Discard the cached directory listing.  Call this after changing the files in the
+ * file system.
+ */
+void dukf_fs_invalidateListing() {
+	g_listingValid = false;
+} // dukf_fs_invalidateListing
+
+
+static int compareEntries(const void *a, const void *b) {
+	return strcmp(((const dukf_fs_entry_t *)a)->name, ((const dukf_fs_entry_t *)b)->name);
+} // compareEntries
+
+
+/**
+ * Free the cached listing.
+ */
+static void freeListing() {
+	int i;
+	for (i=0; i<g_listingCount; i++) {
+		free(g_listing[i].name);
+	}
+	free(g_listing);
+	g_listing = NULL;
+	g_listingCount = 0;
+	g_listingValid = false;
+} // freeListing
+
+
+/**
+ * Build the listing of the files in the root directory if it isn't cached.
+ */
+static bool buildListing(const char *root) {
+	if (g_listingValid) {
+		return true;
+	}
+	LOGD(">> buildListing: %s", root);
+	freeListing();
+	DIR *d = opendir(root);
+	if (d == NULL) {
+		LOGE("buildListing: Unable to open %s: %d %s", root, errno, strerror(errno));
+		return false;
+	}
+	int capacity = 0;
+	struct dirent *dir;
+	while((dir = readdir(d)) != NULL) {
+		// Skip "." and ".." and names that end with "/."
+		int len = strlen(dir->d_name);
+		if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0 ||
+				(len >= 2 && strcmp(dir->d_name + len - 2, "/.") == 0)) {
+			continue;
+		}
+		if (g_listingCount == capacity) {
+			capacity = capacity == 0 ? 16 : capacity * 2;
+			dukf_fs_entry_t *newListing = realloc(g_listing, capacity * sizeof(dukf_fs_entry_t));
+			if (newListing == NULL) {
+				LOGE("buildListing: out of memory");
+				break;
+			}
+			g_listing = newListing;
+		}
+		dukf_fs_entry_t *entry = &g_listing[g_listingCount];
+		entry->name = strdup(dir->d_name);
+		if (entry->name == NULL) {
+			LOGE("buildListing: out of memory");
+			break;
+		}
+		char path[256];
+		struct stat statBuf;
+		snprintf(path, sizeof(path), "%s/%s", root, dir->d_name);
+		if (stat(path, &statBuf) == 0) {
+			entry->size = statBuf.st_size;
+			entry->mtime = statBuf.st_mtime;
+		} else {
+			entry->size = 0;
+			entry->mtime = 0;
+		}
+		g_listingCount++;
+	}
+	closedir(d);
+	qsort(g_listing, g_listingCount, sizeof(dukf_fs_entry_t), compareEntries);
+	g_listingValid = true;
+	LOGD("<< buildListing: %d files", g_listingCount);
+	return true;
+} // buildListing
+
+
+/**
+ * Push the value of DUKF.FILE_SYSTEM_ROOT.
+ */
+static const char *pushRoot(duk_context *ctx) {
+	duk_push_global_object(ctx);
+	duk_get_prop_string(ctx, -1, "DUKF");
+	duk_get_prop_string(ctx, -1, "FILE_SYSTEM_ROOT");
+	duk_remove(ctx, -2);
+	duk_remove(ctx, -2);
+	return duk_get_string(ctx, -1);
+} // pushRoot
+
+
+/**
+ * Push an object describing a listing entry.
+ */
+static void pushEntry(duk_context *ctx, dukf_fs_entry_t *entry) {
+	duk_push_object(ctx);
+	duk_push_string(ctx, entry->name);
+	duk_put_prop_string(ctx, -2, "name");
+	duk_push_number(ctx, entry->size);
+	duk_put_prop_string(ctx, -2, "size");
+	duk_push_number(ctx, entry->mtime);
+	duk_put_prop_string(ctx, -2, "mtime");
+} // pushEntry
+
 /**
  * Convert a string to posix open() flags.
  * "r" - O_RDONLY
@@ -54,6 +184,56 @@ static int stringToPosixFlags(const char *flags) {
 } // stringToPosixFlags
 
 
+/**
+ * Read from a file at the given position or, if position is < 0, from the current file
+ * position.  The SPIFFS VFS has no pread() so on the ESP32 we seek and then read which,
+ * unlike pread(), also moves the file position.
+ */
+static ssize_t readAt(int fd, void *buffer, size_t length, off_t position) {
+	if (position < 0) {
+		return read(fd, buffer, length);
+	}
+#if defined(ESP_PLATFORM)
+	if (lseek(fd, position, SEEK_SET) == -1) {
+		return -1;
+	}
+	return read(fd, buffer, length);
+#else // ESP_PLATFORM
+	return pread(fd, buffer, length, position);
+#endif // ESP_PLATFORM
+} // readAt
+
+
+/**
+ * Write to a file at the given position or, if position is < 0, at the current file
+ * position.  See readAt() for the ESP32 behavior.
+ */
+static ssize_t writeAt(int fd, const void *buffer, size_t length, off_t position) {
+	if (position < 0) {
+		return write(fd, buffer, length);
+	}
+#if defined(ESP_PLATFORM)
+	if (lseek(fd, position, SEEK_SET) == -1) {
+		return -1;
+	}
+	return write(fd, buffer, length);
+#else // ESP_PLATFORM
+	return pwrite(fd, buffer, length, position);
+#endif // ESP_PLATFORM
+} // writeAt
+
+
+/**
+ * Get an optional file position argument.  Returns -1 if it is not a number.
+ */
+static off_t getPosition(duk_context *ctx, duk_idx_t idx) {
+	if (!duk_is_number(ctx, idx) || duk_get_number(ctx, idx) < 0) {
+		return -1;
+	}
+	return (off_t)duk_get_number(ctx, idx);
+} // getPosition
+
+
 /**
  * Write data to a file synchronously.
  *
@@ -61,12 +241,16 @@ static int stringToPosixFlags(const char *flags) {
  * [1] - buffer
  * [2] - offset [Optional]
  * [3] - length [Optional]
+ * [4] - position [Optional]
  *
  * or
  *
  * [0] - file descriptor
  * [1] - string
+ * [2] - position [Optional]
  *
+ * If a position is supplied, the data is written at that position in the file
+ * otherwise at the current file position.
  */
 static duk_ret_t js_fs_writeSync(duk_context *ctx) {
 	int fd;
@@ -75,6 +259,7 @@ static duk_ret_t js_fs_writeSync(duk_context *ctx) {
 	int rc;
 	duk_size_t offset = 0; // Default offset is 0.
 	duk_size_t length;
+	off_t position;
 
 	fd = duk_get_int(ctx, 0);
 	// [0] - file descriptor
@@ -120,6 +305,7 @@ static duk_ret_t js_fs_writeSync(duk_context *ctx) {
 				} // length > bufferSize
 			} // We have a length
 		} // We have an offset
+		position = getPosition(ctx, 4);
 	} // Data is buffer
 	else { // Handle the case where the data type is a string.
 		bufPtr = (uint8_t *)duk_get_string(ctx, 1);
@@ -127,12 +313,18 @@ static duk_ret_t js_fs_writeSync(duk_context *ctx) {
 		// [1] - string
 
 		length = bufferSize = strlen((char *)bufPtr);
+		position = getPosition(ctx, 2);
+	}
+	if (offset > bufferSize) {
+		LOGW("Specified offset is > buffer size");
+		offset = bufferSize;
 	}
 	if (length > (bufferSize - offset)) {
 		LOGW("Specified length + offset is > buffer size");
 		length = bufferSize - offset;
 	}
-	rc = write(fd, bufPtr+offset, length);
+	rc = writeAt(fd, bufPtr+offset, length, position);
+	dukf_fs_invalidateListing();
 
 	duk_push_int(ctx, rc);
 	// [0] - file descriptor
@@ -145,6 +337,37 @@ static duk_ret_t js_fs_writeSync(duk_context *ctx) {
 } // js_fs_writeSync
 
 
+/**
+ * Build the name of the backup that renameSync() keeps of the file at path while
+ * replacing it.  Returns false if the name doesn't fit.
+ */
+static bool fs_backupPath(const char *path, char *backupPath, size_t size) {
+	return snprintf(backupPath, size, "%s.bak", path) < (int)size;
+} // fs_backupPath
+
+
+/**
+ * Finish a replacement of the file at path by renameSync() that was interrupted.  If
+ * the file is missing, its backup is renamed back.  If both are present, the
+ * replacement had completed and the backup is removed.  Returns true if the file was
+ * restored.
+ */
+static bool fs_recoverBackup(const char *path) {
+	char backupPath[256];
+	struct stat statBuf;
+	if (!fs_backupPath(path, backupPath, sizeof(backupPath)) || stat(backupPath, &statBuf) == -1) {
+		return false;
+	}
+	dukf_fs_invalidateListing();
+	if (stat(path, &statBuf) == 0) {
+		unlink(backupPath);
+		return false;
+	}
+	LOGD("fs_recoverBackup: restoring %s from %s", path, backupPath);
+	return rename(backupPath, path) == 0;
+} // fs_recoverBackup
+
+
 /**
  * The native fs.openSync.  Open a file by name and return a file
  * descriptor (<numeric>).
@@ -181,6 +404,12 @@ static duk_ret_t js_fs_openSync(duk_context *ctx) {
 	int posixOpenFlags = stringToPosixFlags(flags);
 
 	int fd = open(path, posixOpenFlags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if (fd < 0 && errno == ENOENT && fs_recoverBackup(path)) {
+		fd = open(path, posixOpenFlags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	}
+	if (posixOpenFlags != O_RDONLY) {
+		dukf_fs_invalidateListing(); // The file may have been created or truncated.
+	}
 	if (fd < 0) {
 		LOGD("<< js_fs_openSync: Error: open(%s, 0x%x): %d errno=%d [%s]", path, posixOpenFlags, fd, errno, strerror(errno));
 		return DUK_RET_ERROR;
@@ -291,7 +520,7 @@ static duk_ret_t js_fs_readSync(duk_context *ctx) {
 	// [3] - maxToRead <Integer>
 	// [4] - position <Integer>
 
-	//size_t position = duk_require_int(ctx, 4);
+	off_t position = getPosition(ctx, 4);
 	ssize_t sizeRead = 0;
 	duk_size_t bufferSize;
 
@@ -303,7 +532,9 @@ static duk_ret_t js_fs_readSync(duk_context *ctx) {
 	// [4] - position <Integer>
 
 	if (bufPtr == NULL) {
-		LOGD("Failed to get the buffer pointer");
+		LOGD("<< js_fs_readSync: Failed to get the buffer pointer");
+		duk_push_int(ctx, 0);
+		return 1;
 	}
 	LOGD("Buffer pointer size returned as %d", (int)bufferSize);
 
@@ -313,19 +544,18 @@ static duk_ret_t js_fs_readSync(duk_context *ctx) {
 	// Check that writeOffset is within range.  If the buffer is "buffer.length" bytes in size
 	// then the writeOffset must be < buffer.length
 	if (writeOffset >= bufferSize) {
-		LOGD("Invalid writeOffset");
+		LOGD("<< js_fs_readSync: Invalid writeOffset");
+		duk_push_int(ctx, 0);
+		return 1;
 	}
 
-	// Position can't be < 0
-	// FIX ... PERFORM CHECK HERE
-
-	// if length > buffer.length -> length = buffer.length
-	if (maxToRead > bufferSize) {
-		maxToRead = bufferSize;
+	// We can't read more than fits in the buffer after the writeOffset.
+	if (maxToRead > bufferSize - writeOffset) {
+		maxToRead = bufferSize - writeOffset;
 	}
 
 	// Read the data from the underlying file.
-	sizeRead = read(fd, bufPtr+writeOffset, maxToRead);
+	sizeRead = readAt(fd, bufPtr+writeOffset, maxToRead, position);
 	if (sizeRead < 0) {
 		LOGD("js_fs_readSync: read() error: %d %s", errno, strerror(errno));
 		sizeRead = 0;
@@ -344,6 +574,39 @@ static duk_ret_t js_fs_readSync(duk_context *ctx) {
 } // js_fs_readSync
 
 
+/**
+ * Read a chunk of a file into a new Buffer.  The Buffer is the size of the data that
+ * was actually read so the caller doesn't have to allocate a Buffer and then slice it.
+ * A Buffer of length 0 is returned at the end of the file.
+ *
+ * [0] - fd <Integer> - file descriptor
+ * [1] - length <Integer> - The maximum number of bytes to read.
+ * [2] - position <Integer> - The position within the file to read from.  If position
+ *    is null then we read from the current file position. [Optional]
+ */
+static duk_ret_t js_fs_readChunkSync(duk_context *ctx) {
+	int fd = duk_require_int(ctx, 0);
+	duk_int_t length = duk_require_int(ctx, 1);
+	off_t position = getPosition(ctx, 2);
+	LOGD(">> js_fs_readChunkSync: fd: %d, length: %d, position: %ld", fd, (int)length, (long)position);
+	if (length < 0) {
+		length = 0;
+	}
+	uint8_t *bufPtr = duk_push_dynamic_buffer(ctx, length);
+	ssize_t sizeRead = length > 0 ? readAt(fd, bufPtr, length, position) : 0;
+	if (sizeRead < 0) {
+		LOGD("js_fs_readChunkSync: read() error: %d %s", errno, strerror(errno));
+		sizeRead = 0;
+	}
+	if (sizeRead < length) {
+		duk_resize_buffer(ctx, -1, sizeRead);
+	}
+	duk_push_buffer_object(ctx, -1, 0, sizeRead, DUK_BUFOBJ_NODEJS_BUFFER);
+	LOGD("<< js_fs_readChunkSync: sizeRead: %d", (int)sizeRead);
+	return 1;
+} // js_fs_readChunkSync
+
+
 /**
  * Unlink the named file.
  * [0] - Path.  The path to the file to unlink.
@@ -351,10 +614,114 @@ static duk_ret_t js_fs_readSync(duk_context *ctx) {
 static duk_ret_t js_fs_unlink(duk_context *ctx) {
 	const char *path = duk_require_string(ctx, 0);
 	unlink(path);
+	dukf_fs_invalidateListing();
 	return 0;
 } // js_fs_unlink
 
 
+/**
+ * Rename a file.  If a file with the new name already exists it is replaced.
+ * SPIFFS will not rename over an existing file (it fails with EEXIST) so in that
+ * case the existing file is first renamed to a backup which is removed once the
+ * rename has succeeded.  If we are stopped in between, fs_recoverBackup() puts
+ * things right the next time the file is opened or replaced.
+ * [0] - Old path name
+ * [1] - New path name
+ */
+static duk_ret_t js_fs_renameSync(duk_context *ctx) {
+	const char *oldPath = duk_require_string(ctx, 0);
+	const char *newPath = duk_require_string(ctx, 1);
+	LOGD(">> js_fs_renameSync: %s -> %s", oldPath, newPath);
+	fs_recoverBackup(newPath);
+	int rc = rename(oldPath, newPath);
+	if (rc == -1 && errno == EEXIST) {
+		char backupPath[256];
+		struct stat statBuf;
+		if (stat(oldPath, &statBuf) == 0 && fs_backupPath(newPath, backupPath, sizeof(backupPath)) &&
+				rename(newPath, backupPath) == 0) {
+			rc = rename(oldPath, newPath);
+			if (rc == 0) {
+				unlink(backupPath);
+			} else {
+				int renameErrno = errno;
+				rename(backupPath, newPath); // Put the original back.
+				errno = renameErrno;
+			}
+		} else {
+			errno = EEXIST;
+		}
+	}
+	dukf_fs_invalidateListing();
+	if (rc == -1) {
+		LOGD("<< js_fs_renameSync: Error from rename of %s to %s: %d %s", oldPath, newPath, errno, strerror(errno));
+		return DUK_RET_ERROR;
+	}
+	LOGD("<< js_fs_renameSync");
+	return 0;
+} // js_fs_renameSync
+
+
+/**
+ * List the files in the file system.  Only one page of entries is returned so that
+ * large directories don't need a large JS array.
+ * [0] - options [optional]
+ * {
+ *    prefix: <Only list names starting with this> [optional]
+ *    offset: <Index of the first matching entry to return> [optional; default 0]
+ *    limit: <Maximum number of entries to return> [optional; default all]
+ * }
+ *
+ * The return is an object:
+ * {
+ *    entries: [{name: <file name>, size: <file size>, mtime: <seconds since the epoch>}, ...]
+ *    total: <Number of entries matching the prefix>
+ * }
+ */
+static duk_ret_t js_fs_listSync(duk_context *ctx) {
+	const char *prefix = "";
+	int offset = 0;
+	int limit = -1;
+	if (duk_is_object(ctx, 0)) {
+		if (duk_get_prop_string(ctx, 0, "prefix") && duk_is_string(ctx, -1)) {
+			prefix = duk_get_string(ctx, -1);
+		}
+		if (duk_get_prop_string(ctx, 0, "offset") && duk_get_int(ctx, -1) > 0) {
+			offset = duk_get_int(ctx, -1);
+		}
+		if (duk_get_prop_string(ctx, 0, "limit") && duk_is_number(ctx, -1) && duk_get_int(ctx, -1) >= 0) {
+			limit = duk_get_int(ctx, -1);
+		}
+		// The prefix string is kept alive by the value stack.
+	}
+	const char *root = pushRoot(ctx);
+	if (root == NULL || !buildListing(root)) {
+		LOGE("js_fs_listSync: Unable to list DUKF.FILE_SYSTEM_ROOT");
+		return DUK_RET_ERROR;
+	}
+	size_t prefixLength = strlen(prefix);
+	duk_push_object(ctx);
+	duk_push_array(ctx);
+	int i;
+	int total = 0;
+	duk_uarridx_t index = 0;
+	for (i=0; i<g_listingCount; i++) {
+		if (strncmp(g_listing[i].name, prefix, prefixLength) != 0) {
+			continue;
+		}
+		if (total >= offset && (limit < 0 || (int)index < limit)) {
+			pushEntry(ctx, &g_listing[i]);
+			duk_put_prop_index(ctx, -2, index);
+			index++;
+		}
+		total++;
+	}
+	duk_put_prop_string(ctx, -2, "entries");
+	duk_push_int(ctx, total);
+	duk_put_prop_string(ctx, -2, "total");
+	return 1;
+} // js_fs_listSync
+
+
 /**
  * Get a listing of SPIFFs files.
  * The return is a JS array which contains objects.  Each
@@ -362,49 +729,23 @@ static duk_ret_t js_fs_unlink(duk_context *ctx) {
  * {
  *    name: <file name>
  *    size: <file size>
+ *    mtime: <modification time in seconds since the epoch>
  * }
  */
 static duk_ret_t js_fs_spiffsDir(duk_context *ctx) {
-#if defined(ESP_PLATFORM)
-	esp32_duktape_dump_spiffs_array(ctx);
-	return 1;
-
-#else // ESP_PLATFORM
-	duk_push_array(ctx); // Push a new empty array onto the stack.
-	DIR *d;
-	struct dirent *dir;
-	duk_push_global_object(ctx);
-	duk_get_prop_string(ctx, -1, "DUKF");
-	duk_get_prop_string(ctx, -1, "FILE_SYSTEM_ROOT");
-	const char *path = duk_get_string(ctx, -1);
-	if (path == NULL) {
-		LOGE("Unable to get DUKF.FILE_SYSTEM_ROOT");
-		return 0;
+	const char *root = pushRoot(ctx);
+	if (root == NULL || !buildListing(root)) {
+		LOGE("js_fs_spiffsDir: Unable to list DUKF.FILE_SYSTEM_ROOT");
+		duk_push_array(ctx);
+		return 1;
 	}
-	d = opendir(path);
-	duk_pop_3(ctx);
-	if (d != NULL) {
-		int i=0;
-		while((dir = readdir(d)) != NULL) {
-			// The dir object now points to a dirent.
-
-			// Skip if "." or ".."
-			if (strcmp(dir->d_name, ".") == 0 ||
-					strcmp(dir->d_name, "..") ==0) {
-				continue;
-			}
-			duk_push_object(ctx);
-			duk_push_string(ctx, dir->d_name);
-			duk_put_prop_string(ctx, -2, "name");
-			duk_push_int(ctx, 0);
-			duk_put_prop_string(ctx, -2, "size");
-			duk_put_prop_index(ctx, -2, i);
-			i++;
-		}
-		closedir(d);
+	duk_push_array(ctx);
+	int i;
+	for (i=0; i<g_listingCount; i++) {
+		pushEntry(ctx, &g_listing[i]);
+		duk_put_prop_index(ctx, -2, i);
 	}
 	return 1;
-#endif  // ESP_PLATFORM
 } // js_fs_spiffsDir
 
 
@@ -416,12 +757,15 @@ duk_ret_t ModuleFS(duk_context *ctx) {
 	ADD_FUNCTION("closeSync", js_fs_closeSync, 1);
 	ADD_FUNCTION("dump",      js_fs_dump,      0);
 	ADD_FUNCTION("fstatSync", js_fs_fstatSync, 1);
+	ADD_FUNCTION("listSync",  js_fs_listSync,  1);
 	ADD_FUNCTION("openSync",  js_fs_openSync,  3);
+	ADD_FUNCTION("readChunkSync", js_fs_readChunkSync, 3);
 	ADD_FUNCTION("readSync",  js_fs_readSync,  5);
+	ADD_FUNCTION("renameSync", js_fs_renameSync, 2);
 	ADD_FUNCTION("spiffsDir", js_fs_spiffsDir, 0);
 	ADD_FUNCTION("statSync",  js_fs_statSync,  1);
 	ADD_FUNCTION("unlink",    js_fs_unlink,    1);
-	ADD_FUNCTION("writeSync", js_fs_writeSync, 4);
+	ADD_FUNCTION("writeSync", js_fs_writeSync, 5);
 
 	return 0;
 } // ModuleFS
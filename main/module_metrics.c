@@ -0,0 +1,204 @@
+/*
+ * Event loop metrics.
+ *
+ * The main task and loop.js record how long each phase of a turn takes: the timer
+ * callbacks, select(), the socket reads and writes, garbage collection, the loop function
+ * as a whole, each event callback and the events of a turn.  We also record how long a
+ * turn takes and how late timers fire (the loop lag).
+ *
+ * Each is a histogram with fixed buckets so recording is a few additions with no
+ * allocation.  Times are usecs.  The histograms are only read when asked for, for example
+ * by the /metrics page of the web server (see metrics.js).
+ *
+ * The functions exposed are:
+ * * enter
+ * * lag
+ * * reset
+ * * snapshot
+ */
+#if defined(ESP_PLATFORM)
+#include <esp_timer.h>
+#else /* ESP_PLATFORM */
+#include <time.h>
+#endif /* ESP_PLATFORM */
+
+#include <duktape.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "duktape_utils.h"
+#include "logging.h"
+#include "module_metrics.h"
+
+LOG_TAG("module_metrics");
+
+// The upper bounds of the buckets in usecs.  A last bucket counts anything longer.
+static const uint32_t g_bounds[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+#define METRICS_BUCKETS (sizeof(g_bounds) / sizeof(g_bounds[0]) + 1)
+
+static const char *g_names[METRICS_COUNT] = {
+	"timers",
+	"select",
+	"io",
+	"gc",
+	"loop",
+	"callback",
+	"events",
+	"turn",
+	"lag"
+};
+
+typedef struct {
+	uint32_t buckets[METRICS_BUCKETS];
+	uint32_t count;
+	uint32_t max;
+	uint64_t sum;
+} metrics_histogram_t;
+
+static metrics_histogram_t g_histograms[METRICS_COUNT];
+static int      g_phase = METRICS_NONE; // The phase of loop.js we are in.
+static uint32_t g_phaseStart;
+
+
+/**
+ * Return the time in usecs.  It wraps so only use it for differences.
+ */
+uint32_t metrics_now() {
+#if defined(ESP_PLATFORM)
+	return (uint32_t)esp_timer_get_time();
+#else /* ESP_PLATFORM */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#endif /* ESP_PLATFORM */
+} // metrics_now
+
+
+/**
+ * Add a time to a histogram.
+ */
+void metrics_record(int histogram, uint32_t usecs) {
+	metrics_histogram_t *pHistogram = &g_histograms[histogram];
+	uint32_t bucket = 0;
+	while (bucket < METRICS_BUCKETS - 1 && usecs > g_bounds[bucket]) {
+		bucket++;
+	}
+	pHistogram->buckets[bucket]++;
+	pHistogram->count++;
+	pHistogram->sum += usecs;
+	if (usecs > pHistogram->max) {
+		pHistogram->max = usecs;
+	}
+} // metrics_record
+
+
+/**
+ * End the current phase, recording how long it took, and start the given one.
+ * METRICS_NONE ends the current phase without starting another.
+ */
+void metrics_enter(int histogram) {
+	uint32_t now = metrics_now();
+	if (g_phase != METRICS_NONE) {
+		metrics_record(g_phase, now - g_phaseStart);
+	}
+	g_phase = histogram;
+	g_phaseStart = now;
+} // metrics_enter
+
+
+/*
+ * End the current phase of loop.js and start another.
+ * [0] - phase - One of the PHASE_ constants or NONE.
+ */
+static duk_ret_t js_metrics_enter(duk_context *ctx) {
+	int phase = duk_get_int(ctx, 0);
+	if (phase < METRICS_NONE || phase > METRICS_GC) {
+		phase = METRICS_NONE;
+	}
+	metrics_enter(phase);
+	return 0;
+} // js_metrics_enter
+
+
+/*
+ * Record how late a timer fired.
+ * [0] - msecs
+ */
+static duk_ret_t js_metrics_lag(duk_context *ctx) {
+	double msecs = duk_get_number(ctx, 0);
+	metrics_record(METRICS_LAG, msecs <= 0 ? 0 : msecs >= 4000000 ? 4000000000u : (uint32_t)(msecs * 1000));
+	return 0;
+} // js_metrics_lag
+
+
+/*
+ * Clear the histograms.
+ */
+static duk_ret_t js_metrics_reset(duk_context *ctx) {
+	memset(g_histograms, 0, sizeof(g_histograms));
+	return 0;
+} // js_metrics_reset
+
+
+/*
+ * Return the histograms.  The result is:
+ * {
+ *    bounds: [<upper bound of each bucket but the last in usecs>],
+ *    histograms: {
+ *       <name>: {buckets: [<count of each bucket>], count, sum, max}
+ *    }
+ * }
+ */
+static duk_ret_t js_metrics_snapshot(duk_context *ctx) {
+	uint32_t i, bucket;
+	duk_push_object(ctx);
+	duk_push_array(ctx);
+	for (bucket=0; bucket<METRICS_BUCKETS - 1; bucket++) {
+		duk_push_number(ctx, g_bounds[bucket]);
+		duk_put_prop_index(ctx, -2, bucket);
+	}
+	duk_put_prop_string(ctx, -2, "bounds");
+	duk_push_object(ctx);
+	for (i=0; i<METRICS_COUNT; i++) {
+		metrics_histogram_t *pHistogram = &g_histograms[i];
+		duk_push_object(ctx);
+		duk_push_array(ctx);
+		for (bucket=0; bucket<METRICS_BUCKETS; bucket++) {
+			duk_push_number(ctx, pHistogram->buckets[bucket]);
+			duk_put_prop_index(ctx, -2, bucket);
+		}
+		duk_put_prop_string(ctx, -2, "buckets");
+		duk_push_number(ctx, pHistogram->count);
+		duk_put_prop_string(ctx, -2, "count");
+		duk_push_number(ctx, (double)pHistogram->sum);
+		duk_put_prop_string(ctx, -2, "sum");
+		duk_push_number(ctx, pHistogram->max);
+		duk_put_prop_string(ctx, -2, "max");
+		duk_put_prop_string(ctx, -2, g_names[i]);
+	}
+	duk_put_prop_string(ctx, -2, "histograms");
+	return 1;
+} // js_metrics_snapshot
+
+
+/**
+ * Add native methods to the Metrics object.
+ * [0] - Metrics Object
+ */
+duk_ret_t ModuleMetrics(duk_context *ctx) {
+
+	ADD_FUNCTION("enter",    js_metrics_enter,    1);
+	ADD_FUNCTION("lag",      js_metrics_lag,      1);
+	ADD_FUNCTION("reset",    js_metrics_reset,    0);
+	ADD_FUNCTION("snapshot", js_metrics_snapshot, 0);
+
+	ADD_INT("PHASE_NONE",   METRICS_NONE);
+	ADD_INT("PHASE_TIMERS", METRICS_TIMERS);
+	ADD_INT("PHASE_SELECT", METRICS_SELECT);
+	ADD_INT("PHASE_IO",     METRICS_IO);
+	ADD_INT("PHASE_GC",     METRICS_GC);
+
+	return 0;
+} // ModuleMetrics
@@ -0,0 +1,1838 @@
+/*
+ * MQTT 3.1.1 client.
+ *
+ * Publishing each reading with an HTTP request costs a TCP connect (and possibly a TLS
+ * handshake) per message.  An MQTT client keeps one connection to the broker open and
+ * writes messages down it back to back.  Each client has its own task which owns the
+ * socket: it connects (over TLS if asked), sends CONNECT, answers keepalive with PINGREQ,
+ * sends queued messages, tracks QoS 1 acknowledgements and reconnects with a backoff
+ * when the connection is lost.  None of this runs on the JavaScript task, so a slow
+ * broker or network never stalls the runtime.
+ *
+ * Outbound messages are queued in RAM (up to queueSize of them).  The task encodes as
+ * many as it can into one buffer and writes them with one call, keeping at most
+ * inflightWindow QoS 1 messages unacknowledged.  Messages that were sent but not
+ * acknowledged when the connection was lost are sent again (with DUP set) on the next
+ * connection.  If a spill file is configured, messages published while we are offline
+ * and the RAM queue is full are appended to the file and read back once we are
+ * connected again.  Messages still undelivered when the client ends are written to the
+ * file too, so they are sent by the next client that uses it.
+ *
+ * Each spilled message is a record with an 8 byte header:
+ * * 'Q'                - marker
+ * * flags    (1 byte)  - QoS in bits 0-1, retain in bit 2
+ * * topic    (2 bytes) - little endian length of the topic
+ * * payload  (4 bytes) - little endian length of the payload
+ * followed by the topic and the payload.
+ *
+ * Received messages are collected into a batch and one event is posted for the batch.
+ * While that event waits to be processed, further messages join the batch.  If
+ * JavaScript falls too far behind, the task stops reading from the socket.
+ *
+ * Everything the task reports reaches JavaScript through the dispatcher function given
+ * to create(), called as dispatcher(event, data):
+ * * "connect", sessionPresent - the broker accepted the connection.
+ * * "message", [{topic, payload, qos, retain}, ...] - a batch of received messages.
+ * * "close", reason - the connection was lost or closed.
+ * * "error", reason - a connection attempt failed.
+ * * "end", stats - the client has finished.  Its pointer must no longer be used.
+ *
+ * QoS 2 is not supported.  Messages published with QoS 2 are sent with QoS 1 and
+ * subscriptions ask for at most QoS 1.
+ *
+ * The functions exposed are:
+ * * create
+ * * end
+ * * publish
+ * * stats
+ * * subscribe
+ * * unsubscribe
+ */
+#if defined(ESP_PLATFORM)
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <lwip/netdb.h>
+#include <lwip/sockets.h>
+
+#include "sdkconfig.h"
+#else /* ESP_PLATFORM */
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif /* ESP_PLATFORM */
+
+#include <duktape.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "c_timeutils.h"
+#include "duktape_event.h"
+#include "duktape_utils.h"
+#include "logging.h"
+#include "module_fs.h"
+#include "module_mqtt.h"
+#include "module_ssl.h"
+
+LOG_TAG("module_mqtt");
+
+// Value identifying a client behind a pointer passed in from JavaScript.
+#define MQTT_MAGIC (0x4D515454) // "MQTT"
+
+#define MQTT_DEFAULT_PORT            (1883)
+#define MQTT_DEFAULT_SSL_PORT        (8883)
+#define MQTT_DEFAULT_KEEPALIVE       (60)    // Seconds.
+#define MQTT_DEFAULT_INFLIGHT        (8)     // Unacknowledged QoS 1 messages.
+#define MQTT_MAX_INFLIGHT            (64)
+#define MQTT_DEFAULT_QUEUE_SIZE      (64)    // Messages held in RAM.
+#define MQTT_DEFAULT_MAX_PACKET      (8192)  // Largest packet we accept from the broker.
+#define MQTT_DEFAULT_CONNECT_TIMEOUT (10000) // Msecs to connect and receive CONNACK.
+
+#define MQTT_POLL_MS          (20)    // Longest wait before looking at the queue again.
+#define MQTT_WAIT_SLICE_MS    (100)   // Longest wait before looking for end() while connecting.
+#define MQTT_MIN_BACKOFF_MS   (1000)  // First wait before reconnecting.
+#define MQTT_MAX_BACKOFF_MS   (60000)
+#define MQTT_END_GRACE_MS     (5000)  // How long end() waits for queued messages to be sent.
+#define MQTT_OUT_HIGH_WATER   (4096)  // Stop encoding messages once this much is waiting to be written.
+#define MQTT_MAX_INBOUND      (256)   // Stop reading once this many received messages are undelivered.
+
+#define MQTT_MAX_HOST         (128)
+#define MQTT_MAX_PATH         (128)
+#define MQTT_ERROR_SIZE       (96)
+#define MQTT_SPILL_HEADER     (8)
+
+#define MQTT_TASK_STACK       (4096)
+#define MQTT_SSL_TASK_STACK   (8192)  // The TLS handshake needs more stack.
+
+// Control packet types (the top 4 bits of the first byte).
+#define MQTT_CONNECT     (0x10)
+#define MQTT_CONNACK     (0x20)
+#define MQTT_PUBLISH     (0x30)
+#define MQTT_PUBACK      (0x40)
+#define MQTT_SUBSCRIBE   (0x82) // Includes the reserved bits that must be set.
+#define MQTT_SUBACK      (0x90)
+#define MQTT_UNSUBSCRIBE (0xA2)
+#define MQTT_UNSUBACK    (0xB0)
+#define MQTT_PINGREQ     (0xC0)
+#define MQTT_PINGRESP    (0xD0)
+#define MQTT_DISCONNECT  (0xE0)
+
+// Events the task has to post once it has released the lock.
+#define MQTT_POST_MESSAGES (0x01)
+#define MQTT_POST_CONNECT  (0x02)
+
+/*
+ * A message, outbound or received.  The topic and payload are allocated with it.
+ */
+typedef struct dukf_mqtt_message {
+	char                     *topic;
+	uint8_t                  *payload;
+	uint32_t                  length;
+	uint8_t                   qos;
+	bool                      retain;
+	bool                      dup;      // Sent before but not acknowledged.
+	uint16_t                  packetId; // Set when a QoS 1 message is first sent.
+	struct dukf_mqtt_message *next;
+} dukf_mqtt_message_t;
+
+/*
+ * A subscription, or a topic to unsubscribe from.
+ */
+typedef struct dukf_mqtt_sub {
+	char                 *topic;
+	uint8_t               qos;
+	bool                  send; // Does the broker need to be told?
+	struct dukf_mqtt_sub *next;
+} dukf_mqtt_sub_t;
+
+typedef struct {
+	uint32_t connects;
+	uint32_t disconnects;
+	uint32_t published;   // PUBLISH packets sent for the first time.
+	uint32_t resent;      // PUBLISH packets sent again after a reconnect.
+	uint32_t acked;       // PUBACKs received.
+	uint32_t received;    // PUBLISH packets received.
+	uint32_t batches;     // Events posted for received messages.
+	uint32_t dropped;     // Messages refused because the queue was full.
+	uint32_t spilled;     // Messages written to the spill file.
+	uint32_t unspilled;   // Messages read back from the spill file.
+	uint32_t writes;      // Socket (or TLS) writes.
+	uint32_t bytesOut;
+	uint32_t bytesIn;
+	uint32_t pings;
+	uint32_t inflightPeak;
+} dukf_mqtt_stats_t;
+
+typedef struct {
+	uint32_t magic;
+
+	// Configuration.  Not changed once the task has started.
+	char     host[MQTT_MAX_HOST];
+	int      port;
+	char    *clientId;
+	char    *username;    // NULL if none.
+	char    *password;    // NULL if none.
+	uint16_t keepAlive;   // Seconds, 0 for none.
+	bool     cleanSession;
+	bool     useSSL;
+	int      inflightWindow;
+	int      queueSize;
+	size_t   maxPacketSize;
+	uint32_t connectTimeout;
+	char     spillPath[MQTT_MAX_PATH]; // Empty if there is no spill file.
+	uint32_t dispatcherStashKey;
+
+	// Shared by the JavaScript task and the client task.  Guarded by the lock.
+#if defined(ESP_PLATFORM)
+	SemaphoreHandle_t lock;
+#else /* ESP_PLATFORM */
+	pthread_mutex_t   lock;
+#endif /* ESP_PLATFORM */
+	bool                 endRequested;
+	uint32_t             endTime;       // When end() was called.
+	bool                 connected;     // CONNACK has been received on the current connection.
+	dukf_mqtt_message_t *pendingHead;   // Messages waiting to be sent.
+	dukf_mqtt_message_t *pendingTail;
+	int                  pendingCount;
+	dukf_mqtt_message_t *inflightHead;  // QoS 1 messages sent but not acknowledged.
+	dukf_mqtt_message_t *inflightTail;
+	int                  inflightCount;
+	dukf_mqtt_message_t *inboundHead;   // Received messages not yet delivered.
+	dukf_mqtt_message_t *inboundTail;
+	int                  inboundCount;
+	bool                 inboundPosted; // Has an event been posted for the inbound messages?
+	dukf_mqtt_sub_t     *subs;
+	dukf_mqtt_sub_t     *unsubs;
+	uint32_t             spillSize;     // Bytes in the spill file.
+	uint32_t             spillOffset;   // Bytes of the spill file already read back.
+	dukf_mqtt_stats_t    stats;
+
+	// Owned by the client task.
+	int                 fd;
+	dukf_ssl_context_t *ssl;
+	uint8_t            *out;            // Encoded packets waiting to be written.
+	size_t              outLen;
+	size_t              outSize;
+	size_t              sslRetryLen;    // Length of a TLS write that must be repeated.
+	uint8_t            *in;             // Received bytes not yet processed.
+	size_t              inLen;
+	uint16_t            nextPacketId;
+	bool                sessionPresent;
+	bool                pingOutstanding;
+	uint32_t            pingTime;
+	uint32_t            lastSend;
+	uint32_t            connectStart;
+	int                 post;           // MQTT_POST_* flags.
+	char                lastError[MQTT_ERROR_SIZE];
+} dukf_mqtt_client_t;
+
+/*
+ * The data of a "connect", "close", "error" or "end" event.
+ */
+typedef struct {
+	dukf_mqtt_client_t *client;
+	const char         *event;
+	char                message[MQTT_ERROR_SIZE];
+	bool                sessionPresent;
+	bool                last; // The "end" event.  The client is freed once it is delivered.
+} dukf_mqtt_status_t;
+
+
+/**
+ * Get the current time in msecs.
+ */
+static uint32_t mqtt_millis() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return timeval_toMsecs(&tv);
+} // mqtt_millis
+
+
+static void mqtt_sleep(uint32_t msecs) {
+#if defined(ESP_PLATFORM)
+	vTaskDelay(msecs / portTICK_PERIOD_MS);
+#else /* ESP_PLATFORM */
+	usleep((useconds_t)msecs * 1000);
+#endif /* ESP_PLATFORM */
+} // mqtt_sleep
+
+
+static void mqtt_lock(dukf_mqtt_client_t *client) {
+#if defined(ESP_PLATFORM)
+	xSemaphoreTake(client->lock, portMAX_DELAY);
+#else /* ESP_PLATFORM */
+	pthread_mutex_lock(&client->lock);
+#endif /* ESP_PLATFORM */
+} // mqtt_lock
+
+
+static void mqtt_unlock(dukf_mqtt_client_t *client) {
+#if defined(ESP_PLATFORM)
+	xSemaphoreGive(client->lock);
+#else /* ESP_PLATFORM */
+	pthread_mutex_unlock(&client->lock);
+#endif /* ESP_PLATFORM */
+} // mqtt_unlock
+
+
+/*
+ * Record why the connection failed.
+ */
+static void mqtt_setError(dukf_mqtt_client_t *client, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vsnprintf(client->lastError, sizeof(client->lastError), format, args);
+	va_end(args);
+	LOGD("%s:%d: %s", client->host, client->port, client->lastError);
+} // mqtt_setError
+
+
+/*
+ * Allocate a message with room for its topic and payload.
+ */
+static dukf_mqtt_message_t *mqtt_newMessage(const char *topic, size_t topicLength, const uint8_t *payload, uint32_t length, uint8_t qos, bool retain) {
+	dukf_mqtt_message_t *message = malloc(sizeof(dukf_mqtt_message_t) + topicLength + 1 + length);
+	if (message == NULL) {
+		LOGE("mqtt_newMessage: out of memory");
+		return NULL;
+	}
+	message->topic = (char *)(message + 1);
+	memcpy(message->topic, topic, topicLength);
+	message->topic[topicLength] = '\0';
+	message->payload = (uint8_t *)message->topic + topicLength + 1;
+	if (length > 0) {
+		memcpy(message->payload, payload, length);
+	}
+	message->length = length;
+	message->qos = qos;
+	message->retain = retain;
+	message->dup = false;
+	message->packetId = 0;
+	message->next = NULL;
+	return message;
+} // mqtt_newMessage
+
+
+static void mqtt_append(dukf_mqtt_message_t **head, dukf_mqtt_message_t **tail, dukf_mqtt_message_t *message) {
+	message->next = NULL;
+	if (*tail == NULL) {
+		*head = message;
+	} else {
+		(*tail)->next = message;
+	}
+	*tail = message;
+} // mqtt_append
+
+
+static void mqtt_freeMessages(dukf_mqtt_message_t *message) {
+	while (message != NULL) {
+		dukf_mqtt_message_t *next = message->next;
+		free(message);
+		message = next;
+	}
+} // mqtt_freeMessages
+
+
+static void mqtt_freeSubs(dukf_mqtt_sub_t *sub) {
+	while (sub != NULL) {
+		dukf_mqtt_sub_t *next = sub->next;
+		free(sub->topic);
+		free(sub);
+		sub = next;
+	}
+} // mqtt_freeSubs
+
+
+/*
+ * Find the subscription to the topic in a list.  If prev is supplied it is set to the
+ * entry before it.
+ */
+static dukf_mqtt_sub_t *mqtt_findSub(dukf_mqtt_sub_t *list, const char *topic, dukf_mqtt_sub_t **prev) {
+	dukf_mqtt_sub_t *before = NULL;
+	while (list != NULL && strcmp(list->topic, topic) != 0) {
+		before = list;
+		list = list->next;
+	}
+	if (prev != NULL) {
+		*prev = before;
+	}
+	return list;
+} // mqtt_findSub
+
+
+/*
+ * Remove the subscription to the topic from a list.  Returns false if there was none.
+ */
+static bool mqtt_removeSub(dukf_mqtt_sub_t **list, const char *topic) {
+	dukf_mqtt_sub_t *prev;
+	dukf_mqtt_sub_t *sub = mqtt_findSub(*list, topic, &prev);
+	if (sub == NULL) {
+		return false;
+	}
+	if (prev == NULL) {
+		*list = sub->next;
+	} else {
+		prev->next = sub->next;
+	}
+	free(sub->topic);
+	free(sub);
+	return true;
+} // mqtt_removeSub
+
+
+/*
+ * Add a topic to a list.  Returns false if we ran out of memory.
+ */
+static bool mqtt_addSub(dukf_mqtt_sub_t **list, const char *topic, uint8_t qos) {
+	dukf_mqtt_sub_t *sub = mqtt_findSub(*list, topic, NULL);
+	if (sub == NULL) {
+		sub = malloc(sizeof(dukf_mqtt_sub_t));
+		if (sub == NULL) {
+			return false;
+		}
+		sub->topic = strdup(topic);
+		if (sub->topic == NULL) {
+			free(sub);
+			return false;
+		}
+		sub->next = *list;
+		*list = sub;
+	}
+	sub->qos = qos;
+	sub->send = true;
+	return true;
+} // mqtt_addSub
+
+
+/*
+ * Spill file.  These are called with the lock held.
+ */
+
+/*
+ * Write messages to the end of an open file.  Returns false if a write failed.
+ */
+static bool mqtt_spillWrite(int fd, dukf_mqtt_message_t *message, uint32_t *size) {
+	uint8_t header[MQTT_SPILL_HEADER];
+	size_t topicLength = strlen(message->topic);
+	header[0] = 'Q';
+	header[1] = (message->qos & 0x03) | (message->retain ? 0x04 : 0);
+	header[2] = topicLength & 0xff;
+	header[3] = (topicLength >> 8) & 0xff;
+	header[4] = message->length & 0xff;
+	header[5] = (message->length >> 8) & 0xff;
+	header[6] = (message->length >> 16) & 0xff;
+	header[7] = (message->length >> 24) & 0xff;
+	if (write(fd, header, sizeof(header)) != sizeof(header) ||
+		write(fd, message->topic, topicLength) != (ssize_t)topicLength ||
+		(message->length > 0 && write(fd, message->payload, message->length) != (ssize_t)message->length)) {
+		LOGE("mqtt_spillWrite: write failed: %d %s", errno, strerror(errno));
+		return false;
+	}
+	*size += sizeof(header) + topicLength + message->length;
+	return true;
+} // mqtt_spillWrite
+
+
+/*
+ * Append a message to the spill file.  Returns false if it could not be written.
+ */
+static bool mqtt_spillAppend(dukf_mqtt_client_t *client, dukf_mqtt_message_t *message) {
+	int fd = open(client->spillPath, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if (fd < 0) {
+		LOGE("mqtt_spillAppend: Unable to open %s: %d %s", client->spillPath, errno, strerror(errno));
+		return false;
+	}
+	bool ok = mqtt_spillWrite(fd, message, &client->spillSize);
+	close(fd);
+	dukf_fs_invalidateListing();
+	if (ok) {
+		client->stats.spilled++;
+	}
+	return ok;
+} // mqtt_spillAppend
+
+
+/*
+ * Forget the spill file once everything in it has been read back.
+ */
+static void mqtt_spillReset(dukf_mqtt_client_t *client) {
+	unlink(client->spillPath);
+	dukf_fs_invalidateListing();
+	client->spillSize = 0;
+	client->spillOffset = 0;
+} // mqtt_spillReset
+
+
+/*
+ * Read spilled messages back onto the end of the pending queue until it holds
+ * queueSize messages or the file has been read.
+ */
+static void mqtt_spillRefill(dukf_mqtt_client_t *client) {
+	uint8_t header[MQTT_SPILL_HEADER];
+	int fd = open(client->spillPath, O_RDONLY);
+	if (fd < 0 || lseek(fd, client->spillOffset, SEEK_SET) != (off_t)client->spillOffset) {
+		LOGE("mqtt_spillRefill: Unable to read %s: %d %s", client->spillPath, errno, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		mqtt_spillReset(client);
+		return;
+	}
+	while (client->pendingCount < client->queueSize && client->spillOffset < client->spillSize) {
+		if (read(fd, header, sizeof(header)) != sizeof(header) || header[0] != 'Q') {
+			break;
+		}
+		size_t topicLength = header[2] | (header[3] << 8);
+		uint32_t length = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+		if (client->spillOffset + sizeof(header) + topicLength + length > client->spillSize) {
+			break; // A partial record, most likely from a power loss while writing.
+		}
+		dukf_mqtt_message_t *message = malloc(sizeof(dukf_mqtt_message_t) + topicLength + 1 + length);
+		if (message == NULL) {
+			close(fd);
+			return; // Try again later.
+		}
+		message->topic = (char *)(message + 1);
+		message->payload = (uint8_t *)message->topic + topicLength + 1;
+		message->length = length;
+		message->qos = header[1] & 0x03;
+		message->retain = (header[1] & 0x04) != 0;
+		message->dup = false;
+		message->packetId = 0;
+		if (read(fd, message->topic, topicLength) != (ssize_t)topicLength ||
+			(length > 0 && read(fd, message->payload, length) != (ssize_t)length)) {
+			free(message);
+			break;
+		}
+		message->topic[topicLength] = '\0';
+		mqtt_append(&client->pendingHead, &client->pendingTail, message);
+		client->pendingCount++;
+		client->spillOffset += sizeof(header) + topicLength + length;
+		client->stats.unspilled++;
+	}
+	close(fd);
+	if (client->spillOffset < client->spillSize &&
+		client->pendingCount < client->queueSize) {
+		// We stopped early on a damaged record.  Nothing after it can be trusted.
+		LOGE("mqtt_spillRefill: %s is damaged after %u bytes, discarding the rest", client->spillPath, client->spillOffset);
+		client->spillSize = client->spillOffset;
+	}
+	if (client->spillOffset >= client->spillSize) {
+		mqtt_spillReset(client);
+	}
+} // mqtt_spillRefill
+
+
+/*
+ * Save the messages that are still in RAM when the client ends.  They are older than
+ * anything left in the spill file so they are written first: the new file holds the
+ * unacknowledged messages, the pending messages and then the unread part of the old file.
+ */
+static void mqtt_spillSave(dukf_mqtt_client_t *client) {
+	char tmpPath[MQTT_MAX_PATH + 4];
+	uint8_t buffer[256];
+	uint32_t size = 0;
+	dukf_mqtt_message_t *lists[2] = { client->inflightHead, client->pendingHead };
+	int i;
+
+	if (client->inflightHead == NULL && client->pendingHead == NULL) {
+		return;
+	}
+	snprintf(tmpPath, sizeof(tmpPath), "%s.new", client->spillPath);
+	int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if (fd < 0) {
+		LOGE("mqtt_spillSave: Unable to open %s: %d %s", tmpPath, errno, strerror(errno));
+		return;
+	}
+	bool ok = true;
+	for (i=0; i<2 && ok; i++) {
+		dukf_mqtt_message_t *message;
+		for (message = lists[i]; message != NULL && ok; message = message->next) {
+			ok = mqtt_spillWrite(fd, message, &size);
+			client->stats.spilled++;
+		}
+	}
+	if (ok && client->spillOffset < client->spillSize) {
+		int oldFd = open(client->spillPath, O_RDONLY);
+		ok = oldFd >= 0 && lseek(oldFd, client->spillOffset, SEEK_SET) == (off_t)client->spillOffset;
+		ssize_t count;
+		while (ok && (count = read(oldFd, buffer, sizeof(buffer))) > 0) {
+			ok = write(fd, buffer, count) == count;
+			size += count;
+		}
+		if (oldFd >= 0) {
+			close(oldFd);
+		}
+	}
+	close(fd);
+	if (!ok) {
+		LOGE("mqtt_spillSave: Unable to save undelivered messages to %s", client->spillPath);
+		unlink(tmpPath);
+	} else {
+		unlink(client->spillPath);
+		rename(tmpPath, client->spillPath);
+		client->spillSize = size;
+		client->spillOffset = 0;
+	}
+	dukf_fs_invalidateListing();
+} // mqtt_spillSave
+
+
+/*
+ * Packet encoding.  Packets are appended to the client's output buffer.
+ */
+
+/*
+ * Make room for len more bytes in the output buffer and return where they go, or NULL
+ * if we ran out of memory.
+ */
+static uint8_t *mqtt_reserve(dukf_mqtt_client_t *client, size_t len) {
+	if (client->outLen + len > client->outSize) {
+		size_t size = client->outSize * 2;
+		while (size < client->outLen + len) {
+			size *= 2;
+		}
+		uint8_t *out = realloc(client->out, size);
+		if (out == NULL) {
+			LOGE("mqtt_reserve: out of memory");
+			return NULL;
+		}
+		client->out = out;
+		client->outSize = size;
+	}
+	uint8_t *p = client->out + client->outLen;
+	client->outLen += len;
+	return p;
+} // mqtt_reserve
+
+
+/*
+ * Start a packet with its fixed header and reserve room for the remaining bytes.
+ * Returns where the remaining bytes go.
+ */
+static uint8_t *mqtt_startPacket(dukf_mqtt_client_t *client, uint8_t type, uint32_t remaining) {
+	uint8_t header[5];
+	size_t headerLength = 0;
+	uint32_t length = remaining;
+	header[headerLength++] = type;
+	do {
+		uint8_t b = length % 128;
+		length /= 128;
+		header[headerLength++] = length > 0 ? b | 0x80 : b;
+	} while (length > 0);
+	uint8_t *p = mqtt_reserve(client, headerLength + remaining);
+	if (p == NULL) {
+		return NULL;
+	}
+	memcpy(p, header, headerLength);
+	return p + headerLength;
+} // mqtt_startPacket
+
+
+static uint8_t *mqtt_put16(uint8_t *p, uint16_t value) {
+	*p++ = value >> 8;
+	*p++ = value & 0xff;
+	return p;
+} // mqtt_put16
+
+
+static uint8_t *mqtt_putString(uint8_t *p, const char *s, size_t length) {
+	p = mqtt_put16(p, length);
+	memcpy(p, s, length);
+	return p + length;
+} // mqtt_putString
+
+
+/*
+ * Append a packet.  The bytes after the fixed header are supplied.
+ */
+static bool mqtt_putPacket(dukf_mqtt_client_t *client, uint8_t type, const uint8_t *body, uint32_t length) {
+	uint8_t *p = mqtt_startPacket(client, type, length);
+	if (p == NULL) {
+		return false;
+	}
+	memcpy(p, body, length);
+	return true;
+} // mqtt_putPacket
+
+
+static uint16_t mqtt_newPacketId(dukf_mqtt_client_t *client) {
+	client->nextPacketId++;
+	if (client->nextPacketId == 0) {
+		client->nextPacketId = 1;
+	}
+	return client->nextPacketId;
+} // mqtt_newPacketId
+
+
+static bool mqtt_putConnect(dukf_mqtt_client_t *client) {
+	size_t idLength = strlen(client->clientId);
+	size_t userLength = client->username == NULL ? 0 : strlen(client->username);
+	size_t passwordLength = client->password == NULL ? 0 : strlen(client->password);
+	uint32_t remaining = 10 + 2 + idLength;
+	uint8_t flags = client->cleanSession ? 0x02 : 0;
+	if (client->username != NULL) {
+		flags |= 0x80;
+		remaining += 2 + userLength;
+	}
+	if (client->password != NULL) {
+		flags |= 0x40;
+		remaining += 2 + passwordLength;
+	}
+	uint8_t *p = mqtt_startPacket(client, MQTT_CONNECT, remaining);
+	if (p == NULL) {
+		return false;
+	}
+	p = mqtt_putString(p, "MQTT", 4);
+	*p++ = 4; // Protocol level 3.1.1
+	*p++ = flags;
+	p = mqtt_put16(p, client->keepAlive);
+	p = mqtt_putString(p, client->clientId, idLength);
+	if (client->username != NULL) {
+		p = mqtt_putString(p, client->username, userLength);
+	}
+	if (client->password != NULL) {
+		p = mqtt_putString(p, client->password, passwordLength);
+	}
+	return true;
+} // mqtt_putConnect
+
+
+static bool mqtt_putPublish(dukf_mqtt_client_t *client, dukf_mqtt_message_t *message) {
+	size_t topicLength = strlen(message->topic);
+	uint32_t remaining = 2 + topicLength + (message->qos > 0 ? 2 : 0) + message->length;
+	uint8_t type = MQTT_PUBLISH | (message->dup ? 0x08 : 0) | (message->qos << 1) | (message->retain ? 0x01 : 0);
+	uint8_t *p = mqtt_startPacket(client, type, remaining);
+	if (p == NULL) {
+		return false;
+	}
+	p = mqtt_putString(p, message->topic, topicLength);
+	if (message->qos > 0) {
+		p = mqtt_put16(p, message->packetId);
+	}
+	memcpy(p, message->payload, message->length);
+	return true;
+} // mqtt_putPublish
+
+
+static bool mqtt_putSubscribe(dukf_mqtt_client_t *client, dukf_mqtt_sub_t *sub, bool unsubscribe) {
+	size_t topicLength = strlen(sub->topic);
+	uint32_t remaining = 2 + 2 + topicLength + (unsubscribe ? 0 : 1);
+	uint8_t *p = mqtt_startPacket(client, unsubscribe ? MQTT_UNSUBSCRIBE : MQTT_SUBSCRIBE, remaining);
+	if (p == NULL) {
+		return false;
+	}
+	p = mqtt_put16(p, mqtt_newPacketId(client));
+	p = mqtt_putString(p, sub->topic, topicLength);
+	if (!unsubscribe) {
+		*p = sub->qos;
+	}
+	return true;
+} // mqtt_putSubscribe
+
+
+/*
+ * Encode what should be sent next: changes to subscriptions and then queued messages
+ * while the in-flight window and the output buffer have room.  Called with the lock held.
+ */
+static bool mqtt_fill(dukf_mqtt_client_t *client) {
+	dukf_mqtt_sub_t *sub;
+	for (sub = client->subs; sub != NULL; sub = sub->next) {
+		if (sub->send) {
+			if (!mqtt_putSubscribe(client, sub, false)) {
+				return false;
+			}
+			sub->send = false;
+		}
+	}
+	while (client->unsubs != NULL) {
+		if (!mqtt_putSubscribe(client, client->unsubs, true)) {
+			return false;
+		}
+		mqtt_removeSub(&client->unsubs, client->unsubs->topic);
+	}
+
+	if (client->spillSize > client->spillOffset && client->pendingCount <= client->queueSize / 2) {
+		mqtt_spillRefill(client);
+	}
+
+	while (client->pendingHead != NULL && client->outLen < MQTT_OUT_HIGH_WATER) {
+		dukf_mqtt_message_t *message = client->pendingHead;
+		if (message->qos > 0 && client->inflightCount >= client->inflightWindow) {
+			break;
+		}
+		if (message->qos > 0 && message->packetId == 0) {
+			message->packetId = mqtt_newPacketId(client);
+		}
+		if (!mqtt_putPublish(client, message)) {
+			return false;
+		}
+		if (message->dup) {
+			client->stats.resent++;
+		} else {
+			client->stats.published++;
+		}
+		client->pendingHead = message->next;
+		if (client->pendingHead == NULL) {
+			client->pendingTail = NULL;
+		}
+		client->pendingCount--;
+		if (message->qos == 0) {
+			free(message);
+		} else {
+			mqtt_append(&client->inflightHead, &client->inflightTail, message);
+			client->inflightCount++;
+			if ((uint32_t)client->inflightCount > client->stats.inflightPeak) {
+				client->stats.inflightPeak = (uint32_t)client->inflightCount;
+			}
+		}
+	}
+	return true;
+} // mqtt_fill
+
+
+/*
+ * Move the unacknowledged messages back to the head of the pending queue so that they
+ * are sent again, with DUP set, on the next connection.  Called with the lock held.
+ */
+static void mqtt_requeueInflight(dukf_mqtt_client_t *client) {
+	dukf_mqtt_message_t *message;
+	if (client->inflightHead == NULL) {
+		return;
+	}
+	for (message = client->inflightHead; message != NULL; message = message->next) {
+		message->dup = true;
+	}
+	client->inflightTail->next = client->pendingHead;
+	if (client->pendingTail == NULL) {
+		client->pendingTail = client->inflightTail;
+	}
+	client->pendingHead = client->inflightHead;
+	client->pendingCount += client->inflightCount;
+	client->inflightHead = client->inflightTail = NULL;
+	client->inflightCount = 0;
+} // mqtt_requeueInflight
+
+
+/*
+ * Packet decoding.
+ */
+
+static void mqtt_handleConnack(dukf_mqtt_client_t *client, const uint8_t *body, uint32_t length) {
+	if (length < 2) {
+		mqtt_setError(client, "bad CONNACK");
+		return;
+	}
+	if (body[1] != 0) {
+		static const char *reasons[] = {
+			"", "unacceptable protocol version", "identifier rejected",
+			"server unavailable", "bad user name or password", "not authorized"
+		};
+		mqtt_setError(client, "connection refused: %s", body[1] < 6 ? reasons[body[1]] : "unknown reason");
+		return;
+	}
+	client->connected = true;
+	client->sessionPresent = (body[0] & 0x01) != 0;
+	client->stats.connects++;
+	if (!client->sessionPresent) {
+		// The broker doesn't know our subscriptions, tell it again.
+		dukf_mqtt_sub_t *sub;
+		for (sub = client->subs; sub != NULL; sub = sub->next) {
+			sub->send = true;
+		}
+	}
+	client->post |= MQTT_POST_CONNECT;
+} // mqtt_handleConnack
+
+
+static bool mqtt_handlePublish(dukf_mqtt_client_t *client, uint8_t type, const uint8_t *body, uint32_t length) {
+	uint8_t qos = (type >> 1) & 0x03;
+	if (length < 2) {
+		mqtt_setError(client, "bad PUBLISH");
+		return false;
+	}
+	size_t topicLength = (body[0] << 8) | body[1];
+	size_t headerLength = 2 + topicLength + (qos > 0 ? 2 : 0);
+	if (headerLength > length) {
+		mqtt_setError(client, "bad PUBLISH");
+		return false;
+	}
+	dukf_mqtt_message_t *message = mqtt_newMessage((const char *)body + 2, topicLength, body + headerLength, length - headerLength, qos, (type & 0x01) != 0);
+	if (message == NULL) {
+		mqtt_setError(client, "out of memory");
+		return false;
+	}
+	if (qos > 0) {
+		// We only ever subscribe with QoS 1 or less so a PUBACK is the right answer.
+		uint8_t ack[2] = { body[2 + topicLength], body[2 + topicLength + 1] };
+		if (!mqtt_putPacket(client, MQTT_PUBACK, ack, sizeof(ack))) {
+			free(message);
+			mqtt_setError(client, "out of memory");
+			return false;
+		}
+	}
+	mqtt_append(&client->inboundHead, &client->inboundTail, message);
+	client->inboundCount++;
+	client->stats.received++;
+	if (!client->inboundPosted) {
+		client->inboundPosted = true;
+		client->post |= MQTT_POST_MESSAGES;
+	}
+	return true;
+} // mqtt_handlePublish
+
+
+static void mqtt_handlePuback(dukf_mqtt_client_t *client, const uint8_t *body, uint32_t length) {
+	if (length < 2) {
+		return;
+	}
+	uint16_t packetId = (body[0] << 8) | body[1];
+	dukf_mqtt_message_t *prev = NULL;
+	dukf_mqtt_message_t *message = client->inflightHead;
+	while (message != NULL && message->packetId != packetId) {
+		prev = message;
+		message = message->next;
+	}
+	if (message == NULL) {
+		LOGD("PUBACK for unknown packet %d", packetId);
+		return;
+	}
+	if (prev == NULL) {
+		client->inflightHead = message->next;
+	} else {
+		prev->next = message->next;
+	}
+	if (client->inflightTail == message) {
+		client->inflightTail = prev;
+	}
+	client->inflightCount--;
+	client->stats.acked++;
+	free(message);
+} // mqtt_handlePuback
+
+
+/*
+ * Process the complete packets in the input buffer.  Returns false if the connection
+ * must be dropped.  Called with the lock held.
+ */
+static bool mqtt_process(dukf_mqtt_client_t *client) {
+	size_t offset = 0;
+	bool ok = true;
+	while (ok && client->inLen - offset >= 2) {
+		uint8_t *p = client->in + offset;
+		uint32_t remaining = 0;
+		uint32_t multiplier = 1;
+		size_t headerLength = 1;
+		bool complete = false;
+		while (headerLength < 5 && offset + headerLength < client->inLen) {
+			uint8_t b = p[headerLength++];
+			remaining += (b & 0x7f) * multiplier;
+			multiplier *= 128;
+			if ((b & 0x80) == 0) {
+				complete = true;
+				break;
+			}
+		}
+		if (!complete) {
+			if (headerLength == 5) {
+				mqtt_setError(client, "bad packet length");
+				return false;
+			}
+			break; // Wait for the rest of the header.
+		}
+		if (headerLength + remaining > client->maxPacketSize) {
+			mqtt_setError(client, "packet of %u bytes is larger than maxPacketSize", headerLength + remaining);
+			return false;
+		}
+		if (offset + headerLength + remaining > client->inLen) {
+			break; // Wait for the rest of the packet.
+		}
+		uint8_t *body = p + headerLength;
+		switch(p[0] & 0xf0) {
+			case MQTT_CONNACK:
+				mqtt_handleConnack(client, body, remaining);
+				ok = client->connected;
+				break;
+			case MQTT_PUBLISH:
+				ok = mqtt_handlePublish(client, p[0], body, remaining);
+				break;
+			case MQTT_PUBACK:
+				mqtt_handlePuback(client, body, remaining);
+				break;
+			case MQTT_SUBACK: {
+				uint32_t i;
+				for (i=2; i<remaining; i++) {
+					if (body[i] == 0x80) {
+						LOGE("%s:%d: a subscription was refused", client->host, client->port);
+					}
+				}
+				break;
+			}
+			case MQTT_PINGRESP:
+				client->pingOutstanding = false;
+				break;
+			case MQTT_UNSUBACK:
+				break;
+			default:
+				LOGD("Ignoring packet type 0x%02x", p[0]);
+				break;
+		}
+		offset += headerLength + remaining;
+	}
+	memmove(client->in, client->in + offset, client->inLen - offset);
+	client->inLen -= offset;
+	return ok;
+} // mqtt_process
+
+
+/*
+ * Socket I/O.  These run on the client task.
+ */
+
+/*
+ * Wait until the socket is ready or the deadline passes.  Returns 1 if it is ready,
+ * 0 if the deadline passed or end() was called and -1 on an error.
+ */
+static int mqtt_wait(dukf_mqtt_client_t *client, bool forWrite, uint32_t deadline) {
+	while (!client->endRequested) {
+		uint32_t now = mqtt_millis();
+		if ((int32_t)(deadline - now) <= 0) {
+			return 0;
+		}
+		uint32_t wait = deadline - now < MQTT_WAIT_SLICE_MS ? deadline - now : MQTT_WAIT_SLICE_MS;
+		struct timeval tv = { wait / 1000, (wait % 1000) * 1000 };
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(client->fd, &fds);
+		int rc = select(client->fd + 1, forWrite ? NULL : &fds, forWrite ? &fds : NULL, NULL, &tv);
+		if (rc != 0) {
+			return rc > 0 ? 1 : -1;
+		}
+	}
+	return 0;
+} // mqtt_wait
+
+
+/*
+ * Make the TCP connection (and TLS handshake).  Returns false on a failure.
+ */
+static bool mqtt_open(dukf_mqtt_client_t *client) {
+	struct addrinfo hints;
+	struct addrinfo *result;
+	struct sockaddr_in address;
+
+	uint32_t deadline = mqtt_millis() + client->connectTimeout;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(client->host, NULL, &hints, &result) != 0) {
+		mqtt_setError(client, "host not found");
+		return false;
+	}
+	memcpy(&address, result->ai_addr, sizeof(address));
+	freeaddrinfo(result);
+	address.sin_port = htons(client->port);
+
+	client->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (client->fd < 0) {
+		mqtt_setError(client, "socket: %s", strerror(errno));
+		return false;
+	}
+	int flag = 1;
+	setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL, 0) | O_NONBLOCK);
+	if (connect(client->fd, (struct sockaddr *)&address, sizeof(address)) != 0 && errno != EINPROGRESS) {
+		mqtt_setError(client, "connect: %s", strerror(errno));
+		return false;
+	}
+	int rc = mqtt_wait(client, true, deadline);
+	if (rc <= 0) {
+		mqtt_setError(client, rc == 0 ? "connect timed out" : "connect: select failed");
+		return false;
+	}
+	int error = 0;
+	socklen_t errorLength = sizeof(error);
+	getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &errorLength);
+	if (error != 0) {
+		mqtt_setError(client, "connect: %s", strerror(error));
+		return false;
+	}
+
+	if (client->useSSL) {
+		client->ssl = dukf_ssl_create(client->host, client->fd, client->port);
+		if (client->ssl == NULL) {
+			mqtt_setError(client, "unable to create SSL context");
+			return false;
+		}
+		while ((rc = dukf_ssl_handshake(client->ssl)) != 0) {
+			if (rc != DUKF_SSL_WANT_READ && rc != DUKF_SSL_WANT_WRITE) {
+				mqtt_setError(client, "SSL handshake failed");
+				return false;
+			}
+			if (mqtt_wait(client, rc == DUKF_SSL_WANT_WRITE, deadline) <= 0) {
+				mqtt_setError(client, "SSL handshake timed out");
+				return false;
+			}
+		}
+	}
+	return true;
+} // mqtt_open
+
+
+static void mqtt_close(dukf_mqtt_client_t *client) {
+	if (client->ssl != NULL) {
+		dukf_ssl_free(client->ssl);
+		client->ssl = NULL;
+	}
+	if (client->fd >= 0) {
+		close(client->fd);
+		client->fd = -1;
+	}
+} // mqtt_close
+
+
+/*
+ * Write as much of the output buffer as the socket will take.  Returns false on an error.
+ */
+static bool mqtt_flush(dukf_mqtt_client_t *client) {
+	while (client->outLen > 0) {
+		int rc;
+		if (client->ssl != NULL) {
+			// mbedtls requires a write that couldn't complete to be repeated exactly.
+			size_t len = client->sslRetryLen > 0 ? client->sslRetryLen : client->outLen;
+			rc = dukf_ssl_write(client->ssl, client->out, len);
+			if (rc == DUKF_SSL_WANT_READ || rc == DUKF_SSL_WANT_WRITE) {
+				client->sslRetryLen = len;
+				return true;
+			}
+			client->sslRetryLen = 0;
+		} else {
+#if defined(MSG_NOSIGNAL)
+			rc = send(client->fd, client->out, client->outLen, MSG_NOSIGNAL);
+#else
+			rc = send(client->fd, client->out, client->outLen, 0);
+#endif
+			if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return true;
+			}
+		}
+		if (rc < 0) {
+			mqtt_setError(client, "write failed");
+			return false;
+		}
+		client->stats.writes++;
+		client->stats.bytesOut += rc;
+		client->lastSend = mqtt_millis();
+		memmove(client->out, client->out + rc, client->outLen - rc);
+		client->outLen -= rc;
+	}
+	return true;
+} // mqtt_flush
+
+
+/*
+ * Read what the socket has for us.  Returns false if the connection has gone.
+ */
+static bool mqtt_receive(dukf_mqtt_client_t *client) {
+	size_t space = client->maxPacketSize - client->inLen;
+	int rc;
+	if (client->ssl != NULL) {
+		rc = dukf_ssl_read(client->ssl, client->in + client->inLen, space);
+		if (rc == DUKF_SSL_WANT_READ || rc == DUKF_SSL_WANT_WRITE) {
+			return true;
+		}
+	} else {
+		rc = recv(client->fd, client->in + client->inLen, space, 0);
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+	}
+	if (rc == 0) {
+		mqtt_setError(client, "connection closed by the broker");
+		return false;
+	}
+	if (rc < 0) {
+		mqtt_setError(client, "read failed");
+		return false;
+	}
+	client->inLen += rc;
+	client->stats.bytesIn += rc;
+	return true;
+} // mqtt_receive
+
+
+/*
+ * Events.
+ */
+
+/*
+ * Called on the JavaScript task to deliver the received messages.  Messages that arrive
+ * while this event waits join it.
+ */
+static int mqtt_pushMessages(duk_context *ctx, void *context) {
+	dukf_mqtt_client_t *client = (dukf_mqtt_client_t *)context;
+	mqtt_lock(client);
+	dukf_mqtt_message_t *message = client->inboundHead;
+	client->inboundHead = client->inboundTail = NULL;
+	client->inboundCount = 0;
+	client->inboundPosted = false;
+	client->stats.batches++;
+	mqtt_unlock(client);
+
+	duk_push_string(ctx, "message");
+	duk_push_array(ctx);
+	int i = 0;
+	while (message != NULL) {
+		dukf_mqtt_message_t *next = message->next;
+		duk_push_object(ctx);
+		duk_push_string(ctx, message->topic);
+		duk_put_prop_string(ctx, -2, "topic");
+		void *buffer = duk_push_fixed_buffer(ctx, message->length);
+		memcpy(buffer, message->payload, message->length);
+		duk_push_buffer_object(ctx, -1, 0, message->length, DUK_BUFOBJ_NODEJS_BUFFER);
+		duk_remove(ctx, -2);
+		duk_put_prop_string(ctx, -2, "payload");
+		duk_push_int(ctx, message->qos);
+		duk_put_prop_string(ctx, -2, "qos");
+		duk_push_boolean(ctx, message->retain);
+		duk_put_prop_string(ctx, -2, "retain");
+		duk_put_prop_index(ctx, -2, i++);
+		free(message);
+		message = next;
+	}
+	// [0] - "message"
+	// [1] - array of messages
+	return 2;
+} // mqtt_pushMessages
+
+
+static void mqtt_pushStats(duk_context *ctx, dukf_mqtt_client_t *client) {
+	mqtt_lock(client);
+	dukf_mqtt_stats_t stats = client->stats;
+	int queued = client->pendingCount;
+	int inflight = client->inflightCount;
+	uint32_t spillBytes = client->spillSize - client->spillOffset;
+	bool connected = client->connected;
+	mqtt_unlock(client);
+
+	duk_push_object(ctx);
+#define PUT_STAT(name) duk_push_number(ctx, stats.name); duk_put_prop_string(ctx, -2, #name)
+	PUT_STAT(connects);
+	PUT_STAT(disconnects);
+	PUT_STAT(published);
+	PUT_STAT(resent);
+	PUT_STAT(acked);
+	PUT_STAT(received);
+	PUT_STAT(batches);
+	PUT_STAT(dropped);
+	PUT_STAT(spilled);
+	PUT_STAT(unspilled);
+	PUT_STAT(writes);
+	PUT_STAT(bytesOut);
+	PUT_STAT(bytesIn);
+	PUT_STAT(pings);
+	PUT_STAT(inflightPeak);
+#undef PUT_STAT
+	duk_push_int(ctx, queued);
+	duk_put_prop_string(ctx, -2, "queued");
+	duk_push_int(ctx, inflight);
+	duk_put_prop_string(ctx, -2, "inflight");
+	duk_push_number(ctx, spillBytes);
+	duk_put_prop_string(ctx, -2, "spillBytes");
+	duk_push_boolean(ctx, connected);
+	duk_put_prop_string(ctx, -2, "connected");
+} // mqtt_pushStats
+
+
+static void mqtt_freeClient(dukf_mqtt_client_t *client) {
+	client->magic = 0;
+	mqtt_freeMessages(client->pendingHead);
+	mqtt_freeMessages(client->inflightHead);
+	mqtt_freeMessages(client->inboundHead);
+	mqtt_freeSubs(client->subs);
+	mqtt_freeSubs(client->unsubs);
+#if defined(ESP_PLATFORM)
+	vSemaphoreDelete(client->lock);
+#else /* ESP_PLATFORM */
+	pthread_mutex_destroy(&client->lock);
+#endif /* ESP_PLATFORM */
+	free(client->clientId);
+	free(client->username);
+	free(client->password);
+	free(client->out);
+	free(client->in);
+	free(client);
+} // mqtt_freeClient
+
+
+/*
+ * Called on the JavaScript task to deliver a "connect", "close", "error" or "end" event.
+ */
+static int mqtt_pushStatus(duk_context *ctx, void *context) {
+	dukf_mqtt_status_t *status = (dukf_mqtt_status_t *)context;
+	duk_push_string(ctx, status->event);
+	if (status->last) {
+		mqtt_pushStats(ctx, status->client);
+		mqtt_freeClient(status->client);
+	} else if (strcmp(status->event, "connect") == 0) {
+		duk_push_boolean(ctx, status->sessionPresent);
+	} else {
+		duk_push_string(ctx, status->message);
+	}
+	free(status);
+	// [0] - event
+	// [1] - data
+	return 2;
+} // mqtt_pushStatus
+
+
+/*
+ * Post an event.  This may wait for room on the event queue so it must not be called
+ * with the lock held.
+ */
+static void mqtt_postStatus(dukf_mqtt_client_t *client, const char *event, const char *message) {
+	dukf_mqtt_status_t *status = malloc(sizeof(dukf_mqtt_status_t));
+	if (status == NULL) {
+		LOGE("mqtt_postStatus: out of memory");
+		return;
+	}
+	status->client = client;
+	status->event = event;
+	snprintf(status->message, sizeof(status->message), "%s", message);
+	status->sessionPresent = client->sessionPresent;
+	status->last = strcmp(event, "end") == 0;
+	// The dispatcher is kept until the "end" event, which is always the last.
+	event_newCallbackRequestedEvent(
+		status->last ? ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION : ESP32_DUKTAPE_CALLBACK_TYPE_PERSISTENT_FUNCTION,
+		client->dispatcherStashKey,
+		mqtt_pushStatus,
+		status);
+} // mqtt_postStatus
+
+
+static void mqtt_postEvents(dukf_mqtt_client_t *client, int post) {
+	if (post & MQTT_POST_CONNECT) {
+		mqtt_postStatus(client, "connect", "");
+	}
+	if (post & MQTT_POST_MESSAGES) {
+		event_newCallbackRequestedEvent(
+			ESP32_DUKTAPE_CALLBACK_TYPE_PERSISTENT_FUNCTION,
+			client->dispatcherStashKey,
+			mqtt_pushMessages,
+			client);
+	}
+} // mqtt_postEvents
+
+
+/*
+ * Run one connection to the broker until it fails or the client ends.  Returns true if
+ * the client ended.
+ */
+static bool mqtt_session(dukf_mqtt_client_t *client) {
+	client->outLen = 0;
+	client->inLen = 0;
+	client->sslRetryLen = 0;
+	client->pingOutstanding = false;
+	client->connectStart = client->lastSend = mqtt_millis();
+	if (!mqtt_putConnect(client)) {
+		mqtt_setError(client, "out of memory");
+		return false;
+	}
+	while (1) {
+		uint32_t now = mqtt_millis();
+		mqtt_lock(client);
+		if (client->endRequested) {
+			// Give the messages already queued a chance to be sent.
+			bool drained = client->pendingCount == 0 && client->inflightCount == 0 && client->outLen == 0;
+			if (!client->connected || drained || now - client->endTime > MQTT_END_GRACE_MS) {
+				mqtt_unlock(client);
+				if (client->connected) {
+					client->outLen = 0;
+					client->sslRetryLen = 0;
+					uint8_t *p = mqtt_startPacket(client, MQTT_DISCONNECT, 0);
+					if (p != NULL) {
+						mqtt_flush(client);
+					}
+				}
+				client->lastError[0] = '\0';
+				return true;
+			}
+		}
+		bool filled = !client->connected || mqtt_fill(client);
+		bool readable = client->inboundCount < MQTT_MAX_INBOUND;
+		mqtt_unlock(client);
+		if (!filled) {
+			mqtt_setError(client, "out of memory");
+			return false;
+		}
+
+		if (!client->connected && now - client->connectStart > client->connectTimeout) {
+			mqtt_setError(client, "no CONNACK from the broker");
+			return false;
+		}
+		if (client->connected && client->keepAlive > 0) {
+			uint32_t interval = client->keepAlive * 1000;
+			if (client->pingOutstanding && now - client->pingTime > interval) {
+				mqtt_setError(client, "no PINGRESP from the broker");
+				return false;
+			}
+			if (!client->pingOutstanding && now - client->lastSend >= interval) {
+				if (mqtt_startPacket(client, MQTT_PINGREQ, 0) == NULL) {
+					mqtt_setError(client, "out of memory");
+					return false;
+				}
+				client->pingOutstanding = true;
+				client->pingTime = now;
+				client->stats.pings++;
+			}
+		}
+
+		if (!mqtt_flush(client)) {
+			return false;
+		}
+
+		if (!(readable && client->ssl != NULL && dukf_ssl_pending(client->ssl) > 0)) {
+			fd_set readfds;
+			fd_set writefds;
+			FD_ZERO(&readfds);
+			FD_ZERO(&writefds);
+			if (readable) {
+				FD_SET(client->fd, &readfds);
+			}
+			if (client->outLen > 0) {
+				FD_SET(client->fd, &writefds);
+			}
+			struct timeval tv = { 0, MQTT_POLL_MS * 1000 };
+			int rc = select(client->fd + 1, &readfds, &writefds, NULL, &tv);
+			if (rc < 0) {
+				mqtt_setError(client, "select failed");
+				return false;
+			}
+			if (rc == 0 || !FD_ISSET(client->fd, &readfds)) {
+				continue;
+			}
+		}
+		if (!mqtt_receive(client)) {
+			return false;
+		}
+		mqtt_lock(client);
+		bool ok = mqtt_process(client);
+		int post = client->post;
+		client->post = 0;
+		if (post & MQTT_POST_CONNECT) {
+			mqtt_requeueInflight(client);
+		}
+		mqtt_unlock(client);
+		mqtt_postEvents(client, post);
+		if (!ok) {
+			return false;
+		}
+	}
+} // mqtt_session
+
+
+/*
+ * Wait before the next connection attempt and double the wait for the one after.  The
+ * wait ends early if end() is called.
+ */
+static void mqtt_backoff(dukf_mqtt_client_t *client, uint32_t *backoff) {
+	uint32_t until = mqtt_millis() + *backoff;
+	while (!client->endRequested && (int32_t)(until - mqtt_millis()) > 0) {
+		mqtt_sleep(MQTT_WAIT_SLICE_MS);
+	}
+	*backoff = *backoff * 2 > MQTT_MAX_BACKOFF_MS ? MQTT_MAX_BACKOFF_MS : *backoff * 2;
+} // mqtt_backoff
+
+
+/*
+ * The body of the client task.  Connect, run the session and reconnect after a backoff
+ * until end() is called.
+ */
+static void mqtt_run(dukf_mqtt_client_t *client) {
+	uint32_t backoff = MQTT_MIN_BACKOFF_MS;
+	bool ended = false;
+	while (!ended) {
+		if (client->endRequested) {
+			break;
+		}
+		if (!mqtt_open(client)) {
+			mqtt_close(client);
+			if (client->endRequested) {
+				break;
+			}
+			mqtt_postStatus(client, "error", client->lastError);
+			mqtt_backoff(client, &backoff);
+			continue;
+		}
+		ended = mqtt_session(client);
+		mqtt_close(client);
+		mqtt_lock(client);
+		bool wasConnected = client->connected;
+		client->connected = false;
+		if (wasConnected) {
+			client->stats.disconnects++;
+			backoff = MQTT_MIN_BACKOFF_MS;
+		}
+		mqtt_unlock(client);
+		if (wasConnected) {
+			mqtt_postStatus(client, "close", client->lastError);
+		} else if (!ended) {
+			// The broker didn't accept us.
+			mqtt_postStatus(client, "error", client->lastError);
+			mqtt_backoff(client, &backoff);
+		}
+	}
+	mqtt_lock(client);
+	if (client->spillPath[0] != '\0') {
+		mqtt_spillSave(client);
+	} else {
+		client->stats.dropped += client->pendingCount + client->inflightCount;
+	}
+	mqtt_unlock(client);
+	mqtt_postStatus(client, "end", "");
+} // mqtt_run
+
+
+#if defined(ESP_PLATFORM)
+static void mqtt_task(void *data) {
+	mqtt_run((dukf_mqtt_client_t *)data);
+	vTaskDelete(NULL);
+} // mqtt_task
+#else /* ESP_PLATFORM */
+static void *mqtt_thread(void *data) {
+	mqtt_run((dukf_mqtt_client_t *)data);
+	return NULL;
+} // mqtt_thread
+#endif /* ESP_PLATFORM */
+
+
+/*
+ * Return the client behind the pointer at the index or NULL.
+ */
+static dukf_mqtt_client_t *mqtt_getClient(duk_context *ctx, duk_idx_t idx) {
+	dukf_mqtt_client_t *client = duk_get_pointer(ctx, idx);
+	if (client == NULL || client->magic != MQTT_MAGIC) {
+		LOGE("Not an MQTT client");
+		return NULL;
+	}
+	return client;
+} // mqtt_getClient
+
+
+/*
+ * Return a copy of an optional string property or NULL.
+ */
+static char *mqtt_getStringOption(duk_context *ctx, duk_idx_t idx, const char *name) {
+	char *value = NULL;
+	if (duk_get_prop_string(ctx, idx, name) && duk_is_string(ctx, -1)) {
+		value = strdup(duk_get_string(ctx, -1));
+	}
+	duk_pop(ctx);
+	return value;
+} // mqtt_getStringOption
+
+
+static int mqtt_getIntOption(duk_context *ctx, duk_idx_t idx, const char *name, int defaultValue) {
+	int value = defaultValue;
+	if (duk_get_prop_string(ctx, idx, name) && duk_is_number(ctx, -1)) {
+		value = duk_get_int(ctx, -1);
+	}
+	duk_pop(ctx);
+	return value;
+} // mqtt_getIntOption
+
+
+/*
+ * Create a client and start its task.
+ * [0] - options
+ * {
+ *    host: <broker host name or address>
+ *    port: <port> - Default 1883, or 8883 with useSSL.
+ *    clientId: <client identifier> - Default "" which asks the broker to assign one.
+ *    username: <user name> [optional]
+ *    password: <password> [optional]
+ *    keepAlive: <seconds> - Default 60, 0 for none.
+ *    cleanSession: <boolean> - Default true.
+ *    useSSL: <boolean> - Default false.
+ *    inflight: <QoS 1 messages awaiting acknowledgement> - Default 8.
+ *    queueSize: <messages held in RAM> - Default 64.
+ *    spillFile: <file for messages published while offline> [optional]
+ *    maxPacketSize: <largest packet accepted> - Default 8192.
+ *    connectTimeout: <msecs> - Default 10000.
+ * }
+ * [1] - dispatcher function(event, data)
+ *
+ * Returns a pointer to the client.
+ */
+static duk_ret_t js_mqtt_create(duk_context *ctx) {
+	if (!duk_is_object(ctx, 0) || !duk_is_function(ctx, 1)) {
+		return DUK_RET_TYPE_ERROR;
+	}
+	if (!duk_get_prop_string(ctx, 0, "host") || !duk_is_string(ctx, -1) ||
+		strlen(duk_get_string(ctx, -1)) >= MQTT_MAX_HOST) {
+		LOGE("js_mqtt_create: No host supplied or host too long");
+		return DUK_RET_TYPE_ERROR;
+	}
+	dukf_mqtt_client_t *client = calloc(1, sizeof(dukf_mqtt_client_t));
+	if (client == NULL) {
+		LOGE("js_mqtt_create: out of memory");
+		return 0;
+	}
+	strcpy(client->host, duk_get_string(ctx, -1));
+	duk_pop(ctx);
+	LOGD(">> js_mqtt_create: %s", client->host);
+
+	client->magic = MQTT_MAGIC;
+	client->fd = -1;
+	duk_get_prop_string(ctx, 0, "useSSL");
+	client->useSSL = duk_to_boolean(ctx, -1);
+	duk_pop(ctx);
+	duk_get_prop_string(ctx, 0, "cleanSession");
+	client->cleanSession = duk_is_undefined(ctx, -1) ? true : duk_to_boolean(ctx, -1);
+	duk_pop(ctx);
+	client->port = mqtt_getIntOption(ctx, 0, "port", client->useSSL ? MQTT_DEFAULT_SSL_PORT : MQTT_DEFAULT_PORT);
+	client->keepAlive = mqtt_getIntOption(ctx, 0, "keepAlive", MQTT_DEFAULT_KEEPALIVE);
+	client->inflightWindow = mqtt_getIntOption(ctx, 0, "inflight", MQTT_DEFAULT_INFLIGHT);
+	client->queueSize = mqtt_getIntOption(ctx, 0, "queueSize", MQTT_DEFAULT_QUEUE_SIZE);
+	client->maxPacketSize = mqtt_getIntOption(ctx, 0, "maxPacketSize", MQTT_DEFAULT_MAX_PACKET);
+	client->connectTimeout = mqtt_getIntOption(ctx, 0, "connectTimeout", MQTT_DEFAULT_CONNECT_TIMEOUT);
+	if (client->inflightWindow < 1) {
+		client->inflightWindow = 1;
+	} else if (client->inflightWindow > MQTT_MAX_INFLIGHT) {
+		client->inflightWindow = MQTT_MAX_INFLIGHT;
+	}
+	if (client->queueSize < 1) {
+		client->queueSize = 1;
+	}
+	if (client->maxPacketSize < 128) {
+		client->maxPacketSize = 128;
+	}
+	client->clientId = mqtt_getStringOption(ctx, 0, "clientId");
+	if (client->clientId == NULL) {
+		client->clientId = strdup("");
+	}
+	client->username = mqtt_getStringOption(ctx, 0, "username");
+	client->password = mqtt_getStringOption(ctx, 0, "password");
+	char *spillPath = mqtt_getStringOption(ctx, 0, "spillFile");
+	if (spillPath != NULL) {
+		if (strlen(spillPath) < MQTT_MAX_PATH) {
+			struct stat statBuf;
+			strcpy(client->spillPath, spillPath);
+			// Messages left by an earlier client are sent first.
+			if (stat(spillPath, &statBuf) == 0) {
+				client->spillSize = statBuf.st_size;
+			}
+		} else {
+			LOGE("js_mqtt_create: Spill file name too long: %s", spillPath);
+		}
+		free(spillPath);
+	}
+	client->outSize = 1024;
+	client->out = malloc(client->outSize);
+	client->in = malloc(client->maxPacketSize);
+#if defined(ESP_PLATFORM)
+	client->lock = xSemaphoreCreateMutex();
+	bool locked = client->lock != NULL;
+#else /* ESP_PLATFORM */
+	bool locked = pthread_mutex_init(&client->lock, NULL) == 0;
+#endif /* ESP_PLATFORM */
+	if (client->clientId == NULL || client->out == NULL || client->in == NULL || !locked) {
+		LOGE("js_mqtt_create: out of memory");
+		free(client->clientId);
+		free(client->username);
+		free(client->password);
+		free(client->out);
+		free(client->in);
+		free(client);
+		return 0;
+	}
+	if (client->clientId[0] == '\0' && !client->cleanSession) {
+		// A broker only keeps a session for a client it can identify.
+		LOGE("js_mqtt_create: A clientId is needed when cleanSession is false");
+		client->cleanSession = true;
+	}
+	if (client->useSSL && dukf_ssl_init() != 0) {
+		LOGE("js_mqtt_create: SSL could not be initialized");
+		mqtt_freeClient(client);
+		return 0;
+	}
+
+	duk_dup(ctx, 1);
+	client->dispatcherStashKey = esp32_duktape_stash_array(ctx, 1);
+
+#if defined(ESP_PLATFORM)
+	xTaskCreatePinnedToCore(&mqtt_task, "mqtt", client->useSSL ? MQTT_SSL_TASK_STACK : MQTT_TASK_STACK, client, 5, NULL, tskNO_AFFINITY);
+#else /* ESP_PLATFORM */
+	pthread_t thread;
+	pthread_create(&thread, NULL, mqtt_thread, client);
+	pthread_detach(thread);
+#endif /* ESP_PLATFORM */
+
+	duk_push_pointer(ctx, client);
+	LOGD("<< js_mqtt_create");
+	return 1;
+} // js_mqtt_create
+
+
+/*
+ * Ask the client to finish.  Queued messages are sent first if we are connected,
+ * waiting at most a few seconds.  The "end" event follows.
+ * [0] - client
+ */
+static duk_ret_t js_mqtt_end(duk_context *ctx) {
+	dukf_mqtt_client_t *client = mqtt_getClient(ctx, 0);
+	if (client == NULL) {
+		return 0;
+	}
+	mqtt_lock(client);
+	if (!client->endRequested) {
+		client->endRequested = true;
+		client->endTime = mqtt_millis();
+	}
+	mqtt_unlock(client);
+	return 0;
+} // js_mqtt_end
+
+
+/*
+ * Queue a message.
+ * [0] - client
+ * [1] - topic
+ * [2] - payload - string or buffer
+ * [3] - qos - 0 or 1
+ * [4] - retain - boolean
+ *
+ * Returns true if the message was queued (or spilled) and false if the queue was full.
+ */
+static duk_ret_t js_mqtt_publish(duk_context *ctx) {
+	dukf_mqtt_client_t *client = mqtt_getClient(ctx, 0);
+	size_t topicLength;
+	size_t length;
+	const uint8_t *payload;
+
+	const char *topic = duk_get_lstring(ctx, 1, &topicLength);
+	if (client == NULL || topic == NULL || topicLength == 0 || topicLength > 0xFFFF) {
+		return DUK_RET_TYPE_ERROR;
+	}
+	if (duk_is_string(ctx, 2)) {
+		payload = (const uint8_t *)duk_get_lstring(ctx, 2, &length);
+	} else {
+		payload = duk_get_buffer_data(ctx, 2, &length);
+		if (payload == NULL) {
+			length = 0;
+		}
+	}
+	uint8_t qos = duk_get_int(ctx, 3) > 0 ? 1 : 0;
+	dukf_mqtt_message_t *message = mqtt_newMessage(topic, topicLength, payload, length, qos, duk_to_boolean(ctx, 4));
+	if (message == NULL) {
+		duk_push_false(ctx);
+		return 1;
+	}
+
+	bool queued = true;
+	mqtt_lock(client);
+	bool spill = client->spillPath[0] != '\0' &&
+		(client->spillSize > client->spillOffset || // Keep the order of what is already spilled.
+		(!client->connected && client->pendingCount >= client->queueSize));
+	if (spill) {
+		queued = mqtt_spillAppend(client, message);
+		free(message);
+	} else if (client->pendingCount >= client->queueSize) {
+		queued = false;
+		free(message);
+	} else {
+		mqtt_append(&client->pendingHead, &client->pendingTail, message);
+		client->pendingCount++;
+	}
+	if (!queued) {
+		client->stats.dropped++;
+	}
+	mqtt_unlock(client);
+	duk_push_boolean(ctx, queued);
+	return 1;
+} // js_mqtt_publish
+
+
+/*
+ * Return statistics about the client.
+ * [0] - client
+ */
+static duk_ret_t js_mqtt_stats(duk_context *ctx) {
+	dukf_mqtt_client_t *client = mqtt_getClient(ctx, 0);
+	if (client == NULL) {
+		return 0;
+	}
+	mqtt_pushStats(ctx, client);
+	return 1;
+} // js_mqtt_stats
+
+
+/*
+ * Subscribe to a topic filter.  The subscription is renewed after each reconnect unless
+ * the broker still has our session.
+ * [0] - client
+ * [1] - topic filter
+ * [2] - qos - 0 or 1
+ */
+static duk_ret_t js_mqtt_subscribe(duk_context *ctx) {
+	dukf_mqtt_client_t *client = mqtt_getClient(ctx, 0);
+	const char *topic = duk_get_string(ctx, 1);
+	if (client == NULL || topic == NULL || topic[0] == '\0') {
+		return DUK_RET_TYPE_ERROR;
+	}
+	mqtt_lock(client);
+	mqtt_removeSub(&client->unsubs, topic);
+	bool ok = mqtt_addSub(&client->subs, topic, duk_get_int(ctx, 2) > 0 ? 1 : 0);
+	mqtt_unlock(client);
+	duk_push_boolean(ctx, ok);
+	return 1;
+} // js_mqtt_subscribe
+
+
+/*
+ * Unsubscribe from a topic filter.
+ * [0] - client
+ * [1] - topic filter
+ */
+static duk_ret_t js_mqtt_unsubscribe(duk_context *ctx) {
+	dukf_mqtt_client_t *client = mqtt_getClient(ctx, 0);
+	const char *topic = duk_get_string(ctx, 1);
+	if (client == NULL || topic == NULL) {
+		return DUK_RET_TYPE_ERROR;
+	}
+	mqtt_lock(client);
+	mqtt_removeSub(&client->subs, topic);
+	mqtt_addSub(&client->unsubs, topic, 0);
+	mqtt_unlock(client);
+	return 0;
+} // js_mqtt_unsubscribe
+
+
+/**
+ * Add native methods to the MQTT object.
+ * [0] - MQTT Object
+ */
+duk_ret_t ModuleMQTT(duk_context *ctx) {
+
+	ADD_FUNCTION("create",      js_mqtt_create,      2);
+	ADD_FUNCTION("end",         js_mqtt_end,         1);
+	ADD_FUNCTION("publish",     js_mqtt_publish,     5);
+	ADD_FUNCTION("stats",       js_mqtt_stats,       1);
+	ADD_FUNCTION("subscribe",   js_mqtt_subscribe,   3);
+	ADD_FUNCTION("unsubscribe", js_mqtt_unsubscribe, 2);
+
+	return 0;
+} // ModuleMQTT
@@ -0,0 +1,711 @@
+/*
+ * Network I/O task.
+ *
+ * Normally the JavaScript loop calls select(), recv() and send() itself, so the time
+ * these take is added to every pass of the loop.  A socket attached to the network
+ * I/O task is instead served by that task, which runs on the other core of the ESP32
+ * (the one that also runs lwIP) or on its own thread on Linux.  The task reads what
+ * arrives into the socket's receive ring and writes what JavaScript has put into the
+ * socket's transmit ring.  JavaScript only copies to and from the rings.
+ *
+ * Each attached socket is a channel with two single producer, single consumer rings:
+ * * rx - written by the task, read by JavaScript.
+ * * tx - written by JavaScript, read by the task.
+ * A ring has a head (only moved by the producer) and a tail (only moved by the consumer)
+ * so neither side takes a lock.  When the receive ring is full the task stops reading
+ * the socket, so a partner that sends faster than JavaScript consumes is held back by
+ * TCP flow control.
+ *
+ * When the task has something to report (data received, end of data, an error or room
+ * in a transmit ring that JavaScript was waiting for) it sets flags on the channel and
+ * posts one event, unless one is already waiting.  The event calls the dispatcher given
+ * to init() with an array of {channel, readable, ended, error, writable}.
+ *
+ * When JavaScript gives the task work while it is waiting in select(), it is woken by a
+ * datagram sent to a loopback UDP socket.  If that socket can't be created, the task
+ * polls instead.
+ *
+ * A channel is closed by JavaScript with close().  The task writes what is left in the
+ * transmit ring (for up to NETIO_LINGER_MS), closes the socket and frees the channel.
+ * Sockets using SSL are not attached; their mbedtls contexts stay on the JavaScript task.
+ *
+ * The functions exposed are:
+ * * attach
+ * * close
+ * * init
+ * * read
+ * * stats
+ * * write
+ */
+#if defined(ESP_PLATFORM)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+
+#include "sdkconfig.h"
+#else /* ESP_PLATFORM */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif /* ESP_PLATFORM */
+
+#include <duktape.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "c_timeutils.h"
+#include "duktape_event.h"
+#include "duktape_utils.h"
+#include "logging.h"
+#include "module_netio.h"
+
+LOG_TAG("module_netio");
+
+#if defined(ESP_PLATFORM)
+#define NETIO_MAX_CHANNELS (8)
+#define NETIO_RING_SIZE    (2048)  // Bytes in each ring.  Must be a power of 2.
+#if defined(CONFIG_FREERTOS_UNICORE)
+#define NETIO_TASK_CORE    tskNO_AFFINITY
+#else
+#define NETIO_TASK_CORE    (0)     // The PRO_CPU, which also runs lwIP.  JavaScript runs on the APP_CPU.
+#endif
+#else /* ESP_PLATFORM */
+#define NETIO_MAX_CHANNELS (32)
+#define NETIO_RING_SIZE    (16384)
+#endif /* ESP_PLATFORM */
+
+#define NETIO_IDLE_MS      (1000)  // Longest wait in select() when we can be woken.
+#define NETIO_POLL_MS      (10)    // Longest wait in select() when we can't be woken.
+#define NETIO_LINGER_MS    (2000)  // How long a closed channel may take to write what is left.
+
+// Channel states.  FREE is only left by JavaScript and CLOSING only by the task.
+#define NETIO_FREE    (0)
+#define NETIO_ACTIVE  (1)
+#define NETIO_CLOSING (2)
+
+// Flags reported to JavaScript.
+#define NETIO_READABLE (0x01)
+#define NETIO_ENDED    (0x02)
+#define NETIO_ERROR    (0x04)
+#define NETIO_WRITABLE (0x08)
+
+#define NETIO_LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define NETIO_STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/*
+ * A single producer, single consumer ring.  head and tail count bytes ever written and
+ * read; their difference is the number of bytes in the ring.
+ */
+typedef struct {
+	uint8_t  *data;
+	uint32_t  head; // Moved by the producer.
+	uint32_t  tail; // Moved by the consumer.
+} netio_ring_t;
+
+typedef struct {
+	uint32_t     state;
+	int          fd;
+	netio_ring_t rx;
+	netio_ring_t tx;
+	uint32_t     flags;       // NETIO_* flags waiting to be reported.
+	uint32_t     txWaiting;   // JavaScript wants NETIO_WRITABLE when tx has room.
+	int          error;       // errno of a failed recv() or send().
+	bool         ended;       // The partner has closed (task only).
+	uint32_t     closingSince; // Task only.
+} netio_channel_t;
+
+typedef struct {
+	uint32_t recvCalls;
+	uint32_t sendCalls;
+	uint32_t bytesIn;
+	uint32_t bytesOut;
+	uint32_t events;
+	uint32_t wakeups;
+	uint32_t attached;
+} netio_stats_t;
+
+static netio_channel_t g_channels[NETIO_MAX_CHANNELS];
+static netio_stats_t   g_stats;
+static bool            g_started = false;
+static uint32_t        g_dispatcherStashKey;
+static uint32_t        g_eventPending = 0; // Has an event been posted and not yet processed?
+static uint32_t        g_sleeping = 0;     // Is the task (about to be) waiting in select()?
+static int             g_wakeFd = -1;      // The task's loopback socket.
+static int             g_wakeSendFd = -1;  // Our socket for waking the task.
+static struct sockaddr_in g_wakeAddress;
+
+
+/**
+ * Get the current time in msecs.
+ */
+static uint32_t netio_millis() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return timeval_toMsecs(&tv);
+} // netio_millis
+
+
+static uint32_t ring_used(netio_ring_t *ring) {
+	return NETIO_LOAD(&ring->head) - NETIO_LOAD(&ring->tail);
+} // ring_used
+
+
+/*
+ * Copy data into a ring.  Only the producer may call this.  Returns the number of
+ * bytes copied, which is less than len if the ring is full.
+ */
+static uint32_t ring_put(netio_ring_t *ring, const uint8_t *data, uint32_t len) {
+	uint32_t head = ring->head;
+	uint32_t space = NETIO_RING_SIZE - (head - NETIO_LOAD(&ring->tail));
+	if (len > space) {
+		len = space;
+	}
+	uint32_t offset = head & (NETIO_RING_SIZE - 1);
+	uint32_t first = NETIO_RING_SIZE - offset < len ? NETIO_RING_SIZE - offset : len;
+	memcpy(ring->data + offset, data, first);
+	memcpy(ring->data, data + first, len - first);
+	NETIO_STORE(&ring->head, head + len);
+	return len;
+} // ring_put
+
+
+/*
+ * Copy data out of a ring.  Only the consumer may call this.
+ */
+static uint32_t ring_get(netio_ring_t *ring, uint8_t *data, uint32_t len) {
+	uint32_t tail = ring->tail;
+	uint32_t used = NETIO_LOAD(&ring->head) - tail;
+	if (len > used) {
+		len = used;
+	}
+	uint32_t offset = tail & (NETIO_RING_SIZE - 1);
+	uint32_t first = NETIO_RING_SIZE - offset < len ? NETIO_RING_SIZE - offset : len;
+	memcpy(data, ring->data + offset, first);
+	memcpy(data + first, ring->data, len - first);
+	NETIO_STORE(&ring->tail, tail + len);
+	return len;
+} // ring_get
+
+
+/*
+ * Add flags to a channel for the next event.
+ */
+static void netio_flag(netio_channel_t *channel, uint32_t flags) {
+	__atomic_or_fetch(&channel->flags, flags, __ATOMIC_ACQ_REL);
+} // netio_flag
+
+
+/*
+ * Called on the JavaScript task to report the channels that have something to say.
+ */
+static int netio_dataProvider(duk_context *ctx, void *context) {
+	int i;
+	int count = 0;
+	// Clear the pending mark first so that anything flagged while we look is reported
+	// by another event.
+	NETIO_STORE(&g_eventPending, 0);
+	g_stats.events++;
+	duk_push_array(ctx);
+	for (i=0; i<NETIO_MAX_CHANNELS; i++) {
+		uint32_t flags = __atomic_exchange_n(&g_channels[i].flags, 0, __ATOMIC_ACQ_REL);
+		if (flags == 0 || NETIO_LOAD(&g_channels[i].state) != NETIO_ACTIVE) {
+			continue;
+		}
+		duk_push_object(ctx);
+		duk_push_int(ctx, i);
+		duk_put_prop_string(ctx, -2, "channel");
+		duk_push_boolean(ctx, (flags & NETIO_READABLE) != 0);
+		duk_put_prop_string(ctx, -2, "readable");
+		duk_push_boolean(ctx, (flags & NETIO_ENDED) != 0);
+		duk_put_prop_string(ctx, -2, "ended");
+		if (flags & NETIO_ERROR) {
+			duk_push_string(ctx, strerror(g_channels[i].error));
+		} else {
+			duk_push_null(ctx);
+		}
+		duk_put_prop_string(ctx, -2, "error");
+		duk_push_boolean(ctx, (flags & NETIO_WRITABLE) != 0);
+		duk_put_prop_string(ctx, -2, "writable");
+		duk_put_prop_index(ctx, -2, count++);
+	}
+	// [0] - array of channel reports
+	return 1;
+} // netio_dataProvider
+
+
+/*
+ * Post an event unless one is already waiting to be processed.
+ */
+static void netio_post() {
+	if (__atomic_exchange_n(&g_eventPending, 1, __ATOMIC_ACQ_REL) == 0) {
+		event_newCallbackRequestedEvent(
+			ESP32_DUKTAPE_CALLBACK_TYPE_PERSISTENT_FUNCTION,
+			g_dispatcherStashKey,
+			netio_dataProvider,
+			NULL);
+	}
+} // netio_post
+
+
+/*
+ * Receive into the channel's ring.  Returns true if something should be reported.
+ */
+static bool netio_receive(netio_channel_t *channel) {
+	netio_ring_t *ring = &channel->rx;
+	uint32_t head = ring->head;
+	uint32_t space = NETIO_RING_SIZE - (head - NETIO_LOAD(&ring->tail));
+	uint32_t offset = head & (NETIO_RING_SIZE - 1);
+	// Only the contiguous part.  The rest is read on the next pass.
+	uint32_t len = NETIO_RING_SIZE - offset < space ? NETIO_RING_SIZE - offset : space;
+	int rc = recv(channel->fd, ring->data + offset, len, 0);
+	g_stats.recvCalls++;
+	if (rc > 0) {
+		NETIO_STORE(&ring->head, head + rc);
+		g_stats.bytesIn += rc;
+		netio_flag(channel, NETIO_READABLE);
+		return true;
+	}
+	if (rc == 0) {
+		channel->ended = true;
+		netio_flag(channel, NETIO_ENDED);
+		return true;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+		return false;
+	}
+	channel->error = errno;
+	channel->ended = true;
+	netio_flag(channel, NETIO_ERROR);
+	return true;
+} // netio_receive
+
+
+/*
+ * Send from the channel's ring.  Returns true if something should be reported.
+ */
+static bool netio_send(netio_channel_t *channel) {
+	netio_ring_t *ring = &channel->tx;
+	uint32_t tail = ring->tail;
+	uint32_t used = NETIO_LOAD(&ring->head) - tail;
+	uint32_t offset = tail & (NETIO_RING_SIZE - 1);
+	uint32_t len = NETIO_RING_SIZE - offset < used ? NETIO_RING_SIZE - offset : used;
+#if defined(MSG_NOSIGNAL)
+	int rc = send(channel->fd, ring->data + offset, len, MSG_NOSIGNAL);
+#else
+	int rc = send(channel->fd, ring->data + offset, len, 0);
+#endif
+	g_stats.sendCalls++;
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return false;
+		}
+		channel->error = errno;
+		channel->ended = true;
+		netio_flag(channel, NETIO_ERROR);
+		return true;
+	}
+	NETIO_STORE(&ring->tail, tail + rc);
+	g_stats.bytesOut += rc;
+	if (NETIO_LOAD(&channel->txWaiting) && ring_used(ring) <= NETIO_RING_SIZE / 2) {
+		NETIO_STORE(&channel->txWaiting, 0);
+		netio_flag(channel, NETIO_WRITABLE);
+		return true;
+	}
+	return false;
+} // netio_send
+
+
+/*
+ * Is there work that arrived from JavaScript which we haven't looked at?  Checked after
+ * saying that we are about to sleep so that a wakeup isn't missed.
+ */
+static bool netio_haveWork() {
+	int i;
+	for (i=0; i<NETIO_MAX_CHANNELS; i++) {
+		uint32_t state = NETIO_LOAD(&g_channels[i].state);
+		if (state == NETIO_CLOSING ||
+			(state == NETIO_ACTIVE && !g_channels[i].ended && ring_used(&g_channels[i].tx) > 0)) {
+			return true;
+		}
+	}
+	return false;
+} // netio_haveWork
+
+
+/*
+ * One pass of the task: wait for the sockets and move data.
+ */
+static void netio_pass() {
+	fd_set readfds;
+	fd_set writefds;
+	int maxFd = -1;
+	int i;
+	uint32_t now = netio_millis();
+
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	for (i=0; i<NETIO_MAX_CHANNELS; i++) {
+		netio_channel_t *channel = &g_channels[i];
+		uint32_t state = NETIO_LOAD(&channel->state);
+		if (state == NETIO_FREE) {
+			continue;
+		}
+		bool txEmpty = ring_used(&channel->tx) == 0;
+		if (state == NETIO_CLOSING) {
+			if (channel->closingSince == 0) {
+				channel->closingSince = now == 0 ? 1 : now;
+			}
+			if (txEmpty || channel->ended || now - channel->closingSince > NETIO_LINGER_MS) {
+				shutdown(channel->fd, SHUT_RDWR);
+				close(channel->fd);
+				channel->fd = -1;
+				channel->closingSince = 0;
+				NETIO_STORE(&channel->state, NETIO_FREE);
+				continue;
+			}
+		}
+		if (channel->ended) {
+			continue;
+		}
+		if (state == NETIO_ACTIVE && ring_used(&channel->rx) < NETIO_RING_SIZE) {
+			FD_SET(channel->fd, &readfds);
+		}
+		if (!txEmpty) {
+			FD_SET(channel->fd, &writefds);
+		}
+		if (channel->fd > maxFd) {
+			maxFd = channel->fd;
+		}
+	}
+	uint32_t wait = NETIO_POLL_MS;
+	if (g_wakeFd >= 0) {
+		FD_SET(g_wakeFd, &readfds);
+		if (g_wakeFd > maxFd) {
+			maxFd = g_wakeFd;
+		}
+		wait = NETIO_IDLE_MS;
+	}
+
+	__atomic_store_n(&g_sleeping, 1, __ATOMIC_SEQ_CST);
+	if (netio_haveWork()) {
+		// Anything we didn't select for is picked up on the next pass.
+		wait = 0;
+	}
+	struct timeval tv = { wait / 1000, (wait % 1000) * 1000 };
+	int rc = select(maxFd + 1, &readfds, &writefds, NULL, &tv);
+	__atomic_store_n(&g_sleeping, 0, __ATOMIC_SEQ_CST);
+	if (rc <= 0) {
+		return;
+	}
+	if (g_wakeFd >= 0 && FD_ISSET(g_wakeFd, &readfds)) {
+		uint8_t b[16];
+		while (recv(g_wakeFd, b, sizeof(b), 0) > 0) {
+			g_stats.wakeups++;
+		}
+	}
+
+	bool post = false;
+	for (i=0; i<NETIO_MAX_CHANNELS; i++) {
+		netio_channel_t *channel = &g_channels[i];
+		if (NETIO_LOAD(&channel->state) == NETIO_FREE || channel->fd < 0) {
+			continue;
+		}
+		if (FD_ISSET(channel->fd, &writefds) && !channel->ended) {
+			post |= netio_send(channel);
+		}
+		if (FD_ISSET(channel->fd, &readfds) && !channel->ended) {
+			post |= netio_receive(channel);
+		}
+	}
+	if (post) {
+		netio_post();
+	}
+} // netio_pass
+
+
+#if defined(ESP_PLATFORM)
+static void netio_task(void *ignore) {
+	while(1) {
+		netio_pass();
+	}
+	vTaskDelete(NULL);
+} // netio_task
+#else /* ESP_PLATFORM */
+static void *netio_thread(void *ignore) {
+	while(1) {
+		netio_pass();
+	}
+	return NULL;
+} // netio_thread
+#endif /* ESP_PLATFORM */
+
+
+/*
+ * Create the loopback sockets used to wake the task.  Without them the task polls.
+ */
+static void netio_createWake() {
+	socklen_t length = sizeof(g_wakeAddress);
+	memset(&g_wakeAddress, 0, sizeof(g_wakeAddress));
+	g_wakeAddress.sin_family = AF_INET;
+	g_wakeAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	g_wakeFd = socket(AF_INET, SOCK_DGRAM, 0);
+	g_wakeSendFd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (g_wakeFd < 0 || g_wakeSendFd < 0 ||
+		bind(g_wakeFd, (struct sockaddr *)&g_wakeAddress, sizeof(g_wakeAddress)) != 0 ||
+		getsockname(g_wakeFd, (struct sockaddr *)&g_wakeAddress, &length) != 0) {
+		LOGW("netio: No loopback wakeup, polling every %d msecs", NETIO_POLL_MS);
+		if (g_wakeFd >= 0) {
+			close(g_wakeFd);
+		}
+		if (g_wakeSendFd >= 0) {
+			close(g_wakeSendFd);
+		}
+		g_wakeFd = g_wakeSendFd = -1;
+		return;
+	}
+	fcntl(g_wakeFd, F_SETFL, fcntl(g_wakeFd, F_GETFL, 0) | O_NONBLOCK);
+	fcntl(g_wakeSendFd, F_SETFL, fcntl(g_wakeSendFd, F_GETFL, 0) | O_NONBLOCK);
+} // netio_createWake
+
+
+/*
+ * Wake the task if it is waiting in select().
+ */
+static void netio_wake() {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (g_wakeSendFd >= 0 && __atomic_load_n(&g_sleeping, __ATOMIC_SEQ_CST)) {
+		uint8_t b = 0;
+		sendto(g_wakeSendFd, &b, 1, 0, (struct sockaddr *)&g_wakeAddress, sizeof(g_wakeAddress));
+	}
+} // netio_wake
+
+
+/*
+ * Return the channel at the index if it is in use by JavaScript or NULL.
+ */
+static netio_channel_t *netio_getChannel(duk_context *ctx, duk_idx_t idx) {
+	int i = duk_get_int(ctx, idx);
+	if (!duk_is_number(ctx, idx) || i < 0 || i >= NETIO_MAX_CHANNELS ||
+		NETIO_LOAD(&g_channels[i].state) != NETIO_ACTIVE) {
+		return NULL;
+	}
+	return &g_channels[i];
+} // netio_getChannel
+
+
+/*
+ * Hand a connected socket to the task.
+ * [0] - socket fd
+ *
+ * Returns the channel number or -1 if there is no free channel.  The socket now
+ * belongs to the task and must not be used or closed by the caller.
+ */
+static duk_ret_t js_netio_attach(duk_context *ctx) {
+	int fd = duk_get_int(ctx, 0);
+	int i;
+	if (!g_started) {
+		duk_push_int(ctx, -1);
+		return 1;
+	}
+	for (i=0; i<NETIO_MAX_CHANNELS; i++) {
+		netio_channel_t *channel = &g_channels[i];
+		if (NETIO_LOAD(&channel->state) != NETIO_FREE) {
+			continue;
+		}
+		if (channel->rx.data == NULL) {
+			channel->rx.data = malloc(NETIO_RING_SIZE);
+			channel->tx.data = malloc(NETIO_RING_SIZE);
+			if (channel->rx.data == NULL || channel->tx.data == NULL) {
+				LOGE("js_netio_attach: out of memory");
+				free(channel->rx.data);
+				free(channel->tx.data);
+				channel->rx.data = channel->tx.data = NULL;
+				break;
+			}
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		channel->fd = fd;
+		channel->rx.head = channel->rx.tail = 0;
+		channel->tx.head = channel->tx.tail = 0;
+		channel->flags = 0;
+		channel->txWaiting = 0;
+		channel->error = 0;
+		channel->ended = false;
+		channel->closingSince = 0;
+		NETIO_STORE(&channel->state, NETIO_ACTIVE);
+		g_stats.attached++;
+		netio_wake();
+		duk_push_int(ctx, i);
+		return 1;
+	}
+	duk_push_int(ctx, -1);
+	return 1;
+} // js_netio_attach
+
+
+/*
+ * Close a channel.  What is already in its transmit ring is still written.
+ * [0] - channel
+ */
+static duk_ret_t js_netio_close(duk_context *ctx) {
+	netio_channel_t *channel = netio_getChannel(ctx, 0);
+	if (channel != NULL) {
+		NETIO_STORE(&channel->state, NETIO_CLOSING);
+		netio_wake();
+	}
+	return 0;
+} // js_netio_close
+
+
+/*
+ * Start the task.
+ * [0] - dispatcher function([{channel, readable, ended, error, writable}, ...])
+ *
+ * Returns true if the task is running.
+ */
+static duk_ret_t js_netio_init(duk_context *ctx) {
+	if (!duk_is_function(ctx, 0)) {
+		return DUK_RET_TYPE_ERROR;
+	}
+	if (!g_started) {
+		duk_dup(ctx, 0);
+		g_dispatcherStashKey = esp32_duktape_stash_array(ctx, 1);
+		netio_createWake();
+#if defined(ESP_PLATFORM)
+		g_started = xTaskCreatePinnedToCore(&netio_task, "netio", 3072, NULL, 5, NULL, NETIO_TASK_CORE) == pdPASS;
+#else /* ESP_PLATFORM */
+		pthread_t thread;
+		g_started = pthread_create(&thread, NULL, netio_thread, NULL) == 0;
+		if (g_started) {
+			pthread_detach(thread);
+		}
+#endif /* ESP_PLATFORM */
+	}
+	duk_push_boolean(ctx, g_started);
+	return 1;
+} // js_netio_init
+
+
+/*
+ * Take the received data from a channel.
+ * [0] - channel
+ *
+ * Returns a Buffer or undefined if there is none.
+ */
+static duk_ret_t js_netio_read(duk_context *ctx) {
+	netio_channel_t *channel = netio_getChannel(ctx, 0);
+	if (channel == NULL) {
+		return 0;
+	}
+	uint32_t used = ring_used(&channel->rx);
+	if (used == 0) {
+		return 0;
+	}
+	bool wasFull = used == NETIO_RING_SIZE;
+	void *buffer = duk_push_fixed_buffer(ctx, used);
+	ring_get(&channel->rx, buffer, used);
+	duk_push_buffer_object(ctx, -1, 0, used, DUK_BUFOBJ_NODEJS_BUFFER);
+	if (wasFull) {
+		netio_wake(); // The task stopped reading this socket.
+	}
+	return 1;
+} // js_netio_read
+
+
+/*
+ * Return statistics about the task.
+ */
+static duk_ret_t js_netio_stats(duk_context *ctx) {
+	int i;
+	int channels = 0;
+	for (i=0; i<NETIO_MAX_CHANNELS; i++) {
+		if (NETIO_LOAD(&g_channels[i].state) != NETIO_FREE) {
+			channels++;
+		}
+	}
+	duk_push_object(ctx);
+	duk_push_int(ctx, channels);
+	duk_put_prop_string(ctx, -2, "channels");
+	duk_push_number(ctx, g_stats.attached);
+	duk_put_prop_string(ctx, -2, "attached");
+	duk_push_number(ctx, g_stats.recvCalls);
+	duk_put_prop_string(ctx, -2, "recvCalls");
+	duk_push_number(ctx, g_stats.sendCalls);
+	duk_put_prop_string(ctx, -2, "sendCalls");
+	duk_push_number(ctx, g_stats.bytesIn);
+	duk_put_prop_string(ctx, -2, "bytesIn");
+	duk_push_number(ctx, g_stats.bytesOut);
+	duk_put_prop_string(ctx, -2, "bytesOut");
+	duk_push_number(ctx, g_stats.events);
+	duk_put_prop_string(ctx, -2, "events");
+	duk_push_number(ctx, g_stats.wakeups);
+	duk_put_prop_string(ctx, -2, "wakeups");
+	return 1;
+} // js_netio_stats
+
+
+/*
+ * Queue data to be written.
+ * [0] - channel
+ * [1] - data - string or buffer
+ *
+ * Returns the number of bytes queued.  If not all of the data fits, the dispatcher
+ * is told when the channel is writable again.
+ */
+static duk_ret_t js_netio_write(duk_context *ctx) {
+	netio_channel_t *channel = netio_getChannel(ctx, 0);
+	size_t len;
+	const uint8_t *data;
+	if (channel == NULL) {
+		duk_push_int(ctx, -1);
+		return 1;
+	}
+	if (duk_is_string(ctx, 1)) {
+		data = (const uint8_t *)duk_get_lstring(ctx, 1, &len);
+	} else {
+		data = duk_get_buffer_data(ctx, 1, &len);
+		if (data == NULL) {
+			len = 0;
+		}
+	}
+	// Ask for NETIO_WRITABLE before the data is published.  Otherwise the task could
+	// drain the ring between ring_put() and the store and never say that it has room.
+	// A NETIO_WRITABLE that arrives when everything fitted is harmless.
+	NETIO_STORE(&channel->txWaiting, 1);
+	uint32_t queued = ring_put(&channel->tx, data, len);
+	if (queued == len) {
+		NETIO_STORE(&channel->txWaiting, 0);
+	}
+	if (queued > 0) {
+		netio_wake();
+	}
+	duk_push_int(ctx, queued);
+	return 1;
+} // js_netio_write
+
+
+/**
+ * Add native methods to the NetIO object.
+ * [0] - NetIO Object
+ */
+duk_ret_t ModuleNetIO(duk_context *ctx) {
+
+	ADD_FUNCTION("attach", js_netio_attach, 1);
+	ADD_FUNCTION("close",  js_netio_close,  1);
+	ADD_FUNCTION("init",   js_netio_init,   1);
+	ADD_FUNCTION("read",   js_netio_read,   1);
+	ADD_FUNCTION("stats",  js_netio_stats,  0);
+	ADD_FUNCTION("write",  js_netio_write,  2);
+
+	ADD_INT("RING_SIZE", NETIO_RING_SIZE);
+
+	return 0;
+} // ModuleNetIO
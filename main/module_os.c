@@ -8,7 +8,6 @@
 #include <lwip/netdb.h>
 #include <lwip/sockets.h>
 #include <mbedtls/sha1.h>
-#include <string.h>
 
 #include "esp32_specific.h"
 #include "sdkconfig.h"
@@ -23,8 +22,10 @@
 #endif // ESP_PLATFORM
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "duktape.h"
 #include "duktape_event.h"
@@ -68,7 +69,12 @@ static void gpio_isr_handler(void *args) {
  * return:
  * {
  *    sockfd: <new socket fd>
+ *    address: <partner IP address>
+ *    port: <partner port>
  * }
+ *
+ * A listening socket is non-blocking, so undefined is returned when no more
+ * connections are waiting.
  */
 static duk_ret_t js_os_accept(duk_context *ctx) {
 	LOGD(">> js_os_accept");
@@ -82,15 +88,27 @@ static duk_ret_t js_os_accept(duk_context *ctx) {
 	}
 	int sockfd = duk_get_int(ctx, -1);
 	LOGD(" About to call accept on %d", sockfd);
-	int newSockfd = accept(sockfd, NULL, NULL);
+	struct sockaddr_in partnerAddr;
+	socklen_t partnerAddrLen = sizeof(partnerAddr);
+	int newSockfd = accept(sockfd, (struct sockaddr *)&partnerAddr, &partnerAddrLen);
 	if (newSockfd < 0) {
-		LOGE("Error with accept: %d: %d - %s", newSockfd, errno, strerror(errno));
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			LOGE("Error with accept: %d: %d - %s", newSockfd, errno, strerror(errno));
+		}
 		return 0;
 	}
-	//fcntl(newSockfd, F_SETFL, fcntl(newSockfd, F_GETFL, 0) | O_NONBLOCK); // Set the socket to be non blocking.
+	// The new socket doesn't inherit O_NONBLOCK on every stack.  Make sure it is blocking
+	// as the rest of OS expects.
+	fcntl(newSockfd, F_SETFL, fcntl(newSockfd, F_GETFL, 0) & ~O_NONBLOCK);
+	char partnerIP[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &partnerAddr.sin_addr, partnerIP, sizeof(partnerIP));
 	duk_push_object(ctx);
 	duk_push_int(ctx, newSockfd);
 	duk_put_prop_string(ctx, -2, "sockfd");
+	duk_push_string(ctx, partnerIP);
+	duk_put_prop_string(ctx, -2, "address");
+	duk_push_int(ctx, ntohs(partnerAddr.sin_port));
+	duk_put_prop_string(ctx, -2, "port");
 	LOGD("<< js_os_accept: new socketfd=%d", newSockfd);
 	return 1;
 } // js_os_accept
@@ -102,6 +120,9 @@ static duk_ret_t js_os_accept(duk_context *ctx) {
  * - port: The port to bind to.
  * - sockfd: The socket to bind.
  *
+ * SO_REUSEADDR is set so that a server can be restarted while connections to its
+ * previous incarnation are still in TIME_WAIT.
+ *
  * returns the bind rc;
  */
 static duk_ret_t js_os_bind(duk_context *ctx) {
@@ -129,6 +150,9 @@ static duk_ret_t js_os_bind(duk_context *ctx) {
 	serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
 	serverAddr.sin_port = htons(port);
 
+	int reuse = 1;
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
 	LOGD("About to call bind on fd=%d with port=%d", sockfd, port);
 	int rc = bind(sockfd, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
 	if (rc < 0) {
@@ -202,6 +226,11 @@ static duk_ret_t js_os_closesocket(duk_context *ctx) {
  * - sockfd - The socket file descriptor.
  * - address - The target address.
  * - port - The target port number.
+ *
+ * The socket is made non-blocking so that we don't wait for the TCP handshake.  The
+ * return is 0 if the connection has been made or is in progress and negative if it
+ * failed straight away.  When the socket becomes writable, call connectResult() to
+ * learn whether the connection succeeded.
  */
 static duk_ret_t js_os_connect(duk_context *ctx) {
 	int sockfd;
@@ -257,9 +286,14 @@ static duk_ret_t js_os_connect(duk_context *ctx) {
 	serverAddress.sin_port = htons(port);
 	inet_pton(AF_INET, address, &serverAddress.sin_addr.s_addr);
 	LOGD(" - About to connect fd=%d, address=%s, port=%d", sockfd, address, port);
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
 	connectRc = connect(sockfd, (struct sockaddr *)&serverAddress, sizeof(serverAddress));
 	if (connectRc != 0) {
-		LOGE("Error with connect: %d: %d - %s", connectRc, errno, strerror(errno));
+		if (errno == EINPROGRESS) {
+			connectRc = 0;
+		} else {
+			LOGE("Error with connect: %d: %d - %s", connectRc, errno, strerror(errno));
+		}
 	}
 	duk_push_int(ctx, connectRc);
 	LOGD("<< js_os_connect: rc=%d", connectRc);
@@ -267,6 +301,53 @@ static duk_ret_t js_os_connect(duk_context *ctx) {
 } // js_os_connect
 
 
+/**
+ * Complete a connection started by connect() once the socket has become writable.
+ * The input is an options parameter object containing:
+ * - sockfd - The socket file descriptor.
+ *
+ * The return is null if the connection succeeded, in which case the socket is made
+ * blocking again, or an object describing why it failed:
+ * {
+ *    errno: <the error number>
+ *    message: <the error text>
+ * }
+ */
+static duk_ret_t js_os_connectResult(duk_context *ctx) {
+	int error = 0;
+	socklen_t length = sizeof(error);
+
+	LOGD(">> js_os_connectResult");
+	if (!duk_is_object(ctx, -1)) {
+		LOGE("js_os_connectResult: No parameters object found.");
+		return 0;
+	}
+	if (!duk_get_prop_string(ctx, -1, "sockfd")) {
+		LOGE("js_os_connectResult: No sockfd property found.");
+		return 0;
+	}
+	int sockfd = duk_get_int(ctx, -1);
+	duk_pop(ctx);
+
+	if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &length) != 0) {
+		error = errno;
+	}
+	if (error != 0) {
+		LOGD("<< js_os_connectResult: fd=%d: %d - %s", sockfd, error, strerror(error));
+		duk_push_object(ctx);
+		duk_push_int(ctx, error);
+		duk_put_prop_string(ctx, -2, "errno");
+		duk_push_string(ctx, strerror(error));
+		duk_put_prop_string(ctx, -2, "message");
+		return 1;
+	}
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & ~O_NONBLOCK);
+	duk_push_null(ctx);
+	LOGD("<< js_os_connectResult: fd=%d connected", sockfd);
+	return 1;
+} // js_os_connectResult
+
+
 /*
  * Retrieve the hostname for the address or null if not resolvable.
  * [0] - hostname
@@ -500,6 +581,10 @@ static duk_ret_t js_os_gpioSetPullMode(duk_context *ctx) {
  * Listen on a server socket.
  * [0] - Params object
  * - sockfd: The socket to bind.
+ * - backlog: The most connections waiting to be accepted.  Optional, default 5.
+ *
+ * The socket is made non-blocking so that the loop can accept every waiting
+ * connection without blocking on the last one.
  */
 static duk_ret_t js_os_listen(duk_context *ctx) {
 	int sockfd;
@@ -520,8 +605,15 @@ static duk_ret_t js_os_listen(duk_context *ctx) {
 	sockfd = duk_get_int(ctx, -1);
 	duk_pop(ctx);
 
-	LOGD("About to call listen on fd=%d", sockfd);
-	int rc = listen(sockfd, 5);
+	int backlog = 5;
+	if (duk_get_prop_string(ctx, -1, "backlog") && duk_is_number(ctx, -1)) {
+		backlog = duk_get_int(ctx, -1);
+	}
+	duk_pop(ctx);
+
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+	LOGD("About to call listen on fd=%d with backlog=%d", sockfd, backlog);
+	int rc = listen(sockfd, backlog);
 	if (rc != 0) {
 		LOGE("Error with listen: %d %d %s", rc, errno, strerror(errno));
 	}
@@ -948,6 +1040,7 @@ void ModuleOS(duk_context *ctx) {
 	ADD_FUNCTION("close",         js_os_close,         1);
 	ADD_FUNCTION("closesocket",   js_os_closesocket,   1);
 	ADD_FUNCTION("connect",       js_os_connect,       1);
+	ADD_FUNCTION("connectResult", js_os_connectResult, 1);
 	ADD_FUNCTION("getaddrinfo",   js_os_getaddrinfo,   1);
 	ADD_FUNCTION("gethostbyname", js_os_gethostbyname, 1);
 
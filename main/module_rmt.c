@@ -7,25 +7,149 @@
  * It has the following methods:
  *
  * * getState
+ * * rxConfig
+ * * rxStart
+ * * rxStop
+ * * streamEnd
+ * * streamStart
+ * * streamWrite
  * * txConfig
+ * * write
+ *
+ * Each TX channel owns an item buffer that is allocated when the channel is
+ * configured and is reused by every write.  A write may either block until the
+ * items have been transmitted or be handed to a transmit task owned by the
+ * channel, in which case a callback is invoked through the event queue when the
+ * transmission has completed.
+ *
+ * A stream splits the item buffer into two halves.  While one half is being
+ * transmitted, JavaScript is asked (through a refill callback) to fill the other.
+ * This allows sequences much longer than the item buffer to be sent.  The stream is
+ * a single transmission: the driver's TX threshold interrupt calls a translator that
+ * copies the next items from the halves into RMT memory, so the line doesn't go idle
+ * between chunks.  If JavaScript falls behind, the translator sends idle items until
+ * the next chunk arrives and counts an underrun.  The translator support of the
+ * driver arrived in ESP-IDF v3.3 so streaming is only built when the framework says it
+ * is at least that version (see RMT_STREAM_SUPPORTED).
+ *
+ * Received frames are drained from the driver by a capture task, optionally
+ * decoded (see rmt_decoders.c) and delivered to JavaScript in batches.  On Linux
+ * only the receive side is available and it replays recorded capture files.
  */
 
+#if defined(ESP_PLATFORM)
 #include <driver/rmt.h>
-#include <duktape.h>
-#include <errno.h>
 #include <esp_log.h>
 #include <esp_system.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/ringbuf.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "esp32_specific.h"
+#include "sdkconfig.h"
+#if defined(__has_include)
+#if __has_include(<esp_idf_version.h>)
+#include <esp_idf_version.h>
+#endif
+#endif
+#else /* ESP_PLATFORM */
+#include <pthread.h>
+#include <stdio.h>
+#endif /* ESP_PLATFORM */
+
+#include <assert.h>
+#include <duktape.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "duktape_event.h"
 #include "duktape_utils.h"
-#include "esp32_specific.h"
 #include "logging.h"
-#include "sdkconfig.h"
+#include "module_rmt.h"
+#include "rmt_decoders.h"
 
 LOG_TAG("module_rmt");
 
+#if !defined(ESP_PLATFORM)
+// Stand-ins for the ESP32 driver types used by the receive side.
+typedef int rmt_channel_t;
+typedef int gpio_num_t;
+#define RMT_CHANNEL_MAX (8)
+#endif /* !ESP_PLATFORM */
+
+#if defined(ESP_PLATFORM)
+
+// The number of 32 bit RMT items (each of two data items) in an RMT memory block.
+#define RMT_ITEMS_PER_MEM_BLOCK (64)
+
+// The number of requests that may be queued for a channel's transmit task.
+#define RMT_TX_REQUEST_QUEUE_SIZE (4)
+
+// The duration in RMT ticks of each idle data item sent while a stream is starved.
+#define RMT_STREAM_IDLE_TICKS (256)
+
+// Streaming needs the driver's translator (rmt_translator_init() and rmt_write_sample())
+// which ESP-IDF has had since v3.3.  Older releases, such as v3.0, have neither the
+// translator nor esp_idf_version.h so they build without streaming.
+#if defined(ESP_IDF_VERSION)
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(3, 3, 0)
+#define RMT_STREAM_SUPPORTED (1)
+#endif
+#endif
+#if !defined(RMT_STREAM_SUPPORTED)
+#define RMT_STREAM_SUPPORTED (0)
+#endif
+
+#define RMT_LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RMT_STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+typedef enum {
+	RMT_TX_REQUEST_WRITE,        // Transmit the start of the item buffer.
+#if RMT_STREAM_SUPPORTED
+	RMT_TX_REQUEST_STREAM_START, // Start transmitting a stream.
+	RMT_TX_REQUEST_STREAM_FREED, // A stream half has been sent (from the interrupt).
+	RMT_TX_REQUEST_STREAM_DONE,  // The last stream item has been handed over (from the interrupt).
+	RMT_TX_REQUEST_STREAM_END    // A stream ended before anything was supplied.
+#endif /* RMT_STREAM_SUPPORTED */
+} rmt_tx_request_type_t;
+
+typedef struct {
+	rmt_tx_request_type_t type;
+	size_t                count; // The number of rmt_item32_t entries to transmit.
+} rmt_tx_request_t;
+
+/*
+ * The transmit state of a channel.  Most fields are only changed from the JavaScript
+ * task (the data providers run there too).  While a stream is being transmitted, the
+ * translator owns the drain fields and hands the halves back through halfCount.
+ */
+typedef struct {
+	rmt_channel_t    channel;
+	rmt_idle_level_t idleLevel;
+	rmt_item32_t    *items;            // The item buffer.
+	size_t           capacity;         // The size of the item buffer in rmt_item32_t entries.
+	QueueHandle_t    requests;         // Requests for the transmit task.
+	TaskHandle_t     task;             // The transmit task (created on first use).
+	bool             busy;             // An asynchronous write or stream owns the item buffer.
+	uint32_t         callbackStashKey; // Completion callback of the asynchronous write or stream.
+	uint32_t         refillStashKey;   // The stream refill callback (a persistent stash).
+	size_t           halfCount[2];     // rmt_item32_t entries waiting in each half, 0 if free.
+	int              fillHalf;         // The next stream half to be filled.
+	bool             started;          // The stream transmission has been started.
+	bool             ending;           // streamEnd() has been called.
+	int              drainHalf;        // The stream half being transmitted.
+	size_t           drainOffset;      // The next entry of that half to be transmitted.
+	bool             starved;          // The translator is sending idle items.
+	uint32_t         underruns;        // Times the stream ran dry before it ended.
+} rmt_tx_channel_t;
+
+static rmt_tx_channel_t g_txChannels[RMT_CHANNEL_MAX];
+
 /**
  * Get the state of a channel.
  * [0] - number - The channel id.
@@ -37,6 +161,8 @@ LOG_TAG("module_rmt");
  *    memBlocks: <number> - The memory blocks being used.
  *    idleLevel: <number> - The idle level.
  *    memoryOwner: <String> - The memory owner "TX" or "RX"
+ *    bufferItems: <number> - The number of data items the TX item buffer holds.
+ *    busy: <boolean> - Whether an asynchronous write or stream is in progress.
  * }
  */
 static duk_ret_t js_rmt_getState(duk_context *ctx) {
@@ -51,6 +177,10 @@ static duk_ret_t js_rmt_getState(duk_context *ctx) {
 	rmt_channel_t channel;
 
 	channel = duk_get_int(ctx, -1); // Get the channel number from stack top.
+	if (channel < 0 || channel >= RMT_CHANNEL_MAX) {
+		LOGE("js_rmt_getState: channel is out of range");
+		return 0;
+	}
 
 	rmt_get_tx_loop_mode(channel, &loop_en);
 	rmt_get_clk_div(channel, &div_cnt);
@@ -71,6 +201,8 @@ static duk_ret_t js_rmt_getState(duk_context *ctx) {
 	ADD_INT("memBlocks", memNum);
 	ADD_INT("idleLevel", 0); // FIX
 	ADD_STRING("memoryOwner", owner==RMT_MEM_OWNER_TX?"TX":"RX");
+	ADD_INT("bufferItems", g_txChannels[channel].capacity * 2);
+	ADD_BOOLEAN("busy", g_txChannels[channel].busy);
 
 	return 1;
 } // js_rmt_getState
@@ -97,8 +229,288 @@ static void setRMTItem(
 
 
 /**
- * Write items into the output stream.  This call will block
- * until the transmission is complete.
+ * Determine the number of data items held in the value at idx.  The value is
+ * either an array of {level, duration} objects or a buffer of 16 bit data items.
+ * Returns -1 if the value is neither.
+ */
+static int countDataItems(duk_context *ctx, duk_idx_t idx) {
+	if (duk_is_array(ctx, idx)) {
+		return duk_get_length(ctx, idx);
+	}
+	if (duk_is_buffer_data(ctx, idx)) {
+		size_t bufferSize;
+		duk_get_buffer_data(ctx, idx, &bufferSize);
+		return bufferSize / 2; // 2 bytes per data item.
+	}
+	return -1;
+} // countDataItems
+
+
+/**
+ * Convert the dataItemCount data items held in the value at idx into dest.
+ * Each rmt_item32_t holds two data items.
+ */
+static void convertDataItems(duk_context *ctx, duk_idx_t idx, int dataItemCount, rmt_item32_t *dest) {
+	int i;
+	if (duk_is_buffer_data(ctx, idx)) {
+		// A buffer is raw memory already in the format of the ESP32 RMT.
+		void *data = duk_get_buffer_data(ctx, idx, NULL);
+		memcpy(dest, data, dataItemCount * 2);
+		return;
+	}
+
+	// We are working with an array of objects where each object contains:
+	// - level: <boolean> - signal level
+	// - duration: <number> - duration of level in RMT ticks
+	for (i=0; i<dataItemCount; i++) {
+		// Get each of the items and work with it.
+		duk_get_prop_index(ctx, idx, i);
+
+		duk_get_prop_string(ctx, -1, "level");
+		uint8_t level = duk_get_boolean(ctx, -1);
+		duk_pop(ctx); // Pop the level
+
+		duk_get_prop_string(ctx, -1, "duration");
+		uint16_t duration = duk_get_int(ctx, -1);
+		duk_pop(ctx); // Pop the duration
+
+		duk_pop(ctx); // Pop the item object
+
+		setRMTItem(level, duration, i, dest);
+	}
+} // convertDataItems
+
+
+/**
+ * Called on the JavaScript task when an asynchronous write has completed.
+ */
+static int rmt_write_dataProvider(duk_context *ctx, void *context) {
+	rmt_tx_channel_t *state = (rmt_tx_channel_t *)context;
+	state->busy = false;
+	state->callbackStashKey = 0;
+	return 0;
+} // rmt_write_dataProvider
+
+
+#if RMT_STREAM_SUPPORTED
+/**
+ * Called on the JavaScript task when a stream chunk has been transmitted.  The
+ * half that held it may now be refilled.  The refill callback is passed the
+ * channel number.
+ */
+static int rmt_refill_dataProvider(duk_context *ctx, void *context) {
+	rmt_tx_channel_t *state = (rmt_tx_channel_t *)context;
+	duk_push_int(ctx, state->channel);
+	return 1;
+} // rmt_refill_dataProvider
+
+
+/**
+ * Called on the JavaScript task when a stream has ended.  The completion
+ * callback is passed the number of times the stream ran dry.
+ */
+static int rmt_stream_done_dataProvider(duk_context *ctx, void *context) {
+	rmt_tx_channel_t *state = (rmt_tx_channel_t *)context;
+	esp32_duktape_stash_delete(ctx, state->refillStashKey);
+	state->refillStashKey = 0;
+	state->busy = false;
+	state->callbackStashKey = 0;
+	duk_push_int(ctx, state->underruns);
+	return 1;
+} // rmt_stream_done_dataProvider
+
+
+/**
+ * The translator of a stream.  The driver calls it from its TX threshold interrupt
+ * each time it has room for wanted_num more entries in RMT memory.  The source it is
+ * passed is the channel's state (see RMT_TX_REQUEST_STREAM_START) and is only said to
+ * have been used once the stream has ended.  Handing over fewer than wanted_num
+ * entries makes the driver end the transmission, so a starved stream is padded with
+ * idle items.
+ */
+static void rmt_stream_translator(const void *src, rmt_item32_t *dest, size_t src_size,
+		size_t wanted_num, size_t *translated_size, size_t *item_num) {
+	rmt_tx_channel_t *state = (rmt_tx_channel_t *)src;
+	size_t halfCapacity = state->capacity / 2;
+	size_t count = 0;
+
+	while (count < wanted_num) {
+		size_t waiting = RMT_LOAD(&state->halfCount[state->drainHalf]);
+		if (waiting == 0) {
+			break;
+		}
+		size_t take = waiting - state->drainOffset;
+		if (take > wanted_num - count) {
+			take = wanted_num - count;
+		}
+		memcpy(dest + count, state->items + state->drainHalf * halfCapacity + state->drainOffset,
+			take * sizeof(rmt_item32_t));
+		count += take;
+		state->drainOffset += take;
+		state->starved = false;
+		if (state->drainOffset == waiting) {
+			// The whole half is in RMT memory, JavaScript may fill it again.
+			rmt_tx_request_t request;
+			request.type  = RMT_TX_REQUEST_STREAM_FREED;
+			request.count = 0;
+			RMT_STORE(&state->halfCount[state->drainHalf], 0);
+			state->drainHalf ^= 1;
+			state->drainOffset = 0;
+			xQueueSendToBackFromISR(state->requests, &request, NULL);
+		}
+	}
+
+	*translated_size = 0;
+	if (count < wanted_num) {
+		if (RMT_LOAD(&state->ending)) {
+			// What we have is the end of the stream.  The driver adds the terminator.
+			rmt_tx_request_t request;
+			request.type  = RMT_TX_REQUEST_STREAM_DONE;
+			request.count = 0;
+			*translated_size = src_size;
+			xQueueSendToBackFromISR(state->requests, &request, NULL);
+		} else {
+			if (!state->starved) {
+				state->underruns++;
+				state->starved = true;
+			}
+			while (count < wanted_num) {
+				dest[count].level0    = state->idleLevel;
+				dest[count].duration0 = RMT_STREAM_IDLE_TICKS;
+				dest[count].level1    = state->idleLevel;
+				dest[count].duration1 = RMT_STREAM_IDLE_TICKS;
+				count++;
+			}
+		}
+	}
+	*item_num = count;
+} // rmt_stream_translator
+#endif /* RMT_STREAM_SUPPORTED */
+
+
+/**
+ * The transmit task of a channel.  It performs the (blocking) transmissions that
+ * were requested asynchronously and posts their completions.
+ */
+static void rmt_tx_task(void *param) {
+	rmt_tx_channel_t *state = (rmt_tx_channel_t *)param;
+	rmt_tx_request_t request;
+	esp_err_t errRc;
+
+	while(1) {
+		if (xQueueReceive(state->requests, &request, portMAX_DELAY) != pdTRUE) {
+			continue;
+		}
+		switch(request.type) {
+			case RMT_TX_REQUEST_WRITE: {
+				errRc = rmt_write_items(state->channel, state->items, request.count, true);
+				if (errRc != ESP_OK) {
+					LOGE("rmt_tx_task: rmt_write_items: %s", esp32_errToString(errRc));
+				}
+				event_newCallbackRequestedEvent(
+					ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION,
+					state->callbackStashKey,
+					rmt_write_dataProvider,
+					state);
+				break;
+			}
+
+#if RMT_STREAM_SUPPORTED
+			case RMT_TX_REQUEST_STREAM_START: {
+				// The translator is handed the channel's state as its source so that it
+				// knows which stream it serves.  It reports the single byte as used once
+				// the stream has ended.
+				state->drainHalf   = 0;
+				state->drainOffset = 0;
+				errRc = rmt_translator_init(state->channel, rmt_stream_translator);
+				if (errRc == ESP_OK) {
+					errRc = rmt_write_sample(state->channel, (const uint8_t *)state, 1, false);
+				}
+				if (errRc != ESP_OK) {
+					LOGE("rmt_tx_task: rmt_write_sample: %s", esp32_errToString(errRc));
+					event_newCallbackRequestedEvent(
+						ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION,
+						state->callbackStashKey,
+						rmt_stream_done_dataProvider,
+						state);
+				}
+				break;
+			}
+
+			case RMT_TX_REQUEST_STREAM_FREED: {
+				// The refill must arrive before the other half has been sent or the
+				// translator has to send idle items, so it goes ahead of I/O.
+				event_newLaneCallbackRequestedEvent(
+					ESP32_DUKTAPE_LANE_REALTIME,
+					ESP32_DUKTAPE_CALLBACK_TYPE_PERSISTENT_FUNCTION,
+					state->refillStashKey,
+					rmt_refill_dataProvider,
+					state);
+				break;
+			}
+
+			case RMT_TX_REQUEST_STREAM_DONE: {
+				// The last items are still in RMT memory.
+				rmt_wait_tx_done(state->channel, portMAX_DELAY);
+				event_newCallbackRequestedEvent(
+					ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION,
+					state->callbackStashKey,
+					rmt_stream_done_dataProvider,
+					state);
+				break;
+			}
+
+			case RMT_TX_REQUEST_STREAM_END: {
+				event_newCallbackRequestedEvent(
+					ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION,
+					state->callbackStashKey,
+					rmt_stream_done_dataProvider,
+					state);
+				break;
+			}
+#endif /* RMT_STREAM_SUPPORTED */
+		}
+	}
+	vTaskDelete(NULL);
+} // rmt_tx_task
+
+
+/**
+ * Get the transmit state of a configured TX channel, starting its transmit task
+ * if needed.  Returns NULL if the channel is not configured for TX.
+ */
+static rmt_tx_channel_t *getTxChannel(rmt_channel_t channel, bool needTask) {
+	if (channel < 0 || channel >= RMT_CHANNEL_MAX) {
+		LOGE("channel %d is out of range", channel);
+		return NULL;
+	}
+	rmt_tx_channel_t *state = &g_txChannels[channel];
+	if (state->items == NULL) {
+		LOGE("channel %d is not configured for TX", channel);
+		return NULL;
+	}
+	if (needTask && state->task == NULL) {
+		state->requests = xQueueCreate(RMT_TX_REQUEST_QUEUE_SIZE, sizeof(rmt_tx_request_t));
+		assert(state->requests != NULL);
+		if (xTaskCreatePinnedToCore(&rmt_tx_task, "rmt_tx", 2048, state, 6, &state->task, tskNO_AFFINITY) != pdPASS) {
+			LOGE("Unable to create transmit task for channel %d", channel);
+			vQueueDelete(state->requests);
+			state->requests = NULL;
+			state->task = NULL;
+			return NULL;
+		}
+	}
+	return state;
+} // getTxChannel
+
+
+/**
+ * Write items into the output stream.  The items are converted into the channel's
+ * item buffer (which grows if needed).  If no callback is supplied, this call
+ * blocks until the transmission is complete.  If a callback is supplied, the
+ * call returns immediately and the callback is invoked when the transmission has
+ * completed.
+ *
  * [0] - channel
  * [1] - array of items.  Each item is an object of the form:
  * {
@@ -110,141 +522,679 @@ static void setRMTItem(
  *
  * [1] - A buffer of items where the buffer is raw memory in the correct format
  * for passing into ESP32 RMT.
+ *
+ * [2] - callback - Optional.
+ *
+ * Returns true if the write was performed (or started) and false if the channel
+ * is busy with an earlier asynchronous write or stream.
  */
 static duk_ret_t js_rmt_write(duk_context *ctx) {
 	LOGD(">> js_rmt_write");
 	rmt_channel_t channel;
-	duk_size_t dataItemCount;
-	duk_uarridx_t i;
-	bool waitForWrite = 1;
-	bool isArray = false;
-	rmt_item32_t *itemBuffer;
-	size_t itemBufferSize;
-
-	if (!duk_is_number(ctx, -2)) {
+	int dataItemCount;
+	size_t itemCount;
+	bool async;
+
+	if (!duk_is_number(ctx, 0)) {
 		LOGE("<< js_rmt_write: param 1 is not a number");
 		return 0;
 	}
-	channel = duk_get_int(ctx, -2); // Get the channel number from parameter 0.
-	if (channel <0 || channel >= RMT_CHANNEL_MAX) {
-		LOGE("<< jms_rmt_write - channel is out of range");
+	channel = duk_get_int(ctx, 0); // Get the channel number from parameter 0.
+	async = duk_is_function(ctx, 2);
+
+	rmt_tx_channel_t *state = getTxChannel(channel, async);
+	if (state == NULL) {
+		LOGE("<< js_rmt_write");
 		return 0;
 	}
 
-	if (duk_is_array(ctx, -1)) {
-		isArray = true;
-	} else if (!duk_is_buffer_data(ctx, -1)) {
-		LOGE("<< jms_rmt_write - data is neither a buffer nor array");
+	if (state->busy) {
+		LOGD("<< js_rmt_write - channel is busy");
+		duk_push_false(ctx);
+		return 1;
+	}
+
+	dataItemCount = countDataItems(ctx, 1);
+	if (dataItemCount < 0) {
+		LOGE("<< js_rmt_write - data is neither a buffer nor array");
+		return 0;
+	}
+	if (dataItemCount == 0) {
+		LOGD("<< js_rmt_write - length of items is 0");
 		return 0;
 	}
 
-	if (!isArray) {
-		// bufferSize is the number of bytes in the buffer.  The buffer holds
-		// RMT data items where each data item is 16 bits (2 bytes).  So the
-		// dataItemCount is bufferSize/2.
-		// Now ... in the RMT APIs ... we are working in 32 bit units which are TWO
-		// data items.  So the number of buffer items we are working with are dataItemCount/2.
-		size_t bufferSize;
-		void *data = duk_get_buffer_data(ctx, -1, &bufferSize);
-		dataItemCount = bufferSize/2; // 2 bytes per data item.
-		if (dataItemCount%2==1) {
-			itemBuffer = malloc(dataItemCount * 2);
-			itemBufferSize = dataItemCount;
-		} else {
-			itemBuffer = malloc(dataItemCount * 2 + 4);
-			itemBufferSize = dataItemCount + 1;
-		}
-		//LOGD("dataItemCount: %d, bufferSize: %d, itemBufferSize: %d", dataItemCount, bufferSize, itemBufferSize);
-		memcpy(itemBuffer, data, bufferSize);
-		setRMTItem(0, 0, dataItemCount, itemBuffer); // Add the terminator.
-	} // We are processing a buffer.
-	else {
-		dataItemCount = duk_get_length(ctx, -1);
-		/*
-		duk_get_prop_string(ctx, 1, "length");
-		length = duk_get_int(ctx, -1);
-		duk_pop(ctx); // Pop the level
-		*/
+	// The last data item must have a duration of 0 which means we need room for
+	// one more data item than we were given.  Each rmt_item32_t holds TWO data items.
+	// | Number of data items | number of rmt_item32_t |
+	// +----------------------+------------------------+
+	// | 1                    | 1                      |
+	// | 2                    | 2                      |
+	// | 3                    | 2                      |
+	// | 4                    | 3                      |
+	itemCount = dataItemCount / 2 + 1;
+	if (itemCount > state->capacity) {
+		rmt_item32_t *newItems = realloc(state->items, itemCount * sizeof(rmt_item32_t));
+		if (newItems == NULL) {
+			LOGE("<< js_rmt_write - unable to grow item buffer to %d items", itemCount);
+			return 0;
+		}
+		LOGD(" - grew item buffer of channel %d from %d to %d items", channel, state->capacity, itemCount);
+		state->items = newItems;
+		state->capacity = itemCount;
+	}
+
+	convertDataItems(ctx, 1, dataItemCount, state->items);
+	if (dataItemCount % 2 == 0) {
+		state->items[itemCount - 1].val = 0; // The terminator.
+	} else {
+		setRMTItem(0, 0, dataItemCount, state->items); // Add the terminator.
+	}
+
+	if (async) {
+		duk_dup(ctx, 2);
+		state->callbackStashKey = esp32_duktape_stash_array(ctx, 1);
+		state->busy = true;
 
-		LOGD("Length of RMT data item array is %d", dataItemCount);
-		if (dataItemCount == 0) {
-			LOGD("<< jms_rmt_write - length of items is 0")
+		rmt_tx_request_t request;
+		request.type  = RMT_TX_REQUEST_WRITE;
+		request.count = itemCount;
+		xQueueSendToBack(state->requests, &request, portMAX_DELAY);
+	} else {
+		esp_err_t errRc = rmt_write_items(channel, state->items, itemCount, true);
+		if (errRc != ESP_OK) {
+			LOGE("<< js_rmt_write: rmt_write_items: %s", esp32_errToString(errRc));
 			return 0;
 		}
+	}
 
-		// We are working with an array of objects where each object contains:
-		// - level: <boolean> - signal level
-		// - duration: <number> - duration of level in RMT ticks
-
-		// An RMT_item is composed of 4 fields:
-		// * duration0
-		// * level0
-		// * duration1
-		// * level1
-		//
-		// The last entry must have a duration of 0 which means we allocate an extra entry.
-		// The number of items we need is length + 1
-		// If 1 array -> 2 items [0, 1*]
-		// If 2 array -> 3 items [0, 1], [2*, ?]
-		// if 3 array -> 4 items [0, 1], [2, 3*]
-		// if 4 array -> 5 items [0, 1], [2, 3], [4*, ?]
-		//
-		// Now let us think of the rmt_item32_t.  This is a 32 bit value that holds TWO data items.
-		// | Number of data items | number of rmt_item32_t |
-		// +----------------------+------------------------+
-		// | 2                    | 1                      |
-		// | 3                    | 2                      |
-		// | 4                    | 2                      |
-		// | 5                    | 3                      |
-		//
-		// Proposition:
-		// The number of rmt_item32_t elements to host n data items is
-		// (n+1) div 2
-		// n -> value
-		// 2 -> 1
-		// 3 -> 2
-		// 4 -> 2
-		// 5 -> 3
-
-		dataItemCount++; // Add 1 for the null terminator.
-
-		itemBufferSize = (dataItemCount + 1) / 2;
-
-		itemBuffer = calloc(sizeof(rmt_item32_t), itemBufferSize);
-		bzero(itemBuffer, sizeof(rmt_item32_t) * itemBufferSize);
-
-		for (i=0; i<dataItemCount-1; i++) {
-			// Get each of the items and work with it.
-			duk_get_prop_index(ctx, -1, i);
-
-			duk_get_prop_string(ctx, -1, "level");
-			uint8_t level = duk_get_boolean(ctx, -1);
-			duk_pop(ctx); // Pop the level
-
-			duk_get_prop_string(ctx, -1, "duration");
-			uint16_t duration = duk_get_int(ctx, -1);
-			duk_pop(ctx); // Pop the duration
-
-			duk_pop(ctx); // Pop the item object
-
-			setRMTItem(level, duration, i, itemBuffer);
-
-			//LOGD("item: %2d - level=%d, duration=%d", i, level, duration);
-		}
-
-		setRMTItem(0, 0, dataItemCount-1, itemBuffer); // Set the trailer / terminator.
-	}  // End of array processing.
-
-	ESP_ERROR_CHECK(rmt_write_items(channel, itemBuffer, itemBufferSize, waitForWrite));
-
-	free(itemBuffer);
 	LOGD("<< js_rmt_write");
-	return 0;
+	duk_push_true(ctx);
+	return 1;
 } // js_rmt_write
 
 
+#if RMT_STREAM_SUPPORTED
+/**
+ * Start streaming items.  The channel's item buffer is split into two halves.
+ * The refill callback is invoked as refill(channel) each time a half becomes free
+ * and should respond by calling streamWrite() or, once there are no more items,
+ * streamEnd().  Both halves are free when the stream starts.  The transmission
+ * starts once both have been filled or the stream has been ended.
+ *
+ * [0] - channel
+ * [1] - refill callback
+ * [2] - completion callback, invoked as callback(underruns)
+ */
+static duk_ret_t js_rmt_streamStart(duk_context *ctx) {
+	LOGD(">> js_rmt_streamStart");
+	rmt_channel_t channel = duk_get_int(ctx, 0);
+
+	if (!duk_is_function(ctx, 1) || !duk_is_function(ctx, 2)) {
+		LOGE("<< js_rmt_streamStart: refill and completion callbacks are required");
+		return 0;
+	}
+	rmt_tx_channel_t *state = getTxChannel(channel, true);
+	if (state == NULL) {
+		LOGE("<< js_rmt_streamStart");
+		return 0;
+	}
+	if (state->busy) {
+		LOGE("<< js_rmt_streamStart: channel is busy");
+		duk_push_false(ctx);
+		return 1;
+	}
+	if (state->capacity < 4) {
+		LOGE("<< js_rmt_streamStart: item buffer is too small to stream");
+		return 0;
+	}
+
+	duk_dup(ctx, 1);
+	state->refillStashKey = esp32_duktape_stash_array(ctx, 1);
+	duk_dup(ctx, 2);
+	state->callbackStashKey = esp32_duktape_stash_array(ctx, 1);
+
+	state->busy         = true;
+	state->halfCount[0] = 0;
+	state->halfCount[1] = 0;
+	state->fillHalf     = 0;
+	state->started      = false;
+	state->ending       = false;
+	state->starved      = false;
+	state->underruns    = 0;
+
+	LOGD("<< js_rmt_streamStart: %d data items per chunk", (state->capacity / 2) * 2);
+	duk_push_true(ctx);
+	return 1;
+} // js_rmt_streamStart
+
+
+/**
+ * Supply the next chunk of a stream.  A chunk must hold an even number of data
+ * items (a data item with a duration of 0 would end the transmission) and no
+ * more than bufferItems/2 of them.
+ *
+ * [0] - channel
+ * [1] - array or buffer of data items (as for write)
+ *
+ * Returns true if the chunk was accepted or false if there is no free half.
+ */
+static duk_ret_t js_rmt_streamWrite(duk_context *ctx) {
+	rmt_channel_t channel = duk_get_int(ctx, 0);
+	rmt_tx_channel_t *state = getTxChannel(channel, false);
+	if (state == NULL || state->refillStashKey == 0) {
+		LOGE("js_rmt_streamWrite: channel %d is not streaming", channel);
+		return 0;
+	}
+	if (state->ending || RMT_LOAD(&state->halfCount[state->fillHalf]) != 0) {
+		duk_push_false(ctx);
+		return 1;
+	}
+
+	int dataItemCount = countDataItems(ctx, 1);
+	if (dataItemCount <= 0 || dataItemCount % 2 != 0) {
+		LOGE("js_rmt_streamWrite: a chunk must hold an even number of data items");
+		return 0;
+	}
+	size_t halfCapacity = state->capacity / 2;
+	if ((size_t)dataItemCount / 2 > halfCapacity) {
+		LOGE("js_rmt_streamWrite: chunk of %d data items exceeds %d", dataItemCount, halfCapacity * 2);
+		return 0;
+	}
+
+	convertDataItems(ctx, 1, dataItemCount, state->items + state->fillHalf * halfCapacity);
+	RMT_STORE(&state->halfCount[state->fillHalf], dataItemCount / 2);
+	state->fillHalf ^= 1;
+
+	// Start once both halves are full so that the first refill has a whole half's
+	// transmission time to arrive.
+	if (!state->started && RMT_LOAD(&state->halfCount[state->fillHalf]) != 0) {
+		rmt_tx_request_t request;
+		request.type  = RMT_TX_REQUEST_STREAM_START;
+		request.count = 0;
+		state->started = true;
+		xQueueSendToBack(state->requests, &request, portMAX_DELAY);
+	}
+
+	duk_push_true(ctx);
+	return 1;
+} // js_rmt_streamWrite
+
+
+/**
+ * Mark the end of a stream.  The completion callback is invoked once the chunks
+ * already supplied have been transmitted.
+ *
+ * [0] - channel
+ */
+static duk_ret_t js_rmt_streamEnd(duk_context *ctx) {
+	rmt_channel_t channel = duk_get_int(ctx, 0);
+	rmt_tx_channel_t *state = getTxChannel(channel, false);
+	if (state == NULL || state->refillStashKey == 0) {
+		LOGE("js_rmt_streamEnd: channel %d is not streaming", channel);
+		return 0;
+	}
+	if (state->ending) {
+		return 0;
+	}
+	RMT_STORE(&state->ending, true);
+	if (state->started) {
+		// The translator ends the transmission once it has run out of items.
+		return 0;
+	}
+	rmt_tx_request_t request;
+	request.count = 0;
+	if (RMT_LOAD(&state->halfCount[0]) != 0 || RMT_LOAD(&state->halfCount[1]) != 0) {
+		request.type   = RMT_TX_REQUEST_STREAM_START;
+		state->started = true;
+	} else {
+		request.type = RMT_TX_REQUEST_STREAM_END;
+	}
+	xQueueSendToBack(state->requests, &request, portMAX_DELAY);
+	return 0;
+} // js_rmt_streamEnd
+#endif /* RMT_STREAM_SUPPORTED */
+#endif /* ESP_PLATFORM */
+
+
+/*
+ * The receive pipeline.  A background task (a thread on Linux) takes captured
+ * frames from the RMT driver's ring buffer (or, on Linux, from a recorded
+ * capture file), optionally decodes them and appends them to a batch.  A single
+ * event is outstanding at any time; frames that arrive while JavaScript hasn't
+ * yet taken the batch join it rather than posting further events.
+ */
+typedef struct rmt_rx_frame {
+	struct rmt_rx_frame *next;
+	bool                 decoded; // If true, code is valid, otherwise items holds the frame.
+	rmt_decoded_t        code;
+	size_t               count;   // The number of data items in items.
+	uint16_t             items[];
+} rmt_rx_frame_t;
+
+typedef struct {
+	rmt_channel_t       channel;
+	bool                configured;       // rxConfig() has been called.
+	uint32_t            tickNs;           // The duration of an RMT tick.
+	rmt_decoder_type_t  decoder;
+	rmt_decoder_state_t decoderState;
+	volatile bool       running;          // The capture task should keep running.
+	volatile bool       taskRunning;      // The capture task has not yet ended.
+	bool                stopping;         // rxStop() has been called with an event outstanding.
+	uint32_t            callbackStashKey; // The batch callback (a persistent stash).
+	bool                eventPosted;      // An event for the current batch is outstanding.
+	rmt_rx_frame_t     *head;             // The current batch.
+	rmt_rx_frame_t     *tail;
+	size_t              batchFrames;      // The number of frames in the current batch.
+	size_t              maxBatchFrames;   // Frames beyond this are dropped.
+	uint32_t            dropped;          // Frames dropped since the last batch.
+#if defined(ESP_PLATFORM)
+	TaskHandle_t        task;
+#else
+	pthread_t           thread;
+	char               *replayFile;       // Capture file to replay.
+	uint32_t            replayInterval;   // Milliseconds between replayed frames.
+#endif
+} rmt_rx_channel_t;
+
+static rmt_rx_channel_t g_rxChannels[RMT_CHANNEL_MAX];
+
+#if defined(ESP_PLATFORM)
+static SemaphoreHandle_t g_rxLock = NULL;
+#define RX_LOCK()   xSemaphoreTake(g_rxLock, portMAX_DELAY)
+#define RX_UNLOCK() xSemaphoreGive(g_rxLock)
+#else
+static pthread_mutex_t g_rxLock = PTHREAD_MUTEX_INITIALIZER;
+#define RX_LOCK()   pthread_mutex_lock(&g_rxLock)
+#define RX_UNLOCK() pthread_mutex_unlock(&g_rxLock)
+#endif
+
+
+/**
+ * Release the frames of a batch.
+ */
+static void rx_freeFrames(rmt_rx_frame_t *frame) {
+	while(frame != NULL) {
+		rmt_rx_frame_t *next = frame->next;
+		free(frame);
+		frame = next;
+	}
+} // rx_freeFrames
+
+
 /**
- * Configure an RX channel.
+ * Called on the JavaScript task to deliver the current batch.  The batch
+ * callback is invoked as callback(frames, dropped) where each frame is either a
+ * decoded code {protocol, address, command, repeat, toggle} or, when no decoder
+ * is in use, a buffer of 16 bit data items.
+ */
+static int rx_batch_dataProvider(duk_context *ctx, void *context) {
+	rmt_rx_channel_t *state = (rmt_rx_channel_t *)context;
+	rmt_rx_frame_t *frame;
+	uint32_t dropped;
+	duk_uarridx_t i = 0;
+
+	RX_LOCK();
+	frame = state->head;
+	dropped = state->dropped;
+	state->head = state->tail = NULL;
+	state->batchFrames = 0;
+	state->dropped = 0;
+	state->eventPosted = false;
+	RX_UNLOCK();
+
+	duk_push_array(ctx);
+	while(frame != NULL) {
+		if (frame->decoded) {
+			duk_push_object(ctx);
+			duk_push_string(ctx, rmt_decoder_toString(frame->code.protocol));
+			duk_put_prop_string(ctx, -2, "protocol");
+			duk_push_int(ctx, frame->code.address);
+			duk_put_prop_string(ctx, -2, "address");
+			duk_push_int(ctx, frame->code.command);
+			duk_put_prop_string(ctx, -2, "command");
+			duk_push_boolean(ctx, frame->code.repeat);
+			duk_put_prop_string(ctx, -2, "repeat");
+			duk_push_boolean(ctx, frame->code.toggle);
+			duk_put_prop_string(ctx, -2, "toggle");
+		} else {
+			void *data = duk_push_fixed_buffer(ctx, frame->count * sizeof(uint16_t));
+			memcpy(data, frame->items, frame->count * sizeof(uint16_t));
+			duk_push_buffer_object(ctx, -1, 0, frame->count * sizeof(uint16_t), DUK_BUFOBJ_NODEJS_BUFFER);
+			duk_remove(ctx, -2);
+		}
+		duk_put_prop_index(ctx, -2, i++);
+		rmt_rx_frame_t *next = frame->next;
+		free(frame);
+		frame = next;
+	}
+	duk_push_int(ctx, dropped);
+
+	// If the channel was stopped while this event was outstanding, the callback has
+	// now been retrieved for the last time.
+	if (state->stopping) {
+		esp32_duktape_stash_delete(ctx, state->callbackStashKey);
+		state->callbackStashKey = 0;
+		state->stopping = false;
+	}
+	return 2;
+} // rx_batch_dataProvider
+
+
+/**
+ * Called on the capture task with one frame of count data items.  The frame is
+ * decoded (if a decoder is in use) and added to the batch.
+ */
+static void rx_deliverFrame(rmt_rx_channel_t *state, const uint16_t *items, size_t count) {
+	rmt_rx_frame_t *frame;
+	bool post = false;
+
+	if (state->decoder != RMT_DECODER_NONE) {
+		rmt_decoded_t code;
+		if (!rmt_decode(state->decoder, &state->decoderState, items, count, state->tickNs, &code)) {
+			LOGD("rx_deliverFrame: frame of %d items on channel %d not decoded", count, state->channel);
+			return;
+		}
+		frame = malloc(sizeof(rmt_rx_frame_t));
+		if (frame != NULL) {
+			frame->decoded = true;
+			frame->code    = code;
+			frame->count   = 0;
+		}
+	} else {
+		frame = malloc(sizeof(rmt_rx_frame_t) + count * sizeof(uint16_t));
+		if (frame != NULL) {
+			frame->decoded = false;
+			frame->count   = count;
+			memcpy(frame->items, items, count * sizeof(uint16_t));
+		}
+	}
+
+	// A frame we had no memory for is counted as dropped like one that didn't fit in
+	// the batch.
+	RX_LOCK();
+	if (frame == NULL || state->batchFrames >= state->maxBatchFrames) {
+		state->dropped++;
+		free(frame);
+		frame = NULL;
+	} else {
+		frame->next = NULL;
+		if (state->tail == NULL) {
+			state->head = frame;
+		} else {
+			state->tail->next = frame;
+		}
+		state->tail = frame;
+		state->batchFrames++;
+	}
+	if (!state->eventPosted) {
+		state->eventPosted = true;
+		post = true;
+	}
+	RX_UNLOCK();
+
+	if (post) {
+		event_newCallbackRequestedEvent(
+			ESP32_DUKTAPE_CALLBACK_TYPE_PERSISTENT_FUNCTION,
+			state->callbackStashKey,
+			rx_batch_dataProvider,
+			state);
+	}
+} // rx_deliverFrame
+
+
+/**
+ * Split count data items into frames at the items with a duration of 0 and
+ * deliver each of them.
+ */
+static void rx_deliverItems(rmt_rx_channel_t *state, const uint16_t *items, size_t count) {
+	size_t start = 0;
+	size_t i;
+	for (i=0; i<=count; i++) {
+		if (i == count || RMT_DATA_ITEM_DURATION(items[i]) == 0) {
+			if (i > start) {
+				rx_deliverFrame(state, items + start, i - start);
+			}
+			start = i + 1;
+		}
+	}
+} // rx_deliverItems
+
+
+#if defined(ESP_PLATFORM)
+/**
+ * The capture task of an RX channel.  It drains the driver's ring buffer.  An
+ * rmt_item32_t has the same memory layout as two 16 bit data items so the
+ * captured items are used as they are.
+ */
+static void rmt_rx_task(void *param) {
+	rmt_rx_channel_t *state = (rmt_rx_channel_t *)param;
+	RingbufHandle_t ringBuffer = NULL;
+	esp_err_t errRc;
+
+	errRc = rmt_get_ringbuf_handle(state->channel, &ringBuffer);
+	if (errRc != ESP_OK || ringBuffer == NULL) {
+		LOGE("rmt_rx_task: rmt_get_ringbuf_handle: %s", esp32_errToString(errRc));
+		state->taskRunning = false;
+		vTaskDelete(NULL);
+		return;
+	}
+	rmt_rx_start(state->channel, true);
+	while(state->running) {
+		size_t size;
+		rmt_item32_t *items = (rmt_item32_t *)xRingbufferReceive(ringBuffer, &size, pdMS_TO_TICKS(100));
+		if (items == NULL) {
+			continue;
+		}
+		rx_deliverItems(state, (uint16_t *)items, size / sizeof(uint16_t));
+		vRingbufferReturnItem(ringBuffer, items);
+	}
+	rmt_rx_stop(state->channel);
+	state->taskRunning = false;
+	vTaskDelete(NULL);
+} // rmt_rx_task
+
+#else /* ESP_PLATFORM */
+
+/**
+ * The replay thread of an RX channel.  The capture file holds 16 bit little
+ * endian data items with frames separated by items with a duration of 0, which
+ * is also the format of the buffers passed to write() and delivered when no
+ * decoder is in use.
+ */
+static void *rmt_rx_replay_thread(void *param) {
+	rmt_rx_channel_t *state = (rmt_rx_channel_t *)param;
+	FILE *file = fopen(state->replayFile, "rb");
+	uint16_t frame[1024];
+	size_t count = 0;
+	uint8_t bytes[2];
+
+	if (file == NULL) {
+		LOGE("rmt_rx_replay_thread: unable to open %s", state->replayFile);
+		state->taskRunning = false;
+		return NULL;
+	}
+	while(state->running && fread(bytes, 1, 2, file) == 2) {
+		uint16_t item = bytes[0] | (bytes[1] << 8);
+		if (RMT_DATA_ITEM_DURATION(item) != 0 && count < sizeof(frame) / sizeof(frame[0])) {
+			frame[count++] = item;
+			continue;
+		}
+		if (count > 0) {
+			rx_deliverFrame(state, frame, count);
+			usleep(state->replayInterval * 1000);
+		}
+		count = 0;
+	}
+	if (state->running && count > 0) {
+		rx_deliverFrame(state, frame, count);
+	}
+	fclose(file);
+	state->taskRunning = false;
+	return NULL;
+} // rmt_rx_replay_thread
+#endif /* ESP_PLATFORM */
+
+
+/**
+ * Start capturing on a configured RX channel.
+ *
+ * [0] - channel
+ * [1] - options
+ * {
+ *    decoder: <string> - "NEC", "RC5" or "none".  Optional, default is "none".
+ *    maxBatch: <number> - The most frames delivered in one callback.  Frames that
+ *      arrive while a full batch waits for JavaScript are dropped and counted.
+ *      Optional, default is 32.
+ *    replay: <string> - Linux only.  The capture file to replay.
+ *    replayInterval: <number> - Linux only.  Milliseconds between replayed frames.
+ *      Optional, default is 50.
+ * }
+ * [2] - callback - Invoked as callback(frames, dropped).
+ */
+static duk_ret_t js_rmt_rxStart(duk_context *ctx) {
+	LOGD(">> js_rmt_rxStart");
+	rmt_channel_t channel = duk_get_int(ctx, 0);
+
+	if (channel < 0 || channel >= RMT_CHANNEL_MAX) {
+		LOGE("<< js_rmt_rxStart: channel out of range");
+		return 0;
+	}
+	rmt_rx_channel_t *state = &g_rxChannels[channel];
+	if (!state->configured) {
+		LOGE("<< js_rmt_rxStart: channel %d is not configured for RX", channel);
+		return 0;
+	}
+	if (state->callbackStashKey != 0) {
+		LOGE("<< js_rmt_rxStart: channel %d is already capturing", channel);
+		return 0;
+	}
+	if (!duk_is_function(ctx, 2)) {
+		LOGE("<< js_rmt_rxStart: no callback supplied");
+		return 0;
+	}
+
+	state->decoder = RMT_DECODER_NONE;
+	state->maxBatchFrames = 32;
+	if (duk_is_object(ctx, 1)) {
+		if (duk_get_prop_string(ctx, 1, "decoder")) {
+			const char *decoder = duk_get_string(ctx, -1);
+			state->decoder = rmt_decoder_fromString(decoder);
+			if (state->decoder == RMT_DECODER_NONE && decoder != NULL && strcmp(decoder, "none") != 0) {
+				LOGE("<< js_rmt_rxStart: unknown decoder %s", decoder);
+				duk_pop(ctx);
+				return 0;
+			}
+		}
+		duk_pop(ctx);
+		if (duk_get_prop_string(ctx, 1, "maxBatch")) {
+			state->maxBatchFrames = duk_get_int(ctx, -1);
+			if (state->maxBatchFrames < 1) {
+				state->maxBatchFrames = 1;
+			}
+		}
+		duk_pop(ctx);
+	}
+#if !defined(ESP_PLATFORM)
+	free(state->replayFile);
+	state->replayFile = NULL;
+	state->replayInterval = 50;
+	if (duk_is_object(ctx, 1)) {
+		if (duk_get_prop_string(ctx, 1, "replay")) {
+			state->replayFile = strdup(duk_get_string(ctx, -1));
+		}
+		duk_pop(ctx);
+		if (duk_get_prop_string(ctx, 1, "replayInterval")) {
+			state->replayInterval = duk_get_int(ctx, -1);
+		}
+		duk_pop(ctx);
+	}
+	if (state->replayFile == NULL) {
+		LOGE("<< js_rmt_rxStart: no capture file to replay");
+		return 0;
+	}
+#endif
+
+	memset(&state->decoderState, 0, sizeof(state->decoderState));
+	state->channel     = channel;
+	state->head        = state->tail = NULL;
+	state->batchFrames = 0;
+	state->dropped     = 0;
+	state->eventPosted = false;
+
+	duk_dup(ctx, 2);
+	state->callbackStashKey = esp32_duktape_stash_array(ctx, 1);
+	state->running     = true;
+	state->taskRunning = true;
+
+#if defined(ESP_PLATFORM)
+	if (g_rxLock == NULL) {
+		g_rxLock = xSemaphoreCreateMutex();
+	}
+	if (xTaskCreatePinnedToCore(&rmt_rx_task, "rmt_rx", 3072, state, 6, &state->task, tskNO_AFFINITY) != pdPASS) {
+		state->taskRunning = false;
+	}
+#else
+	if (pthread_create(&state->thread, NULL, rmt_rx_replay_thread, state) != 0) {
+		state->taskRunning = false;
+	}
+#endif
+	if (!state->taskRunning) {
+		LOGE("<< js_rmt_rxStart: unable to start the capture task");
+		state->running = false;
+		esp32_duktape_stash_delete(ctx, state->callbackStashKey);
+		state->callbackStashKey = 0;
+		return 0;
+	}
+
+	LOGD("<< js_rmt_rxStart: decoder: %s", rmt_decoder_toString(state->decoder));
+	return 0;
+} // js_rmt_rxStart
+
+
+/**
+ * Stop capturing on an RX channel.  Frames not yet delivered are discarded.
+ *
+ * [0] - channel
+ */
+static duk_ret_t js_rmt_rxStop(duk_context *ctx) {
+	LOGD(">> js_rmt_rxStop");
+	rmt_channel_t channel = duk_get_int(ctx, 0);
+
+	if (channel < 0 || channel >= RMT_CHANNEL_MAX ||
+			g_rxChannels[channel].callbackStashKey == 0 || g_rxChannels[channel].stopping) {
+		LOGE("<< js_rmt_rxStop: channel is not capturing");
+		return 0;
+	}
+	rmt_rx_channel_t *state = &g_rxChannels[channel];
+	state->running = false;
+#if defined(ESP_PLATFORM)
+	while(state->taskRunning) {
+		vTaskDelay(10 / portTICK_PERIOD_MS);
+	}
+#else
+	pthread_join(state->thread, NULL);
+	state->taskRunning = false;
+#endif
+
+	// The capture task has ended so only this task touches the state from here on.
+	rx_freeFrames(state->head);
+	state->head = state->tail = NULL;
+	state->batchFrames = 0;
+	if (state->eventPosted) {
+		state->stopping = true; // The data provider releases the callback.
+	} else {
+		esp32_duktape_stash_delete(ctx, state->callbackStashKey);
+		state->callbackStashKey = 0;
+	}
+	LOGD("<< js_rmt_rxStop");
+	return 0;
+} // js_rmt_rxStop
+
+
+/**
+ * Configure an RX channel.  On Linux the configuration is only recorded; the
+ * channel is fed from a capture file given to rxStart().
  * Two parameters
  * 1) Channel id
  * 2) Configuration:
@@ -335,6 +1285,14 @@ static duk_ret_t js_rmt_rxConfig(duk_context *ctx) {
 		}
 		duk_pop(ctx);
 
+		if (g_rxChannels[channel].callbackStashKey != 0) {
+			LOGE("Channel is capturing");
+			return 0;
+		}
+		g_rxChannels[channel].configured = true;
+		g_rxChannels[channel].tickNs     = clockDiv * 25 / 2; // APB clock of 80MHz.
+
+#if defined(ESP_PLATFORM)
 		rmt_config_t rxConfig;
 		rxConfig.channel = channel;
 		rxConfig.clk_div = clockDiv;
@@ -354,12 +1312,20 @@ static duk_ret_t js_rmt_rxConfig(duk_context *ctx) {
 		if (errCode != ESP_OK) {
 			LOGE("rmt_driver_install: %s", esp32_errToString(errCode));
 		}
+#else /* ESP_PLATFORM */
+		(void)gpio;
+		(void)memBlocks;
+		(void)filterEn;
+		(void)idleThreshold;
+		(void)ringBufferSize;
+#endif /* ESP_PLATFORM */
 
 		LOGD("<< js_rmt_txConfig");
 	  return 0;
 } // js_rmt_rxConfig
 
 
+#if defined(ESP_PLATFORM)
 /**
  * Configure a TX channel.
  * Two parameters
@@ -370,6 +1336,8 @@ static duk_ret_t js_rmt_rxConfig(duk_context *ctx) {
  * 		memBlocks: <number> - Memory blocks to use. Optional, default is 1.
  * 		idleLevel: <boolean> - Idle value to use.  Optional, default is LOW.
  * 		clockDiv: <number> - Clock divider.  Optional, default is 1.
+ * 		bufferItems: <number> - Data items to allocate for writes.  Optional, default
+ * 		  is the number of data items held by the RMT memory blocks.
  * }
  *
  * [0] - number - Channel
@@ -379,6 +1347,7 @@ static duk_ret_t js_rmt_rxConfig(duk_context *ctx) {
  *    memBlocks: [Optional]
  *    idleLevel: [Optional]
  *    clockDiv:  [Optional]
+ *    bufferItems: [Optional]
  * }
  *
  */
@@ -389,12 +1358,17 @@ static duk_ret_t js_rmt_txConfig(duk_context *ctx) {
 	uint8_t memBlocks = 1;
 	rmt_idle_level_t idleLevel = RMT_IDLE_LEVEL_LOW;
 	uint8_t clockDiv = 1;
+	int bufferItems = -1;
 
 	channel = duk_get_int(ctx, 0);
 	if (channel >= RMT_CHANNEL_MAX) {
 		LOGE("Channel out of range");
 		return 0;
 	}
+	if (g_txChannels[channel].busy) {
+		LOGE("Channel is busy");
+		return 0;
+	}
 
 	if (duk_get_prop_string(ctx, 1, "gpio")) {
 		gpio = duk_get_int(ctx, -1);
@@ -430,6 +1404,28 @@ static duk_ret_t js_rmt_txConfig(duk_context *ctx) {
 	}
 	duk_pop(ctx);
 
+	if (duk_get_prop_string(ctx, 1, "bufferItems")) {
+		bufferItems = duk_get_int(ctx, -1);
+	}
+	duk_pop(ctx);
+	if (bufferItems <= 0) {
+		bufferItems = memBlocks * RMT_ITEMS_PER_MEM_BLOCK * 2;
+	}
+
+	// Allocate the item buffer now so that writes don't have to.  There is room for
+	// the requested data items plus the terminator.
+	rmt_tx_channel_t *state = &g_txChannels[channel];
+	free(state->items);
+	state->channel   = channel;
+	state->idleLevel = idleLevel;
+	state->capacity = bufferItems / 2 + 1;
+	state->items    = malloc(state->capacity * sizeof(rmt_item32_t));
+	if (state->items == NULL) {
+		LOGE("Unable to allocate %d items", state->capacity);
+		state->capacity = 0;
+		return 0;
+	}
+
 	rmt_config_t config;
 	config.channel = channel;
 	config.clk_div = clockDiv;
@@ -473,6 +1469,7 @@ static duk_ret_t js_rmt_txConfig(duk_context *ctx) {
 	LOGD("<< js_rmt_txConfig");
   return 0;
 } // js_fs_openSync
+#endif /* ESP_PLATFORM */
 
 
 /**
@@ -481,10 +1478,23 @@ static duk_ret_t js_rmt_txConfig(duk_context *ctx) {
  */
 duk_ret_t ModuleRMT(duk_context *ctx) {
 
-	ADD_FUNCTION("getState", js_rmt_getState, 1);
-	ADD_FUNCTION("rxConfig", js_rmt_rxConfig, 2);
-	ADD_FUNCTION("txConfig", js_rmt_txConfig, 2);
-	ADD_FUNCTION("write",    js_rmt_write,    2);
+	ADD_FUNCTION("rxConfig",    js_rmt_rxConfig,    2);
+	ADD_FUNCTION("rxStart",     js_rmt_rxStart,     3);
+	ADD_FUNCTION("rxStop",      js_rmt_rxStop,      1);
+#if defined(ESP_PLATFORM)
+	ADD_FUNCTION("getState",    js_rmt_getState,    1);
+#if RMT_STREAM_SUPPORTED
+	ADD_FUNCTION("streamEnd",   js_rmt_streamEnd,   1);
+	ADD_FUNCTION("streamStart", js_rmt_streamStart, 3);
+	ADD_FUNCTION("streamWrite", js_rmt_streamWrite, 2);
+#endif /* RMT_STREAM_SUPPORTED */
+	ADD_FUNCTION("txConfig",    js_rmt_txConfig,    2);
+	ADD_FUNCTION("write",       js_rmt_write,       3);
+
+	ADD_BOOLEAN("SIMULATED", 0);
+#else
+	ADD_BOOLEAN("SIMULATED", 1);
+#endif /* ESP_PLATFORM */
 
 	return 0;
 } // ModuleRMT
@@ -1,15 +1,293 @@
+/*
+ * SPI master access.
+ *
+ * Transactions can be performed either synchronously (transmit) where the caller
+ * blocks until the data has been clocked out or asynchronously (queue) where the
+ * transaction is handed to the SPI driver's DMA queue and a JavaScript callback is
+ * invoked through the event queue when it completes.  A device may have several
+ * asynchronous transactions in flight at once (up to its queue_size).  A batch
+ * (queueBatch) splits a buffer into segments that are each queued as a transaction
+ * of their own, so that CS is released between them, with a single callback once
+ * the last has completed.  Segments of up to 4 bytes travel inside the transaction
+ * descriptor rather than through DMA.
+ *
+ * When building for Linux there is no SPI hardware so we provide a simulated
+ * device.  The simulated device behaves as though MISO were wired to MOSI (a
+ * loopback) and takes as long as the real bus would at the configured clock
+ * speed.  This lets drivers built on the asynchronous path be exercised on a
+ * desktop.
+ */
+#if defined(ESP_PLATFORM)
 #include <driver/spi_master.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include "esp32_specific.h"
+#include "sdkconfig.h"
+#else /* ESP_PLATFORM */
+#include <pthread.h>
+#include <unistd.h>
+#endif /* ESP_PLATFORM */
+
+#include <assert.h>
 #include <duktape.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "duktape_event.h"
 #include "duktape_utils.h"
-#include "esp32_specific.h"
 #include "logging.h"
 #include "module_spi.h"
 
 LOG_TAG("module_spi");
 
+#if !defined(ESP_PLATFORM)
+// Host identifiers matching the values used by the ESP-IDF.
+typedef int spi_host_device_t;
+#define SPI_HOST  (0)
+#define HSPI_HOST (1)
+#define VSPI_HOST (2)
+
+// A minimal transaction descriptor for the simulated device.
+typedef struct {
+	size_t      length;    // Total data length in bits.
+	size_t      rxlength;  // Receive length in bits.
+	const void *tx_buffer;
+	void       *rx_buffer;
+	void       *user;
+} spi_transaction_t;
+#endif /* !ESP_PLATFORM */
+
 #define DEFAULT_HOST HSPI_HOST
 #define DEFAULT_CLOCK_SPEED (10000)
+#define DEFAULT_QUEUE_SIZE (10)
+
+// The maximum number of asynchronous transactions that may be in flight across
+// all devices.  This is the depth of the completion queue.
+#define MAX_TOTAL_IN_FLIGHT (32)
+
+/*
+ * A device added to an SPI bus.  The handle passed back to JavaScript is a pointer
+ * to one of these.  We count the asynchronous transactions that have been queued
+ * but whose callbacks have not yet run so that we never overrun the driver's
+ * transaction queue and never remove a device that still owns buffers.
+ */
+typedef struct {
+#if defined(ESP_PLATFORM)
+	spi_device_handle_t handle;
+#else
+	int clockSpeed;
+#endif
+	int queueSize; // The maximum number of transactions that may be in flight.
+	int inFlight;  // The number of transactions queued and not yet reported.
+} dukf_spi_device_t;
+
+/*
+ * An asynchronous transaction or batch of them.  The JavaScript data buffers are kept
+ * in a stash for the lifetime of the transactions so that they can't be garbage
+ * collected while the DMA engine is reading from or writing into them.
+ */
+typedef struct dukf_spi_async {
+	dukf_spi_device_t     *device;
+	uint32_t               callbackStashKey; // Stash of [callback].
+	uint32_t               pinStashKey;      // Stash of [rxBuffer, txBuffer].
+	void                  *rxData;           // The JavaScript receive buffer.
+	size_t                 rxSize;
+	void                  *txBounce;         // DMA capable copy of the transmit data (or NULL).
+	void                  *rxBounce;         // DMA capable receive area (or NULL).
+	int                    status;           // 0 on success, otherwise the first error.
+	struct dukf_spi_async *next;             // Linux simulation queue link.
+	size_t                 segmentSize;      // The size in bytes of each segment.
+	int                    segments;         // The number of transactions queued.
+	int                    remaining;        // The transactions that have yet to complete.
+	spi_transaction_t      trans[];          // One per segment.
+} dukf_spi_async_t;
+
+static int g_totalInFlight = 0;
+
+#if defined(ESP_PLATFORM)
+static QueueHandle_t g_spiCompletionQueue = NULL;
+
+// The DMA engine wants word aligned buffers.  Anything else is bounced through
+// memory we allocate ourselves.
+#define IS_DMA_FRIENDLY(PTR) ((((uint32_t)(PTR)) & 3) == 0)
+#endif /* ESP_PLATFORM */
+
+
+/*
+ * Called on the JavaScript task when the completion event for an asynchronous
+ * transaction is processed.  We add the error (or null) and the receive buffer
+ * as the parameters to the callback, release the pinned buffers and the
+ * transaction itself.
+ */
+static int spi_async_dataProvider(duk_context *ctx, void *context) {
+	dukf_spi_async_t *pAsync = (dukf_spi_async_t *)context;
+
+	if (pAsync->rxBounce != NULL) {
+		if (pAsync->status == 0) {
+			memcpy(pAsync->rxData, pAsync->rxBounce, pAsync->rxSize);
+		}
+		free(pAsync->rxBounce);
+	}
+	if (pAsync->txBounce != NULL) {
+		free(pAsync->txBounce);
+	}
+#if defined(ESP_PLATFORM)
+	if (pAsync->segmentSize <= 4 && pAsync->status == 0) {
+		int i;
+		for (i=0; i<pAsync->segments; i++) {
+			size_t offset = i * pAsync->segmentSize;
+			if (offset < pAsync->rxSize) {
+				size_t size = pAsync->rxSize - offset < pAsync->segmentSize ? pAsync->rxSize - offset : pAsync->segmentSize;
+				memcpy((uint8_t *)pAsync->rxData + offset, pAsync->trans[i].rx_data, size);
+			}
+		}
+	}
+#endif /* ESP_PLATFORM */
+	pAsync->device->inFlight -= pAsync->segments;
+	g_totalInFlight -= pAsync->segments;
+
+	if (pAsync->status == 0) {
+		duk_push_null(ctx);
+	} else {
+#if defined(ESP_PLATFORM)
+		duk_push_string(ctx, esp32_errToString(pAsync->status));
+#else
+		duk_push_string(ctx, "SPI transaction failed");
+#endif
+	}
+	// [0] - err
+
+	esp32_duktape_unstash_object(ctx, pAsync->pinStashKey);
+	// [0] - err
+	// [1] - [rxBuffer, txBuffer]
+
+	duk_get_prop_index(ctx, -1, 0);
+	// [0] - err
+	// [1] - [rxBuffer, txBuffer]
+	// [2] - rxBuffer
+
+	duk_remove(ctx, -2);
+	// [0] - err
+	// [1] - rxBuffer
+
+	esp32_duktape_stash_delete(ctx, pAsync->pinStashKey);
+	free(pAsync);
+	return 2;
+} // spi_async_dataProvider
+
+
+#if defined(ESP_PLATFORM)
+/*
+ * Called by the SPI driver in interrupt context when a transaction has finished.
+ * Synchronous transactions have no user data and are collected by the caller.
+ */
+static void IRAM_ATTR spi_post_cb(spi_transaction_t *trans) {
+	BaseType_t higherPriorityTaskWoken = pdFALSE;
+	if (trans->user == NULL) {
+		return;
+	}
+	xQueueSendFromISR(g_spiCompletionQueue, &trans->user, &higherPriorityTaskWoken);
+	if (higherPriorityTaskWoken) {
+		portYIELD_FROM_ISR();
+	}
+} // spi_post_cb
+
+
+/*
+ * Post the completion event of an asynchronous transaction once the last of its
+ * segments has finished.
+ */
+static void spi_async_segmentDone(dukf_spi_async_t *pAsync, int count) {
+	if (__atomic_sub_fetch(&pAsync->remaining, count, __ATOMIC_ACQ_REL) == 0) {
+		event_newCallbackRequestedEvent(
+			ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION,
+			pAsync->callbackStashKey,
+			spi_async_dataProvider,
+			pAsync);
+	}
+} // spi_async_segmentDone
+
+
+/*
+ * Task that collects finished transactions from the driver and posts their
+ * completion events.  Results for a device are returned in the order they were
+ * queued so the result we fetch is the one the interrupt told us about.
+ */
+static void spi_completion_task(void *ignore) {
+	dukf_spi_async_t *pAsync;
+	spi_transaction_t *pResult;
+	while(1) {
+		if (xQueueReceive(g_spiCompletionQueue, &pAsync, portMAX_DELAY) != pdTRUE) {
+			continue;
+		}
+		esp_err_t errRc = spi_device_get_trans_result(pAsync->device->handle, &pResult, portMAX_DELAY);
+		if (errRc == ESP_OK) {
+			pAsync = (dukf_spi_async_t *)pResult->user;
+		} else if (pAsync->status == 0) {
+			pAsync->status = errRc;
+		}
+		spi_async_segmentDone(pAsync, 1);
+	}
+	vTaskDelete(NULL);
+} // spi_completion_task
+#else /* ESP_PLATFORM */
+
+static pthread_mutex_t   g_simMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    g_simCond  = PTHREAD_COND_INITIALIZER;
+static dukf_spi_async_t *g_simHead  = NULL;
+static dukf_spi_async_t *g_simTail  = NULL;
+static int               g_simStarted = 0;
+
+/*
+ * The simulated bus.  Transactions are executed one at a time in the order they
+ * were queued.  Each takes the time the real bus would take and loops the
+ * transmitted data back as the received data.
+ */
+static void *spi_sim_thread(void *ignore) {
+	dukf_spi_async_t *pAsync;
+	while(1) {
+		pthread_mutex_lock(&g_simMutex);
+		while (g_simHead == NULL) {
+			pthread_cond_wait(&g_simCond, &g_simMutex);
+		}
+		pAsync = g_simHead;
+		g_simHead = pAsync->next;
+		if (g_simHead == NULL) {
+			g_simTail = NULL;
+		}
+		pthread_mutex_unlock(&g_simMutex);
+
+		int i;
+		for (i=0; i<pAsync->segments; i++) {
+			spi_transaction_t *trans = &pAsync->trans[i];
+			uint64_t wireTime = (uint64_t)trans->length * 1000000 / pAsync->device->clockSpeed;
+			if (wireTime > 100000) {
+				wireTime = 100000; // Don't let a slow clock stall the simulation.
+			}
+			usleep((useconds_t)wireTime);
+
+			if (trans->rx_buffer != NULL && trans->rx_buffer != trans->tx_buffer) {
+				size_t size = trans->length / 8;
+				if (trans->rxlength / 8 < size) {
+					size = trans->rxlength / 8;
+				}
+				memcpy(trans->rx_buffer, trans->tx_buffer, size);
+			}
+		}
+		pAsync->status = 0;
+		event_newCallbackRequestedEvent(
+			ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION,
+			pAsync->callbackStashKey,
+			spi_async_dataProvider,
+			pAsync);
+	}
+	return NULL;
+} // spi_sim_thread
+#endif /* ESP_PLATFORM */
 
 
 /*
@@ -17,6 +295,8 @@ LOG_TAG("module_spi");
  * * host - optional - Default to HSPI_HOST
  * * mode - optional -
  * * clock_speed - optional -
+ * * cs - optional -
+ * * queue_size - optional - Maximum asynchronous transactions in flight.  Default 10.
  *
  * Return:
  * handle
@@ -24,8 +304,9 @@ LOG_TAG("module_spi");
 static duk_ret_t js_spi_bus_add_device(duk_context *ctx) {
 	LOGD(">> js_spi_bus_add_device");
 	spi_host_device_t host = DEFAULT_HOST;
+	dukf_spi_device_t *device;
+#if defined(ESP_PLATFORM)
 	spi_device_interface_config_t dev_config;
-	spi_device_handle_t *handle;
 
 	dev_config.command_bits     = 0;
 	dev_config.address_bits     = 0;
@@ -36,10 +317,23 @@ static duk_ret_t js_spi_bus_add_device(duk_context *ctx) {
 	dev_config.clock_speed_hz   = DEFAULT_CLOCK_SPEED;
 	dev_config.spics_io_num     = -1;
 	dev_config.flags            = 0;
-	dev_config.queue_size       = 10;
+	dev_config.queue_size       = DEFAULT_QUEUE_SIZE;
 	dev_config.pre_cb           = NULL;
-	dev_config.post_cb          = NULL;
+	dev_config.post_cb          = spi_post_cb;
 	dev_config.mode             = 0;
+#else /* ESP_PLATFORM */
+	struct {
+		int clock_speed_hz;
+		int spics_io_num;
+		int queue_size;
+		int mode;
+	} dev_config;
+
+	dev_config.clock_speed_hz   = DEFAULT_CLOCK_SPEED;
+	dev_config.spics_io_num     = -1;
+	dev_config.queue_size       = DEFAULT_QUEUE_SIZE;
+	dev_config.mode             = 0;
+#endif /* ESP_PLATFORM */
 
 	if (!duk_is_object(ctx, -1)) {
 		LOGE("<< js_spi_bus_add_device: No options object.");
@@ -70,23 +364,54 @@ static duk_ret_t js_spi_bus_add_device(duk_context *ctx) {
 	}
 	duk_pop(ctx);
 
-	handle = malloc(sizeof(spi_device_handle_t));
-	assert(handle != NULL);
+	// queue_size
+	if (duk_get_prop_string(ctx, -1, "queue_size") == 1) {
+		dev_config.queue_size = duk_get_int(ctx, -1);
+	}
+	duk_pop(ctx);
 
-	LOGD(" - host: %d, mode: %d, spics_io_num:%d, clock_speed_hz: %d",
-		host, dev_config.mode, dev_config.spics_io_num, dev_config.clock_speed_hz);
+	if (dev_config.queue_size < 1) {
+		dev_config.queue_size = 1;
+	}
+	if (dev_config.clock_speed_hz <= 0) {
+		dev_config.clock_speed_hz = DEFAULT_CLOCK_SPEED;
+	}
+
+	device = calloc(1, sizeof(dukf_spi_device_t));
+	assert(device != NULL);
+	device->queueSize = dev_config.queue_size;
+
+	LOGD(" - host: %d, mode: %d, spics_io_num:%d, clock_speed_hz: %d, queue_size: %d",
+		host, dev_config.mode, dev_config.spics_io_num, dev_config.clock_speed_hz, dev_config.queue_size);
+
+#if defined(ESP_PLATFORM)
+	// The first device added starts the task that reports asynchronous completions.
+	if (g_spiCompletionQueue == NULL) {
+		g_spiCompletionQueue = xQueueCreate(MAX_TOTAL_IN_FLIGHT, sizeof(dukf_spi_async_t *));
+		assert(g_spiCompletionQueue != NULL);
+		xTaskCreatePinnedToCore(&spi_completion_task, "spi_completion", 2048, NULL, 6, NULL, tskNO_AFFINITY);
+	}
 
 	esp_err_t errRc = spi_bus_add_device(
 		host,
 	  &dev_config,
-	  handle);
+	  &device->handle);
 	if (errRc != ESP_OK) {
 		LOGE("<< js_spi_bus_add_device: %s", esp32_errToString(errRc));
-		free(handle);
+		free(device);
 		return 0;
 	}
+#else /* ESP_PLATFORM */
+	device->clockSpeed = dev_config.clock_speed_hz;
+	if (!g_simStarted) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, spi_sim_thread, NULL);
+		pthread_detach(thread);
+		g_simStarted = 1;
+	}
+#endif /* ESP_PLATFORM */
 
-	duk_push_pointer(ctx, handle);
+	duk_push_pointer(ctx, device);
 	LOGD("<< js_spi_bus_add_device");
 	return 1;
 } // js_spi_bus_add_device
@@ -101,11 +426,15 @@ static duk_ret_t js_spi_bus_free(duk_context *ctx) {
 	if (duk_is_number(ctx, -1)) {
 		host = duk_get_int(ctx, -1);
 	}
+#if defined(ESP_PLATFORM)
 	esp_err_t errRc = spi_bus_free(host);
 	if (errRc != ESP_OK) {
 		LOGE("<< js_spi_bus_free: %s", esp32_errToString(errRc));
 		return 0;
 	}
+#else
+	LOGD(" - simulated bus %d freed", host);
+#endif
 	LOGD("<< js_spi_bus_free");
 	return 0;
 } // js_spi_bus_free
@@ -113,7 +442,8 @@ static duk_ret_t js_spi_bus_free(duk_context *ctx) {
 
 /*
  * Initialize the SPI environment identifying the pins that are to be used for
- * distinct tasks.
+ * distinct tasks.  The bus is always set up to use DMA so that transactions of
+ * any size can be queued.
  *
  * [0] - Options
  * * host - Optional - Default to HSPI_HOST
@@ -124,14 +454,24 @@ static duk_ret_t js_spi_bus_free(duk_context *ctx) {
 static duk_ret_t js_spi_bus_initialize(duk_context *ctx) {
 	LOGD(">> js_spi_bus_initialize");
 	spi_host_device_t host = DEFAULT_HOST;
+#if defined(ESP_PLATFORM)
 	spi_bus_config_t bus_config;
+#else
+	struct {
+		int mosi_io_num;
+		int miso_io_num;
+		int sclk_io_num;
+	} bus_config;
+#endif
 	int dma_chan;
 
 	bus_config.mosi_io_num   = -1; // MOSI
 	bus_config.miso_io_num   = -1; // MISO
 	bus_config.sclk_io_num = -1; // CLK
+#if defined(ESP_PLATFORM)
 	bus_config.quadwp_io_num  = -1;
 	bus_config.quadhd_io_num  = -1;
+#endif
 	dma_chan = 1;
 
 	if (!duk_is_object(ctx, -1)) {
@@ -173,22 +513,227 @@ static duk_ret_t js_spi_bus_initialize(duk_context *ctx) {
 		return 0;
 	}
 
-	LOGD("- mosi=%d, miso=%d, clk=%d, host=%d",
+	LOGD("- mosi=%d, miso=%d, clk=%d, host=%d, dma_chan=%d",
 		bus_config.mosi_io_num,
 		bus_config.miso_io_num,
 		bus_config.sclk_io_num,
-		host);
+		host,
+		dma_chan);
 
+#if defined(ESP_PLATFORM)
 	esp_err_t errRc = spi_bus_initialize(host, &bus_config, dma_chan);
 	if (errRc != ESP_OK) {
 		LOGE("<< js_spi_bus_initialize: %s", esp32_errToString(errRc));
 		return 0;
 	}
+#endif
 	LOGD("<< js_spi_bus_initialize");
 	return 0;
 } // js_spi_bus_initialize
 
 
+/*
+ * Return the number of asynchronous transactions that have been queued against
+ * the device and whose callbacks have not yet been invoked.
+ * [0] - handle
+ */
+static duk_ret_t js_spi_device_pending(duk_context *ctx) {
+	if (!duk_is_pointer(ctx, -1)) {
+		LOGE("js_spi_device_pending: Invalid handle");
+		return 0;
+	}
+	dukf_spi_device_t *device = duk_get_pointer(ctx, -1);
+	duk_push_int(ctx, device->inFlight);
+	return 1;
+} // js_spi_device_pending
+
+
+/*
+ * Queue an asynchronous transaction.  The data is transmitted directly from the
+ * buffer supplied (no copy is made unless the buffer isn't suitable for DMA) and
+ * the buffers must not be modified until the callback has been invoked.  The
+ * callback is invoked as callback(err, rxBuffer).
+ *
+ * [0] - handle
+ * [1] - data to transmit (buffer)
+ * [2] - receive buffer (buffer) or null.  If null, the received data overwrites
+ *       the transmit buffer as it does for transmit().
+ * [3] - callback function
+ * [4] - segment size (number) - Optional.  If given, the data is sent as a batch of
+ *       transactions of this many bytes each.  It must be at most 4 or a multiple
+ *       of 4 so that each segment stays word aligned for DMA.
+ *
+ * Return:
+ * true if the transaction was queued, false if the device's queue doesn't have room
+ * for all of its segments and the caller should try again after an earlier
+ * transaction completes.
+ */
+static duk_ret_t js_spi_device_queue(duk_context *ctx) {
+	LOGD(">> js_spi_device_queue");
+	size_t txSize;
+	size_t rxSize;
+	size_t segmentSize;
+	int segments;
+	void *txData;
+	void *rxData;
+	duk_idx_t rxIdx;
+
+	if (!duk_is_pointer(ctx, 0)) {
+		LOGE("<< js_spi_device_queue: Invalid handle");
+		return 0;
+	}
+	dukf_spi_device_t *device = duk_get_pointer(ctx, 0);
+
+	if (!duk_is_buffer_data(ctx, 1)) {
+		LOGE("<< js_spi_device_queue: Invalid data");
+		return 0;
+	}
+	txData = duk_get_buffer_data(ctx, 1, &txSize);
+
+	if (duk_is_buffer_data(ctx, 2)) {
+		rxIdx = 2;
+		rxData = duk_get_buffer_data(ctx, 2, &rxSize);
+		if (rxSize > txSize) {
+			rxSize = txSize;
+		}
+	} else {
+		rxIdx = 1;
+		rxData = txData;
+		rxSize = txSize;
+	}
+
+	if (!duk_is_function(ctx, 3)) {
+		LOGE("<< js_spi_device_queue: No callback function");
+		return 0;
+	}
+
+	if (txSize == 0) {
+		LOGE("<< js_spi_device_queue: No data to transmit");
+		return 0;
+	}
+
+	// A negative segment size is read as 0 and rejected.
+	segmentSize = duk_is_number(ctx, 4) ? (size_t)duk_get_uint(ctx, 4) : txSize;
+	if (segmentSize == 0 || segmentSize > txSize || (segmentSize > 4 && (segmentSize & 3) != 0)) {
+		LOGE("<< js_spi_device_queue: Invalid segment size %d", (int)segmentSize);
+		return 0;
+	}
+	segments = (txSize + segmentSize - 1) / segmentSize;
+
+	if (device->inFlight + segments > device->queueSize || g_totalInFlight + segments > MAX_TOTAL_IN_FLIGHT) {
+		LOGD("<< js_spi_device_queue: queue full (%d in flight)", device->inFlight);
+		duk_push_false(ctx);
+		return 1;
+	}
+
+	dukf_spi_async_t *pAsync = calloc(1, sizeof(dukf_spi_async_t) + segments * sizeof(spi_transaction_t));
+	assert(pAsync != NULL);
+	pAsync->device      = device;
+	pAsync->rxData      = rxData;
+	pAsync->rxSize      = rxSize;
+	pAsync->segmentSize = segmentSize;
+	pAsync->segments    = segments;
+	pAsync->remaining   = segments;
+
+	const uint8_t *txDMA = txData;
+	uint8_t *rxDMA = rxData;
+#if defined(ESP_PLATFORM)
+	if (segmentSize > 4) {
+		if (!IS_DMA_FRIENDLY(txData)) {
+			pAsync->txBounce = heap_caps_malloc(txSize, MALLOC_CAP_DMA);
+			assert(pAsync->txBounce != NULL);
+			memcpy(pAsync->txBounce, txData, txSize);
+			txDMA = pAsync->txBounce;
+		}
+		if (!IS_DMA_FRIENDLY(rxData) || (rxSize & 3) != 0) {
+			// Received DMA data is written a word at a time so round up the area.
+			pAsync->rxBounce = heap_caps_malloc((rxSize + 3) & ~3, MALLOC_CAP_DMA);
+			assert(pAsync->rxBounce != NULL);
+			rxDMA = pAsync->rxBounce;
+		}
+	}
+#endif /* ESP_PLATFORM */
+
+	int i;
+	for (i=0; i<segments; i++) {
+		spi_transaction_t *trans = &pAsync->trans[i];
+		size_t offset = i * segmentSize;
+		size_t length = txSize - offset < segmentSize ? txSize - offset : segmentSize;
+		size_t rxLength = offset >= rxSize ? 0 : (rxSize - offset < length ? rxSize - offset : length);
+		trans->length   = length * 8; // The length property is size in bits.
+		trans->rxlength = rxLength * 8;
+		trans->user     = pAsync;
+#if defined(ESP_PLATFORM)
+		if (segmentSize <= 4) {
+			// Small enough to travel in the descriptor, spi_async_dataProvider copies
+			// the received data out.
+			trans->flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA;
+			memcpy(trans->tx_data, txDMA + offset, length);
+			continue;
+		}
+#endif /* ESP_PLATFORM */
+		trans->tx_buffer = txDMA + offset;
+		trans->rx_buffer = rxLength > 0 ? rxDMA + offset : NULL;
+	}
+
+	// Stash the callback and pin the buffers before the transaction is started as it
+	// may complete before we get a chance to return.
+	duk_dup(ctx, 3);
+	pAsync->callbackStashKey = esp32_duktape_stash_array(ctx, 1);
+
+	duk_push_array(ctx);
+	duk_dup(ctx, rxIdx);
+	duk_put_prop_index(ctx, -2, 0);
+	duk_dup(ctx, 1);
+	duk_put_prop_index(ctx, -2, 1);
+	pAsync->pinStashKey = esp32_duktape_stash_object(ctx);
+
+	device->inFlight += segments;
+	g_totalInFlight += segments;
+
+#if defined(ESP_PLATFORM)
+	for (i=0; i<segments; i++) {
+		esp_err_t errRc = spi_device_queue_trans(device->handle, &pAsync->trans[i], 0);
+		if (errRc == ESP_OK) {
+			continue;
+		}
+		LOGE("<< js_spi_device_queue: %s", esp32_errToString(errRc));
+		device->inFlight -= segments - i;
+		g_totalInFlight -= segments - i;
+		if (i == 0) {
+			esp32_duktape_stash_delete(ctx, pAsync->callbackStashKey);
+			esp32_duktape_stash_delete(ctx, pAsync->pinStashKey);
+			free(pAsync->txBounce);
+			free(pAsync->rxBounce);
+			free(pAsync);
+			duk_push_false(ctx);
+			return 1;
+		}
+		// Part of the batch is with the driver.  The callback reports the error once
+		// that part has completed.
+		pAsync->status   = errRc;
+		pAsync->segments = i;
+		spi_async_segmentDone(pAsync, segments - i);
+		break;
+	}
+#else /* ESP_PLATFORM */
+	pthread_mutex_lock(&g_simMutex);
+	if (g_simTail == NULL) {
+		g_simHead = pAsync;
+	} else {
+		g_simTail->next = pAsync;
+	}
+	g_simTail = pAsync;
+	pthread_cond_signal(&g_simCond);
+	pthread_mutex_unlock(&g_simMutex);
+#endif /* ESP_PLATFORM */
+
+	LOGD("<< js_spi_device_queue: %d bytes in %d segments, %d in flight", txSize, segments, device->inFlight);
+	duk_push_true(ctx);
+	return 1;
+} // js_spi_device_queue
+
+
 /*
  * [0] - handle
  */
@@ -200,13 +745,21 @@ static duk_ret_t js_spi_bus_remove_device(duk_context *ctx) {
 		return 0;
 	}
 
-	spi_device_handle_t *handle = duk_get_pointer(ctx, -1);
-	esp_err_t errRc = spi_bus_remove_device(*handle);
-	free(handle);
+	dukf_spi_device_t *device = duk_get_pointer(ctx, -1);
+	if (device->inFlight > 0) {
+		LOGE("<< js_spi_bus_remove_device: %d transactions still in flight", device->inFlight);
+		return 0;
+	}
+#if defined(ESP_PLATFORM)
+	esp_err_t errRc = spi_bus_remove_device(device->handle);
+	free(device);
 	if (errRc != ESP_OK) {
 		LOGE("<< spi_bus_remove_device: %s", esp32_errToString(errRc));
 		return 0;
 	}
+#else
+	free(device);
+#endif
 	LOGD("<< js_spi_bus_remove_device");
 	return 0;
 } // js_spi_bus_remove_device
@@ -222,16 +775,24 @@ static duk_ret_t js_spi_device_transmit(duk_context *ctx) {
 		LOGE("<< js_spi_device_transmit: Invalid handle");
 		return 0;
 	}
-	spi_device_handle_t *handle = duk_get_pointer(ctx, -2);
+	dukf_spi_device_t *device = duk_get_pointer(ctx, -2);
 
 	if (!duk_is_buffer_data(ctx, -1)) {
 		LOGE("<< js_spi_device_transmit: Invalid data");
 		return 0;
 	}
 
+	// A synchronous transaction collects the next result from the driver which
+	// would be the result of an earlier queued transaction if there were any.
+	if (device->inFlight > 0) {
+		LOGE("<< js_spi_device_transmit: %d queued transactions still in flight", device->inFlight);
+		return 0;
+	}
+
 	size_t size;
 	void *data = duk_get_buffer_data(ctx, -1, &size);
 
+#if defined(ESP_PLATFORM)
 	spi_transaction_t trans_desc;
 	trans_desc.flags     = 0;
 	trans_desc.cmd       = 0;
@@ -243,11 +804,16 @@ static duk_ret_t js_spi_device_transmit(duk_context *ctx) {
 	trans_desc.rx_buffer = data;
 
 	LOGD(" - Transmitting %d bits of data.", trans_desc.length);
-	esp_err_t errRc = spi_device_transmit(*handle, &trans_desc);
+	esp_err_t errRc = spi_device_transmit(device->handle, &trans_desc);
 	if (errRc != ESP_OK) {
 		LOGE("<< js_spi_device_transmit: %s", esp32_errToString(errRc));
 		return 0;
 	}
+#else /* ESP_PLATFORM */
+	// The simulated device loops MOSI back to MISO so the buffer is unchanged.
+	LOGD(" - Transmitting %d bits of data.", (int)(size * 8));
+	(void)data;
+#endif /* ESP_PLATFORM */
 
 	LOGD("<< js_spi_device_transmit");
 	return 0;
@@ -263,6 +829,8 @@ duk_ret_t ModuleSPI(duk_context *ctx) {
 	ADD_FUNCTION("add_device",     js_spi_bus_add_device,    1);
 	ADD_FUNCTION("bus_free",       js_spi_bus_free,          1);
 	ADD_FUNCTION("bus_initialize", js_spi_bus_initialize,    1);
+	ADD_FUNCTION("pending",        js_spi_device_pending,    1);
+	ADD_FUNCTION("queue",          js_spi_device_queue,      5);
 	ADD_FUNCTION("remove_device",  js_spi_bus_remove_device, 1);
 	ADD_FUNCTION("transmit",       js_spi_device_transmit,   2);
 
@@ -270,5 +838,11 @@ duk_ret_t ModuleSPI(duk_context *ctx) {
 	ADD_INT("HSPI_HOST", HSPI_HOST);
 	ADD_INT("VSPI_HOST", VSPI_HOST);
 
+#if defined(ESP_PLATFORM)
+	ADD_BOOLEAN("SIMULATED", 0);
+#else
+	ADD_BOOLEAN("SIMULATED", 1);
+#endif
+
 	return 0;
 } // ModuleSPI
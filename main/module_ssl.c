@@ -1,14 +1,55 @@
+/*
+ * Provide support for SSL (secure sockets layer) from within the ESP32-Duktape environment.
+ *
+ * All connections share one mbedtls configuration.  The entropy source and DRBG are
+ * seeded once and the CA chain (if any) is parsed once when configure() is called.
+ * Each connection then only needs its own mbedtls_ssl_context.
+ *
+ * To make repeated connections to the same server cheap we keep:
+ * * A small cache of TLS sessions keyed by "host:port".  A new connection to a host:port
+ *   for which we have a session offers that session (ID or ticket) to the server so that
+ *   an abbreviated handshake can be performed.
+ * * A small pool of idle, already established connections keyed by "host:port".  A caller
+ *   that has finished with a connection may release() it into the pool and a later
+ *   caller may acquire() it instead of connecting again.  Idle connections are discarded
+ *   after SSL_POOL_IDLE_MS or if the server has closed them.
+ *
+ * SSL sockets are non-blocking.  The handshake, read and write functions return
+ * WANT_READ or WANT_WRITE when mbedtls needs the socket to become readable or writable
+ * before it can make progress.  The JavaScript event loop then waits for that readiness
+ * and calls the same function again.  Decrypted data that mbedtls already holds is not
+ * visible to select(), so pending() reports how much of it is waiting to be read.
+ *
+ * The dukf_ssl_* functions declared in module_ssl.h let native modules that run their
+ * own tasks (such as MQTT) make connections with the same configuration.  The DRBG and
+ * the session cache are shared by those tasks and the JavaScript task so they are
+ * guarded by a lock.  The connection pool is only used by JavaScript.
+ */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(ESP_PLATFORM)
 #include <lwip/sockets.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#else /* ESP_PLATFORM */
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif /* ESP_PLATFORM */
 #include <mbedtls/platform.h> // Has to come early
 
 #include <mbedtls/ctr_drbg.h>
 #include <mbedtls/debug.h>
 #include <mbedtls/entropy.h>
 #include <mbedtls/error.h>
-#include <mbedtls/net.h>
 #include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
 #include <string.h>
 
 #include "duktape_utils.h"
@@ -17,6 +58,16 @@
 
 LOG_TAG("ssl");
 
+#define SSL_SESSION_CACHE_SIZE (4)     // Number of host:port sessions remembered for resumption.
+#define SSL_POOL_SIZE          (4)     // Number of idle connections kept for reuse.
+#define SSL_POOL_IDLE_MS       (30000) // How long an idle connection may stay in the pool.
+#define SSL_KEY_SIZE           (72)    // Size of a "host:port" key.
+
+// Values returned to JavaScript when an operation has to be retried once the socket
+// is ready.  They can't be confused with a byte count.
+#define SSL_WANT_READ          DUKF_SSL_WANT_READ
+#define SSL_WANT_WRITE         DUKF_SSL_WANT_WRITE
+
 static void debug_log(
 	void *context,
 	int level,
@@ -32,20 +83,171 @@ static void debug_log(
 } // debug_log
 
 
+struct dukf_ssl_context {
+	mbedtls_ssl_context ssl;
+	int fd;
+	char key[SSL_KEY_SIZE];   // "host:port" used for the session cache and the pool.
+	bool sessionSaved;        // Have we saved the session of this connection?
+};
+
 /*
- * Provide support for SSL (secure sockets layer) from within the ESP32-Duktape environment.
+ * State shared by all connections.
  */
 typedef struct {
-  mbedtls_x509_crt cacert;
-  mbedtls_ssl_config conf;
-  mbedtls_ctr_drbg_context ctr_drbg;
-  mbedtls_entropy_context entropy;
-  mbedtls_ssl_context ssl;
-  int fd;
-} dukf_ssl_context_t;
+	bool initialized;
+	bool haveCA;              // Has a CA chain been loaded?  If so, servers are verified.
+	mbedtls_x509_crt cacert;
+	mbedtls_ssl_config conf;
+	mbedtls_ctr_drbg_context ctr_drbg;
+	mbedtls_entropy_context entropy;
+	int liveContexts;         // Number of contexts (including pooled ones) using conf.
+} ssl_shared_t;
+
+typedef struct {
+	bool valid;
+	char key[SSL_KEY_SIZE];
+	mbedtls_ssl_session session;
+	uint32_t lastUsed;
+} ssl_session_entry_t;
+
+typedef struct {
+	dukf_ssl_context_t *dukf_ssl_context; // NULL if the slot is free.
+	uint32_t idleSince;                   // Time in msecs when the connection was released.
+} ssl_pool_entry_t;
+
+typedef struct {
+	uint32_t fullHandshakes;
+	uint32_t resumedHandshakes;
+	uint32_t poolHits;
+	uint32_t poolMisses;
+	uint32_t poolDiscarded;
+} ssl_stats_t;
+
+static ssl_shared_t        g_sslShared;
+static ssl_session_entry_t g_sessionCache[SSL_SESSION_CACHE_SIZE];
+static ssl_pool_entry_t    g_pool[SSL_POOL_SIZE];
+static ssl_stats_t         g_sslStats;
+static uint32_t            g_sessionClock = 0; // Ticks on each session cache use for LRU.
+
+#if defined(ESP_PLATFORM)
+static SemaphoreHandle_t g_sslLock = NULL; // Created by ssl_lockInit() on the JavaScript task.
+#else /* ESP_PLATFORM */
+static pthread_mutex_t   g_sslLock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* ESP_PLATFORM */
 
 const static char *pers = "ssl_client1";
 
+
+static void ssl_lockInit() {
+#if defined(ESP_PLATFORM)
+	if (g_sslLock == NULL) {
+		g_sslLock = xSemaphoreCreateMutex();
+	}
+#endif /* ESP_PLATFORM */
+} // ssl_lockInit
+
+
+/*
+ * Take the lock that guards the DRBG, the session cache and the count of live
+ * contexts.  It is not recursive.
+ */
+static void ssl_lock() {
+#if defined(ESP_PLATFORM)
+	xSemaphoreTake(g_sslLock, portMAX_DELAY);
+#else /* ESP_PLATFORM */
+	pthread_mutex_lock(&g_sslLock);
+#endif /* ESP_PLATFORM */
+} // ssl_lock
+
+
+static void ssl_unlock() {
+#if defined(ESP_PLATFORM)
+	xSemaphoreGive(g_sslLock);
+#else /* ESP_PLATFORM */
+	pthread_mutex_unlock(&g_sslLock);
+#endif /* ESP_PLATFORM */
+} // ssl_unlock
+
+
+/*
+ * The random number generator given to mbedtls.  The DRBG may be used by handshakes
+ * on several tasks at once.
+ */
+static int ssl_random(void *p_rng, unsigned char *output, size_t len) {
+	ssl_lock();
+	int rc = mbedtls_ctr_drbg_random(p_rng, output, len);
+	ssl_unlock();
+	return rc;
+} // ssl_random
+
+/*
+ * Return the current time in milliseconds.
+ */
+static uint32_t ssl_millis() {
+#if defined(ESP_PLATFORM)
+	return xTaskGetTickCount() * portTICK_PERIOD_MS;
+#else /* ESP_PLATFORM */
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint32_t)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+#endif /* ESP_PLATFORM */
+} // ssl_millis
+
+
+static void ssl_makeKey(char *key, const char *hostname, int port) {
+	snprintf(key, SSL_KEY_SIZE, "%s:%d", hostname, port);
+} // ssl_makeKey
+
+
+/*
+ * Initialize the shared configuration if it has not already been done.  Returns 0 on
+ * success or an mbedtls error code.  Called with the lock held.
+ */
+static int ssl_shared_init() {
+	if (g_sslShared.initialized) {
+		return 0;
+	}
+	mbedtls_ssl_config_init(&g_sslShared.conf);
+	mbedtls_x509_crt_init(&g_sslShared.cacert);
+	mbedtls_ctr_drbg_init(&g_sslShared.ctr_drbg);
+	mbedtls_entropy_init(&g_sslShared.entropy);
+
+	int rc = mbedtls_ctr_drbg_seed(
+		&g_sslShared.ctr_drbg,
+		mbedtls_entropy_func, &g_sslShared.entropy, (const unsigned char *) pers, strlen(pers));
+	if (rc != 0) {
+		LOGE("mbedtls_ctr_drbg_seed returned %d", rc);
+		goto fail;
+	}
+
+	rc = mbedtls_ssl_config_defaults(
+		&g_sslShared.conf,
+		MBEDTLS_SSL_IS_CLIENT,
+		MBEDTLS_SSL_TRANSPORT_STREAM,
+		MBEDTLS_SSL_PRESET_DEFAULT);
+	if (rc != 0) {
+		LOGE("mbedtls_ssl_config_defaults returned %d", rc);
+		goto fail;
+	}
+
+	mbedtls_ssl_conf_dbg(&g_sslShared.conf, debug_log, NULL);
+	mbedtls_ssl_conf_authmode(&g_sslShared.conf, MBEDTLS_SSL_VERIFY_NONE);
+	mbedtls_ssl_conf_rng(&g_sslShared.conf, ssl_random, &g_sslShared.ctr_drbg);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	mbedtls_ssl_conf_session_tickets(&g_sslShared.conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+	g_sslShared.initialized = true;
+	return 0;
+
+fail:
+	mbedtls_ssl_config_free(&g_sslShared.conf);
+	mbedtls_x509_crt_free(&g_sslShared.cacert);
+	mbedtls_ctr_drbg_free(&g_sslShared.ctr_drbg);
+	mbedtls_entropy_free(&g_sslShared.entropy);
+	return rc;
+} // ssl_shared_init
+
+
 static int ssl_send(void *ctx, const unsigned char *buf, size_t len) {
 	LOGD(">> ssl_send");
 	assert(ctx != NULL);
@@ -55,7 +257,11 @@ static int ssl_send(void *ctx, const unsigned char *buf, size_t len) {
 
 	int rc = send(dukf_ssl_context->fd, buf, len, 0);
 	if (rc == -1) {
-		LOGE("send(): errno=%s", strerror(errno));
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			rc = MBEDTLS_ERR_SSL_WANT_WRITE;
+		} else {
+			LOGE("send(): errno=%s", strerror(errno));
+		}
 	}
 	LOGD("<< ssl_send: fd=%d, rc=%d",dukf_ssl_context->fd, rc);
 	return rc;
@@ -65,82 +271,426 @@ static int ssl_recv(void *ctx, unsigned char *buf, size_t len) {
 	LOGD(">> ssl_recv: max_length=%d", len);
 	dukf_ssl_context_t *dukf_ssl_context = (dukf_ssl_context_t *)ctx;
 	int rc = recv(dukf_ssl_context->fd, buf, len, 0);
+	if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		rc = MBEDTLS_ERR_SSL_WANT_READ;
+	}
 	LOGD("<< ssl_recv: fd=%d, rc=%d", dukf_ssl_context->fd, rc);
 	return rc;
 } // ssl_recv
 
-static dukf_ssl_context_t *create_dukf_ssl_context(const char *hostname, int fd) {
-	char errortext[256];
-	dukf_ssl_context_t *dukf_ssl_context;
 
-	dukf_ssl_context = malloc(sizeof(dukf_ssl_context_t));
-	mbedtls_ssl_init(&dukf_ssl_context->ssl);
-	mbedtls_ssl_config_init(&dukf_ssl_context->conf);
-	mbedtls_x509_crt_init(&dukf_ssl_context->cacert);
-	mbedtls_ctr_drbg_init(&dukf_ssl_context->ctr_drbg);
-	mbedtls_entropy_init(&dukf_ssl_context->entropy);
-
-	mbedtls_ssl_conf_dbg(&dukf_ssl_context->conf, debug_log, NULL);
-	dukf_ssl_context->fd = fd;
+/*
+ * Find the session cache entry for the key or NULL if there is none.  Called with the
+ * lock held.
+ */
+static ssl_session_entry_t *ssl_session_find(const char *key) {
+	int i;
+	for (i=0; i<SSL_SESSION_CACHE_SIZE; i++) {
+		if (g_sessionCache[i].valid && strcmp(g_sessionCache[i].key, key) == 0) {
+			return &g_sessionCache[i];
+		}
+	}
+	return NULL;
+} // ssl_session_find
 
-  int rc = mbedtls_ctr_drbg_seed(
-     &dukf_ssl_context->ctr_drbg,
-     mbedtls_entropy_func, &dukf_ssl_context->entropy, (const unsigned char *) pers, strlen(pers));
-  if (rc != 0) {
-     LOGE(" failed\n  ! mbedtls_ctr_drbg_seed returned %d", rc);
-     return NULL;
-  }
 
-  rc = mbedtls_ssl_config_defaults(
-		&dukf_ssl_context->conf,
-		MBEDTLS_SSL_IS_CLIENT,
-		MBEDTLS_SSL_TRANSPORT_STREAM,
-		MBEDTLS_SSL_PRESET_DEFAULT);
+/*
+ * Remember the session of a connection that has completed its handshake so that
+ * later connections to the same host:port may resume it.  We also use this moment to
+ * count whether the handshake was a full one or an abbreviated (resumed) one.  A
+ * resumed handshake is one where the server accepted the session ID we offered.
+ */
+static void ssl_session_save(dukf_ssl_context_t *dukf_ssl_context) {
+	dukf_ssl_context->sessionSaved = true;
+	if (dukf_ssl_context->key[0] == '\0') {
+		return;
+	}
+	mbedtls_ssl_session session;
+	mbedtls_ssl_session_init(&session);
+	int rc = mbedtls_ssl_get_session(&dukf_ssl_context->ssl, &session);
 	if (rc != 0) {
-		 LOGE("mbedtls_ssl_config_defaults returned %d", rc);
-		 return NULL;
+		LOGD("mbedtls_ssl_get_session returned %d", rc);
+		mbedtls_ssl_session_free(&session);
+		return;
+	}
+
+	ssl_lock();
+	ssl_session_entry_t *entry = ssl_session_find(dukf_ssl_context->key);
+	if (entry != NULL &&
+		entry->session.id_len > 0 &&
+		entry->session.id_len == session.id_len &&
+		memcmp(entry->session.id, session.id, session.id_len) == 0) {
+		g_sslStats.resumedHandshakes++;
+	} else {
+		g_sslStats.fullHandshakes++;
 	}
 
-	mbedtls_ssl_conf_authmode(&dukf_ssl_context->conf, MBEDTLS_SSL_VERIFY_NONE);
+	if (entry == NULL) {
+		// Pick a free slot or else the least recently used one.
+		int i;
+		entry = &g_sessionCache[0];
+		for (i=0; i<SSL_SESSION_CACHE_SIZE; i++) {
+			if (!g_sessionCache[i].valid) {
+				entry = &g_sessionCache[i];
+				break;
+			}
+			if (g_sessionCache[i].lastUsed < entry->lastUsed) {
+				entry = &g_sessionCache[i];
+			}
+		}
+	}
+	if (entry->valid) {
+		mbedtls_ssl_session_free(&entry->session);
+	}
+	entry->session = session; // The entry now owns the session (including any ticket).
+	strcpy(entry->key, dukf_ssl_context->key);
+	entry->lastUsed = ++g_sessionClock;
+	entry->valid = true;
+	ssl_unlock();
+} // ssl_session_save
+
+
+static void ssl_session_flush() {
+	int i;
+	for (i=0; i<SSL_SESSION_CACHE_SIZE; i++) {
+		if (g_sessionCache[i].valid) {
+			mbedtls_ssl_session_free(&g_sessionCache[i].session);
+			g_sessionCache[i].valid = false;
+		}
+	}
+} // ssl_session_flush
+
 
-	mbedtls_ssl_conf_rng(&dukf_ssl_context->conf, mbedtls_ctr_drbg_random, &dukf_ssl_context->ctr_drbg);
+static dukf_ssl_context_t *create_dukf_ssl_context(const char *hostname, int fd, int port) {
+	char errortext[256];
+	dukf_ssl_context_t *dukf_ssl_context;
 
-	rc = mbedtls_ssl_setup(&dukf_ssl_context->ssl, &dukf_ssl_context->conf);
+	ssl_lock();
+	int rc = ssl_shared_init();
 	if (rc != 0) {
-		 mbedtls_strerror(rc, errortext, sizeof(errortext));
-		 LOGE("error from mbedtls_ssl_setup: %d - %x - %s\n", rc, rc, errortext);
-		 return NULL;
+		ssl_unlock();
+		return NULL;
+	}
+
+	dukf_ssl_context = malloc(sizeof(dukf_ssl_context_t));
+	if (dukf_ssl_context == NULL) {
+		LOGE("create_dukf_ssl_context: out of memory");
+		ssl_unlock();
+		return NULL;
+	}
+	mbedtls_ssl_init(&dukf_ssl_context->ssl);
+	dukf_ssl_context->fd = fd;
+	dukf_ssl_context->sessionSaved = false;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK); // All SSL I/O is driven by the event loop.
+	ssl_makeKey(dukf_ssl_context->key, hostname, port);
+
+	rc = mbedtls_ssl_setup(&dukf_ssl_context->ssl, &g_sslShared.conf);
+	if (rc != 0) {
+		mbedtls_strerror(rc, errortext, sizeof(errortext));
+		LOGE("error from mbedtls_ssl_setup: %d - %x - %s\n", rc, rc, errortext);
+		goto fail;
 	}
 
 	rc = mbedtls_ssl_set_hostname(&dukf_ssl_context->ssl, hostname);
 	if (rc) {
-		 mbedtls_strerror(rc, errortext, sizeof(errortext));
-		 LOGE("error from mbedtls_ssl_set_hostname: %s %d - %x - %s", hostname, rc, rc, errortext);
-		 return NULL;
+		mbedtls_strerror(rc, errortext, sizeof(errortext));
+		LOGE("error from mbedtls_ssl_set_hostname: %s %d - %x - %s", hostname, rc, rc, errortext);
+		goto fail;
+	}
+
+	// If we have previously talked to this host:port, offer the old session.
+	ssl_session_entry_t *entry = ssl_session_find(dukf_ssl_context->key);
+	if (entry != NULL) {
+		rc = mbedtls_ssl_set_session(&dukf_ssl_context->ssl, &entry->session);
+		if (rc != 0) {
+			LOGD("mbedtls_ssl_set_session returned %d", rc);
+		}
+		entry->lastUsed = ++g_sessionClock;
 	}
 
 	mbedtls_ssl_set_bio(&dukf_ssl_context->ssl, dukf_ssl_context, ssl_send, ssl_recv, NULL);
+	g_sslShared.liveContexts++;
+	ssl_unlock();
 	return dukf_ssl_context;
+
+fail:
+	mbedtls_ssl_free(&dukf_ssl_context->ssl);
+	free(dukf_ssl_context);
+	ssl_unlock();
+	return NULL;
 } // create_ssl_socket
 
 
 static void free_dukf_ssl_context(dukf_ssl_context_t *dukf_ssl_context) {
-  mbedtls_ssl_free(&dukf_ssl_context->ssl);
-  mbedtls_ssl_config_free(&dukf_ssl_context->conf);
-  mbedtls_ctr_drbg_free(&dukf_ssl_context->ctr_drbg);
-  mbedtls_entropy_free(&dukf_ssl_context->entropy);
-  free(dukf_ssl_context);
+	mbedtls_ssl_free(&dukf_ssl_context->ssl);
+	free(dukf_ssl_context);
+	ssl_lock();
+	g_sslShared.liveContexts--;
+	ssl_unlock();
 } // free_ssl_socket
 
+
+/*
+ * Discard a connection that we own: tell the server we are going, close the socket
+ * and release the context.
+ */
+static void ssl_discard(dukf_ssl_context_t *dukf_ssl_context) {
+	mbedtls_ssl_close_notify(&dukf_ssl_context->ssl);
+	close(dukf_ssl_context->fd);
+	free_dukf_ssl_context(dukf_ssl_context);
+	g_sslStats.poolDiscarded++;
+} // ssl_discard
+
+
+/*
+ * Determine whether an idle connection is still usable.  An idle connection should
+ * have nothing to read, neither decrypted data left over in mbedtls nor anything on
+ * the socket.  If the peer has closed the connection (recv returns 0) or sent us
+ * something (most likely a close_notify alert or the rest of a response we didn't
+ * read) we can't reuse it.
+ */
+static bool ssl_pool_isAlive(dukf_ssl_context_t *dukf_ssl_context) {
+	uint8_t b;
+	if (mbedtls_ssl_get_bytes_avail(&dukf_ssl_context->ssl) > 0) {
+		return false;
+	}
+	int rc = recv(dukf_ssl_context->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+	return rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+} // ssl_pool_isAlive
+
+
+/*
+ * Discard any pooled connections that have been idle for too long.
+ */
+static void ssl_pool_expire() {
+	int i;
+	uint32_t now = ssl_millis();
+	for (i=0; i<SSL_POOL_SIZE; i++) {
+		if (g_pool[i].dukf_ssl_context != NULL && now - g_pool[i].idleSince > SSL_POOL_IDLE_MS) {
+			LOGD("Expiring idle connection to %s", g_pool[i].dukf_ssl_context->key);
+			ssl_discard(g_pool[i].dukf_ssl_context);
+			g_pool[i].dukf_ssl_context = NULL;
+		}
+	}
+} // ssl_pool_expire
+
+
+static void ssl_pool_flush() {
+	int i;
+	for (i=0; i<SSL_POOL_SIZE; i++) {
+		if (g_pool[i].dukf_ssl_context != NULL) {
+			ssl_discard(g_pool[i].dukf_ssl_context);
+			g_pool[i].dukf_ssl_context = NULL;
+		}
+	}
+} // ssl_pool_flush
+
+
+/*
+ * Take an idle connection to the host:port from the pool.  Returns NULL if there is none.
+ */
+static dukf_ssl_context_t *ssl_pool_acquire(const char *key) {
+	int i;
+	ssl_pool_expire();
+	for (i=0; i<SSL_POOL_SIZE; i++) {
+		dukf_ssl_context_t *dukf_ssl_context = g_pool[i].dukf_ssl_context;
+		if (dukf_ssl_context == NULL || strcmp(dukf_ssl_context->key, key) != 0) {
+			continue;
+		}
+		g_pool[i].dukf_ssl_context = NULL;
+		if (ssl_pool_isAlive(dukf_ssl_context)) {
+			return dukf_ssl_context;
+		}
+		LOGD("Pooled connection to %s was closed by the server", key);
+		ssl_discard(dukf_ssl_context);
+	}
+	return NULL;
+} // ssl_pool_acquire
+
+
+/*
+ * Place an idle connection into the pool.  If the pool is full the connection that
+ * has been idle the longest is discarded to make room.
+ */
+static void ssl_pool_release(dukf_ssl_context_t *dukf_ssl_context) {
+	int i;
+	ssl_pool_entry_t *slot = NULL;
+	ssl_pool_expire();
+	for (i=0; i<SSL_POOL_SIZE; i++) {
+		if (g_pool[i].dukf_ssl_context == NULL) {
+			slot = &g_pool[i];
+			break;
+		}
+		if (slot == NULL || g_pool[i].idleSince < slot->idleSince) {
+			slot = &g_pool[i];
+		}
+	}
+	if (slot->dukf_ssl_context != NULL) {
+		ssl_discard(slot->dukf_ssl_context);
+	}
+	slot->dukf_ssl_context = dukf_ssl_context;
+	slot->idleSince = ssl_millis();
+} // ssl_pool_release
+
+
+/*
+ * Push the result of an mbedtls read, write or handshake for JavaScript.  A count of
+ * bytes (or 0 for a completed handshake) is pushed as is, the need to wait for the
+ * socket as SSL_WANT_READ or SSL_WANT_WRITE and any other error as NaN.
+ */
+static void ssl_pushResult(duk_context *ctx, const char *what, int rc) {
+	char errortext[256];
+	if (rc == MBEDTLS_ERR_SSL_WANT_READ) {
+		duk_push_int(ctx, SSL_WANT_READ);
+	} else if (rc == MBEDTLS_ERR_SSL_WANT_WRITE) {
+		duk_push_int(ctx, SSL_WANT_WRITE);
+	} else if (rc < 0) {
+		mbedtls_strerror(rc, errortext, sizeof(errortext));
+		LOGE("error from %s: %d - %x - %s", what, rc, rc, errortext);
+		duk_push_nan(ctx);
+	} else {
+		duk_push_int(ctx, rc);
+	}
+} // ssl_pushResult
+
+
+/*
+ * Take an idle connection to host:port from the pool.
+ * [0] - hostname
+ * [1] - port
+ *
+ * Returns an object {context: <pointer>, fd: <socket fd>} or undefined if there is
+ * no usable idle connection.
+ */
+static duk_ret_t js_ssl_acquire(duk_context *ctx) {
+	char key[SSL_KEY_SIZE];
+	ssl_makeKey(key, duk_get_string(ctx, 0), duk_get_int(ctx, 1));
+	LOGD(">> js_ssl_acquire: %s", key);
+	dukf_ssl_context_t *dukf_ssl_context = ssl_pool_acquire(key);
+	if (dukf_ssl_context == NULL) {
+		g_sslStats.poolMisses++;
+		LOGD("<< js_ssl_acquire: none");
+		return 0;
+	}
+	g_sslStats.poolHits++;
+	duk_push_object(ctx);
+	duk_push_pointer(ctx, dukf_ssl_context);
+	duk_put_prop_string(ctx, -2, "context");
+	duk_push_int(ctx, dukf_ssl_context->fd);
+	duk_put_prop_string(ctx, -2, "fd");
+	LOGD("<< js_ssl_acquire: fd=%d", dukf_ssl_context->fd);
+	return 1;
+} // js_ssl_acquire
+
+
+/*
+ * Configure the shared SSL settings.  This may only be called while there are no
+ * connections in use.  Any cached sessions and pooled connections are discarded.
+ * [0] - options object
+ * {
+ *    caFile: <name of a PEM file containing trusted CA certificates> [optional]
+ *    ca: <string or buffer containing PEM trusted CA certificates> [optional]
+ *    verify: <boolean> - Verify the server certificate.  Default is true if a CA is
+ *            supplied and false otherwise.  An error is thrown if verification is
+ *            requested but no CA could be loaded.  Connections then fail until a
+ *            CA is configured rather than silently skipping verification.
+ * }
+ */
+static duk_ret_t js_ssl_configure(duk_context *ctx) {
+	char errortext[256];
+	int rc;
+	LOGD(">> js_ssl_configure");
+	if (!duk_is_object(ctx, 0)) {
+		LOGE("js_ssl_configure: No options object supplied.");
+		return 0;
+	}
+	ssl_pool_flush();
+	ssl_lock();
+	rc = ssl_shared_init();
+	if (rc != 0) {
+		ssl_unlock();
+		return 0;
+	}
+	if (g_sslShared.liveContexts > 0) {
+		LOGE("js_ssl_configure: SSL connections are still in use.");
+		ssl_unlock();
+		return 0;
+	}
+	ssl_session_flush();
+
+	mbedtls_x509_crt_free(&g_sslShared.cacert);
+	mbedtls_x509_crt_init(&g_sslShared.cacert);
+	g_sslShared.haveCA = false;
+
+	if (duk_get_prop_string(ctx, 0, "caFile")) {
+		rc = mbedtls_x509_crt_parse_file(&g_sslShared.cacert, duk_get_string(ctx, -1));
+		if (rc != 0) {
+			mbedtls_strerror(rc, errortext, sizeof(errortext));
+			LOGE("error parsing CA file %s: %d - %s", duk_get_string(ctx, -1), rc, errortext);
+		} else {
+			g_sslShared.haveCA = true;
+		}
+	}
+	duk_pop(ctx);
+
+	if (duk_get_prop_string(ctx, 0, "ca")) {
+		size_t len;
+		const unsigned char *data;
+		if (duk_is_string(ctx, -1)) {
+			// PEM data must include the terminating NUL in its length.
+			data = (const unsigned char *)duk_get_lstring(ctx, -1, &len);
+			len++;
+		} else {
+			data = duk_get_buffer_data(ctx, -1, &len);
+		}
+		rc = data == NULL ? -1 : mbedtls_x509_crt_parse(&g_sslShared.cacert, data, len);
+		if (rc != 0) {
+			LOGE("error parsing CA data: %d", rc);
+		} else {
+			g_sslShared.haveCA = true;
+		}
+	}
+	duk_pop(ctx);
+
+	bool verify = g_sslShared.haveCA;
+	if (duk_get_prop_string(ctx, 0, "verify")) {
+		verify = duk_to_boolean(ctx, -1);
+	}
+	duk_pop(ctx);
+
+	if (verify && !g_sslShared.haveCA) {
+		LOGE("js_ssl_configure: Verification requested but no CA is loaded.");
+		mbedtls_ssl_conf_ca_chain(&g_sslShared.conf, NULL, NULL);
+		mbedtls_ssl_conf_authmode(&g_sslShared.conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+		ssl_unlock();
+		duk_error(ctx, DUK_ERR_ERROR, "verification requested but no CA is loaded");
+	}
+	mbedtls_ssl_conf_ca_chain(&g_sslShared.conf, g_sslShared.haveCA ? &g_sslShared.cacert : NULL, NULL);
+	mbedtls_ssl_conf_authmode(&g_sslShared.conf, verify ? MBEDTLS_SSL_VERIFY_REQUIRED : MBEDTLS_SSL_VERIFY_NONE);
+	ssl_unlock();
+	LOGD("<< js_ssl_configure: haveCA=%d, verify=%d", g_sslShared.haveCA, verify);
+	return 0;
+} // js_ssl_configure
+
+
 /*
  * [0] - hostname
  * [1] - socket fd
+ * [2] - port [optional]
  */
 static duk_ret_t js_ssl_create_dukf_ssl_context(duk_context *ctx) {
-	const char *hostname = duk_get_string(ctx, -2);
-	int fd = duk_get_int(ctx, -1);
-	LOGD(">> js_ssl_create_dukf_ssl_context: hostname=\"%s\", fd=%d", hostname, fd);
-	dukf_ssl_context_t *dukf_ssl_context = create_dukf_ssl_context(hostname, fd);
+	const char *hostname = duk_get_string(ctx, 0);
+	int fd = duk_get_int(ctx, 1);
+	int port = duk_get_int(ctx, 2);
+	LOGD(">> js_ssl_create_dukf_ssl_context: hostname=\"%s\", fd=%d, port=%d", hostname, fd, port);
+	if (hostname == NULL) {
+		LOGE("js_ssl_create_dukf_ssl_context: No hostname supplied.");
+		return 0;
+	}
+	dukf_ssl_context_t *dukf_ssl_context = create_dukf_ssl_context(hostname, fd, port);
+	if (dukf_ssl_context == NULL) {
+		return 0;
+	}
 	duk_push_pointer(ctx, dukf_ssl_context);
 	LOGD("<< js_ssl_create_dukf_ssl_context");
 	return 1;
@@ -184,35 +734,138 @@ static duk_ret_t js_ssl_free_dukf_ssl_context(duk_context *ctx) {
 } // js_ssl_free
 
 
+/*
+ * Advance the handshake as far as the socket allows.
+ * [0] - dukf_ssl_context_t - pointer
+ *
+ * Returns 0 when the handshake is complete, WANT_READ or WANT_WRITE if it should be
+ * called again when the socket is readable or writable and NaN on a failure.
+ */
+static duk_ret_t js_ssl_handshake(duk_context *ctx) {
+	LOGD(">> js_ssl_handshake");
+	dukf_ssl_context_t *dukf_ssl_context = duk_get_pointer(ctx, 0);
+	if (dukf_ssl_context == NULL) {
+		LOGE("No ssl_socket passed.");
+		duk_push_nan(ctx);
+		return 1;
+	}
+	int rc = mbedtls_ssl_handshake(&dukf_ssl_context->ssl);
+	if (rc == 0 && !dukf_ssl_context->sessionSaved) {
+		ssl_session_save(dukf_ssl_context);
+	}
+	ssl_pushResult(ctx, "mbedtls_ssl_handshake", rc);
+	LOGD("<< js_ssl_handshake: rc=%d", rc);
+	return 1;
+} // js_ssl_handshake
+
+
+/*
+ * Return the number of decrypted bytes that are held by mbedtls and can be read
+ * without waiting for the socket.
+ * [0] - dukf_ssl_context_t - pointer
+ */
+static duk_ret_t js_ssl_pending(duk_context *ctx) {
+	dukf_ssl_context_t *dukf_ssl_context = duk_get_pointer(ctx, 0);
+	if (dukf_ssl_context == NULL) {
+		duk_push_int(ctx, 0);
+	} else {
+		duk_push_int(ctx, mbedtls_ssl_get_bytes_avail(&dukf_ssl_context->ssl));
+	}
+	return 1;
+} // js_ssl_pending
+
+
+/*
+ * Return a connection that is no longer needed by its user to the pool of idle
+ * connections.  The socket is now owned by the pool and must not be used or closed
+ * by the caller.  A connection that never completed its handshake is discarded.
+ * [0] - dukf_ssl_context_t - pointer
+ */
+static duk_ret_t js_ssl_release(duk_context *ctx) {
+	LOGD(">> js_ssl_release");
+	dukf_ssl_context_t *dukf_ssl_context = duk_get_pointer(ctx, 0);
+	if (dukf_ssl_context == NULL) {
+		LOGE("No ssl_socket passed.");
+		return 0;
+	}
+	if (!dukf_ssl_context->sessionSaved || !ssl_pool_isAlive(dukf_ssl_context)) {
+		ssl_discard(dukf_ssl_context);
+	} else {
+		ssl_pool_release(dukf_ssl_context);
+	}
+	LOGD("<< js_ssl_release");
+	return 0;
+} // js_ssl_release
+
+
 /*
  * [0] - dukf_ssl_context_t - pointer
  * [1] - data to read - buffer
  */
 static duk_ret_t js_ssl_read(duk_context *ctx) {
-	char errortext[256];
 	LOGD(">> js_ssl_read");
 	dukf_ssl_context_t *dukf_ssl_context = duk_get_pointer(ctx, -2);
 	size_t len;
 	uint8_t *buf = duk_get_buffer_data(ctx, -1, &len);
 	int rc = mbedtls_ssl_read(&dukf_ssl_context->ssl, buf, len);
-	if (rc < 0) {
-		 mbedtls_strerror(rc, errortext, sizeof(errortext));
-		 LOGE("error from mbedtls_ssl_read: %d - %x - %s", rc, rc, errortext);
-		 duk_push_nan(ctx);
-	} else {
-		duk_push_int(ctx, rc);
+	if (rc == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+		// The partner has closed the connection cleanly, report it as end of data.
+		rc = 0;
+	}
+	if (rc >= 0 && !dukf_ssl_context->sessionSaved) {
+		ssl_session_save(dukf_ssl_context);
 	}
+	ssl_pushResult(ctx, "mbedtls_ssl_read", rc);
 	LOGD("<< js_ssl_read: rc=%d", rc);
 	return 1;
 } // js_ssl_read
 
 
+/*
+ * Return statistics about the handshakes, session cache and connection pool.
+ */
+static duk_ret_t js_ssl_stats(duk_context *ctx) {
+	int i;
+	int pooled = 0;
+	int sessions = 0;
+	for (i=0; i<SSL_POOL_SIZE; i++) {
+		if (g_pool[i].dukf_ssl_context != NULL) {
+			pooled++;
+		}
+	}
+	for (i=0; i<SSL_SESSION_CACHE_SIZE; i++) {
+		if (g_sessionCache[i].valid) {
+			sessions++;
+		}
+	}
+	duk_push_object(ctx);
+	duk_push_int(ctx, g_sslStats.fullHandshakes);
+	duk_put_prop_string(ctx, -2, "fullHandshakes");
+	duk_push_int(ctx, g_sslStats.resumedHandshakes);
+	duk_put_prop_string(ctx, -2, "resumedHandshakes");
+	duk_push_int(ctx, g_sslStats.poolHits);
+	duk_put_prop_string(ctx, -2, "poolHits");
+	duk_push_int(ctx, g_sslStats.poolMisses);
+	duk_put_prop_string(ctx, -2, "poolMisses");
+	duk_push_int(ctx, g_sslStats.poolDiscarded);
+	duk_put_prop_string(ctx, -2, "poolDiscarded");
+	duk_push_int(ctx, pooled);
+	duk_put_prop_string(ctx, -2, "pooled");
+	duk_push_int(ctx, sessions);
+	duk_put_prop_string(ctx, -2, "sessions");
+	duk_push_int(ctx, g_sslShared.liveContexts);
+	duk_put_prop_string(ctx, -2, "liveContexts");
+	duk_push_boolean(ctx, g_sslShared.haveCA);
+	duk_put_prop_string(ctx, -2, "haveCA");
+	return 1;
+} // js_ssl_stats
+
+
 /*
  * [0] - dukf_ssl_context_t - pointer
  * [1] - data to write - buffer or string
  */
 static duk_ret_t js_ssl_write(duk_context *ctx) {
-	char errortext[256];
 	LOGD(">> js_ssl_write");
 	dukf_ssl_context_t *dukf_ssl_context = duk_get_pointer(ctx, -2);
 	size_t len;
@@ -233,29 +886,132 @@ static duk_ret_t js_ssl_write(duk_context *ctx) {
 
 	LOGD("About to send data over SSL: %.*s", len, buf);
 	int rc = mbedtls_ssl_write(&dukf_ssl_context->ssl, buf, len);
-	if (rc < 0) {
-		 mbedtls_strerror(rc, errortext, sizeof(errortext));
-		 LOGE("error from mbedtls_ssl_write: %d - %x - %s", rc, rc, errortext);
-		 duk_push_nan(ctx);
-	} else {
-		duk_push_int(ctx, rc);
+	if (rc >= 0 && !dukf_ssl_context->sessionSaved) {
+		ssl_session_save(dukf_ssl_context);
 	}
+	ssl_pushResult(ctx, "mbedtls_ssl_write", rc);
 	LOGD("<< js_ssl_write: rc=%d", rc);
 	return 1;
 } // js_ssl_write
 
 
+/*
+ * Map the result of an mbedtls read, write or handshake to the values returned by the
+ * dukf_ssl_* functions.
+ */
+static int ssl_mapResult(const char *what, int rc) {
+	char errortext[256];
+	if (rc == MBEDTLS_ERR_SSL_WANT_READ) {
+		return DUKF_SSL_WANT_READ;
+	}
+	if (rc == MBEDTLS_ERR_SSL_WANT_WRITE) {
+		return DUKF_SSL_WANT_WRITE;
+	}
+	if (rc < 0) {
+		mbedtls_strerror(rc, errortext, sizeof(errortext));
+		LOGE("error from %s: %d - %x - %s", what, rc, rc, errortext);
+		return DUKF_SSL_ERROR;
+	}
+	return rc;
+} // ssl_mapResult
+
+
+/*
+ * Prepare for connections made by native tasks.  This must be called on the
+ * JavaScript task before the first dukf_ssl_create().  Returns 0 on success.
+ */
+int dukf_ssl_init() {
+	ssl_lockInit();
+	ssl_lock();
+	int rc = ssl_shared_init();
+	ssl_unlock();
+	return rc;
+} // dukf_ssl_init
+
+
+/*
+ * Create a client connection over a connected socket.  The socket is made
+ * non-blocking.  Returns NULL on a failure.
+ */
+dukf_ssl_context_t *dukf_ssl_create(const char *hostname, int fd, int port) {
+	return create_dukf_ssl_context(hostname, fd, port);
+} // dukf_ssl_create
+
+
+/*
+ * Advance the handshake.  Returns 0 once it is complete.
+ */
+int dukf_ssl_handshake(dukf_ssl_context_t *dukf_ssl_context) {
+	int rc = mbedtls_ssl_handshake(&dukf_ssl_context->ssl);
+	if (rc == 0 && !dukf_ssl_context->sessionSaved) {
+		ssl_session_save(dukf_ssl_context);
+	}
+	return ssl_mapResult("mbedtls_ssl_handshake", rc);
+} // dukf_ssl_handshake
+
+
+/*
+ * Read decrypted data.  Returns the number of bytes read, 0 if the server has closed
+ * the connection, WANT_READ, WANT_WRITE or DUKF_SSL_ERROR.
+ */
+int dukf_ssl_read(dukf_ssl_context_t *dukf_ssl_context, uint8_t *buf, size_t len) {
+	int rc = mbedtls_ssl_read(&dukf_ssl_context->ssl, buf, len);
+	if (rc == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+		rc = 0;
+	}
+	return ssl_mapResult("mbedtls_ssl_read", rc);
+} // dukf_ssl_read
+
+
+/*
+ * Return the number of decrypted bytes that can be read without waiting for the socket.
+ */
+size_t dukf_ssl_pending(dukf_ssl_context_t *dukf_ssl_context) {
+	return mbedtls_ssl_get_bytes_avail(&dukf_ssl_context->ssl);
+} // dukf_ssl_pending
+
+
+/*
+ * Write data.  Returns the number of bytes written, WANT_READ, WANT_WRITE or
+ * DUKF_SSL_ERROR.  After WANT_READ or WANT_WRITE the call must be repeated with the
+ * same data and length.
+ */
+int dukf_ssl_write(dukf_ssl_context_t *dukf_ssl_context, const uint8_t *buf, size_t len) {
+	return ssl_mapResult("mbedtls_ssl_write", mbedtls_ssl_write(&dukf_ssl_context->ssl, buf, len));
+} // dukf_ssl_write
+
+
+/*
+ * Tell the server that we are going and release the context.  The socket is left
+ * open for the caller to close.
+ */
+void dukf_ssl_free(dukf_ssl_context_t *dukf_ssl_context) {
+	mbedtls_ssl_close_notify(&dukf_ssl_context->ssl);
+	free_dukf_ssl_context(dukf_ssl_context);
+} // dukf_ssl_free
+
+
 /**
  * Add native methods to the SSL object.
  * [0] - SSL Object
  */
 duk_ret_t ModuleSSL(duk_context *ctx) {
+	ssl_lockInit();
 
-	ADD_FUNCTION("create_dukf_ssl_context", js_ssl_create_dukf_ssl_context, 2);
+	ADD_FUNCTION("acquire",                 js_ssl_acquire,                 2);
+	ADD_FUNCTION("configure",               js_ssl_configure,               1);
+	ADD_FUNCTION("create_dukf_ssl_context", js_ssl_create_dukf_ssl_context, 3);
 	ADD_FUNCTION("debugThreshold",          js_ssl_debug_set_threshold,     1);
 	ADD_FUNCTION("free_dukf_ssl_context",   js_ssl_free_dukf_ssl_context,   1);
+	ADD_FUNCTION("handshake",               js_ssl_handshake,               1);
+	ADD_FUNCTION("pending",                 js_ssl_pending,                 1);
 	ADD_FUNCTION("read",                    js_ssl_read,                    2);
+	ADD_FUNCTION("release",                 js_ssl_release,                 1);
+	ADD_FUNCTION("stats",                   js_ssl_stats,                   0);
 	ADD_FUNCTION("write",                   js_ssl_write,                   2);
 
+	ADD_INT("WANT_READ",  SSL_WANT_READ);
+	ADD_INT("WANT_WRITE", SSL_WANT_WRITE);
+
 	return 0;
 } // ModuleSSL
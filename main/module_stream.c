@@ -0,0 +1,330 @@
+/*
+ * Native storage for streams.
+ *
+ * A stream holds the data written to it while its reader is paused or hasn't yet
+ * registered for data.  That data is kept in a ring buffer which starts small and
+ * doubles in size as needed up to a maximum.  Data is copied in once when it is
+ * written and copied out once when it is read, no matter how the reads and writes
+ * are sized.
+ *
+ * The functions exposed are:
+ * * capacity
+ * * clear
+ * * create
+ * * free
+ * * length
+ * * read
+ * * readInto
+ * * write
+ *
+ * A ring is a pointer which must be released with free() once it is no longer needed.
+ */
+#include <duktape.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "duktape_utils.h"
+#include "logging.h"
+#include "module_stream.h"
+
+LOG_TAG("module_stream");
+
+// Value identifying a ring behind a pointer passed in from JavaScript.
+#define STREAM_RING_MAGIC (0x52494E47) // "RING"
+
+#define STREAM_DEFAULT_CAPACITY     (1024)
+#define STREAM_DEFAULT_MAX_CAPACITY (64 * 1024)
+
+typedef struct {
+	uint32_t magic;
+	uint8_t *data;
+	size_t   capacity;    // Size of data.
+	size_t   maxCapacity; // Size that data may grow to.
+	size_t   head;        // Index of the oldest byte.
+	size_t   length;      // Number of bytes held.
+} dukf_ring_t;
+
+
+/**
+ * Grow the ring so that it can hold at least required bytes.  The content is
+ * moved to the start of the new storage.  Returns false if the ring can't grow.
+ */
+static bool ring_grow(dukf_ring_t *ring, size_t required) {
+	size_t newCapacity = ring->capacity;
+	while (newCapacity < required) {
+		newCapacity *= 2;
+	}
+	if (newCapacity > ring->maxCapacity) {
+		newCapacity = ring->maxCapacity;
+	}
+	if (newCapacity <= ring->capacity) {
+		return false;
+	}
+	uint8_t *newData = malloc(newCapacity);
+	if (newData == NULL) {
+		LOGE("ring_grow: Unable to allocate %d bytes", (int)newCapacity);
+		return false;
+	}
+	size_t firstPart = ring->capacity - ring->head;
+	if (firstPart > ring->length) {
+		firstPart = ring->length;
+	}
+	memcpy(newData, ring->data + ring->head, firstPart);
+	memcpy(newData + firstPart, ring->data, ring->length - firstPart);
+	free(ring->data);
+	ring->data = newData;
+	ring->capacity = newCapacity;
+	ring->head = 0;
+	return true;
+} // ring_grow
+
+
+/**
+ * Append as much of the data as will fit.  Returns the number of bytes appended.
+ */
+static size_t ring_write(dukf_ring_t *ring, const uint8_t *data, size_t length) {
+	if (ring->length + length > ring->capacity) {
+		ring_grow(ring, ring->length + length);
+	}
+	size_t space = ring->capacity - ring->length;
+	if (length > space) {
+		length = space;
+	}
+	size_t tail = (ring->head + ring->length) % ring->capacity;
+	size_t firstPart = ring->capacity - tail;
+	if (firstPart > length) {
+		firstPart = length;
+	}
+	memcpy(ring->data + tail, data, firstPart);
+	memcpy(ring->data, data + firstPart, length - firstPart);
+	ring->length += length;
+	return length;
+} // ring_write
+
+
+/**
+ * Remove up to length bytes from the ring into data.  Returns the number of bytes removed.
+ */
+static size_t ring_read(dukf_ring_t *ring, uint8_t *data, size_t length) {
+	if (length > ring->length) {
+		length = ring->length;
+	}
+	size_t firstPart = ring->capacity - ring->head;
+	if (firstPart > length) {
+		firstPart = length;
+	}
+	memcpy(data, ring->data + ring->head, firstPart);
+	memcpy(data + firstPart, ring->data, length - firstPart);
+	ring->head = (ring->head + length) % ring->capacity;
+	ring->length -= length;
+	if (ring->length == 0) {
+		ring->head = 0;
+	}
+	return length;
+} // ring_read
+
+
+/**
+ * Get the ring at idx or NULL if it isn't one.
+ */
+static dukf_ring_t *getRing(duk_context *ctx, duk_idx_t idx) {
+	dukf_ring_t *ring = duk_get_pointer(ctx, idx);
+	if (ring == NULL || ring->magic != STREAM_RING_MAGIC) {
+		LOGE("Not a stream ring");
+		return NULL;
+	}
+	return ring;
+} // getRing
+
+
+/*
+ * Return the size of the storage of the ring.
+ * [0] - ring
+ */
+static duk_ret_t js_stream_capacity(duk_context *ctx) {
+	dukf_ring_t *ring = getRing(ctx, 0);
+	if (ring == NULL) {
+		return 0;
+	}
+	duk_push_number(ctx, ring->capacity);
+	return 1;
+} // js_stream_capacity
+
+
+/*
+ * Discard the data held in the ring.
+ * [0] - ring
+ */
+static duk_ret_t js_stream_clear(duk_context *ctx) {
+	dukf_ring_t *ring = getRing(ctx, 0);
+	if (ring != NULL) {
+		ring->head = 0;
+		ring->length = 0;
+	}
+	return 0;
+} // js_stream_clear
+
+
+/*
+ * Create a ring.
+ * [0] - initial capacity [optional; default 1024]
+ * [1] - maximum capacity [optional; default 64K]
+ *
+ * Returns the ring or undefined if there is no memory.
+ */
+static duk_ret_t js_stream_create(duk_context *ctx) {
+	size_t capacity = STREAM_DEFAULT_CAPACITY;
+	size_t maxCapacity = STREAM_DEFAULT_MAX_CAPACITY;
+	if (duk_is_number(ctx, 0) && duk_get_int(ctx, 0) > 0) {
+		capacity = duk_get_int(ctx, 0);
+	}
+	if (duk_is_number(ctx, 1) && duk_get_int(ctx, 1) > 0) {
+		maxCapacity = duk_get_int(ctx, 1);
+	}
+	if (capacity > maxCapacity) {
+		capacity = maxCapacity;
+	}
+	dukf_ring_t *ring = malloc(sizeof(dukf_ring_t));
+	if (ring == NULL) {
+		LOGE("js_stream_create: out of memory");
+		return 0;
+	}
+	ring->data = malloc(capacity);
+	if (ring->data == NULL) {
+		LOGE("js_stream_create: Unable to allocate %d bytes", (int)capacity);
+		free(ring);
+		return 0;
+	}
+	ring->magic = STREAM_RING_MAGIC;
+	ring->capacity = capacity;
+	ring->maxCapacity = maxCapacity;
+	ring->head = 0;
+	ring->length = 0;
+	duk_push_pointer(ctx, ring);
+	return 1;
+} // js_stream_create
+
+
+/*
+ * Release a ring.
+ * [0] - ring
+ */
+static duk_ret_t js_stream_free(duk_context *ctx) {
+	dukf_ring_t *ring = getRing(ctx, 0);
+	if (ring != NULL) {
+		ring->magic = 0;
+		free(ring->data);
+		free(ring);
+	}
+	return 0;
+} // js_stream_free
+
+
+/*
+ * Return the number of bytes held in the ring.
+ * [0] - ring
+ */
+static duk_ret_t js_stream_length(duk_context *ctx) {
+	dukf_ring_t *ring = getRing(ctx, 0);
+	if (ring == NULL) {
+		return 0;
+	}
+	duk_push_number(ctx, ring->length);
+	return 1;
+} // js_stream_length
+
+
+/*
+ * Remove data from the ring and return it as a new Buffer.
+ * [0] - ring
+ * [1] - maximum number of bytes to read [optional; default all]
+ */
+static duk_ret_t js_stream_read(duk_context *ctx) {
+	dukf_ring_t *ring = getRing(ctx, 0);
+	if (ring == NULL) {
+		return 0;
+	}
+	size_t length = ring->length;
+	if (duk_is_number(ctx, 1) && duk_get_int(ctx, 1) >= 0 && (size_t)duk_get_int(ctx, 1) < length) {
+		length = duk_get_int(ctx, 1);
+	}
+	void *buffer = duk_push_fixed_buffer(ctx, length);
+	ring_read(ring, buffer, length);
+	duk_push_buffer_object(ctx, -1, 0, length, DUK_BUFOBJ_NODEJS_BUFFER);
+	duk_remove(ctx, -2);
+	return 1;
+} // js_stream_read
+
+
+/*
+ * Remove data from the ring into an existing buffer.  This allows a reader to
+ * reuse one buffer rather than have a new one made for each read.
+ * [0] - ring
+ * [1] - buffer
+ * [2] - offset within the buffer [optional; default 0]
+ *
+ * Returns the number of bytes read.
+ */
+static duk_ret_t js_stream_readInto(duk_context *ctx) {
+	dukf_ring_t *ring = getRing(ctx, 0);
+	if (ring == NULL) {
+		return 0;
+	}
+	duk_size_t size;
+	uint8_t *buffer = duk_get_buffer_data(ctx, 1, &size);
+	size_t offset = duk_get_int(ctx, 2);
+	if (buffer == NULL || offset > size) {
+		LOGE("js_stream_readInto: No buffer or bad offset");
+		return 0;
+	}
+	duk_push_number(ctx, ring_read(ring, buffer + offset, size - offset));
+	return 1;
+} // js_stream_readInto
+
+
+/*
+ * Append data to the ring, growing it if needed and allowed.
+ * [0] - ring
+ * [1] - data - string or buffer
+ *
+ * Returns the number of bytes appended which is less than the size of the data if the
+ * ring has reached its maximum capacity.
+ */
+static duk_ret_t js_stream_write(duk_context *ctx) {
+	dukf_ring_t *ring = getRing(ctx, 0);
+	if (ring == NULL) {
+		return 0;
+	}
+	duk_size_t length;
+	const uint8_t *data;
+	if (duk_is_string(ctx, 1)) {
+		data = (const uint8_t *)duk_get_lstring(ctx, 1, &length);
+	} else {
+		data = duk_get_buffer_data(ctx, 1, &length);
+	}
+	if (data == NULL) {
+		duk_push_int(ctx, 0);
+		return 1;
+	}
+	duk_push_number(ctx, ring_write(ring, data, length));
+	return 1;
+} // js_stream_write
+
+
+/**
+ * Add native methods to the Stream object.
+ * [0] - Stream Object
+ */
+duk_ret_t ModuleStream(duk_context *ctx) {
+	ADD_FUNCTION("capacity", js_stream_capacity, 1);
+	ADD_FUNCTION("clear",    js_stream_clear,    1);
+	ADD_FUNCTION("create",   js_stream_create,   2);
+	ADD_FUNCTION("free",     js_stream_free,     1);
+	ADD_FUNCTION("length",   js_stream_length,   1);
+	ADD_FUNCTION("read",     js_stream_read,     2);
+	ADD_FUNCTION("readInto", js_stream_readInto, 3);
+	ADD_FUNCTION("write",    js_stream_write,    2);
+	return 0;
+} // ModuleStream
@@ -0,0 +1,471 @@
+/**
+ * WS2812 (NeoPixel) pixel engine.
+ *
+ * A strip owns a framebuffer that JavaScript writes pixels into.  When the strip
+ * is shown, the framebuffer is copied to a second (front) buffer and a task owned
+ * by the strip takes a copy of the front buffer, encodes it into RMT items and
+ * transmits them.  The interpreter never waits for the encoding or the
+ * transmission and may start building the next frame immediately.
+ *
+ * Each bit of pixel data is one RMT item (a high period followed by a low period).
+ * Rather than building the items bit by bit we use a lookup table that maps each
+ * nibble to the four items that represent it.
+ *
+ * The module has the following methods:
+ *
+ * * create
+ * * fill
+ * * free
+ * * getPixel
+ * * setPixel
+ * * setPixels
+ * * show
+ */
+
+#include <driver/rmt.h>
+#include <duktape.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "duktape_event.h"
+#include "duktape_utils.h"
+#include "esp32_specific.h"
+#include "logging.h"
+#include "module_ws2812.h"
+#include "sdkconfig.h"
+
+LOG_TAG("module_ws2812");
+
+// With a clock divider of 8, each RMT tick is 80MHz / 8 = 100ns.
+#define WS2812_CLOCK_DIV (8)
+
+// The RMT item (as a 32 bit value) for a 0 bit and a 1 bit.  An item is:
+// duration0 (15 bits) | level0 (1 bit) | duration1 (15 bits) | level1 (1 bit)
+#define WS2812_ITEM(HIGH_TICKS, LOW_TICKS) ((HIGH_TICKS) | (1 << 15) | ((LOW_TICKS) << 16))
+#define WS2812_BIT_0 WS2812_ITEM(4, 7) // 0.4us high, 0.7us low
+#define WS2812_BIT_1 WS2812_ITEM(8, 6) // 0.8us high, 0.6us low
+
+// The order in which the color components are sent on the wire.
+enum {
+	WS2812_ORDER_GRB = 0,
+	WS2812_ORDER_RGB = 1
+};
+
+typedef struct {
+	rmt_channel_t     channel;
+	uint16_t          pixelCount;
+	uint8_t           order;            // WS2812_ORDER_xxx
+	uint8_t          *pixels;           // Framebuffer written by JavaScript, in wire order.
+	uint8_t          *front;            // Frame handed to the strip task.
+	uint8_t          *encoding;         // The task's copy of the front frame, encoded without the mutex.
+	rmt_item32_t     *items;            // The encoded front frame plus a terminator.
+	SemaphoreHandle_t mutex;            // Guards front, framePending and callbackStashKey.
+	TaskHandle_t      task;
+	bool              framePending;     // True if front holds a frame not yet encoded.
+	bool              stopping;         // True if the strip has been freed.
+	uint32_t          callbackStashKey; // Callback for the pending frame or 0.
+} ws2812_strip_t;
+
+// The four RMT items for each possible nibble value, most significant bit first.
+static uint32_t g_nibbleItems[16][4];
+static bool g_nibbleItemsInitialized = false;
+
+
+static void initNibbleItems() {
+	int nibble;
+	int bit;
+	for (nibble=0; nibble<16; nibble++) {
+		for (bit=0; bit<4; bit++) {
+			g_nibbleItems[nibble][bit] = (nibble & (0x8 >> bit)) ? WS2812_BIT_1 : WS2812_BIT_0;
+		}
+	}
+	g_nibbleItemsInitialized = true;
+} // initNibbleItems
+
+
+/**
+ * Encode the task's copy of the front buffer into RMT items.
+ */
+static void encodeFrame(ws2812_strip_t *strip) {
+	uint32_t *out = (uint32_t *)strip->items;
+	size_t size = strip->pixelCount * 3;
+	size_t i;
+	for (i=0; i<size; i++) {
+		uint8_t value = strip->encoding[i];
+		memcpy(out,     g_nibbleItems[value >> 4],  sizeof(g_nibbleItems[0]));
+		memcpy(out + 4, g_nibbleItems[value & 0xf], sizeof(g_nibbleItems[0]));
+		out += 8;
+	}
+	*out = 0; // The terminator item.
+} // encodeFrame
+
+
+/**
+ * The task that drives a strip.  It waits to be told that a frame is pending,
+ * encodes it and transmits it.  While a frame is being transmitted the next frame
+ * may already be pending in the front buffer.
+ */
+static void ws2812_task(void *param) {
+	ws2812_strip_t *strip = (ws2812_strip_t *)param;
+	uint32_t stashKey;
+
+	while(1) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if (strip->stopping) {
+			break;
+		}
+
+		xSemaphoreTake(strip->mutex, portMAX_DELAY);
+		if (!strip->framePending) {
+			xSemaphoreGive(strip->mutex);
+			continue;
+		}
+		// Only the copy is made while holding the mutex so that show() isn't held up
+		// by the encoding.
+		memcpy(strip->encoding, strip->front, strip->pixelCount * 3);
+		stashKey = strip->callbackStashKey;
+		strip->callbackStashKey = 0;
+		strip->framePending = false;
+		xSemaphoreGive(strip->mutex);
+
+		encodeFrame(strip);
+
+		esp_err_t errRc = rmt_write_items(strip->channel, strip->items, strip->pixelCount * 24 + 1, true);
+		if (errRc != ESP_OK) {
+			LOGE("rmt_write_items: %s", esp32_errToString(errRc));
+		}
+		if (stashKey != 0) {
+			event_newCallbackRequestedEvent(
+				ESP32_DUKTAPE_CALLBACK_TYPE_FUNCTION,
+				stashKey,
+				NULL,
+				NULL);
+		}
+	}
+
+	rmt_driver_uninstall(strip->channel);
+	vSemaphoreDelete(strip->mutex);
+	free(strip->items);
+	free(strip->encoding);
+	free(strip->front);
+	free(strip->pixels);
+	free(strip);
+	vTaskDelete(NULL);
+} // ws2812_task
+
+
+/**
+ * Create a new strip.
+ * [0] - number - channel
+ * [1] - number - gpio
+ * [2] - number - pixel count
+ * [3] - object - options (optional)
+ * {
+ *    order: <string> - "GRB" (default) or "RGB".
+ *    memBlocks: <number> - RMT memory blocks to use.  Default 1.
+ * }
+ *
+ * Returns a handle to the strip or undefined on error.
+ */
+static duk_ret_t js_ws2812_create(duk_context *ctx) {
+	LOGD(">> js_ws2812_create");
+	rmt_channel_t channel = duk_get_int(ctx, 0);
+	gpio_num_t gpio = duk_get_int(ctx, 1);
+	int pixelCount = duk_get_int(ctx, 2);
+	uint8_t order = WS2812_ORDER_GRB;
+	uint8_t memBlocks = 1;
+
+	if (channel < 0 || channel >= RMT_CHANNEL_MAX) {
+		LOGE("<< js_ws2812_create: channel out of range");
+		return 0;
+	}
+	if (pixelCount <= 0 || pixelCount > 0xffff) {
+		LOGE("<< js_ws2812_create: pixel count out of range");
+		return 0;
+	}
+
+	if (duk_is_object(ctx, 3)) {
+		if (duk_get_prop_string(ctx, 3, "order")) {
+			const char *orderString = duk_get_string(ctx, -1);
+			if (orderString != NULL && strcmp(orderString, "RGB") == 0) {
+				order = WS2812_ORDER_RGB;
+			}
+		}
+		duk_pop(ctx);
+
+		if (duk_get_prop_string(ctx, 3, "memBlocks")) {
+			memBlocks = duk_get_int(ctx, -1);
+			if (memBlocks < 1 || memBlocks > 8) {
+				LOGE("<< js_ws2812_create: memBlocks must be >= 1 and <=8");
+				duk_pop(ctx);
+				return 0;
+			}
+		}
+		duk_pop(ctx);
+	}
+
+	if (!g_nibbleItemsInitialized) {
+		initNibbleItems();
+	}
+
+	ws2812_strip_t *strip = calloc(1, sizeof(ws2812_strip_t));
+	if (strip == NULL) {
+		LOGE("<< js_ws2812_create: out of memory");
+		return 0;
+	}
+	strip->channel    = channel;
+	strip->pixelCount = pixelCount;
+	strip->order      = order;
+	strip->pixels     = calloc(pixelCount, 3);
+	strip->front      = calloc(pixelCount, 3);
+	strip->encoding   = malloc(pixelCount * 3);
+	strip->items      = malloc((pixelCount * 24 + 1) * sizeof(rmt_item32_t));
+	strip->mutex      = xSemaphoreCreateMutex();
+	if (strip->pixels == NULL || strip->front == NULL || strip->encoding == NULL || strip->items == NULL ||
+			strip->mutex == NULL) {
+		LOGE("<< js_ws2812_create: out of memory");
+		goto fail;
+	}
+
+	rmt_config_t config;
+	config.channel = channel;
+	config.clk_div = WS2812_CLOCK_DIV;
+	config.gpio_num = gpio;
+	config.mem_block_num = memBlocks;
+	config.rmt_mode = RMT_MODE_TX;
+	config.tx_config.carrier_duty_percent = 50;
+	config.tx_config.carrier_en = 0;
+	config.tx_config.carrier_freq_hz = 10000;
+	config.tx_config.carrier_level = RMT_CARRIER_LEVEL_HIGH;
+	config.tx_config.idle_output_en = 1;
+	config.tx_config.idle_level = RMT_IDLE_LEVEL_LOW;
+	config.tx_config.loop_en = 0;
+
+	esp_err_t errRc = rmt_config(&config);
+	if (errRc != ESP_OK) {
+		LOGE("<< js_ws2812_create: rmt_config: %s", esp32_errToString(errRc));
+		goto fail;
+	}
+	errRc = rmt_driver_install(channel, 0, 0);
+	if (errRc != ESP_OK) {
+		LOGE("<< js_ws2812_create: rmt_driver_install: %s", esp32_errToString(errRc));
+		goto fail;
+	}
+
+	if (xTaskCreatePinnedToCore(&ws2812_task, "ws2812", 2048, strip, 6, &strip->task, tskNO_AFFINITY) != pdPASS) {
+		LOGE("<< js_ws2812_create: unable to create task");
+		rmt_driver_uninstall(channel);
+		goto fail;
+	}
+
+	duk_push_pointer(ctx, strip);
+	LOGD("<< js_ws2812_create: %d pixels on channel %d, gpio %d", pixelCount, channel, gpio);
+	return 1;
+
+fail:
+	if (strip->mutex != NULL) {
+		vSemaphoreDelete(strip->mutex);
+	}
+	free(strip->items);
+	free(strip->encoding);
+	free(strip->front);
+	free(strip->pixels);
+	free(strip);
+	return 0;
+} // js_ws2812_create
+
+
+/**
+ * Set all the pixels to the same color.
+ * [0] - handle
+ * [1] - red
+ * [2] - green
+ * [3] - blue
+ */
+static duk_ret_t js_ws2812_fill(duk_context *ctx) {
+	ws2812_strip_t *strip = duk_get_pointer(ctx, 0);
+	if (strip == NULL) {
+		LOGE("js_ws2812_fill: Invalid handle");
+		return 0;
+	}
+	uint8_t red   = duk_get_int(ctx, 1);
+	uint8_t green = duk_get_int(ctx, 2);
+	uint8_t blue  = duk_get_int(ctx, 3);
+	uint8_t first  = strip->order == WS2812_ORDER_GRB ? green : red;
+	uint8_t second = strip->order == WS2812_ORDER_GRB ? red : green;
+	int i;
+	uint8_t *p = strip->pixels;
+	for (i=0; i<strip->pixelCount; i++) {
+		*p++ = first;
+		*p++ = second;
+		*p++ = blue;
+	}
+	return 0;
+} // js_ws2812_fill
+
+
+/**
+ * Release the strip.  Any frame currently being transmitted is completed first.
+ * [0] - handle
+ */
+static duk_ret_t js_ws2812_free(duk_context *ctx) {
+	ws2812_strip_t *strip = duk_get_pointer(ctx, 0);
+	if (strip == NULL) {
+		LOGE("js_ws2812_free: Invalid handle");
+		return 0;
+	}
+	xSemaphoreTake(strip->mutex, portMAX_DELAY);
+	if (strip->callbackStashKey != 0) {
+		esp32_duktape_stash_delete(ctx, strip->callbackStashKey);
+		strip->callbackStashKey = 0;
+	}
+	strip->framePending = false;
+	strip->stopping = true;
+	xSemaphoreGive(strip->mutex);
+	xTaskNotifyGive(strip->task); // The task releases the strip.
+	return 0;
+} // js_ws2812_free
+
+
+/**
+ * Get the color of a pixel as the integer 0xRRGGBB.
+ * [0] - handle
+ * [1] - pixel index
+ */
+static duk_ret_t js_ws2812_getPixel(duk_context *ctx) {
+	ws2812_strip_t *strip = duk_get_pointer(ctx, 0);
+	int pixel = duk_get_int(ctx, 1);
+	if (strip == NULL || pixel < 0 || pixel >= strip->pixelCount) {
+		return 0;
+	}
+	uint8_t *p = &strip->pixels[pixel * 3];
+	uint32_t red   = strip->order == WS2812_ORDER_GRB ? p[1] : p[0];
+	uint32_t green = strip->order == WS2812_ORDER_GRB ? p[0] : p[1];
+	duk_push_uint(ctx, red << 16 | green << 8 | p[2]);
+	return 1;
+} // js_ws2812_getPixel
+
+
+/**
+ * Set the color of a single pixel.
+ * [0] - handle
+ * [1] - pixel index
+ * [2] - red
+ * [3] - green
+ * [4] - blue
+ */
+static duk_ret_t js_ws2812_setPixel(duk_context *ctx) {
+	ws2812_strip_t *strip = duk_get_pointer(ctx, 0);
+	int pixel = duk_get_int(ctx, 1);
+	if (strip == NULL || pixel < 0 || pixel >= strip->pixelCount) {
+		return 0;
+	}
+	uint8_t red   = duk_get_int(ctx, 2);
+	uint8_t green = duk_get_int(ctx, 3);
+	uint8_t *p = &strip->pixels[pixel * 3];
+	p[0] = strip->order == WS2812_ORDER_GRB ? green : red;
+	p[1] = strip->order == WS2812_ORDER_GRB ? red : green;
+	p[2] = duk_get_int(ctx, 4);
+	return 0;
+} // js_ws2812_setPixel
+
+
+/**
+ * Set a run of pixels from a buffer of RGB triples.
+ * [0] - handle
+ * [1] - buffer - r, g, b, r, g, b ...
+ * [2] - number - first pixel to set (optional, default 0)
+ */
+static duk_ret_t js_ws2812_setPixels(duk_context *ctx) {
+	ws2812_strip_t *strip = duk_get_pointer(ctx, 0);
+	if (strip == NULL) {
+		LOGE("js_ws2812_setPixels: Invalid handle");
+		return 0;
+	}
+	if (!duk_is_buffer_data(ctx, 1)) {
+		LOGE("js_ws2812_setPixels: data is not a buffer");
+		return 0;
+	}
+	size_t size;
+	uint8_t *data = duk_get_buffer_data(ctx, 1, &size);
+	int first = duk_is_number(ctx, 2) ? duk_get_int(ctx, 2) : 0;
+	if (first < 0 || first >= strip->pixelCount) {
+		return 0;
+	}
+	int count = size / 3;
+	if (count > strip->pixelCount - first) {
+		count = strip->pixelCount - first;
+	}
+	uint8_t *p = &strip->pixels[first * 3];
+	if (strip->order == WS2812_ORDER_RGB) {
+		memcpy(p, data, count * 3);
+	} else {
+		int i;
+		for (i=0; i<count; i++) {
+			p[0] = data[1];
+			p[1] = data[0];
+			p[2] = data[2];
+			p += 3;
+			data += 3;
+		}
+	}
+	return 0;
+} // js_ws2812_setPixels
+
+
+/**
+ * Show the current framebuffer.  The framebuffer is copied and may be changed as
+ * soon as this call returns.
+ * [0] - handle
+ * [1] - callback - Optional.  Invoked once the frame has been transmitted.
+ *
+ * Returns true if the frame was accepted or false if the previous frame has not
+ * yet been started.  In that case, try again from the previous frame's callback.
+ */
+static duk_ret_t js_ws2812_show(duk_context *ctx) {
+	ws2812_strip_t *strip = duk_get_pointer(ctx, 0);
+	if (strip == NULL) {
+		LOGE("js_ws2812_show: Invalid handle");
+		return 0;
+	}
+
+	xSemaphoreTake(strip->mutex, portMAX_DELAY);
+	if (strip->framePending) {
+		xSemaphoreGive(strip->mutex);
+		duk_push_false(ctx);
+		return 1;
+	}
+	memcpy(strip->front, strip->pixels, strip->pixelCount * 3);
+	if (duk_is_function(ctx, 1)) {
+		duk_dup(ctx, 1);
+		strip->callbackStashKey = esp32_duktape_stash_array(ctx, 1);
+	}
+	strip->framePending = true;
+	xSemaphoreGive(strip->mutex);
+
+	xTaskNotifyGive(strip->task);
+	duk_push_true(ctx);
+	return 1;
+} // js_ws2812_show
+
+
+/**
+ * Add native methods to the WS2812 object.
+ * [0] - WS2812 Object
+ */
+duk_ret_t ModuleWS2812(duk_context *ctx) {
+
+	ADD_FUNCTION("create",    js_ws2812_create,    4);
+	ADD_FUNCTION("fill",      js_ws2812_fill,      4);
+	ADD_FUNCTION("free",      js_ws2812_free,      1);
+	ADD_FUNCTION("getPixel",  js_ws2812_getPixel,  2);
+	ADD_FUNCTION("setPixel",  js_ws2812_setPixel,  5);
+	ADD_FUNCTION("setPixels", js_ws2812_setPixels, 3);
+	ADD_FUNCTION("show",      js_ws2812_show,      2);
+
+	return 0;
+} // ModuleWS2812
@@ -23,13 +23,20 @@
 #include "modules.h"
 #include "module_adc.h"
 #include "module_aes.h"
+#include "module_applog.h"
 #include "module_bluetooth.h"
+#include "module_crypto.h"
+#include "module_dgram.h"
+#include "module_dns.h"
 #include "module_dukf.h"
 #include "module_gpio.h"
 #include "module_fs.h"
 #include "module_i2c.h"
 #include "module_ledc.h"
 #include "module_linenoise.h"
+#include "module_metrics.h"
+#include "module_mqtt.h"
+#include "module_netio.h"
 #include "module_netvfs.h"
 #include "module_nvs.h"
 #include "module_os.h"
@@ -40,7 +47,9 @@
 #include "module_serialvfs.h"
 #include "module_spi.h"
 #include "module_ssl.h"
+#include "module_stream.h"
 #include "module_wifi.h"
+#include "module_ws2812.h"
 LOG_TAG("modules");
 
 /**
@@ -87,7 +96,6 @@ typedef struct {
  */
 functionTableEntry_t functionTable[] = {
 #if defined(ESP_PLATFORM)
-	{ "ModuleADC",        ModuleADC,        1},
 	{ "ModuleAES",        ModuleAES,        1},
 #if defined(CONFIG_BT_ENABLED)
 	{ "ModuleBluetooth",  ModuleBluetooth,  1},
@@ -100,13 +108,24 @@ functionTableEntry_t functionTable[] = {
 	{ "ModuleNetVFS",     ModuleNetVFS,     1},
 	{ "ModuleNVS",        ModuleNVS,        1},
 	{ "ModulePartitions", ModulePartitions, 1},
-	{ "ModuleRMT",        ModuleRMT,        1},
 	{ "ModuleRTOS",       ModuleRTOS,       1},
 	{ "ModuleSerial",     ModuleSerial,     1},
 	{ "ModuleSerialVFS",  ModuleSerialVFS,  1},
+	{ "ModuleWS2812",     ModuleWS2812,     1},
+#endif // ESP_PLATFORM
+	// Modules that are available on all platforms (simulated where needed).
+	{ "ModuleADC",        ModuleADC,        1},
+	{ "ModuleAppLog",     ModuleAppLog,     1},
+	{ "ModuleCrypto",     ModuleCrypto,     1},
+	{ "ModuleDgram",      ModuleDgram,      1},
+	{ "ModuleDNS",        ModuleDNS,        1},
+	{ "ModuleMetrics",    ModuleMetrics,    1},
+	{ "ModuleMQTT",       ModuleMQTT,       1},
+	{ "ModuleNetIO",      ModuleNetIO,      1},
+	{ "ModuleRMT",        ModuleRMT,        1},
 	{ "ModuleSPI",        ModuleSPI,        1},
 	{ "ModuleSSL",        ModuleSSL,        1},
-#endif // ESP_PLATFORM
+	{ "ModuleStream",     ModuleStream,     1},
 	// Must be last entry
 	{NULL, NULL, 0 } // *** DO NOT DELETE *** - MUST BE LAST ENTRY.
 };
@@ -419,9 +438,10 @@ static void ModuleConsole(duk_context *ctx) {
 	// <stack empty>
 } // ModuleConsole
 
-#if defined(ESP_PLATFORM)
 /**
- * Register the ESP32 module with its functions.
+ * Register the ESP32 module with its functions.  When running on Linux we still
+ * register the object (without the ESPFS and reboot functions) so that the
+ * JavaScript modules can find their native functions.
  */
 static void ModuleESP32(duk_context *ctx) {
 	duk_push_global_object(ctx);
@@ -431,6 +451,7 @@ static void ModuleESP32(duk_context *ctx) {
 	// [0] - Global object
 	// [1] - New object
 
+#if defined(ESP_PLATFORM)
 	duk_push_c_function(ctx, js_esp32_dumpESPFS, 0);
 	// [0] - Global object
 	// [1] - New object
@@ -439,6 +460,7 @@ static void ModuleESP32(duk_context *ctx) {
 	duk_put_prop_string(ctx, -2, "dumpESPFS"); // Add dumpESPFS to new ESP32
 	// [0] - Global object
 	// [1] - New object
+#endif /* ESP_PLATFORM */
 
 	duk_push_c_function(ctx, js_esp32_getNativeFunction, 1);
 	// [0] - Global object
@@ -467,6 +489,7 @@ static void ModuleESP32(duk_context *ctx) {
 	// [0] - Global object
 	// [1] - New object
 
+#if defined(ESP_PLATFORM)
 	duk_push_c_function(ctx, js_esp32_loadFileESPFS, 1);
 	// [0] - Global object
 	// [1] - New object
@@ -485,6 +508,7 @@ static void ModuleESP32(duk_context *ctx) {
 	duk_put_prop_string(ctx, -2, "reboot"); // Add reboot to new ESP32
 	// [0] - Global object
 	// [1] - New object
+#endif /* ESP_PLATFORM */
 
 
 	duk_push_c_function(ctx, js_esp32_reset, 0);
@@ -512,8 +536,6 @@ static void ModuleESP32(duk_context *ctx) {
 	// <Empty stack>
 } // ModuleESP32
 
-#endif // ESP_PLATFORM
-
 /**
  * Register the static modules.  These are modules that will ALWAYS
  * bein the global address space/scope.
@@ -535,10 +557,10 @@ void registerModules(duk_context *ctx) {
 	ModuleDUKF(ctx);
 	assert(top == duk_get_top(ctx));
 
-#if defined(ESP_PLATFORM)
 	ModuleESP32(ctx);
 	assert(top == duk_get_top(ctx));
 
+#if defined(ESP_PLATFORM)
 	ModuleWIFI(ctx); // Load the WiFi module
 	assert(top == duk_get_top(ctx));
 
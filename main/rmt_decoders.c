@@ -0,0 +1,227 @@
+/*
+ * rmt_decoders.c
+ *
+ * Decoders for common IR protocols that work on captured RMT data items.  They
+ * have no dependencies on the ESP32 so that they can also be used (and tested)
+ * on Linux against recorded captures.
+ */
+#include <string.h>
+
+#include "rmt_decoders.h"
+
+#define NEC_LEADER_MARK_US   9000
+#define NEC_LEADER_SPACE_US  4500
+#define NEC_REPEAT_SPACE_US  2250
+#define NEC_BIT_MARK_US       560
+#define NEC_ZERO_SPACE_US     560
+#define NEC_ONE_SPACE_US     1690
+#define NEC_BITS               32
+
+#define RC5_HALF_BIT_US       889
+#define RC5_BITS               14
+
+/**
+ * Convert the duration of a data item into microseconds.
+ */
+static uint32_t durationUs(uint16_t item, uint32_t tickNs) {
+	return RMT_DATA_ITEM_DURATION(item) * tickNs / 1000;
+} // durationUs
+
+
+/**
+ * Is the measured duration within 25% of the expected duration?
+ */
+static bool matches(uint32_t us, uint32_t expectedUs) {
+	return us >= expectedUs - expectedUs / 4 && us <= expectedUs + expectedUs / 4;
+} // matches
+
+
+/**
+ * Is the data item a mark (carrier present)?  IR demodulators drive their output
+ * low while they see the carrier.
+ */
+static bool isMark(uint16_t item) {
+	return RMT_DATA_ITEM_LEVEL(item) == 0;
+} // isMark
+
+
+/**
+ * Decode an NEC frame.  A frame is a 9ms leader mark and 4.5ms space followed
+ * by 32 bits (LSB first) of address, inverted address, command and inverted
+ * command.  A repeat code is a 9ms mark, a 2.25ms space and a bit mark.  If the
+ * inverted address doesn't match, the extended form with a 16 bit address is
+ * assumed.
+ */
+static bool decodeNEC(rmt_decoder_state_t *state, const uint16_t *items, size_t count, uint32_t tickNs, rmt_decoded_t *result) {
+	uint32_t value = 0;
+	size_t i;
+
+	if (count < 3 || !isMark(items[0]) || !matches(durationUs(items[0], tickNs), NEC_LEADER_MARK_US)) {
+		return false;
+	}
+
+	uint32_t spaceUs = durationUs(items[1], tickNs);
+	if (matches(spaceUs, NEC_REPEAT_SPACE_US)) {
+		if (!state->haveLast || state->last.protocol != RMT_DECODER_NEC) {
+			return false;
+		}
+		*result = state->last;
+		result->repeat = true;
+		return true;
+	}
+	if (!matches(spaceUs, NEC_LEADER_SPACE_US) || count < 2 + NEC_BITS * 2) {
+		return false;
+	}
+
+	for (i=0; i<NEC_BITS; i++) {
+		uint16_t mark  = items[2 + i*2];
+		uint16_t space = items[3 + i*2];
+		if (!matches(durationUs(mark, tickNs), NEC_BIT_MARK_US)) {
+			return false;
+		}
+		uint32_t bitSpaceUs = durationUs(space, tickNs);
+		if (matches(bitSpaceUs, NEC_ONE_SPACE_US)) {
+			value |= 1UL << i;
+		} else if (!matches(bitSpaceUs, NEC_ZERO_SPACE_US)) {
+			return false;
+		}
+	}
+
+	uint8_t address     = value & 0xff;
+	uint8_t addressInv  = (value >> 8) & 0xff;
+	uint8_t command     = (value >> 16) & 0xff;
+	uint8_t commandInv  = (value >> 24) & 0xff;
+	if ((uint8_t)~command != commandInv) {
+		return false;
+	}
+
+	memset(result, 0, sizeof(*result));
+	result->protocol = RMT_DECODER_NEC;
+	result->address  = ((uint8_t)~address == addressInv) ? address : (value & 0xffff);
+	result->command  = command;
+	state->last      = *result;
+	state->haveLast  = true;
+	return true;
+} // decodeNEC
+
+
+/**
+ * Decode an RC5 frame.  RC5 is Manchester encoded with a bit time of 1.778ms
+ * where a 1 is a space followed by a mark.  The 14 bits are two start bits (the
+ * second is an inverted 7th command bit in extended RC5), a toggle bit, 5 bits
+ * of address and 6 bits of command, MSB first.
+ */
+static bool decodeRC5(rmt_decoder_state_t *state, const uint16_t *items, size_t count, uint32_t tickNs, rmt_decoded_t *result) {
+	uint8_t halves[RC5_BITS * 2];
+	size_t halfCount = 0;
+	uint32_t value = 0;
+	size_t i;
+
+	// The first half of the first start bit is a space which is indistinguishable
+	// from idle and so never captured.
+	halves[halfCount++] = 0;
+
+	for (i=0; i<count && halfCount < RC5_BITS * 2; i++) {
+		uint32_t us = durationUs(items[i], tickNs);
+		int length;
+		if (us == 0) {
+			break;
+		}
+		if (matches(us, RC5_HALF_BIT_US)) {
+			length = 1;
+		} else if (matches(us, RC5_HALF_BIT_US * 2)) {
+			length = 2;
+		} else if (!isMark(items[i]) && i == count - 1) {
+			length = 1; // The trailing idle space.
+		} else {
+			return false;
+		}
+		while (length-- > 0 && halfCount < RC5_BITS * 2) {
+			halves[halfCount++] = isMark(items[i]) ? 1 : 0;
+		}
+	}
+	// A frame ending with a 0 bit ends on a space that the capture may not hold.
+	if (halfCount == RC5_BITS * 2 - 1) {
+		halves[halfCount++] = 0;
+	}
+	if (halfCount != RC5_BITS * 2) {
+		return false;
+	}
+
+	for (i=0; i<RC5_BITS; i++) {
+		uint8_t first  = halves[i*2];
+		uint8_t second = halves[i*2 + 1];
+		if (first == second) {
+			return false;
+		}
+		value = (value << 1) | second;
+	}
+
+	// value = S1 S2 T A4..A0 C5..C0
+	if ((value & 0x2000) == 0) {
+		return false;
+	}
+	memset(result, 0, sizeof(*result));
+	result->protocol = RMT_DECODER_RC5;
+	result->toggle   = (value >> 11) & 1;
+	result->address  = (value >> 6) & 0x1f;
+	result->command  = (value & 0x3f) | (((value >> 12) & 1) ? 0 : 0x40);
+	result->repeat   = state->haveLast &&
+		state->last.protocol == RMT_DECODER_RC5 &&
+		state->last.toggle   == result->toggle &&
+		state->last.address  == result->address &&
+		state->last.command  == result->command;
+	state->last     = *result;
+	state->haveLast = true;
+	return true;
+} // decodeRC5
+
+
+/**
+ * Map a decoder name ("NEC", "RC5") to its type.  Unknown names map to
+ * RMT_DECODER_NONE.
+ */
+rmt_decoder_type_t rmt_decoder_fromString(const char *name) {
+	if (name == NULL) {
+		return RMT_DECODER_NONE;
+	}
+	if (strcmp(name, "NEC") == 0) {
+		return RMT_DECODER_NEC;
+	}
+	if (strcmp(name, "RC5") == 0) {
+		return RMT_DECODER_RC5;
+	}
+	return RMT_DECODER_NONE;
+} // rmt_decoder_fromString
+
+
+/**
+ * Map a decoder type to its name.
+ */
+const char *rmt_decoder_toString(rmt_decoder_type_t type) {
+	switch(type) {
+		case RMT_DECODER_NEC:
+			return "NEC";
+		case RMT_DECODER_RC5:
+			return "RC5";
+		default:
+			return "none";
+	}
+} // rmt_decoder_toString
+
+
+/**
+ * Decode one captured frame of count data items where each tick of a duration
+ * is tickNs nanoseconds.  Returns true and fills in result if the frame is a
+ * valid frame of the protocol.
+ */
+bool rmt_decode(rmt_decoder_type_t type, rmt_decoder_state_t *state, const uint16_t *items, size_t count, uint32_t tickNs, rmt_decoded_t *result) {
+	switch(type) {
+		case RMT_DECODER_NEC:
+			return decodeNEC(state, items, count, tickNs, result);
+		case RMT_DECODER_RC5:
+			return decodeRC5(state, items, count, tickNs, result);
+		default:
+			return false;
+	}
+} // rmt_decode